@@ -26,6 +26,11 @@ public:
   float freq;
   float folded_snr;
   double opt_period;
+  float refined_snr;
+  float refined_dm;
+  double refined_period;
+  float refined_acc;
+  int segment;
   bool is_adjacent;
   bool is_physical;
   float ddm_count_ratio;
@@ -34,6 +39,7 @@ public:
   std::vector<float> fold;
   int nbins;
   int nints;
+  int payload_id; /*!< Set once the fold and detections are queued for writing.*/
   
   void append(Candidate& other){
     assoc.push_back(other);
@@ -51,20 +57,23 @@ public:
   Candidate(float dm, int dm_idx, float acc, int nh, float snr, float freq)
     :dm(dm),dm_idx(dm_idx),acc(acc),nh(nh),
      snr(snr),folded_snr(0.0),freq(freq),
-     opt_period(0.0),is_adjacent(false),is_physical(false),
-     ddm_count_ratio(0.0),ddm_snr_ratio(0.0),nints(0),nbins(0){}
+     opt_period(0.0),refined_snr(0.0),refined_dm(0.0),
+     refined_period(0.0),refined_acc(0.0),segment(-1),is_adjacent(false),is_physical(false),
+     ddm_count_ratio(0.0),ddm_snr_ratio(0.0),nints(0),nbins(0),payload_id(-1){}
   
   Candidate(float dm, int dm_idx, float acc, int nh, float snr, float folded_snr, float freq)
     :dm(dm),dm_idx(dm_idx),acc(acc),nh(nh),snr(snr),
      folded_snr(folded_snr),freq(freq),opt_period(0.0),
-     is_adjacent(false),is_physical(false),
-     ddm_count_ratio(0.0),ddm_snr_ratio(0.0),nints(0),nbins(0){}
+     refined_snr(0.0),refined_dm(0.0),refined_period(0.0),refined_acc(0.0),
+     segment(-1),is_adjacent(false),is_physical(false),
+     ddm_count_ratio(0.0),ddm_snr_ratio(0.0),nints(0),nbins(0),payload_id(-1){}
 
   Candidate()
     :dm(0.0),dm_idx(0.0),acc(0.0),nh(0.0),snr(0.0),
      folded_snr(0.0),freq(0.0),opt_period(0.0),
-     is_adjacent(false),is_physical(false),
-     ddm_count_ratio(0.0),ddm_snr_ratio(0.0),nints(0),nbins(0){}
+     refined_snr(0.0),refined_dm(0.0),refined_period(0.0),refined_acc(0.0),
+     segment(-1),is_adjacent(false),is_physical(false),
+     ddm_count_ratio(0.0),ddm_snr_ratio(0.0),nints(0),nbins(0),payload_id(-1){}
 
   void set_fold(float* ar, int nbins, int nints){
     int size = nbins*nints;
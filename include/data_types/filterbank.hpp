@@ -30,8 +30,17 @@
 #include <fstream>
 #include <sstream>
 #include <stdexcept>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <iostream>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "data_types/header.hpp"
 #include "utils/exceptions.hpp"
+#include "utils/ringbuffer.hpp"
+#include "utils/huge_pages.hpp"
 
 /*!
   \brief Base class for handling filterbank data.
@@ -45,7 +54,7 @@ class Filterbank {
 protected:
   //Filterbank metadata
   unsigned char* data; /*!< Pointer to filterbank data.*/ 
-  unsigned int nsamps; /*!< Number of time samples. */ 
+  size_t nsamps; /*!< Number of time samples. */ 
   unsigned int nchans; /*!< Number of frequecy channels. */ 
   unsigned char nbits; /*!< Bits per time sample. */ 
   float fch1; /*!< Frequency of top channel (MHz) */ 
@@ -66,7 +75,7 @@ protected:
     \param foff The bandwidth of a frequency channel.
     \param tsamp The sampling time of the data.
   */
-  Filterbank(unsigned char* data_ptr, unsigned int nsamps,
+  Filterbank(unsigned char* data_ptr, size_t nsamps,
 	     unsigned int nchans, unsigned char nbits,
 	     float fch1, float foff, float tsamp)
     :data(data_ptr),nsamps(nsamps),nchans(nchans),
@@ -83,7 +92,9 @@ protected:
      nbits(0),fch1(0.0),foff(0.0),tsamp(0.0){}
 
 public:
-  
+  //Subclasses own their data and may be deleted through a Filterbank*
+  virtual ~Filterbank(){}
+
   /*!
     \brief Get the currently set sampling time.
     
@@ -145,14 +156,14 @@ public:
 
     \return The number of time samples.
   */
-  virtual unsigned int get_nsamps(void){return nsamps;}
+  virtual size_t get_nsamps(void){return nsamps;}
   
   /*!
     \brief Set the number of time samples in data.
 
     \param nsamps The number of time samples.
   */
-  virtual void set_nsamps(unsigned int nsamps){this->nsamps = nsamps;}
+  virtual void set_nsamps(size_t nsamps){this->nsamps = nsamps;}
 
   /*!
     \brief Get the number of bits per sample.
@@ -181,6 +192,14 @@ public:
     \param data A pointer to a block of filterbank data.
   */
   virtual void set_data(unsigned char *data){this->data = data;}
+
+  /*!
+    \brief Read the data if the constructor only read the header.
+
+    Lets a caller size its work from the metadata before the data
+    take up memory. Does nothing if the data are already held.
+  */
+  virtual void load(void){}
   
   /*!
   \brief Get the centre frequency of the data block.
@@ -202,9 +221,14 @@ public:
   
   A subclass of the Filterbank class for handling filterbank
   in Sigproc style/format from file. Filterbank memory buffer
-  is allocated in constructor and deallocated in destructor.
+  is allocated in constructor (or load()) and deallocated in
+  destructor.
 */
 class SigprocFilterbank: public Filterbank {
+private:
+  std::string filename;
+  size_t header_size;
+
 public:
   /*!
     \brief Create a new SigprocFilterbank object from a file.
@@ -214,8 +238,10 @@ public:
     Metadata is set from the filterbank header values.
 
     \param filename Path to a valid sigproc filterbank file.
+    \param load_data If false only the header is read, until load().
   */
-  SigprocFilterbank(std::string filename)
+  SigprocFilterbank(std::string filename, bool load_data=true)
+    :filename(filename)
   {
     std::ifstream infile;
     SigprocHeader hdr;
@@ -223,11 +249,7 @@ public:
     ErrorChecker::check_file_error(infile, filename);
     // Read the header
     read_header(infile,hdr);
-    size_t input_size = (size_t) hdr.nsamples*hdr.nbits*hdr.nchans/8;
-    this->data = new unsigned char [input_size];
-    infile.seekg(hdr.size, std::ios::beg);
-    // Read the data
-    infile.read(reinterpret_cast<char*>(this->data), input_size);
+    header_size = hdr.size;
     // Set the metadata
     this->nsamps = hdr.nsamples;
     this->nchans = hdr.nchans;
@@ -235,6 +257,21 @@ public:
     this->nbits = hdr.nbits;
     this->fch1 = hdr.fch1;
     this->foff  = hdr.foff;
+    if (load_data)
+      load();
+  }
+
+  void load(void){
+    if (this->data != NULL)
+      return;
+    std::ifstream infile;
+    infile.open(filename.c_str(),std::ifstream::in | std::ifstream::binary);
+    ErrorChecker::check_file_error(infile, filename);
+    size_t input_size = (size_t) this->nsamps*this->nbits*this->nchans/8;
+    this->data = HugePages::alloc<unsigned char>(input_size,"filterbank");
+    infile.seekg(header_size, std::ios::beg);
+    // Read the data
+    infile.read(reinterpret_cast<char*>(this->data), input_size);
   }
   
   /*!
@@ -245,6 +282,338 @@ public:
   */
   ~SigprocFilterbank()
   {
-    delete [] this->data;
+    HugePages::free(this->data);
+  }
+};
+
+
+/*!
+  \brief A class for handling PSRDADA format filterbanks.
+
+  A subclass of the Filterbank class for filterbank data recorded
+  as one or more .dada files. Files are ordered by OBS_OFFSET and
+  must follow on from each other without gaps. Where the header
+  sizes and file sizes allow it, the data sections of all files are
+  memory mapped back to back into one contiguous read only region,
+  so no data is copied. Otherwise the data are read into memory.
+*/
+class DadaFilterbank: public Filterbank {
+private:
+  std::vector<DadaHeader> headers;
+  std::vector<std::string> filenames;
+  void* mapping;
+  size_t mapping_size;
+  size_t total;
+  bool mapped;
+
+  void check_headers(void){
+    DadaHeader& first = headers[0];
+    if (first.npol*first.ndim != 1)
+      ErrorChecker::throw_error("DadaFilterbank: only total intensity (NPOL=1, NDIM=1) data are supported");
+    if (first.nchan==0 || first.nbit==0 || first.tsamp<=0)
+      ErrorChecker::throw_error("DadaFilterbank: header is missing NCHAN, NBIT or TSAMP");
+    size_t bytes_per_samp = (size_t) first.nchan*first.nbit/8;
+    for (size_t ii=0;ii<headers.size();ii++){
+      DadaHeader& hdr = headers[ii];
+      if (hdr.nchan!=first.nchan || hdr.nbit!=first.nbit ||
+	  hdr.tsamp!=first.tsamp || hdr.freq!=first.freq || hdr.bw!=first.bw)
+	ErrorChecker::throw_error("DadaFilterbank: "+filenames[ii]+" does not match the format of "+filenames[0]);
+      if (hdr.filesize%bytes_per_samp)
+	ErrorChecker::throw_error("DadaFilterbank: "+filenames[ii]+" does not hold a whole number of samples");
+      if (ii==0)
+	continue;
+      DadaHeader& prev = headers[ii-1];
+      if (hdr.obs_offset != prev.obs_offset+prev.filesize)
+	ErrorChecker::throw_error("DadaFilterbank: "+filenames[ii]+" does not follow on from "+filenames[ii-1]+" (OBS_OFFSET)");
+      if (hdr.file_no!=0 && hdr.file_no!=prev.file_no+1)
+	std::cerr << "Warning: DadaFilterbank: FILE_NUMBER of " << filenames[ii]
+		  << " is not consecutive" << std::endl;
+    }
+  }
+
+  //Each file must start and end on a page boundary to be mapped in place
+  bool can_map(void){
+    size_t page = sysconf(_SC_PAGESIZE);
+    for (size_t ii=0;ii<headers.size();ii++){
+      if (headers[ii].header_size%page)
+	return false;
+      if (ii+1<headers.size() && headers[ii].filesize%page)
+	return false;
+    }
+    return true;
+  }
+
+  void map_files(void){
+    size_t page = sysconf(_SC_PAGESIZE);
+    mapping_size = std::max(page,(total+page-1)/page*page);
+    //Reserve a contiguous range, then map each file over its part of it
+    mapping = mmap(NULL,mapping_size,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (mapping==MAP_FAILED){
+      mapping = NULL;
+      ErrorChecker::throw_error("DadaFilterbank: could not reserve address space");
+    }
+    size_t offset = 0;
+    for (size_t ii=0;ii<headers.size();ii++){
+      if (headers[ii].filesize==0)
+	continue;
+      int fd = open(filenames[ii].c_str(),O_RDONLY);
+      if (fd<0)
+	ErrorChecker::throw_error("DadaFilterbank: could not open "+filenames[ii]);
+      void* ptr = mmap((char*)mapping+offset,headers[ii].filesize,PROT_READ,
+		       MAP_PRIVATE|MAP_FIXED,fd,headers[ii].header_size);
+      close(fd);
+      if (ptr==MAP_FAILED)
+	ErrorChecker::throw_error("DadaFilterbank: could not map "+filenames[ii]);
+      offset += headers[ii].filesize;
+    }
+    madvise(mapping,mapping_size,MADV_SEQUENTIAL);
+    this->data = (unsigned char*) mapping;
+  }
+
+  void read_files(void){
+    this->data = HugePages::alloc<unsigned char>(total,"filterbank");
+    size_t offset = 0;
+    for (size_t ii=0;ii<headers.size();ii++){
+      std::ifstream infile(filenames[ii].c_str(),std::ifstream::in | std::ifstream::binary);
+      ErrorChecker::check_file_error(infile, filenames[ii]);
+      infile.seekg(headers[ii].header_size, std::ios::beg);
+      infile.read(reinterpret_cast<char*>(this->data+offset),headers[ii].filesize);
+      offset += headers[ii].filesize;
+    }
+  }
+
+  void open_files(std::vector<std::string>& files, bool load_data){
+    if (files.size()==0)
+      ErrorChecker::throw_error("DadaFilterbank: no files given");
+    std::vector< std::pair<size_t,size_t> > order;
+    std::vector<DadaHeader> unordered(files.size());
+    for (size_t ii=0;ii<files.size();ii++){
+      unordered[ii].fromfile(files[ii]);
+      order.push_back(std::make_pair(unordered[ii].obs_offset,ii));
+    }
+    std::sort(order.begin(),order.end());
+    for (size_t ii=0;ii<order.size();ii++){
+      headers.push_back(unordered[order[ii].second]);
+      filenames.push_back(files[order[ii].second]);
+    }
+    check_headers();
+
+    DadaHeader& hdr = headers[0];
+    total = 0;
+    for (size_t ii=0;ii<headers.size();ii++)
+      total += headers[ii].filesize;
+    this->nchans = hdr.nchan;
+    this->nbits = hdr.nbit;
+    this->tsamp = hdr.tsamp*1.0e-6;
+    this->foff = hdr.bw/hdr.nchan;
+    this->fch1 = hdr.freq - hdr.bw/2.0 + this->foff/2.0;
+    this->nsamps = total/((size_t) hdr.nchan*hdr.nbit/8);
+    mapped = can_map();
+    if (load_data)
+      load();
+  }
+
+public:
+  /*!
+    \brief Create a new DadaFilterbank from a single file.
+
+    \param filename Path to a .dada file.
+    \param load_data If false only the headers are read, until load().
+  */
+  DadaFilterbank(std::string filename, bool load_data=true)
+    :mapping(NULL),mapping_size(0),total(0),mapped(false)
+  {
+    std::vector<std::string> files(1,filename);
+    open_files(files,load_data);
+  }
+
+  /*!
+    \brief Create a new DadaFilterbank from a sequence of files.
+
+    \param files Paths to .dada files from one observation, in any order.
+    \param load_data If false only the headers are read, until load().
+  */
+  DadaFilterbank(std::vector<std::string> files, bool load_data=true)
+    :mapping(NULL),mapping_size(0),total(0),mapped(false)
+  {
+    open_files(files,load_data);
+  }
+
+  void load(void){
+    if (this->data != NULL)
+      return;
+    if (mapped)
+      map_files();
+    else
+      read_files();
+  }
+
+  /*!
+    \brief Get the header of the first file in the sequence.
+
+    \return The DadaHeader of the earliest file.
+  */
+  DadaHeader& get_header(void){return headers[0];}
+
+  /*!
+    \brief Check if the data are memory mapped rather than copied.
+
+    Known from the headers, before load().
+
+    \return true if memory mapped.
+  */
+  bool is_mapped(void){return mapped;}
+
+  ~DadaFilterbank()
+  {
+    if (mapping != NULL)
+      munmap(mapping,mapping_size);
+    else
+      HugePages::free(this->data);
+  }
+};
+
+
+/*!
+  \brief A filterbank window over a shared memory ring buffer.
+
+  Attaches to a SharedRingBuffer whose header block holds a PSRDADA
+  style header and exposes a sliding window of its data as an
+  ordinary Filterbank. fill() grows the window with samples as they
+  arrive and discard() drops samples from its start, so a consumer
+  can dedisperse the stream a gulp at a time while it is recorded.
+*/
+class RingBufferFilterbank: public Filterbank {
+private:
+  SharedRingBuffer ring;
+  DadaHeader header;
+  size_t capacity;
+  size_t bytes_per_samp;
+  size_t start_sample;
+  char* block;
+  size_t block_nbytes;
+  size_t block_pos;
+  bool finished;
+
+public:
+  /*!
+    \brief Attach to a ring buffer and read its header.
+
+    \param key Shared memory name of the ring buffer.
+    \param timeout Seconds to wait for the writer to create the ring.
+  */
+  RingBufferFilterbank(std::string key, unsigned int timeout=60)
+    :ring(key,timeout),capacity(0),start_sample(0),
+     block(NULL),block_nbytes(0),block_pos(0),finished(false)
+  {
+    header.fromstring(ring.read_header());
+    if (header.npol*header.ndim != 1)
+      ErrorChecker::throw_error("RingBufferFilterbank: only total intensity (NPOL=1, NDIM=1) data are supported");
+    if (header.nchan==0 || header.nbit==0 || header.tsamp<=0)
+      ErrorChecker::throw_error("RingBufferFilterbank: header is missing NCHAN, NBIT or TSAMP");
+    if (((size_t) header.nchan*header.nbit)%8)
+      ErrorChecker::throw_error("RingBufferFilterbank: samples must be a whole number of bytes");
+    this->nchans = header.nchan;
+    this->nbits = header.nbit;
+    this->tsamp = header.tsamp*1.0e-6;
+    this->foff = header.bw/header.nchan;
+    this->fch1 = header.freq - header.bw/2.0 + this->foff/2.0;
+    this->nsamps = 0;
+    this->data = NULL;
+    bytes_per_samp = (size_t) header.nchan*header.nbit/8;
+  }
+
+  /*!
+    \brief Set the largest number of samples the window can hold.
+
+    \param nsamps Window capacity in samples.
+  */
+  void reserve(size_t nsamps){
+    if (nsamps <= capacity)
+      return;
+    unsigned char* grown = HugePages::alloc<unsigned char>(nsamps*bytes_per_samp,"filterbank_window");
+    if (this->data != NULL){
+      std::memcpy(grown,this->data,this->nsamps*bytes_per_samp);
+      HugePages::free(this->data);
+    }
+    this->data = grown;
+    capacity = nsamps;
+  }
+
+  /*!
+    \brief Read from the ring until the window holds nsamps samples.
+
+    Blocks while the writer catches up. A writer that exits without
+    finishing ends the stream.
+
+    \param nsamps Number of samples wanted in the window.
+    \return The number of samples in the window, fewer than nsamps once the stream has ended.
+  */
+  size_t fill(size_t nsamps){
+    reserve(nsamps);
+    size_t filled = this->nsamps*bytes_per_samp;
+    size_t wanted = nsamps*bytes_per_samp;
+    while (filled < wanted && !finished){
+      if (block == NULL){
+	block = ring.open_read_block(block_nbytes);
+	block_pos = 0;
+	if (block == NULL){
+	  finished = true;
+	  break;
+	}
+      }
+      size_t ncopy = std::min(wanted-filled,block_nbytes-block_pos);
+      std::memcpy(this->data+filled,block+block_pos,ncopy);
+      filled += ncopy;
+      block_pos += ncopy;
+      if (block_pos == block_nbytes){
+	ring.close_read_block();
+	block = NULL;
+      }
+    }
+    //A partial trailing sample can only come from a truncated stream
+    this->nsamps = filled/bytes_per_samp;
+    return this->nsamps;
+  }
+
+  /*!
+    \brief Drop samples from the start of the window.
+
+    \param nsamps Number of samples to drop.
+  */
+  void discard(size_t nsamps){
+    nsamps = std::min(nsamps,(size_t) this->nsamps);
+    std::memmove(this->data,this->data+nsamps*bytes_per_samp,
+		 (this->nsamps-nsamps)*bytes_per_samp);
+    this->nsamps -= nsamps;
+    start_sample += nsamps;
+  }
+
+  /*!
+    \brief Get the index in the stream of the first sample in the window.
+
+    \return Sample index counted from the start of the stream.
+  */
+  size_t get_start_sample(void){return start_sample;}
+
+  /*!
+    \brief Check if the writer has finished and all data have been read.
+
+    \return true at the end of the stream.
+  */
+  bool is_finished(void){return finished;}
+
+  /*!
+    \brief Get the header read from the ring buffer.
+
+    \return The DadaHeader.
+  */
+  DadaHeader& get_header(void){return header;}
+
+  ~RingBufferFilterbank()
+  {
+    if (block != NULL)
+      ring.close_read_block();
+    HugePages::free(this->data);
   }
 };
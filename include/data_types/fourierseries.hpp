@@ -37,7 +37,7 @@ template <class T>
 class FrequencySeries {
 protected:
   T* data_ptr; /*!< Pointer to series data.*/
-  unsigned int nbins; /*!< Number of bins in series.*/
+  size_t nbins; /*!< Number of bins in series.*/
   double bin_width; /*!< Width of each bin in frequency space (Hz).*/
 
   /*!
@@ -52,7 +52,7 @@ protected:
     \param nbins Number of bins in series.
     \param bin_width Width of each bin in frequency space (Hz).
   */
-  FrequencySeries(unsigned int nbins, double bin_width)
+  FrequencySeries(size_t nbins, double bin_width)
     :data_ptr(0),nbins(nbins),bin_width(bin_width){}
   
   /*!
@@ -62,7 +62,7 @@ protected:
     \param nbins Number of bins in series.
     \param bin_width Width of each bin in frequency space (Hz).
   */
-  FrequencySeries(T* data_ptr, unsigned int nbins, double bin_width)
+  FrequencySeries(T* data_ptr, size_t nbins, double bin_width)
     :data_ptr(data_ptr),nbins(nbins),bin_width(bin_width){}
 
 public:
@@ -100,14 +100,14 @@ public:
 
     \return Number of frequency bins.
   */
-  unsigned int get_nbins(void){return nbins;}
+  size_t get_nbins(void){return nbins;}
   
   /*!
     \brief Set number of frequency bins.
     
     \param Number of frequency bins.
   */
-  void set_nbins(unsigned int nbins){this->nbins = nbins;}
+  void set_nbins(size_t nbins){this->nbins = nbins;}
 };
 
 
@@ -120,7 +120,7 @@ public:
 template <class T>
 class DeviceFrequencySeries: public FrequencySeries<T> {
 protected:
-  DeviceFrequencySeries(unsigned int nbins, double bin_width)
+  DeviceFrequencySeries(size_t nbins, double bin_width)
     :FrequencySeries<T>(nbins,bin_width)
   {
     Utils::device_malloc<T>(&this->data_ptr,nbins);
@@ -136,7 +136,7 @@ protected:
 template <class T>
 class DeviceFourierSeries: public DeviceFrequencySeries<T> {
 public:
-  DeviceFourierSeries(unsigned int nbins, double bin_width)
+  DeviceFourierSeries(size_t nbins, double bin_width)
     :DeviceFrequencySeries<T>(nbins,bin_width){}
 };
 
@@ -147,7 +147,7 @@ private:
   unsigned int nh;
   
 public:
-  DevicePowerSpectrum(unsigned int nbins, double bin_width,unsigned int nh=0)
+  DevicePowerSpectrum(size_t nbins, double bin_width,unsigned int nh=0)
     :DeviceFrequencySeries<T>(nbins,bin_width),nh(nh){}
   
   template <class U>
@@ -165,7 +165,9 @@ private:
   std::vector< DevicePowerSpectrum<T>* > folds;
 
 public:
-  HarmonicSums(DevicePowerSpectrum<T>& fold0, unsigned int nfolds)
+  //fold0 need not share the storage type of the sums
+  template <class U>
+  HarmonicSums(DevicePowerSpectrum<U>& fold0, unsigned int nfolds)
   {
     folds.reserve(nfolds);
     for (int ii=0;ii<nfolds;ii++)
@@ -28,7 +28,7 @@
   implemented header formats are:
   
   sigproc - used for peasoup filterbank input mode 
-  psrdada - currently unused
+  psrdada - used for peasoup filterbank input mode (see DadaFilterbank)
 
 */
 
@@ -39,6 +39,7 @@
 #include <sstream>
 #include <vector>
 #include <stdlib.h>
+#include "utils/exceptions.hpp"
 
 #define DADA_HDR_SIZE 4096L
 
@@ -121,16 +122,53 @@ public:
   */
   
   void fromfile(std::string filename){
-    std::ifstream infile(filename.c_str());
+    std::ifstream infile(filename.c_str(),std::ifstream::in | std::ifstream::binary);
+    ErrorChecker::check_file_error(infile, filename);
     std::vector<char> buf(DADA_HDR_SIZE);
     infile.read(&buf[0],DADA_HDR_SIZE);
     std::stringstream header;
-    header.rdbuf()->pubsetbuf(&buf[0],DADA_HDR_SIZE);
+    header.str(std::string(&buf[0],DADA_HDR_SIZE));
+    header_version = atof(get_value("HDR_VERSION ",header).c_str());
+    header_size    = atoi(get_value("HDR_SIZE ",header).c_str());
+    if (header_size == 0)
+      header_size = DADA_HDR_SIZE;
+    //Keys can sit beyond the default header size
+    if (header_size > DADA_HDR_SIZE){
+      buf.resize(header_size);
+      infile.seekg(0,infile.beg);
+      infile.read(&buf[0],header_size);
+      header.str(std::string(&buf[0],header_size));
+    }
+    infile.clear();
     infile.seekg(0,infile.end);
-    filesize       = (size_t) infile.tellg() - (size_t) DADA_HDR_SIZE;
+    filesize       = (size_t) infile.tellg() - (size_t) header_size;
+    infile.close();
+    parse(header);
+  }
+
+  /*!
+    \brief Read a psrdada header from a string.
+
+    Used for headers that do not come from a file, e.g. the header
+    block of a shared memory ring buffer. The data size is unknown so
+    filesize and nsamples are zero.
+
+    \param text the ASCII header.
+  */
+  void fromstring(std::string text){
+    std::stringstream header;
+    header.str(text);
     header_version = atof(get_value("HDR_VERSION ",header).c_str());
     header_size    = atoi(get_value("HDR_SIZE ",header).c_str());
-    bw             = atoi(get_value("BW ",header).c_str());
+    if (header_size == 0)
+      header_size = DADA_HDR_SIZE;
+    filesize       = 0;
+    parse(header);
+  }
+
+private:
+  void parse(std::stringstream& header){
+    bw             = atof(get_value("BW ",header).c_str());
     freq           = atof(get_value("FREQ ",header).c_str());
     nant           = atoi(get_value("NANT ",header).c_str());
     nchan          = atoi(get_value("NCHAN ",header).c_str());
@@ -146,17 +184,16 @@ public:
     mode           = get_value("MODE ",header);
     observer       = get_value("OBSERVER ",header);
     pid            = get_value("PID ",header);
-    obs_offset     = atoi(get_value("OBS_OFFSET ",header).c_str());
+    obs_offset     = strtoull(get_value("OBS_OFFSET ",header).c_str(),NULL,10);
     telescope      = get_value("TELESCOPE ",header);
     instrument     = get_value("INSTRUMENT ",header);
     dsb            = atoi(get_value("DSB ",header).c_str());
-    dada_filesize  = atoi(get_value("FILE_SIZE ",header).c_str());
-    nsamples       = filesize/nchan/nant/npol/2.;
-    bytes_per_sec  = atoi(get_value("BYTES_PER_SECOND ",header).c_str());
+    dada_filesize  = strtoull(get_value("FILE_SIZE ",header).c_str(),NULL,10);
+    nsamples       = (nchan && nant && npol) ? filesize/nchan/nant/npol/2. : 0;
+    bytes_per_sec  = strtoull(get_value("BYTES_PER_SECOND ",header).c_str(),NULL,10);
     utc_start      = get_value("UTC_START ",header);
     ant_id         = atoi(get_value("ANT_ID ",header).c_str());
     file_no        = atoi(get_value("FILE_NUMBER ",header).c_str());
-    infile.close();
   }
 };  
 
@@ -192,7 +229,7 @@ public:
   int    barycentric; 
   int    pulsarcentric;
   int    nbins;  
-  int    nsamples; /*!< Number of time samples.*/
+  size_t nsamples; /*!< Number of time samples.*/
   int    nifs; 
   int    npuls;
   double refdm; /*!< Reference DM of data.*/
@@ -373,7 +410,12 @@ bool read_header(BinaryStream& stream, Header& header) {
     else if( s == "barycentric" )   stream.read((char*)&header.barycentric, sizeof(int));
     else if( s == "pulsarcentric" ) stream.read((char*)&header.pulsarcentric, sizeof(int));
     else if( s == "nbins" )         stream.read((char*)&header.nbins, sizeof(int));
-    else if( s == "nsamples" )      stream.read((char*)&header.nsamples, sizeof(int));
+    else if( s == "nsamples" ) {
+      //Stored as a 32-bit int, recomputed from the file size when zero
+      int nsamples;
+      stream.read((char*)&nsamples, sizeof(int));
+      header.nsamples = nsamples;
+    }
     else if( s == "nifs" )          stream.read((char*)&header.nifs, sizeof(int));
     else if( s == "npuls" )         stream.read((char*)&header.npuls, sizeof(int));
     else if( s == "refdm" )         stream.read((char*)&header.refdm, sizeof(double));
@@ -395,7 +437,7 @@ bool read_header(BinaryStream& stream, Header& header) {
     // Compute the number of samples from the file size
     stream.seekg(0, std::ios::end);
     size_t total_size = stream.tellg();
-    header.nsamples = (total_size-header.size) / header.nchans * 8 / header.nbits;
+    header.nsamples = (total_size-header.size) * 8 / header.nbits / header.nchans;
     // Seek back to the end of the header
     stream.seekg(header.size, std::ios::beg);
   }
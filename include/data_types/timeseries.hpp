@@ -30,8 +30,13 @@
 #include <thrust/device_ptr.h>
 #include "utils/exceptions.hpp"
 #include "utils/utils.hpp"
+#include "utils/huge_pages.hpp"
 #include <data_types/header.hpp>
 #include <string>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <cstring>
 #include "kernels/kernels.h"
 #include "kernels/defaults.h"
 
@@ -50,7 +55,7 @@
 template <class T> class TimeSeries {
 protected:
   T* data_ptr; /*!< Pointer to timeseries data.*/
-  unsigned int nsamps; /*!< Number of samples.*/
+  size_t nsamps; /*!< Number of samples.*/
   float tsamp; /*!< Sampling time (seconds).*/
   
 public:  
@@ -61,7 +66,7 @@ public:
     \param nsamps Number of samples.
     \param tsamp Sampling time (seconds).
   */
-  TimeSeries(T* data_ptr,unsigned int nsamps,float tsamp)
+  TimeSeries(T* data_ptr,size_t nsamps,float tsamp)
     :data_ptr(data_ptr), nsamps(nsamps), tsamp(tsamp){}
 
   /*!
@@ -71,10 +76,10 @@ public:
     set to zero.
   */
   TimeSeries(void)
-    :data_ptr(0), nsamps(0.0), tsamp(0.0) {}
+    :data_ptr(0), nsamps(0), tsamp(0.0) {}
 
   //Why does this exist?
-  TimeSeries(unsigned int nsamps)
+  TimeSeries(size_t nsamps)
     :data_ptr(0), nsamps(nsamps), tsamp(0.0){}
   
   /*!
@@ -83,7 +88,7 @@ public:
     \param n Index of sample.
     \return nth sample from timeseries.
   */
-  T operator[](int n){
+  T operator[](size_t n){
     return data_ptr[n];
   }
   
@@ -106,14 +111,14 @@ public:
 
   \return Number of samples in the time series.
   */
-  unsigned int get_nsamps(void){return nsamps;}
+  size_t get_nsamps(void){return nsamps;}
   
   /*!
     \brief Set the number of samples.
 
     \param Number of samples in timeseries.
   */
-  void set_nsamps(unsigned int nsamps){this->nsamps = nsamps;}
+  void set_nsamps(size_t nsamps){this->nsamps = nsamps;}
   
   /*!
     \brief Get sampling time.
@@ -188,7 +193,7 @@ public:
     \param tsamp Sampling time (seconds).
     \param dm  Dispersion measure (pc cm^-3).
   */
-  DedispersedTimeSeries(T* data_ptr, unsigned int nsamps, float tsamp, float dm)
+  DedispersedTimeSeries(T* data_ptr, size_t nsamps, float tsamp, float dm)
     :TimeSeries<T>(data_ptr,nsamps,tsamp),dm(dm){}
   
   /*!
@@ -213,7 +218,7 @@ class FilterbankChannel: public TimeSeries<T> {
 private:
   float freq;  
 public:
-  FilterbankChannel(T* data_ptr, unsigned int nsamps, float tsamp, float freq)
+  FilterbankChannel(T* data_ptr, size_t nsamps, float tsamp, float freq)
     :TimeSeries<T>(data_ptr,nsamps,tsamp),freq(freq){}
 };
 
@@ -236,7 +241,7 @@ public:
 
     \param nsamps Number of samples.
   */
-  DeviceTimeSeries(unsigned int nsamps)
+  DeviceTimeSeries(size_t nsamps)
     :TimeSeries<OnDeviceType>(nsamps)
   {
     Utils::device_malloc<OnDeviceType>(&this->data_ptr,nsamps);
@@ -262,7 +267,7 @@ public:
     Utils::device_malloc<OnHostType>(&copy_buffer,this->nsamps);
     Utils::h2dcpy(copy_buffer,host_tim.get_data(),this->nsamps*sizeof(OnHostType));
     device_conversion<OnHostType,OnDeviceType>(copy_buffer, this->data_ptr,
-                                               (unsigned int)this->nsamps,
+                                               this->nsamps,
                                                (unsigned int)MAX_BLOCKS,
                                                (unsigned int)MAX_THREADS);
     this->tsamp = host_tim.get_tsamp();
@@ -318,7 +323,7 @@ public:
 
     \param nsamps Number of samples.
   */
-  ReusableDeviceTimeSeries(unsigned int nsamps)
+  ReusableDeviceTimeSeries(size_t nsamps)
     :DeviceTimeSeries<OnDeviceType>(nsamps)
   {
     Utils::device_malloc<OnHostType>(&copy_buffer,this->nsamps);
@@ -338,7 +343,7 @@ public:
     this->tsamp = host_tim.get_tsamp();
     Utils::h2dcpy(copy_buffer, host_tim.get_data(), size*sizeof(OnHostType));
     device_conversion<OnHostType,OnDeviceType>(copy_buffer, this->data_ptr,
-                                               (unsigned int)size,
+                                               size,
                                                (unsigned int)MAX_BLOCKS,
 					       (unsigned int)MAX_THREADS);
   }
@@ -366,7 +371,7 @@ template <class T>
 class TimeSeriesContainer {
 protected:
   T* data_ptr; /*!< Pointer to timeseries.*/
-  unsigned int nsamps; /*!< Number of samples in each timeseries.*/
+  size_t nsamps; /*!< Number of samples in each timeseries.*/
   float tsamp; /*!< Sampling time of each timeseries (seconds).*/
   unsigned int count; /*!< Number of timeseries.*/
   
@@ -378,7 +383,7 @@ protected:
     \param tsamp Sampling time (seconds).
     \param count Number of timeseries.
   */
-  TimeSeriesContainer(T* data_ptr, unsigned int nsamps, float tsamp, unsigned int count)
+  TimeSeriesContainer(T* data_ptr, size_t nsamps, float tsamp, unsigned int count)
     :data_ptr(data_ptr),nsamps(nsamps),tsamp(tsamp),count(count){}
   
 public:
@@ -394,7 +399,7 @@ public:
 
   \return Number of samples.
   */
-  unsigned int get_nsamps(void){return nsamps;}
+  size_t get_nsamps(void){return nsamps;}
   
   /*!
     \brief Set the sampling time of each timeseries.
@@ -433,6 +438,76 @@ class DispersionTrials: public TimeSeriesContainer<T> {
   */
 private:
   std::vector<float> dm_list; /*!< Dispersion measure of each timeseries.*/
+  unsigned int nbits; /*!< Bits per stored sample, less than 8 once requantised.*/
+  size_t packed_nbytes; /*!< Bytes per requantised timeseries.*/
+  std::vector<unsigned char,HugePageAllocator<unsigned char> > packed; /*!< Requantised timeseries.*/
+  std::vector<float> offsets; /*!< Value of the bottom of level 0 for each timeseries.*/
+  std::vector<float> scales; /*!< Level spacing for each timeseries.*/
+
+  /*
+    Uniform level spacing (in units of the standard deviation) that
+    minimises the quantisation noise of Gaussian data.
+  */
+  static float optimal_step(unsigned int nbits){
+    return (nbits==2) ? 0.996 : 0.335;
+  }
+
+  void allocate_packed(unsigned int nbits_out){
+    if (nbits_out!=4 && nbits_out!=2)
+      ErrorChecker::throw_error("DispersionTrials can only be requantised to 4 or 2 bits");
+    unsigned int per_byte = 8/nbits_out;
+    packed_nbytes = (this->nsamps+per_byte-1)/per_byte;
+    packed.assign(packed_nbytes*this->count,0);
+    offsets.resize(this->count);
+    scales.resize(this->count);
+  }
+
+  //Requantise one timeseries of nsamps samples into slot idx
+  void quantise(unsigned int idx, const T* src, unsigned int nbits_out){
+    unsigned int nlevels = 1<<nbits_out;
+    unsigned int per_byte = 8/nbits_out;
+    double sum = 0.0, sumsq = 0.0;
+    for (size_t ii=0;ii<this->nsamps;ii++){
+      sum += src[ii];
+      sumsq += (double)src[ii]*src[ii];
+    }
+    double mean = sum/this->nsamps;
+    double std = sqrt(std::max(0.0,sumsq/this->nsamps-mean*mean));
+    float scale = std::max(1e-6,optimal_step(nbits_out)*std);
+    float offset = mean-0.5*nlevels*scale;
+    offsets[idx] = offset;
+    scales[idx] = scale;
+    unsigned char* dst = &packed[idx*packed_nbytes];
+    for (size_t ii=0;ii<this->nsamps;ii++){
+      int level = (int) floor((src[ii]-offset)/scale);
+      level = std::max(0,std::min((int)nlevels-1,level));
+      dst[ii/per_byte] |= level<<((ii%per_byte)*nbits_out);
+    }
+  }
+
+  void unpack(unsigned int idx, std::vector<T>& buffer, const unsigned char* storage){
+    unsigned int per_byte = 8/nbits;
+    unsigned int mask = (1<<nbits)-1;
+    float lo = std::numeric_limits<T>::is_integer ? std::numeric_limits<T>::min() : -std::numeric_limits<T>::max();
+    float hi = std::numeric_limits<T>::max();
+    //Decode a whole byte at a time through a lookup table
+    T table[256][4];
+    for (unsigned int byte=0;byte<256;byte++)
+      for (unsigned int kk=0;kk<per_byte;kk++){
+	unsigned int level = (byte>>(kk*nbits))&mask;
+	float val = offsets[idx]+(level+0.5)*scales[idx];
+	val = std::max(lo,std::min(hi,val));
+	table[byte][kk] = std::numeric_limits<T>::is_integer ? (T) floor(val+0.5) : (T) val;
+      }
+    buffer.resize(this->nsamps);
+    const unsigned char* src = storage+idx*packed_nbytes;
+    size_t nfull = this->nsamps/per_byte;
+    T* dst = &buffer[0];
+    for (size_t ii=0;ii<nfull;ii++,dst+=per_byte)
+      std::copy(table[src[ii]],table[src[ii]]+per_byte,dst);
+    for (size_t ii=nfull*per_byte;ii<this->nsamps;ii++)
+      buffer[ii] = table[src[nfull]][ii-nfull*per_byte];
+  }
   
 public:
   /*!
@@ -444,11 +519,112 @@ public:
     \param dm_list_in A vector of dispersion measures.
     \note The number of timeseries in the container is dm_list_in.size().
   */
-  DispersionTrials(T* data_ptr, unsigned int nsamps, float tsamp, std::vector<float> dm_list_in)
-    :TimeSeriesContainer<T>(data_ptr,nsamps,tsamp, (unsigned int)dm_list_in.size())
+  DispersionTrials(T* data_ptr, size_t nsamps, float tsamp, std::vector<float> dm_list_in)
+    :TimeSeriesContainer<T>(data_ptr,nsamps,tsamp, (unsigned int)dm_list_in.size()),
+     nbits(sizeof(T)*8),packed_nbytes(0),packed(HugePageAllocator<unsigned char>("dm_trials"))
   {
     dm_list.swap(dm_list_in);
   }
+
+  /*!
+    \brief Create an empty requantised DispersionTrials instance.
+
+    Timeseries are added with pack(), allowing the trials to be
+    produced a few at a time without ever holding them all at 8 bits.
+
+    \param nsamps Number of samples in each dedispersed timeseries.
+    \param tsamp Sampling time (seconds).
+    \param dm_list_in A vector of dispersion measures.
+    \param nbits_out Bits per stored sample, 4 or 2.
+  */
+  DispersionTrials(size_t nsamps, float tsamp, std::vector<float> dm_list_in,
+		   unsigned int nbits_out)
+    :TimeSeriesContainer<T>(NULL,nsamps,tsamp,(unsigned int)dm_list_in.size()),
+     nbits(nbits_out),packed_nbytes(0),packed(HugePageAllocator<unsigned char>("dm_trials"))
+  {
+    dm_list.swap(dm_list_in);
+    allocate_packed(nbits_out);
+  }
+
+  /*!
+    \brief Requantise a block of timeseries into the container.
+
+    \param first Index of the first timeseries in the block.
+    \param src Start of the block's first timeseries.
+    \param stride Samples between the starts of consecutive timeseries
+    in src (at least get_nsamps()).
+    \param n Number of timeseries in the block.
+  */
+  void pack(unsigned int first, const T* src, size_t stride, unsigned int n){
+    if (this->data_ptr!=NULL)
+      ErrorChecker::throw_error("Only requantised DispersionTrials can be packed");
+    if (first+n > this->count || stride < this->nsamps)
+      ErrorChecker::throw_error("DispersionTrials::pack: block out of range");
+    for (unsigned int ii=0;ii<n;ii++)
+      quantise(first+ii,src+ii*stride,nbits);
+  }
+
+  /*!
+    \brief Get the number of bits per stored sample.
+
+    \return Bits per sample.
+  */
+  unsigned int get_nbits(void){return nbits;}
+
+  /*!
+    \brief Get the number of bytes used to store the timeseries.
+
+    \return Size in bytes.
+  */
+  size_t get_nbytes(void){
+    if (this->data_ptr==NULL)
+      return packed.size();
+    return this->nsamps*this->count*sizeof(T);
+  }
+
+  /*!
+    \brief Get the stored timeseries as raw bytes.
+
+    Requantised timeseries are returned packed. A copy of these
+    get_nbytes() bytes, e.g. on another NUMA node, can be read through
+    get_idx().
+
+    \return Pointer to the first timeseries.
+  */
+  unsigned char* get_storage(void){
+    if (this->data_ptr!=NULL)
+      return (unsigned char*) this->data_ptr;
+    return packed.size() ? &packed[0] : NULL;
+  }
+
+  /*!
+    \brief Get the number of bytes between stored timeseries.
+
+    \return Stride in bytes.
+  */
+  size_t get_storage_stride(void){
+    if (this->data_ptr!=NULL)
+      return this->nsamps*sizeof(T);
+    return packed_nbytes;
+  }
+
+  /*!
+    \brief Move every timeseries towards its start.
+
+    Drops the first nshift samples of each timeseries, leaving the
+    last nshift samples free to be overwritten with newer data.
+
+    \param nshift Number of samples to drop.
+  */
+  void shift(size_t nshift){
+    if (this->data_ptr==NULL)
+      ErrorChecker::throw_error("Requantised DispersionTrials cannot be shifted");
+    nshift = std::min(nshift,(size_t)this->nsamps);
+    for (size_t ii=0;ii<this->count;ii++){
+      T* ptr = this->data_ptr+ii*(size_t)this->nsamps;
+      std::memmove(ptr,ptr+nshift,(this->nsamps-nshift)*sizeof(T));
+    }
+  }
   
   /*!
     \brief Select the Nth timeseries.
@@ -458,6 +634,8 @@ public:
   */
   DedispersedTimeSeries<T> operator[](int idx)
   {
+    if (this->data_ptr==NULL)
+      ErrorChecker::throw_error("Requantised DispersionTrials must be accessed through get_idx()");
     T* ptr = this->data_ptr+idx*(size_t)this->nsamps;
     return DedispersedTimeSeries<T>(ptr, this->nsamps, this->tsamp, dm_list[idx]);
   }
@@ -471,12 +649,38 @@ public:
     overloaded [] operator.
   */
   void get_idx(unsigned int idx, DedispersedTimeSeries<T>& tim){
+    if (this->data_ptr==NULL)
+      ErrorChecker::throw_error("Requantised DispersionTrials must be unpacked into a buffer");
     T* ptr = this->data_ptr+(size_t)idx*(size_t)this->nsamps;
     tim.set_data(ptr);
     tim.set_dm(dm_list[idx]);
     tim.set_nsamps(this->nsamps);
     tim.set_tsamp(this->tsamp);
   }
+
+  /*!
+    \brief Set DedispersedTimeSeries instance, unpacking requantised data.
+    
+    \param idx Index of desired time series.
+    \param tim DedispersedTimeSeries which will take the data.
+    \param buffer Caller owned storage for unpacked samples. Unused
+    unless the trials have been requantised.
+    \param storage Copy of get_storage() to read from instead, or NULL.
+  */
+  void get_idx(unsigned int idx, DedispersedTimeSeries<T>& tim, std::vector<T>& buffer,
+	       unsigned char* storage=NULL){
+    if (this->data_ptr!=NULL){
+      get_idx(idx,tim);
+      if (storage!=NULL)
+	tim.set_data((T*) storage+(size_t)idx*this->nsamps);
+      return;
+    }
+    unpack(idx,buffer,storage!=NULL ? storage : &packed[0]);
+    tim.set_data(&buffer[0]);
+    tim.set_dm(dm_list[idx]);
+    tim.set_nsamps(this->nsamps);
+    tim.set_tsamp(this->tsamp);
+  }
 };
 
 
@@ -0,0 +1,149 @@
+#pragma once
+#include <data_types/timeseries.hpp>
+#include <utils/exceptions.hpp>
+#include <utils/numa.hpp>
+#include <utils/huge_pages.hpp>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+/*!
+  \brief Placement of the DM trials across the NUMA nodes of the host.
+
+  Modes:
+    local      - left where dedispersion wrote them, usually all on the
+                 node of the dedispersing thread.
+    interleave - split into one contiguous block of DMs per node (with
+                 CPUs), each block moved to its node.
+    replicate  - a full copy on every node, so every DM is local to
+                 every worker, for nnodes-1 extra copies of the trials.
+
+  Records the node holding each DM so DMDispenser can hand DMs to
+  workers on that node first. On single node hosts every mode is the
+  same as local.
+*/
+class TrialPlacement {
+private:
+  DispersionTrials<unsigned char>& trials;
+  std::string mode;
+  int nnodes;
+  std::vector<int> dm_nodes;
+  std::vector<unsigned char*> replicas;
+  size_t replica_nbytes;
+
+  void find_dm_nodes(void){
+    NumaTopology& topology = NumaTopology::instance();
+    unsigned char* storage = trials.get_storage();
+    size_t stride = trials.get_storage_stride();
+    dm_nodes.resize(trials.get_count());
+    for (unsigned int ii=0;ii<trials.get_count();ii++)
+      dm_nodes[ii] = (nnodes > 1) ? topology.get_page_node(storage+ii*stride) : -1;
+  }
+
+  void interleave(std::vector<int>& nodes){
+    NumaTopology& topology = NumaTopology::instance();
+    unsigned char* storage = trials.get_storage();
+    size_t stride = trials.get_storage_stride();
+    unsigned int count = trials.get_count();
+    for (size_t kk=0;kk<nodes.size();kk++){
+      unsigned int first = kk*count/nodes.size();
+      unsigned int last = (kk+1)*count/nodes.size();
+      if (!topology.bind(storage+first*stride,(last-first)*stride,nodes[kk]))
+	std::cerr << "Warning: could not move DM trials to NUMA node " << nodes[kk] << std::endl;
+    }
+  }
+
+  bool replicate(std::vector<int>& nodes){
+    NumaTopology& topology = NumaTopology::instance();
+    unsigned char* storage = trials.get_storage();
+    size_t nbytes = trials.get_nbytes();
+    int home = topology.get_page_node(storage);
+    replicas.assign(nnodes,(unsigned char*) NULL);
+    for (size_t kk=0;kk<nodes.size();kk++){
+      if (nodes[kk]==home)
+	continue;
+      //Bound before the copy so every page is first touched on its node
+      unsigned char* ptr;
+      try {
+	ptr = HugePages::alloc<unsigned char>(nbytes,"dm_trial_replica");
+      } catch (std::bad_alloc&){
+	release();
+	return false;
+      }
+      replicas[nodes[kk]] = ptr;
+      replica_nbytes += nbytes;
+      topology.bind(ptr,nbytes,nodes[kk]);
+      std::memcpy(ptr,storage,nbytes);
+    }
+    return true;
+  }
+
+  void release(void){
+    for (size_t ii=0;ii<replicas.size();ii++)
+      HugePages::free(replicas[ii]);
+    replicas.clear();
+    replica_nbytes = 0;
+  }
+
+public:
+  /*!
+    \param trials Dedispersed (and, if wanted, requantised) trials.
+    \param mode "local", "interleave" or "replicate".
+  */
+  TrialPlacement(DispersionTrials<unsigned char>& trials, std::string mode)
+    :trials(trials),mode(mode),replica_nbytes(0)
+  {
+    if (mode!="local" && mode!="interleave" && mode!="replicate")
+      ErrorChecker::throw_error("Unknown trial placement: "+mode);
+    NumaTopology& topology = NumaTopology::instance();
+    nnodes = topology.get_nnodes();
+    std::vector<int> nodes;
+    for (int node=0;node<nnodes;node++)
+      if (topology.get_cpus(node).size())
+	nodes.push_back(node);
+    if (trials.get_storage()==NULL || nodes.size() < 2)
+      this->mode = "local";
+    if (this->mode=="replicate" && !replicate(nodes)){
+      std::cerr << "Warning: could not replicate DM trials, interleaving them instead" << std::endl;
+      this->mode = "interleave";
+    }
+    if (this->mode=="interleave")
+      interleave(nodes);
+    if (this->mode=="replicate")
+      dm_nodes.assign(trials.get_count(),-1);
+    else
+      find_dm_nodes();
+  }
+
+  //Mode in use, "local" if the host has a single node
+  std::string get_mode(void){return mode;}
+
+  int get_nnodes(void){return nnodes;}
+
+  //Bytes of the extra copies made by "replicate"
+  size_t get_replica_nbytes(void){return replica_nbytes;}
+
+  /*!
+    \brief Node holding a DM trial.
+
+    \return Node index, or -1 if local to every node.
+  */
+  int get_dm_node(unsigned int idx){return dm_nodes[idx];}
+
+  /*!
+    \brief Copy of the trials to read on a node.
+
+    \return Storage for DispersionTrials::get_idx(), NULL for the original.
+  */
+  unsigned char* get_storage(int node){
+    if (node < 0 || node >= (int) replicas.size())
+      return NULL;
+    return replicas[node];
+  }
+
+  ~TrialPlacement(){
+    release();
+  }
+};
@@ -0,0 +1,153 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <utils/utils.hpp>
+#include <data_types/timeseries.hpp>
+#include "pthread.h"
+
+/*!
+  \brief Host side store of dereddened time series.
+
+  During the search each Worker forward transforms, dereddens and
+  inverse transforms every DM trial. MultiFolder needs exactly the
+  same series for the DMs it folds, so rather than repeating the two
+  full size FFTs and the median pass, workers can offer their whitened
+  series to this cache and the folder will pick them up.
+
+  The cache is bounded in bytes. When full, an offered series is only
+  admitted if its strongest candidate beats the weakest entry already
+  held, which is then evicted. This keeps the DMs most likely to be in
+  the top --npdmp candidates.
+*/
+class WhitenedSeriesCache {
+private:
+  struct Entry {
+    std::vector<float> data;
+    float tsamp;
+    float max_snr;
+  };
+  std::map<unsigned int, Entry> entries;
+  size_t max_bytes;
+  size_t used_bytes;
+  unsigned int hits;
+  unsigned int misses;
+  pthread_mutex_t mutex;
+
+  //Returns the DM index of the entry with the lowest S/N
+  unsigned int weakest(void){
+    std::map<unsigned int, Entry>::iterator iter = entries.begin();
+    std::map<unsigned int, Entry>::iterator min_iter = iter;
+    for (;iter!=entries.end();iter++)
+      if (iter->second.max_snr < min_iter->second.max_snr)
+	min_iter = iter;
+    return min_iter->first;
+  }
+
+public:
+  /*!
+    \brief Create a new cache.
+
+    \param max_bytes The maximum number of bytes of time series to hold.
+  */
+  WhitenedSeriesCache(size_t max_bytes)
+    :max_bytes(max_bytes),used_bytes(0),hits(0),misses(0)
+  {
+    pthread_mutex_init(&mutex, NULL);
+  }
+
+  /*!
+    \brief Check if an entry of a given size would be accepted.
+
+    Cheap test used to avoid a device to host copy for series
+    that would be rejected by offer().
+
+    \param nsamps Number of samples in the series.
+    \param max_snr The S/N of the strongest candidate in the series.
+  */
+  bool would_accept(size_t nsamps, float max_snr){
+    size_t nbytes = nsamps*sizeof(float);
+    if (nbytes > max_bytes)
+      return false;
+    bool retval = true;
+    pthread_mutex_lock(&mutex);
+    if (used_bytes+nbytes > max_bytes)
+      retval = (entries.size()>0 && entries[weakest()].max_snr < max_snr);
+    pthread_mutex_unlock(&mutex);
+    return retval;
+  }
+
+  /*!
+    \brief Offer a whitened series from the GPU to the cache.
+
+    \param dm_idx Index of the DM trial the series belongs to.
+    \param tim Whitened time series on the device.
+    \param max_snr The S/N of the strongest candidate in the series.
+    \return true if the series was stored.
+  */
+  bool offer(unsigned int dm_idx, DeviceTimeSeries<float>& tim, float max_snr){
+    if (!would_accept(tim.get_nsamps(),max_snr))
+      return false;
+    Entry entry;
+    entry.tsamp = tim.get_tsamp();
+    entry.max_snr = max_snr;
+    entry.data.resize(tim.get_nsamps());
+    Utils::d2hcpy<float>(&entry.data[0],tim.get_data(),tim.get_nsamps());
+    size_t nbytes = entry.data.size()*sizeof(float);
+
+    bool retval = true;
+    pthread_mutex_lock(&mutex);
+    while (used_bytes+nbytes > max_bytes){
+      unsigned int idx = weakest();
+      if (entries[idx].max_snr >= max_snr){
+	retval = false;
+	break;
+      }
+      used_bytes -= entries[idx].data.size()*sizeof(float);
+      entries.erase(idx);
+    }
+    if (retval){
+      entries[dm_idx].data.swap(entry.data);
+      entries[dm_idx].tsamp = entry.tsamp;
+      entries[dm_idx].max_snr = entry.max_snr;
+      used_bytes += nbytes;
+    }
+    pthread_mutex_unlock(&mutex);
+    return retval;
+  }
+
+  /*!
+    \brief Copy a cached series to the GPU.
+
+    \param dm_idx Index of the DM trial.
+    \param tim Device time series to receive the data.
+    \return false if the DM is not cached or the cached series
+    does not have the same length as tim.
+  */
+  bool fetch(unsigned int dm_idx, DeviceTimeSeries<float>& tim){
+    Entry* entry = NULL;
+    pthread_mutex_lock(&mutex);
+    std::map<unsigned int, Entry>::iterator iter = entries.find(dm_idx);
+    if (iter!=entries.end() && iter->second.data.size()==tim.get_nsamps()){
+      entry = &iter->second;
+      hits++;
+    } else {
+      misses++;
+    }
+    pthread_mutex_unlock(&mutex);
+    if (entry==NULL)
+      return false;
+    //Entries are never evicted once folding has started
+    Utils::h2dcpy<float>(tim.get_data(),&entry->data[0],entry->data.size());
+    tim.set_tsamp(entry->tsamp);
+    return true;
+  }
+
+  size_t get_count(void){return entries.size();}
+  size_t get_used_bytes(void){return used_bytes;}
+  unsigned int get_hits(void){return hits;}
+  unsigned int get_misses(void){return misses;}
+
+  ~WhitenedSeriesCache(){
+    pthread_mutex_destroy(&mutex);
+  }
+};
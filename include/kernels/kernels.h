@@ -2,6 +2,7 @@
 #include <thrust/system/cuda/vector.h>
 #include <thrust/system/cuda/execution_policy.h>
 #include <thrust/device_vector.h>
+#include <cuda_fp16.h>
 #include <map>
 
 class cached_allocator
@@ -108,6 +109,13 @@ void device_harmonic_sum(float* d_input_array,
 			 unsigned int max_blocks,
 			 unsigned int max_threads);
 
+void device_harmonic_sum(float* d_input_array, 
+			 half** d_output_array,
+			 size_t size, 
+			 unsigned nharms,
+			 unsigned int max_blocks,
+			 unsigned int max_threads);
+
 void device_form_power_series(cufftComplex* d_array_in,
 			      float* d_array_out,
 			      size_t size,
@@ -131,23 +139,46 @@ void device_resampleII(float * d_idata,
                      unsigned int block_size,
                      unsigned int max_blocks);
 
-int device_find_peaks(int n,
-		      int start_index,
+void device_decimate(float * d_idata,
+		     float * d_odata,
+		     size_t out_length,
+		     unsigned int factor,
+		     unsigned int block_size,
+		     unsigned int max_blocks);
+
+int device_find_peaks(size_t n,
+		      size_t start_index,
 		      float * d_dat,
 		      float thresh,
-		      int * indexes,
+		      size_t * indexes,
+		      float * snrs,
+		      thrust::device_vector<size_t>&,
+		      thrust::device_vector<float>&,
+		      cached_allocator&);
+
+int device_find_peaks(size_t n,
+		      size_t start_index,
+		      half * d_dat,
+		      float thresh,
+		      size_t * indexes,
 		      float * snrs,
-		      thrust::device_vector<int>&,
+		      thrust::device_vector<size_t>&,
 		      thrust::device_vector<float>&,
 		      cached_allocator&);
 
 void device_normalise(float* d_powers,
                       float mean,
                       float sigma,
-                      unsigned int size,
+                      size_t size,
                       unsigned int max_blocks,
                       unsigned int max_threads);
 
+void device_accumulate(float* d_input,
+		       float* d_output,
+		       size_t size,
+		       unsigned int max_blocks,
+		       unsigned int max_threads);
+
 void device_normalise_spectrum(int nsamp,
 			       float* d_power_spectrum,
 			       float* d_normalised_power_spectrum,
@@ -168,23 +199,23 @@ void device_fold_timeseries(float* input,
 
 //------GPU fold optimisation related-----//
 
-unsigned int device_argmax(float* input, 
-			   unsigned int size);
+size_t device_argmax(float* input, 
+		     size_t size);
 
 void device_real_to_complex(float* input, 
 			    cuComplex* output, 
-			    unsigned int size,
+			    size_t size,
 			    unsigned int max_blocks,
 			    unsigned int max_threads);
 
 void device_get_absolute_value(cuComplex* input, 
 			       float* output, 
-			       unsigned int size,
+			       size_t size,
                                unsigned int max_blocks, 
 			       unsigned int max_threads);
 
 void device_generate_shift_array(cuComplex* shifted_ar,
-                                 unsigned int shifted_ar_size,
+                                 size_t shifted_ar_size,
                                  unsigned int nbins, 
 				 unsigned int nints,
                                  unsigned int nshift,
@@ -194,15 +225,15 @@ void device_generate_shift_array(cuComplex* shifted_ar,
 
 void device_generate_template_array(cuComplex* templates, 
 				    unsigned int nbins, 
-				    unsigned int size,
+				    size_t size,
 				    unsigned int max_blocks,
 				    unsigned int max_threads);
 
 void device_multiply_by_shift(cuComplex* input, 
 			      cuComplex* output,
                               cuComplex* shift_array,
-			      unsigned int size,
-			      unsigned int nbins_by_nints,
+			      size_t size,
+			      size_t nbins_by_nints,
 			      unsigned int max_blocks,
 			      unsigned int max_threads);
 
@@ -210,7 +241,7 @@ void device_collapse_subints(cuComplex* input,
 			     cuComplex* output,
                              unsigned int nbins,
 			     unsigned int nints,
-                             unsigned int size,
+                             size_t size,
 			     unsigned int max_blocks, 
 			     unsigned int max_threads);
 
@@ -219,12 +250,35 @@ void device_multiply_by_templates(cuComplex* input,
 				  cuComplex* templates,
 				  unsigned int nbins,
 				  unsigned int nshifts,
-				  unsigned int size,
+				  size_t size,
 				  unsigned int step,
 				  unsigned int max_blocks, 
 				  unsigned int max_threads);
 
 
+void device_shift_and_collapse(cuComplex* input,
+			       cuComplex* output,
+			       float* shifts,
+			       unsigned int nbins,
+			       unsigned int nints,
+			       unsigned int nshifts,
+			       unsigned int max_blocks,
+			       unsigned int max_threads);
+
+void device_apply_shift(cuComplex* input,
+			cuComplex* output,
+			float shift,
+			unsigned int nbins,
+			unsigned int nints,
+			unsigned int max_blocks,
+			unsigned int max_threads);
+
+void device_profile_power(cuComplex* input,
+			  float* output,
+			  unsigned int nbins,
+			  unsigned int nshifts,
+			  unsigned int max_threads);
+
 //--------------median filter------------//
 
 typedef unsigned char         hd_byte;
@@ -261,7 +315,7 @@ hd_error linear_stretch(const hd_float* d_in,
 
 void device_divide_c_by_f(cuComplex* c, 
 			  float* f, 
-			  unsigned int size,
+			  size_t size,
 			  unsigned int max_blocks, 
 			  unsigned int max_threads);
 
@@ -270,7 +324,7 @@ void device_zap_birdies(cuComplex* fseries,
 			float* d_widths,
 			float bin_width,
                         unsigned int birdies_size,
-			unsigned int fseries_size,
+			size_t fseries_size,
                         unsigned int max_blocks,
 			unsigned int max_threads);
 
@@ -278,13 +332,17 @@ void device_zap_birdies(cuComplex* fseries,
 
 template <typename T>
 float GPU_rms(T* d_collection,
-	      int nsamps,
-	      int min_bin);
+	      size_t nsamps,
+	      size_t min_bin);
 
 template <typename T>
 float GPU_mean(T* d_collection,
-	       int nsamps,
-	       int min_bin);  
+	       size_t nsamps,
+	       size_t min_bin);  
+
+float device_max_abs_difference(float* d_ref,
+				half* d_test,
+				size_t size);
 
 template <typename T>
 void GPU_fill(T* start,
@@ -316,6 +374,6 @@ void device_cuCmulf_inplace(cufftComplex* x,
                             unsigned int max_threads);
 
 template <class X, class Y>
-void device_conversion(X*, Y*, unsigned int,
+void device_conversion(X*, Y*, size_t,
 		       unsigned int, unsigned int);
 
@@ -0,0 +1,205 @@
+#pragma once
+#include <data_types/candidates.hpp>
+#include <data_types/fourierseries.hpp>
+#include <utils/utils.hpp>
+#include <vector>
+#include <complex>
+#include <cmath>
+#include <algorithm>
+#include "cufft.h"
+
+#define ACCEL_REFINE_SPEED_OF_LIGHT 299792458.0
+
+/*!
+  \brief Refines candidates from a coarse acceleration search.
+
+  Rather than resampling and transforming the full time series for
+  every fine acceleration trial, the whitened Fourier series of the
+  unresampled DM trial is correlated, for each harmonic, against the
+  analytic Fourier response of a linearly drifting signal (a chirp
+  spanning z bins over the observation). Only a few tens to a few
+  hundred bins around each coarse detection are touched.
+
+  The response is referenced to the middle of the observation to
+  match TimeDomainResampler::resampleII, so a coarse candidate
+  frequency maps directly onto the centre of the chirp.
+
+  The template is unit normalised, so in white noise the matched
+  filter amplitude has the distribution of a single bin's amplitude
+  (SpectrumFormer::form), not that of the interbinned spectrum the
+  search normalises with. The interbinned mean is about 0.4 sigma
+  higher, so its statistics would bias the refined S/N low by about
+  0.4*sqrt(nharms).
+*/
+class AccelerationRefiner {
+private:
+  float tobs;
+  int nroffsets;
+  std::vector<cufftComplex> window;
+
+  typedef std::complex<double> complex_t;
+
+  //C(x) + iS(x), series for small |x| and erfc continued fraction otherwise
+  static complex_t fresnel(double x){
+    double ax = fabs(x);
+    complex_t retval;
+    if (ax < 2.0){
+      double t = M_PI_2*ax*ax;
+      double c = 0.0, s = 0.0, term = ax;
+      for (int n=0;n<40;n++){
+	//term = (pi/2)^n x^(2n+1) / n!
+	double val = term/(2*n+1);
+	switch (n%4){
+	case 0: c += val; break;
+	case 1: s += val; break;
+	case 2: c -= val; break;
+	case 3: s -= val; break;
+	}
+	term *= t/(n+1);
+	if (term < 1e-17)
+	  break;
+      }
+      retval = complex_t(c,s);
+    } else {
+      complex_t z = complex_t(1.0,-1.0)*(sqrt(M_PI)/2.0*ax);
+      //Lentz evaluation of erfc(z) = exp(-z^2)/sqrt(pi) / (z + 1/2/(z + 1/(z + 3/2/(z + ...))))
+      complex_t f = z, cc = z, d = 0.0;
+      for (int n=1;n<500;n++){
+	double a = n/2.0;
+	d = z + a*d;
+	cc = z + a/cc;
+	d = 1.0/d;
+	complex_t delta = cc*d;
+	f *= delta;
+	if (std::abs(delta-1.0) < 1e-15)
+	  break;
+      }
+      complex_t erfc = std::exp(-z*z)/sqrt(M_PI)/f;
+      retval = complex_t(0.5,0.5)*(1.0-erfc);
+    }
+    return (x<0) ? -retval : retval;
+  }
+
+  /*
+    Fourier response at offset q bins from a signal whose frequency
+    drifts by z bins over the observation, centred at mid-observation:
+    integral_0^1 exp(2 pi i (q u + z (u^2-u)/2)) du
+  */
+  static complex_t response(double q, double z){
+    if (fabs(z) < 1e-4){
+      if (fabs(q) < 1e-9)
+	return 1.0;
+      return (std::exp(complex_t(0.0,2.0*M_PI*q))-1.0)/complex_t(0.0,2.0*M_PI*q);
+    }
+    double b = q - z/2.0;
+    double scale = sqrt(2.0*fabs(z));
+    double w0 = scale*(b/z);
+    double w1 = scale*(1.0+b/z);
+    complex_t fres = fresnel(w1)-fresnel(w0);
+    if (z < 0)
+      fres = std::conj(fres);
+    return std::exp(complex_t(0.0,-M_PI*b*b/z))*fres/scale;
+  }
+
+  /*
+    Matched filter amplitude of bins [first,first+n) against the
+    response of a signal at fractional bin r drifting by z bins.
+    The template is unit normalised so for z=0 and integer r this
+    reduces to the amplitude of bin r.
+  */
+  float correlate(cufftComplex* data, size_t first, int n, double r, double z){
+    complex_t sum = 0.0;
+    double norm = 0.0;
+    for (int ii=0;ii<n;ii++){
+      complex_t t = response(r-(first+ii),z);
+      sum += complex_t(data[ii].x,data[ii].y)*std::conj(t);
+      norm += std::norm(t);
+    }
+    return (norm>0) ? std::abs(sum)/sqrt(norm) : 0.0;
+  }
+
+public:
+  /*!
+    \brief Create a new AccelerationRefiner.
+
+    \param tobs Observation length in seconds (transform size * tsamp).
+    \param nroffsets Number of quarter bin frequency offsets to try either side of the coarse frequency.
+  */
+  AccelerationRefiner(float tobs, int nroffsets=2)
+    :tobs(tobs),nroffsets(nroffsets){}
+
+  /*!
+    \brief Refine a single candidate on a fine acceleration grid.
+
+    \param fseries Whitened Fourier series of the unresampled DM trial.
+    \param cand Candidate from the coarse search, updated in place.
+    \param mean Mean of the single bin amplitude spectrum of fseries.
+    \param std Standard deviation of the single bin amplitude spectrum of fseries.
+    \param step Fine acceleration step (m/s/s).
+    \param nsteps Number of fine steps to try either side of cand.acc.
+    \return The number of fine trials evaluated.
+  */
+  unsigned int refine(DeviceFourierSeries<cufftComplex>& fseries, Candidate& cand,
+		      float mean, float std, float step, int nsteps)
+  {
+    int nharms = 1<<cand.nh;
+    size_t nbins = fseries.get_nbins();
+    double r_mid = cand.freq*tobs;
+    double z_per_acc = -r_mid*tobs/ACCEL_REFINE_SPEED_OF_LIGHT;
+    double z_max = std::max(fabs(z_per_acc*(cand.acc-nsteps*step)),
+			    fabs(z_per_acc*(cand.acc+nsteps*step)));
+
+    //Pull a window around every harmonic to the host once
+    std::vector<size_t> firsts(nharms);
+    std::vector<int> counts(nharms);
+    std::vector<int> offsets(nharms);
+    int total = 0;
+    for (int hh=0;hh<nharms;hh++){
+      long long half = (long long)((hh+1)*z_max/2.0) + nroffsets + 4;
+      long long centre = (long long)((hh+1)*r_mid);
+      long long first = std::max(0LL,centre-half);
+      long long last = std::min((long long)nbins,centre+half+1);
+      firsts[hh] = first;
+      counts[hh] = (int) std::max(0LL,last-first);
+      offsets[hh] = total;
+      total += counts[hh];
+    }
+    window.resize(std::max(1,total));
+    for (int hh=0;hh<nharms;hh++)
+      if (counts[hh]>0)
+	Utils::d2hcpy<cufftComplex>(&window[offsets[hh]],fseries.get_data()+firsts[hh],counts[hh]);
+
+    float best_snr = cand.snr;
+    float best_acc = cand.acc;
+    double best_r = r_mid;
+    bool improved = false;
+    unsigned int ntrials = 0;
+    for (int aa=-nsteps;aa<=nsteps;aa++){
+      double acc = cand.acc + aa*step;
+      double z = z_per_acc*acc;
+      for (int rr=-nroffsets;rr<=nroffsets;rr++){
+	double r = r_mid + 0.25*rr;
+	float snr = 0.0;
+	for (int hh=0;hh<nharms;hh++){
+	  if (counts[hh]==0)
+	    continue;
+	  float amp = correlate(&window[offsets[hh]],firsts[hh],counts[hh],
+				(hh+1)*r,(hh+1)*z);
+	  snr += (amp-mean)/std;
+	}
+	snr /= sqrt((float)nharms);
+	ntrials++;
+	if (!improved || snr > best_snr){
+	  improved = true;
+	  best_snr = snr;
+	  best_acc = acc;
+	  best_r = r;
+	}
+      }
+    }
+    cand.snr = best_snr;
+    cand.acc = best_acc;
+    cand.freq = best_r/tobs;
+    return ntrials;
+  }
+};
@@ -60,11 +60,11 @@ public:
 
   void zap(DeviceFourierSeries<cufftComplex>& fseries){
     float bin_width = fseries.get_bin_width();
-    unsigned int nbins = fseries.get_nbins();
+    size_t nbins = fseries.get_nbins();
     zap(fseries.get_data(),bin_width,nbins);
   }
   
-  void zap(cufftComplex* fseries, float bin_width, unsigned int nbins){
+  void zap(cufftComplex* fseries, float bin_width, size_t nbins){
     device_zap_birdies(fseries, d_birdies, d_widths,
                        bin_width, birdies.size(), nbins,
                        MAX_BLOCKS, MAX_THREADS);
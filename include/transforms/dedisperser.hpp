@@ -1,6 +1,7 @@
 #pragma once
 #include "dedisp.h"
 #include <cstdlib>
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <sstream>
@@ -94,13 +95,39 @@ public:
     
   }
   
+  size_t get_max_delay(void){
+    return dedisp_get_max_delay(plan);
+  }
+
+  /*!
+    \brief Dedisperse the filterbank into an existing buffer.
+
+    Writes get_nsamps()-get_max_delay() samples per DM trial, with
+    trials out_stride bytes apart. Used to append to the trials of
+    a stream one gulp at a time.
+
+    \param out Start of the first DM trial's output.
+    \param out_stride Bytes between the starts of consecutive DM trials.
+  */
+  void dedisperse_into(unsigned char* out, size_t out_stride)
+  {
+    size_t in_stride = (size_t) filterbank.get_nchans()*filterbank.get_nbits()/8;
+    dedisp_error error = dedisp_execute_adv(plan,
+					    filterbank.get_nsamps(),
+					    filterbank.get_data(),
+					    filterbank.get_nbits(),
+					    in_stride,
+					    out,8,out_stride,(unsigned)0);
+    ErrorChecker::check_dedisp_error(error,"execute_adv");
+  }
+
   //DispersionTrials<unsigned char> dedisperse(void);
   DispersionTrials<unsigned char> dedisperse(void)
   {
     size_t max_delay = dedisp_get_max_delay(plan);
-    unsigned int out_nsamps = filterbank.get_nsamps()-max_delay;
+    size_t out_nsamps = filterbank.get_nsamps()-max_delay;
     size_t output_size = out_nsamps * dm_list.size();
-    unsigned char* data_ptr = new unsigned char [output_size];
+    unsigned char* data_ptr = HugePages::alloc<unsigned char>(output_size,"dm_trials");
     dedisp_error error = dedisp_execute(plan,
 					filterbank.get_nsamps(),
 					filterbank.get_data(),
@@ -111,4 +138,40 @@ public:
     DispersionTrials<unsigned char> ddata(data_ptr,out_nsamps,filterbank.get_tsamp(),dm_list);
     return ddata;
   }
+
+  /*!
+    \brief Dedisperse dm_gulp DM trials at a time, requantising each gulp.
+
+    Only one gulp of 8-bit trials is held at once, so the peak memory
+    is the requantised trials plus dm_gulp 8-bit timeseries rather than
+    every trial at 8 bits.
+
+    \param nbits Bits per stored sample, 4 or 2.
+    \param dm_gulp Number of DM trials dedispersed per call to dedisp.
+  */
+  DispersionTrials<unsigned char> dedisperse(unsigned int nbits, unsigned int dm_gulp)
+  {
+    size_t out_nsamps = filterbank.get_nsamps()-dedisp_get_max_delay(plan);
+    DispersionTrials<unsigned char> ddata(out_nsamps,filterbank.get_tsamp(),dm_list,nbits);
+    std::vector<unsigned char,HugePageAllocator<unsigned char> > gulp(HugePageAllocator<unsigned char>("dedispersion_gulp"));
+    dm_gulp = std::max(1u,dm_gulp);
+    for (size_t start=0;start<dm_list.size();start+=dm_gulp){
+      unsigned int ndms = std::min((size_t) dm_gulp,dm_list.size()-start);
+      dedisp_error error = dedisp_set_dm_list(plan,&dm_list[start],ndms);
+      ErrorChecker::check_dedisp_error(error,"set_dm_list");
+      //A gulp of low DMs has a shorter delay, so yields more samples
+      size_t gulp_nsamps = filterbank.get_nsamps()-dedisp_get_max_delay(plan);
+      gulp.resize(gulp_nsamps*ndms);
+      error = dedisp_execute(plan,
+			     filterbank.get_nsamps(),
+			     filterbank.get_data(),
+			     filterbank.get_nbits(),
+			     &gulp[0],8,(unsigned)0);
+      ErrorChecker::check_dedisp_error(error,"execute");
+      ddata.pack(start,&gulp[0],gulp_nsamps,ndms);
+    }
+    dedisp_error error = dedisp_set_dm_list(plan,&dm_list[0],dm_list.size());
+    ErrorChecker::check_dedisp_error(error,"set_dm_list");
+    return ddata;
+  }
 };
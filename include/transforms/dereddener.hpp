@@ -6,10 +6,11 @@
 #include "utils/utils.hpp"
 #include "utils/exceptions.hpp"
 #include <iostream>
+#include <algorithm>
 
 class Dereddener {
 private:
-  unsigned int size;
+  size_t size;
   float boundary_5_freq;
   float boundary_25_freq;
   float* median_5;
@@ -18,8 +19,24 @@ private:
   float* median;
   float* intermediate;
   
+  /*
+    Stretch a scrunched median back over the bins it was formed from.
+    Spectrum lengths are rarely multiples of the scrunch factor (and
+    need not be for mixed radix transforms), so only the fully covered
+    bins are interpolated and the remainder repeats the last median.
+  */
+  void stretch(float* scrunched, size_t count, unsigned int factor){
+    size_t covered = std::min(size,count*factor);
+    linear_stretch(scrunched,count,intermediate,covered);
+    if (covered < size){
+      float last;
+      Utils::d2hcpy(&last,scrunched+count-1,1);
+      GPU_fill(intermediate+covered,intermediate+size,last);
+    }
+  }
+
 public:
-  Dereddener(unsigned int size)
+  Dereddener(size_t size)
     :size(size)
   {
     Utils::device_malloc(&intermediate,size);
@@ -45,19 +62,19 @@ public:
     if (powers.get_nbins()!=size)
       ErrorChecker::throw_error("Bad data length given to running_median()");
   
-    int pos5  = (int) (boundary_5_freq/powers.get_bin_width());
-    int pos25 = (int) (boundary_25_freq/powers.get_bin_width());
+    size_t pos5  = std::min(size,(size_t) (boundary_5_freq/powers.get_bin_width()));
+    size_t pos25 = std::max(pos5,std::min(size,(size_t) (boundary_25_freq/powers.get_bin_width())));
     median_scrunch5(powers.get_data(),size,median_5);
     median_scrunch5(median_5,size/5,median_25);
     median_scrunch5(median_25,size/5/5,median_125);
     
-    linear_stretch(median_5,size/5,intermediate,size);
+    stretch(median_5,size/5,5);
     Utils::d2dcpy(median,intermediate,pos5);
     
-    linear_stretch(median_25,size/5/5,intermediate,size);
-    Utils::d2dcpy(median+pos5,intermediate+pos5,pos25);
+    stretch(median_25,size/5/5,25);
+    Utils::d2dcpy(median+pos5,intermediate+pos5,pos25-pos5);
     
-    linear_stretch(median_125,size/5/5/5,intermediate,size);
+    stretch(median_125,size/5/5/5,125);
     Utils::d2dcpy(median+pos25,intermediate+pos25,size-pos25);
   }
   
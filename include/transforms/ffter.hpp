@@ -3,20 +3,40 @@
 #include "cufft.h"
 #include "data_types/timeseries.hpp"
 #include "utils/exceptions.hpp"
+#include <climits>
 
 class CuFFTer {
 protected:
   cufftHandle fft_plan;
-  unsigned int size; 
+  size_t size; 
   CuFFTer(void):fft_plan(0),size(0){}
-  unsigned int get_size(void){return size;}
+  size_t get_size(void){return size;}
+
+  /*
+    cufftPlan1d takes an int length, so transforms beyond 2^31 points
+    go through the 64-bit plan interface.
+  */
+  void make_plan(size_t size, cufftType type, unsigned int batch){
+    cufftResult error;
+    if (size <= INT_MAX){
+      error = cufftPlan1d(&fft_plan, (int) size, type, batch);
+    } else {
+      error = cufftCreate(&fft_plan);
+      ErrorChecker::check_cufft_error(error);
+      long long int n = size;
+      size_t work_size;
+      error = cufftMakePlanMany64(fft_plan, 1, &n, NULL, 1, 0, NULL, 1, 0,
+                                  type, batch, &work_size);
+    }
+    ErrorChecker::check_cufft_error(error);
+  }
 
 public:
   double get_resolution(float tsamp){
     return (double) 1.0/(size * tsamp);
   }
   
-  virtual unsigned int get_output_size(void){
+  virtual size_t get_output_size(void){
     return size/2+1;
   }
 
@@ -24,12 +44,11 @@ public:
 
 class CuFFTerC2C: public CuFFTer {
 public:
-  CuFFTerC2C(unsigned int size, unsigned int batch=1)
+  CuFFTerC2C(size_t size, unsigned int batch=1)
     :CuFFTer()
   {
     this->size = size;
-    cufftResult error = cufftPlan1d(&fft_plan, size, CUFFT_C2C, batch);
-    ErrorChecker::check_cufft_error(error);
+    make_plan(size, CUFFT_C2C, batch);
   }
   
   void execute(cufftComplex* input, cufftComplex* output, int direction)
@@ -38,19 +57,18 @@ public:
     ErrorChecker::check_cufft_error(error);
   }
   
-  unsigned int get_output_size(void){
+  size_t get_output_size(void){
     return size;
   }
 };
 
 class CuFFTerR2C: public CuFFTer {
 public:
-  CuFFTerR2C(unsigned int size, unsigned int batch=1)
+  CuFFTerR2C(size_t size, unsigned int batch=1)
     :CuFFTer()
   {
     this->size = size;
-    cufftResult error = cufftPlan1d(&fft_plan, size, CUFFT_R2C, batch);
-    ErrorChecker::check_cufft_error(error);
+    make_plan(size, CUFFT_R2C, batch);
   }
   
   void execute(float* tim, cufftComplex* fseries)
@@ -62,12 +80,11 @@ public:
 
 class CuFFTerC2R: public CuFFTer {
 public:
-  CuFFTerC2R(unsigned int size, unsigned int batch=1)
+  CuFFTerC2R(size_t size, unsigned int batch=1)
     :CuFFTer()
   {
     this->size = size;
-    cufftResult error = cufftPlan1d(&fft_plan, size, CUFFT_C2R, batch);
-    ErrorChecker::check_cufft_error(error);
+    make_plan(size, CUFFT_C2R, batch);
   }
   
   void execute(cufftComplex* input, float* output)
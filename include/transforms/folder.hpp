@@ -5,18 +5,23 @@
 #include <utils/utils.hpp>
 #include <utils/stats.hpp>
 #include <utils/progress_bar.hpp>
+#include <utils/nvtx.hpp>
+#include <utils/async_writer.hpp>
 #include <data_types/folded.hpp>
 #include <data_types/candidates.hpp>
+#include <data_types/whitened_cache.hpp>
 #include <transforms/dereddener.hpp>
 #include <transforms/spectrumformer.hpp>
 #include <transforms/ffter.hpp>
 #include <transforms/resampler.hpp>
+#include <transforms/birdiezapper.hpp>
 #include <data_types/fourierseries.hpp>
 #include <algorithm>
 #include <numeric>
 #include <cmath>
 #include <map>
 #include <stdio.h>
+#include "pthread.h"
 #include "cuda.h"
 #include "cufft.h"
 #include "cuComplex.h"
@@ -32,12 +37,12 @@ struct less_than_key
 
 class TimeSeriesFolder {
 private:
-  unsigned int size;
+  size_t size;
   unsigned int max_blocks;
   unsigned int max_threads;
     
 public:
-  TimeSeriesFolder(unsigned int size,
+  TimeSeriesFolder(size_t size,
 		   unsigned int max_blocks=MAX_BLOCKS,
 		   unsigned int max_threads=MAX_THREADS)
     :size(size),max_blocks(max_blocks),max_threads(max_threads){}
@@ -62,6 +67,15 @@ public:
 };
 
 
+/*
+  Optimises a folded set of subints over a range of linear phase
+  drifts (period offsets) and pulse widths.
+
+  Phase ramps for each trial drift are generated on the fly while
+  collapsing the subints, so device memory scales as nbins*nshifts
+  rather than nbins*nints*nshifts. Templates are only matched against
+  the drift that maximises the harmonic power of the collapsed profile.
+*/
 class FoldOptimiser {
 private:
   unsigned int nbins;
@@ -72,13 +86,13 @@ private:
   
   //phase shift parameters
   float* shift_mags;
-  cufftComplex* shiftar;
   int nshifts;
 
   //collapsed subints after shifting
   cufftComplex* shifted_profiles;
+  float* shift_powers;
 
-  //final array of ntemplates * nbins * nshifts
+  //final array of ntemplates * nbins for the best shift
   //this must be fft'd to get the optimisation
   cufftComplex* final_array_complex;
   float* final_array_float;
@@ -87,7 +101,7 @@ private:
   cufftComplex* templates;
   unsigned int ntemplates;
 
-  //shifted_array
+  //subints shifted by the best drift
   cufftComplex* post_shift_input;
 
   //FFT plans
@@ -109,31 +123,22 @@ private:
   void generate_templates(unsigned int step=1)
   {
     ntemplates = (int)(nbins/step - 1);
-    unsigned int size = ntemplates*nbins;
+    size_t size = (size_t) ntemplates*nbins;
     CuFFTerC2C template_ffter(nbins,ntemplates);
     Utils::device_malloc<cufftComplex>(&templates,size);   
     device_generate_template_array(templates, nbins, size, max_blocks, max_threads);
     template_ffter.execute(templates,templates,CUFFT_FORWARD);
   }
   
-  void generate_shift_array(void)
+  void generate_shift_mags(void)
   {
-    nshifts = nbins;
     float* shift_mags_temp;
     Utils::host_malloc<float>(&shift_mags_temp,nshifts);
     Utils::device_malloc<float>(&shift_mags,nshifts);
     for (int ii=0;ii<nshifts;ii++)
       shift_mags_temp[ii] = ii-nshifts/2;
-    
     Utils::h2dcpy<float>(shift_mags,shift_mags_temp,nshifts);
     Utils::host_free(shift_mags_temp);
-    unsigned int size = nshifts*nbins*nints;
-    //Utils::dump_device_buffer(shift_mags,nshifts,"shift_magnitudes.bin");
-
-    Utils::device_malloc<cufftComplex>(&shiftar,size);
-    device_generate_shift_array(shiftar, size, nbins, nints,
-				nshifts, shift_mags,
-				max_blocks, max_threads);
   }
     
 
@@ -192,18 +197,19 @@ public:
   {
     generate_templates();
     nshifts = nbins;
-    generate_shift_array();
+    generate_shift_mags();
     Utils::device_malloc<cufftComplex>(&input_data,nbins*nints);
-    Utils::device_malloc<cufftComplex>(&post_shift_input,nbins*nints*nshifts);
+    Utils::device_malloc<cufftComplex>(&post_shift_input,nbins*nints);
     Utils::device_malloc<cufftComplex>(&shifted_profiles,nbins*nshifts);
-    Utils::device_malloc<cufftComplex>(&final_array_complex,nbins*nshifts*ntemplates);
-    Utils::device_malloc<float>(&final_array_float,nbins*nshifts*ntemplates);
+    Utils::device_malloc<float>(&shift_powers,nshifts);
+    Utils::device_malloc<cufftComplex>(&final_array_complex,nbins*ntemplates);
+    Utils::device_malloc<float>(&final_array_float,nbins*ntemplates);
     Utils::host_malloc<cufftComplex>(&opt_prof_complex,nbins);
     Utils::host_malloc<cufftComplex>(&opt_subints_complex,nbins*nints);
     Utils::host_malloc<float>(&opt_prof,nbins);
     Utils::host_malloc<float>(&opt_subints,nbins*nints);
     forward_fft = new CuFFTerC2C(nbins,nints);
-    inverse_fft = new CuFFTerC2C(nbins,nshifts*ntemplates);
+    inverse_fft = new CuFFTerC2C(nbins,ntemplates);
     inverse_fft_profile = new CuFFTerC2C(nbins,1);
   }
 
@@ -211,9 +217,10 @@ public:
   {
     Utils::device_free(shift_mags);
     Utils::device_free(templates);
-    Utils::device_free(shiftar);
     Utils::device_free(input_data);
     Utils::device_free(post_shift_input);
+    Utils::device_free(shifted_profiles);
+    Utils::device_free(shift_powers);
     Utils::device_free(final_array_complex);
     Utils::device_free(final_array_float);
     Utils::host_free(opt_prof);
@@ -225,10 +232,13 @@ public:
     delete inverse_fft_profile;
   }
 
+  unsigned int get_nbins(void){return nbins;}
+  unsigned int get_nints(void){return nints;}
+
   void dump_buffers(void){
     Utils::dump_host_buffer<float>(opt_prof,nbins,"opt_prof.bin");
-    Utils::dump_device_buffer<cufftComplex>(post_shift_input,nbins*nints*nshifts,"shifted.bin");
-    Utils::dump_device_buffer<float>(final_array_float,nshifts*nbins*ntemplates,"abs_templated.bin");
+    Utils::dump_device_buffer<cufftComplex>(post_shift_input,nbins*nints,"shifted.bin");
+    Utils::dump_device_buffer<float>(final_array_float,nbins*ntemplates,"abs_templated.bin");
     Utils::dump_device_buffer<cufftComplex>(shifted_profiles,nshifts*nbins,"shifted_profiles.bin");
   }
 
@@ -239,70 +249,50 @@ public:
     float* tmp = fold.get_data();
 
     device_real_to_complex(tmp,input_data,
-			   nbins*nints,max_blocks,max_threads);
-
-    //Utils::dump_device_buffer<cuComplex>(input_data,nbins*nints,"prefft.bin");
+			   (size_t) nbins*nints,max_blocks,max_threads);
 
     forward_fft->execute(input_data,input_data,CUFFT_FORWARD);
 
-    //Utils::dump_device_buffer<cuComplex>(input_data,nbins*nints,"preshift.bin");
-
-    device_multiply_by_shift(input_data, post_shift_input,
-			     shiftar, nbins*nints*nshifts,
-			     nbins*nints, max_blocks, max_threads);
-    //Utils::dump_device_buffer<cuComplex>(post_shift_input,nbins*nints*nshifts,"shifted.bin");
+    //Collapse subints for every trial drift, applying the
+    //phase ramps on the fly
+    device_shift_and_collapse(input_data,shifted_profiles,shift_mags,
+			      nbins,nints,nshifts,max_blocks,max_threads);
 
-    device_collapse_subints(post_shift_input,shifted_profiles,nbins,
-			    nints,nbins*nshifts,max_blocks,max_threads);
-    
-    ///Utils::dump_device_buffer<cuComplex>(shifted_profiles,nbins*nshifts,"pretemplate.bin");
+    //Select the drift that maximises harmonic power
+    device_profile_power(shifted_profiles,shift_powers,nbins,nshifts,max_threads);
+    size_t opt_shift = device_argmax(shift_powers,nshifts);
+    cufftComplex* prof = shifted_profiles+nbins*opt_shift;
 
     //template normalisation is too steep
 
-    device_multiply_by_templates(shifted_profiles, final_array_complex, templates,
-				 nbins, nshifts, nshifts*nbins*ntemplates,
+    device_multiply_by_templates(prof, final_array_complex, templates,
+				 nbins, 1, (size_t) nbins*ntemplates,
 				 1,max_blocks,max_threads);
 
-    //Utils::dump_device_buffer<cuComplex>(final_array_complex,ntemplates*nbins*nshifts,"posttemplate.bin");
-
     inverse_fft->execute(final_array_complex,final_array_complex,CUFFT_INVERSE);
 
-    //Utils::dump_device_buffer<cuComplex>(final_array_complex,nshifts*nbins*ntemplates,"preabs.bin");
-
     device_get_absolute_value(final_array_complex,final_array_float,
-			      nshifts*nbins*ntemplates,
-			      max_blocks,max_threads);
+			      (size_t) nbins*ntemplates,max_blocks,max_threads);
     
-    //Utils::dump_device_buffer<float>(final_array_float,nshifts*nbins*ntemplates,"pdmp.bin");
-
-    int argmax = device_argmax(final_array_float,nshifts*nbins*ntemplates);
-    unsigned int opt_template = argmax/(nbins*nshifts);
-    int opt_bin = argmax%nbins-opt_template/2;
-    unsigned int opt_shift = argmax/nbins%nbins;
-    cufftComplex* prof = shifted_profiles+nbins*opt_shift;
-
-    cufftComplex* subs = post_shift_input+nbins*nints*opt_shift;
-    forward_fft->execute(subs,input_data,CUFFT_INVERSE);
+    size_t argmax = device_argmax(final_array_float,(size_t) nbins*ntemplates);
+    unsigned int opt_template = argmax/nbins;
+    int opt_bin = (int)(argmax%nbins) - (int)(opt_template/2);
+
+    //Only the best drift is applied to the full set of subints
+    device_apply_shift(input_data,post_shift_input,(float)opt_shift-nshifts/2,
+		       nbins,nints,max_blocks,max_threads);
+    forward_fft->execute(post_shift_input,input_data,CUFFT_INVERSE);
     Utils::d2hcpy<cufftComplex>(opt_subints_complex,input_data,nbins*nints);
-    for (int ii=0; ii<nbins*nints; ii++)
+    for (size_t ii=0; ii<(size_t) nbins*nints; ii++)
       opt_subints[ii] = (float) opt_subints_complex[ii].x;    
 
-    
-    //Utils::dump_device_buffer<cufftComplex>(prof,nbins,"prof.bin");
-
-    //printf("opt_shift: %d   opt_bin: %d   opt_width: %d\n",opt_shift,opt_bin,opt_template);
-
     inverse_fft_profile->execute(prof,prof,CUFFT_INVERSE);
-
-    //Utils::dump_device_buffer<cufftComplex>(prof,nbins,"prof_td.bin");
     
     Utils::d2hcpy<cufftComplex>(opt_prof_complex,prof,nbins);
     
     for (int ii=0; ii<nbins; ii++)
       opt_prof[ii] = opt_prof_complex[ii].x;
     
-    //Utils::dump_device_buffer<float>(opt_prof,nbins,"prof_real.bin");
-    
     //up to here is good for narrow pulse widths 
 
     float sn1 = 0;
@@ -327,91 +317,310 @@ public:
 
     fold.set_opt_prof(opt_prof,nbins);
     fold.set_opt_fold(opt_subints,nbins*nints);
-    fold.set_opt_period( p*((((32.0-opt_shift)*p)/(nbins*tobs))+1) );
+    fold.set_opt_period( p*((((nshifts/2.0-opt_shift)*p)/(nbins*tobs))+1) );
     fold.set_opt_width(opt_template+1);
     fold.set_opt_bin(opt_bin);
         
   }  
 };
 
-class MultiFolder {
+/*
+  Hands out DM trial indices (and the candidates mapped to them)
+  to folding threads. Mirrors DMDispenser in the search stage.
+*/
+class FoldDispenser {
+private:
+  std::map< unsigned int, std::vector<unsigned int> >& dm_to_cand_map;
+  std::map< unsigned int, std::vector<unsigned int> >::iterator iter;
+  pthread_mutex_t mutex;
+  int count;
+  int done;
+  ProgressBar* progress;
+  bool use_progress_bar;
+
+public:
+  FoldDispenser(std::map< unsigned int, std::vector<unsigned int> >& dm_to_cand_map,
+		ProgressBar* progress=NULL)
+    :dm_to_cand_map(dm_to_cand_map),done(0),
+     progress(progress),use_progress_bar(progress!=NULL)
+  {
+    iter = dm_to_cand_map.begin();
+    count = dm_to_cand_map.size();
+    pthread_mutex_init(&mutex, NULL);
+  }
+
+  //Returns false when there are no DMs left to fold
+  bool get_next(unsigned int& dm_idx, std::vector<unsigned int>& cand_idxs){
+    bool retval = false;
+    pthread_mutex_lock(&mutex);
+    if (iter != dm_to_cand_map.end()){
+      if (use_progress_bar)
+	progress->set_progress((float)done/count);
+      dm_idx = iter->first;
+      cand_idxs = iter->second;
+      iter++;
+      done++;
+      retval = true;
+    }
+    pthread_mutex_unlock(&mutex);
+    return retval;
+  }
+
+  ~FoldDispenser(){
+    pthread_mutex_destroy(&mutex);
+  }
+};
+
+/*
+  Chooses a fold grid for a candidate from its period. The number of
+  phase bins is the largest power of two not exceeding the number of
+  samples per period and the number of subints is the largest power of
+  two not exceeding the number of pulse rotations, each clamped to the
+  given limits.
+*/
+#define FOLD_MIN_NBINS 16
+#define FOLD_MIN_NINTS 8
+
+class FoldShapeSelector {
 private:
+  unsigned int min_nbins;
+  unsigned int max_nbins;
+  unsigned int min_nints;
+  unsigned int max_nints;
+  float tsamp;
+  float tobs;
+
+  unsigned int clamp_pow2(double val, unsigned int lo, unsigned int hi){
+    unsigned int n = (val >= hi) ? hi : Utils::prev_power_of_two((unsigned int) val + 1);
+    return std::max(std::min(lo,hi),std::min(n,hi));
+  }
+
+  //Every value clamp_pow2() can return
+  static std::vector<unsigned int> clamp_pow2_values(unsigned int lo, unsigned int hi){
+    std::vector<unsigned int> values;
+    unsigned int first = std::min(lo,hi);
+    values.push_back(first);
+    for (unsigned int n=Utils::prev_power_of_two(first)*2;n<hi;n*=2)
+      if (n > first)
+	values.push_back(n);
+    if (hi > first)
+      values.push_back(hi);
+    return values;
+  }
+
+public:
+  FoldShapeSelector(unsigned int max_nbins, unsigned int max_nints,
+		    float tsamp, float tobs,
+		    unsigned int min_nbins=FOLD_MIN_NBINS, unsigned int min_nints=FOLD_MIN_NINTS)
+    :min_nbins(min_nbins),max_nbins(max_nbins),
+     min_nints(min_nints),max_nints(max_nints),
+     tsamp(tsamp),tobs(tobs){}
+
+  void select(double period, unsigned int& nbins, unsigned int& nints){
+    nbins = clamp_pow2(period/tsamp,min_nbins,max_nbins);
+    nints = clamp_pow2(tobs/period,min_nints,max_nints);
+  }
+
+  /*!
+    \brief Every (nbins, nints) grid select() can return for these limits.
+
+    A FoldWorker may create a FoldOptimiser for each of them.
+  */
+  static std::vector< std::pair<unsigned int,unsigned int> >
+  possible_shapes(unsigned int max_nbins, unsigned int max_nints,
+		  unsigned int min_nbins=FOLD_MIN_NBINS, unsigned int min_nints=FOLD_MIN_NINTS){
+    std::vector<unsigned int> nbins = clamp_pow2_values(min_nbins,max_nbins);
+    std::vector<unsigned int> nints = clamp_pow2_values(min_nints,max_nints);
+    std::vector< std::pair<unsigned int,unsigned int> > shapes;
+    for (size_t ii=0;ii<nbins.size();ii++)
+      for (size_t jj=0;jj<nints.size();jj++)
+	shapes.push_back(std::make_pair(nbins[ii],nints[jj]));
+    return shapes;
+  }
+};
+
+/*
+  A single folding thread. Each FoldWorker owns its own device
+  buffers, FFT plans and FoldOptimisers so that no state is shared
+  between threads. Candidates are only ever written through the
+  indices handed out by the FoldDispenser, so writes never overlap.
+
+  Optimisers are created lazily, one per fold grid, so template and
+  FFT plan setup is only paid once per shape.
+*/
+class FoldWorker {
+private:
+  typedef std::pair<unsigned int,unsigned int> shape_type;
   std::vector<Candidate>& cands;
   DispersionTrials<unsigned char>& dm_trials;
-  TimeDomainResampler resampler;
-  unsigned int nsamps;
-  float tsamp;
-  std::map< unsigned int, std::vector<unsigned int> > dm_to_cand_map;
-  FoldedSubints<float>* subints;
-  FoldOptimiser* optimiser;
-  float min_period;
-  float max_period;
-  bool use_progress_bar;
-  ProgressBar* progress_bar;
+  FoldDispenser& dispenser;
+  WhitenedSeriesCache* cache;
+  AsyncArchiveWriter* writer;
+  std::string zapfilename;
+  size_t nsamps;
+  unsigned int max_nbins;
+  unsigned int max_nints;
+  int device;
+  std::map<shape_type, FoldedSubints<float>*> subints;
+  std::map<shape_type, FoldOptimiser*> optimisers;
+
+  void get_folder_objects(unsigned int nbins, unsigned int nints,
+			  FoldedSubints<float>** fold, FoldOptimiser** optimiser){
+    shape_type shape(nbins,nints);
+    if (optimisers.find(shape)==optimisers.end()){
+      subints[shape] = new FoldedSubints<float>(nbins,nints);
+      optimisers[shape] = new FoldOptimiser(nbins,nints);
+    }
+    *fold = subints[shape];
+    *optimiser = optimisers[shape];
+  }
 
-  void fold_all_mapped(void){
-    std::map<unsigned int, std::vector<unsigned int> >::iterator iter;
+  void free_folder_objects(void){
+    std::map<shape_type, FoldOptimiser*>::iterator iter;
+    for (iter=optimisers.begin();iter!=optimisers.end();iter++){
+      delete subints[iter->first];
+      delete iter->second;
+    }
+    subints.clear();
+    optimisers.clear();
+  }
+
+public:
+  FoldWorker(std::vector<Candidate>& cands,
+	     DispersionTrials<unsigned char>& dm_trials,
+	     FoldDispenser& dispenser, WhitenedSeriesCache* cache,
+	     size_t nsamps, unsigned int max_nbins, unsigned int max_nints,
+	     int device, AsyncArchiveWriter* writer=NULL, std::string zapfilename="")
+    :cands(cands),dm_trials(dm_trials),dispenser(dispenser),cache(cache),
+     writer(writer),zapfilename(zapfilename),nsamps(nsamps),max_nbins(max_nbins),max_nints(max_nints),device(device){}
+
+  void start(void){
+    cudaSetDevice(device);
+    NAME_NVTX_THREAD("Folder",device)
+    float tsamp = dm_trials.get_tsamp();
+    float tobs = nsamps*tsamp;
     ReusableDeviceTimeSeries<float,unsigned char> device_tim(nsamps);
     DeviceTimeSeries<float> d_tim_r(nsamps);
     Dereddener rednoise(nsamps/2+1);
     TimeDomainResampler resampler;
     SpectrumFormer former;
-    float tobs = nsamps*tsamp;
     CuFFTerR2C r2cfft(nsamps);
     CuFFTerC2R c2rfft(nsamps);
     DeviceFourierSeries<cufftComplex> d_fseries(nsamps/2+1,1.0/tobs);
     DevicePowerSpectrum<float> pspec(d_fseries);
-    int nbins = 64;
-    int nints = 16;
     TimeSeriesFolder folder(nsamps);
+    //Device buffers, so one per thread
+    Zapper* bzap = (zapfilename!="") ? new Zapper(zapfilename) : NULL;
+    FoldShapeSelector shapes(max_nbins,max_nints,tsamp,tobs);
+    FoldedSubints<float>* fold;
+    FoldOptimiser* optimiser;
+    DedispersedTimeSeries<unsigned char> h_tim;
+    std::vector<unsigned char> unpack_buffer;
+    std::vector<unsigned int> cand_idxs;
+    unsigned int dm_idx;
+    unsigned int nbins,nints;
     float period;
     int cand_idx;
-    TimeSeries<unsigned char> h_tim;
-    float mean,std,rms;
 
-    if (use_progress_bar){
-      printf("Folding and optimising candidates...\n");
-      progress_bar->start();
-    }
-    for(iter = dm_to_cand_map.begin(); iter != dm_to_cand_map.end(); iter++)
+    while (dispenser.get_next(dm_idx,cand_idxs))
       {
-	if (use_progress_bar)
-	  progress_bar->set_progress((float)std::distance(dm_to_cand_map.begin(),iter)/dm_to_cand_map.size());
-	mean = std = rms = 0.0;
-	
-	h_tim = dm_trials[iter->first];
-        device_tim.copy_from_host(h_tim);
-	d_tim_r.set_tsamp(h_tim.get_tsamp());
-	r2cfft.execute(device_tim.get_data(),d_fseries.get_data());
-	former.form(d_fseries,pspec);
-	rednoise.calculate_median(pspec);
-	rednoise.deredden(d_fseries);
-	c2rfft.execute(d_fseries.get_data(),device_tim.get_data());
-        
-	for(int ii=0;ii<iter->second.size();ii++)
-          {
-	    
-            cand_idx = iter->second[ii];
-            period = 1.0/cands[cand_idx].freq;
+	PUSH_NVTX_RANGE_IDX("Fold-DM-Trial",6,dm_idx,-1)
+	d_tim_r.set_tsamp(tsamp);
+	//Use the whitened series from the search if it was kept, else
+	//whiten it the same way so folds do not depend on the cache
+	if (cache==NULL || !cache->fetch(dm_idx,device_tim)){
+	  dm_trials.get_idx(dm_idx,h_tim,unpack_buffer);
+	  device_tim.copy_from_host(h_tim);
+	  r2cfft.execute(device_tim.get_data(),d_fseries.get_data());
+	  former.form(d_fseries,pspec);
+	  rednoise.calculate_median(pspec);
+	  rednoise.deredden(d_fseries);
+	  if (bzap != NULL)
+	    bzap->zap(d_fseries);
+	  c2rfft.execute(d_fseries.get_data(),device_tim.get_data());
+	}
+
+	for(int ii=0;ii<cand_idxs.size();ii++)
+	  {
+	    cand_idx = cand_idxs[ii];
+	    period = 1.0/cands[cand_idx].freq;
+	    shapes.select(period,nbins,nints);
+	    get_folder_objects(nbins,nints,&fold,&optimiser);
 	    resampler.resample(device_tim,d_tim_r,nsamps,cands[cand_idx].acc);
-	    folder.fold(d_tim_r,*subints,period);
-	    optimiser->optimise(*subints);
-	    cands[cand_idx].folded_snr = subints->get_opt_sn();
-	    cands[cand_idx].set_fold(&subints->opt_fold[0],nbins,nints);
-	    cands[cand_idx].opt_period = subints->get_opt_period();
+	    folder.fold(d_tim_r,*fold,period);
+	    optimiser->optimise(*fold);
+	    cands[cand_idx].folded_snr = fold->get_opt_sn();
+	    cands[cand_idx].set_fold(&fold->opt_fold[0],nbins,nints);
+	    cands[cand_idx].opt_period = fold->get_opt_period();
+	    if (writer != NULL)
+	      writer->submit(cands[cand_idx]);
 	  }
+	POP_NVTX_RANGE
       }
+    free_folder_objects();
+    if (bzap != NULL)
+      delete bzap;
+  }
+
+  static void* launch(void* ptr){
+    reinterpret_cast<FoldWorker*>(ptr)->start();
+    return NULL;
+  }
+};
+
+class MultiFolder {
+private:
+  std::vector<Candidate>& cands;
+  DispersionTrials<unsigned char>& dm_trials;
+  size_t nsamps;
+  unsigned int nthreads;
+  int ngpus;
+  WhitenedSeriesCache* cache;
+  AsyncArchiveWriter* writer;
+  std::string zapfilename;
+  std::map< unsigned int, std::vector<unsigned int> > dm_to_cand_map;
+  unsigned int nbins;
+  unsigned int nints;
+  float min_period;
+  float max_period;
+  bool use_progress_bar;
+  ProgressBar* progress_bar;
+
+  void fold_all_mapped(void){
+    int ndevices = std::max(1,ngpus > 0 ? ngpus : Utils::gpu_count());
+    int nworkers = std::max(1,(int)std::min((size_t)nthreads,dm_to_cand_map.size()));
+    std::vector<FoldWorker*> workers(nworkers);
+    std::vector<pthread_t> threads(nworkers);
+    FoldDispenser dispenser(dm_to_cand_map, use_progress_bar ? progress_bar : NULL);
+
+    if (use_progress_bar){
+      printf("Folding and optimising candidates...\n");
+      progress_bar->start();
+    }
+    for (int ii=0;ii<nworkers;ii++){
+      workers[ii] = new FoldWorker(cands,dm_trials,dispenser,cache,
+				   nsamps,nbins,nints,ii%ndevices,writer,zapfilename);
+      pthread_create(&threads[ii], NULL, FoldWorker::launch, (void*) workers[ii]);
+    }
+    for (int ii=0;ii<nworkers;ii++){
+      pthread_join(threads[ii],NULL);
+      delete workers[ii];
+    }
     if (use_progress_bar)
       progress_bar->stop();
   }
 
 public:
-  MultiFolder(std::vector<Candidate>& cands, DispersionTrials<unsigned char>& dm_trials)
-    :cands(cands),dm_trials(dm_trials),use_progress_bar(false){
-    nsamps = Utils::prev_power_of_two(dm_trials.get_nsamps());
-    tsamp = dm_trials.get_tsamp();
-    subints = new FoldedSubints<float>(64,16);
-    optimiser = new FoldOptimiser (64,16);
+  /*!
+    \param nthreads Folding threads, at most one per DM trial folded.
+    \param ngpus GPUs the threads are spread over, 0 for every GPU.
+  */
+  MultiFolder(std::vector<Candidate>& cands, DispersionTrials<unsigned char>& dm_trials,
+	      unsigned int nthreads=1, unsigned int nbins=64, unsigned int nints=16,
+	      int ngpus=0)
+    :cands(cands),dm_trials(dm_trials),nthreads(std::max(1u,nthreads)),ngpus(ngpus),
+     cache(NULL),writer(NULL),nbins(nbins),nints(nints),use_progress_bar(false){
+    nsamps = Utils::prev_smooth_size(dm_trials.get_nsamps());
     min_period = 0.001;
     max_period = 10.00;
   }
@@ -420,6 +629,23 @@ public:
     progress_bar = new ProgressBar;
     use_progress_bar = true;
   }
+
+  //Whitened series kept by the search stage (may be NULL)
+  void set_cache(WhitenedSeriesCache* cache_){
+    cache = cache_;
+  }
+
+  //Folded candidates are handed to the writer as they complete (may be NULL)
+  void set_writer(AsyncArchiveWriter* writer_){
+    writer = writer_;
+  }
+
+  //Birdies zapped when whitening, as in the search (empty for none)
+  void set_zapfile(std::string zapfilename_){
+    zapfilename = zapfilename_;
+  }
+
+  size_t get_nsamps(void){return nsamps;}
   
   void fold_n(unsigned int n_to_fold){
     int count = std::min(n_to_fold,(unsigned int) cands.size());
@@ -430,12 +656,12 @@ public:
 	dm_to_cand_map[cands[ii].dm_idx].push_back(ii);
     }
     fold_all_mapped();
-    std::sort(cands.begin(),cands.end(),less_than_key());
+    //stable sort so that ties keep their distilled order
+    //regardless of which thread folded them
+    std::stable_sort(cands.begin(),cands.end(),less_than_key());
   }
   
   ~MultiFolder(){
-    delete subints;
-    delete optimiser;
     if (use_progress_bar)
       delete progress_bar;
   }
@@ -5,22 +5,27 @@
 #include <iostream>
 #include <utils/nvtx.hpp>
 
+/*
+  Sums are formed in fp32 from an fp32 spectrum and stored as T,
+  either float or half.
+*/
+template <class T>
 class HarmonicFolder {
 private:
   unsigned int max_blocks;
   unsigned int max_threads;
-  float** h_data_ptrs;
-  float** d_data_ptrs;
-  HarmonicSums<float>& sums;
+  T** h_data_ptrs;
+  T** d_data_ptrs;
+  HarmonicSums<T>& sums;
 
 public:
-  HarmonicFolder(HarmonicSums<float>& sums,
+  HarmonicFolder(HarmonicSums<T>& sums,
 		 unsigned int max_blocks=MAX_BLOCKS,
 		 unsigned int max_threads=MAX_THREADS)
     :sums(sums),max_blocks(max_blocks),max_threads(max_threads)
   {
-    Utils::device_malloc<float*>(&d_data_ptrs,sums.size());
-    Utils::host_malloc<float*>(&h_data_ptrs,sums.size());
+    Utils::device_malloc<T*>(&d_data_ptrs,sums.size());
+    Utils::host_malloc<T*>(&h_data_ptrs,sums.size());
   }
   
   void fold(DevicePowerSpectrum<float>& fold0)
@@ -30,7 +35,7 @@ public:
       {
 	h_data_ptrs[ii] = sums[ii]->get_data();
       }
-    Utils::h2dcpy<float*>(d_data_ptrs,h_data_ptrs,sums.size());
+    Utils::h2dcpy<T*>(d_data_ptrs,h_data_ptrs,sums.size());
     device_harmonic_sum(fold0.get_data(),d_data_ptrs,
 			fold0.get_nbins(),sums.size(),
 			max_blocks,max_threads);
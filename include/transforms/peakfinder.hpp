@@ -15,12 +15,12 @@ private:
   float max_freq;
   int min_gap; //The minimum gap between adjacent peaks such that the are considered unique
   unsigned int max_cands; //This value is hardcoded (could cause segfault)
-  std::vector<int> idxs;
+  std::vector<size_t> idxs;
   std::vector<float> snrs;
-  std::vector<int> peakidxs;
+  std::vector<size_t> peakidxs;
   std::vector<float> peaksnrs;
   std::vector<float> peakfreqs;
-  thrust::device_vector<int> d_idxs;
+  thrust::device_vector<size_t> d_idxs;
   thrust::device_vector<float> d_snrs;
   cached_allocator allocator;
   
@@ -28,8 +28,8 @@ private:
   {
     int ii;
     float cpeak;
-    int cpeakidx;
-    int lastidx= -1 * min_gap;
+    size_t cpeakidx;
+    size_t lastidx;
     int npeaks=0;
     ii=0;
 
@@ -39,7 +39,7 @@ private:
       lastidx=idxs[ii];
       ii++;
 
-      while (ii<count && (idxs[ii]-lastidx) < min_gap){
+      while (ii<count && (idxs[ii]-lastidx) < (size_t) min_gap){
         if (snrs[ii]>cpeak)
 	  {                                                                                
 	    cpeak=snrs[ii];
@@ -56,7 +56,7 @@ private:
   }
 
 public:
-  PeakFinder(float threshold, float min_freq, float max_freq, unsigned int size, int min_gap=30)
+  PeakFinder(float threshold, float min_freq, float max_freq, size_t size, int min_gap=30)
     :threshold(threshold), min_freq(min_freq), 
      max_freq(max_freq),min_gap(min_gap),max_cands(100000)
   {
@@ -69,18 +69,20 @@ public:
     d_snrs.resize(size);
   }
 
-  void find_candidates(HarmonicSums<float>& sums, SpectrumCandidates& cands){
+  template <class T>
+  void find_candidates(HarmonicSums<T>& sums, SpectrumCandidates& cands){
     for (int ii=0;ii<sums.size();ii++)
       find_candidates(*sums[ii],cands);
   }
   
-  void find_candidates(DevicePowerSpectrum<float>& pspec, SpectrumCandidates& cands){
-    int size = pspec.get_nbins();
+  template <class T>
+  void find_candidates(DevicePowerSpectrum<T>& pspec, SpectrumCandidates& cands){
+    size_t size = pspec.get_nbins();
     float nyquist = pspec.get_bin_width()*size;
-    int orig_size = 2.0*(size-1.0);
+    size_t orig_size = 2*(size-1);
     int nh = pspec.get_nh();
-    int max_bin = (int)((max_freq/pspec.get_bin_width())*pow(2.0,nh));
-    int start_idx = (int)(orig_size*(min_freq/nyquist)*pow(2.0,nh));
+    size_t max_bin = (size_t)((max_freq/pspec.get_bin_width())*pow(2.0,nh));
+    size_t start_idx = (size_t)(orig_size*(min_freq/nyquist)*pow(2.0,nh));
     int count = device_find_peaks(std::min(size,max_bin),
                                   start_idx, pspec.get_data(),
                                   threshold, &idxs[0], &snrs[0],
@@ -0,0 +1,519 @@
+#pragma once
+#include <data_types/filterbank.hpp>
+#include <data_types/candidates.hpp>
+#include <utils/exceptions.hpp>
+#include <utils/utils.hpp>
+#include <utils/unpacker.hpp>
+#include <utils/thread_pool.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#define REFINE_DM_CONST 4.148808e3
+#define REFINE_SPEED_OF_LIGHT 299792458.0
+
+/*!
+  \brief A (subint, subband, phase) cube folded from raw filterbank data.
+
+  The cube is folded once per candidate at its nominal DM, period and
+  acceleration. Channels are dedispersed within each subband to the
+  highest frequency of that subband; the remaining inter-subband delay
+  is left in the cube so that the DM can be changed afterwards by
+  rotating subbands rather than refolding.
+*/
+struct FoldedCube {
+  unsigned int nints;
+  unsigned int nsubbands;
+  unsigned int nbins;
+  double period;
+  double acc;
+  float dm;
+  std::vector<float> data;
+  std::vector<unsigned int> count;
+
+  FoldedCube(unsigned int nints, unsigned int nsubbands, unsigned int nbins,
+	     double period, double acc, float dm)
+    :nints(nints),nsubbands(nsubbands),nbins(nbins),
+     period(period),acc(acc),dm(dm),
+     data(nints*nsubbands*nbins,0.0),
+     count(nints*nsubbands*nbins,0){}
+
+  inline unsigned int idx(unsigned int subint, unsigned int subband, unsigned int bin){
+    return (subint*nsubbands + subband)*nbins + bin;
+  }
+
+  //Add the unnormalised sums of a cube folded with the same ephemeris
+  void add(FoldedCube& other){
+    for (size_t ii=0;ii<data.size();ii++){
+      data[ii] += other.data[ii];
+      count[ii] += other.count[ii];
+    }
+  }
+};
+
+/*!
+  \brief Folds raw filterbank data into FoldedCubes on the host.
+
+  Several candidates are folded in a single pass over the data. Each
+  spectrum is unpacked to float once and its channels are scattered
+  into a small per-candidate ring of subband sums indexed by output
+  sample. An output sample is folded once the most delayed channel
+  has arrived.
+
+  fold() does the whole observation. For threads, prepare() the cubes
+  once, fold_range() disjoint ranges of output samples into separate
+  cubes, add() them and normalise(). Each range reads the max_delay
+  spectra past its end again.
+*/
+class FilterbankFolder {
+private:
+  Filterbank& filterbank;
+  unsigned int nsubbands;
+  unsigned int nchans;
+  size_t nsamps;
+  unsigned int nbits;
+  unsigned int chans_per_subband;
+  size_t bytes_per_samp;
+  float tsamp;
+  std::vector<double> chan_freqs;
+  std::vector<double> subband_freqs;
+  //Set by prepare()
+  std::vector< std::vector<unsigned int> > delays;
+  std::vector<double> accel_facts;
+  unsigned int max_delay;
+  size_t nvalid;
+
+  inline void fold_sample(FoldedCube& cube, size_t samp, float* subbands,
+			  double accel_fact, double tobs, size_t nvalid){
+    double t = samp*tsamp;
+    double rotation = (t + t*accel_fact*(t-tobs))/cube.period;
+    double phase = rotation-floor(rotation);
+    unsigned int bin = std::min(cube.nbins-1,(unsigned int)(phase*cube.nbins));
+    unsigned int subint = std::min(cube.nints-1,(unsigned int)((double)samp*cube.nints/nvalid));
+    for (unsigned int jj=0;jj<nsubbands;jj++){
+      unsigned int idx = cube.idx(subint,jj,bin);
+      cube.data[idx] += subbands[jj];
+      cube.count[idx]++;
+    }
+  }
+
+public:
+  /*!
+    \brief Create a new FilterbankFolder.
+
+    \param filterbank The filterbank to fold (1, 2, 4, 8, 16 or 32 bit).
+    \param nsubbands The number of subbands to fold into.
+  */
+  FilterbankFolder(Filterbank& filterbank, unsigned int nsubbands)
+    :filterbank(filterbank),max_delay(0),nvalid(0)
+  {
+    nchans = filterbank.get_nchans();
+    nsamps = filterbank.get_nsamps();
+    nbits = filterbank.get_nbits();
+    tsamp = filterbank.get_tsamp();
+    if (!unpacker_supports(nbits))
+      ErrorChecker::throw_error("FilterbankFolder: only 1, 2, 4, 8, 16 and 32 bit data are supported");
+    nsubbands = std::max(1u,std::min(nsubbands,nchans));
+    while (nchans%nsubbands)
+      nsubbands--;
+    this->nsubbands = nsubbands;
+    chans_per_subband = nchans/nsubbands;
+    bytes_per_samp = (size_t) nchans*nbits/8;
+    chan_freqs.resize(nchans);
+    for (unsigned int ii=0;ii<nchans;ii++)
+      chan_freqs[ii] = filterbank.get_fch1() + ii*filterbank.get_foff();
+    subband_freqs.resize(nsubbands);
+    for (unsigned int ii=0;ii<nsubbands;ii++){
+      double* first = &chan_freqs[ii*chans_per_subband];
+      subband_freqs[ii] = *std::max_element(first,first+chans_per_subband);
+    }
+  }
+
+  unsigned int get_nsubbands(void){return nsubbands;}
+  std::vector<double>& get_subband_freqs(void){return subband_freqs;}
+  double get_top_freq(void){
+    return *std::max_element(chan_freqs.begin(),chan_freqs.end());
+  }
+  double get_bottom_freq(void){
+    return *std::min_element(chan_freqs.begin(),chan_freqs.end());
+  }
+  float get_tobs(void){return nsamps*tsamp;}
+
+  /*!
+    \brief Compute the channel delays of a set of cubes.
+
+    Each cube must already carry its period, acceleration and DM.
+
+    \return The number of output samples, 0 if the DM delay spans the data.
+  */
+  size_t prepare(std::vector<FoldedCube*>& cubes){
+    size_t ncubes = cubes.size();
+    delays.assign(ncubes,std::vector<unsigned int>(nchans));
+    accel_facts.resize(ncubes);
+    max_delay = 0;
+    for (size_t cc=0;cc<ncubes;cc++){
+      FoldedCube& cube = *cubes[cc];
+      for (unsigned int ii=0;ii<nchans;ii++){
+	double ref = subband_freqs[ii/chans_per_subband];
+	double delay = REFINE_DM_CONST*cube.dm*(1.0/(chan_freqs[ii]*chan_freqs[ii]) - 1.0/(ref*ref));
+	delays[cc][ii] = (unsigned int)(delay/tsamp + 0.5);
+	max_delay = std::max(max_delay,delays[cc][ii]);
+      }
+      accel_facts[cc] = cube.acc/(2.0*REFINE_SPEED_OF_LIGHT);
+    }
+    nvalid = (max_delay < nsamps) ? nsamps-max_delay : 0;
+    return nvalid;
+  }
+
+  unsigned int get_max_delay(void){return max_delay;}
+
+  /*!
+    \brief Fold output samples [first,last) without normalising.
+
+    \param cubes Cubes matching, in order, those given to prepare().
+    \param first First output sample.
+    \param last One past the last output sample, at most prepare()'s count.
+  */
+  void fold_range(std::vector<FoldedCube*>& cubes, size_t first, size_t last){
+    size_t ncubes = cubes.size();
+    double tobs = nsamps*tsamp;
+    size_t ring_size = max_delay+1;
+    std::vector< std::vector<float> > rings(ncubes);
+    for (size_t cc=0;cc<ncubes;cc++)
+      rings[cc].assign(ring_size*nsubbands,0.0f);
+    std::vector<float> spectrum(nchans);
+    unsigned char* data = filterbank.get_data();
+
+    for (size_t row=first;row<last+max_delay;row++){
+      unpack_samples(nbits,data+row*bytes_per_samp,&spectrum[0],nchans);
+      size_t slot = row%ring_size;
+      for (size_t cc=0;cc<ncubes;cc++){
+	float* ring = &rings[cc][0];
+	unsigned int* delay = &delays[cc][0];
+	//Channel ii of this spectrum belongs to output sample row-delay[ii]
+	bool edge = row < first+max_delay || row >= last;
+	for (unsigned int jj=0;jj<nsubbands;jj++){
+	  for (unsigned int ii=jj*chans_per_subband;ii<(jj+1)*chans_per_subband;ii++){
+	    if (edge && (row < first+delay[ii] || row-delay[ii] >= last))
+	      continue;
+	    size_t pos = (slot>=delay[ii]) ? slot-delay[ii] : slot+ring_size-delay[ii];
+	    ring[pos*nsubbands + jj] += spectrum[ii];
+	  }
+	}
+	if (row < first+max_delay)
+	  continue;
+	size_t samp = row-max_delay;
+	float* subbands = &ring[(samp%ring_size)*nsubbands];
+	fold_sample(*cubes[cc],samp,subbands,accel_facts[cc],tobs,nvalid);
+	std::fill(subbands,subbands+nsubbands,0.0f);
+      }
+    }
+  }
+
+  //Average each bin and remove the baseline of each subint/subband
+  void normalise(std::vector<FoldedCube*>& cubes){
+    for (size_t cc=0;cc<cubes.size();cc++){
+      FoldedCube& cube = *cubes[cc];
+      for (unsigned int ii=0;ii<cube.nints*cube.nsubbands;ii++){
+	float* prof = &cube.data[ii*cube.nbins];
+	unsigned int* count = &cube.count[ii*cube.nbins];
+	double sum = 0.0;
+	unsigned int nfilled = 0;
+	for (unsigned int bb=0;bb<cube.nbins;bb++){
+	  if (count[bb]){
+	    prof[bb] /= count[bb];
+	    sum += prof[bb];
+	    nfilled++;
+	  }
+	}
+	float mean = nfilled ? sum/nfilled : 0.0;
+	for (unsigned int bb=0;bb<cube.nbins;bb++)
+	  prof[bb] = count[bb] ? prof[bb]-mean : 0.0;
+      }
+    }
+  }
+
+  /*!
+    \brief Fold a set of cubes in one pass over the data.
+
+    Each cube must already carry its period, acceleration and DM.
+  */
+  void fold(std::vector<FoldedCube*>& cubes){
+    if (prepare(cubes) == 0)
+      return;
+    fold_range(cubes,0,nvalid);
+    normalise(cubes);
+  }
+};
+
+/*!
+  \brief pdmp style DM/period/acceleration optimisation of a FoldedCube.
+
+  Every grid point is evaluated by rotating each (subint, subband)
+  profile by the phase difference between the trial and the folded
+  ephemeris, evaluated at the subint centre, and summing. Grid steps
+  are chosen so that one step moves the pulse by one phase bin across
+  the band (DM) or across the observation (period, acceleration).
+*/
+class CubeOptimiser {
+private:
+  FilterbankFolder& folder;
+  int ndm;
+  int nperiod;
+  int nacc;
+
+  //Largest boxcar S/N over power of two widths
+  float profile_sn(std::vector<float>& prof, float sigma){
+    unsigned int nbins = prof.size();
+    float best = 0.0;
+    for (unsigned int width=1;width<=nbins/2;width*=2){
+      float norm = sigma*sqrt((float)width);
+      for (unsigned int start=0;start<nbins;start++){
+	float sum = 0.0;
+	for (unsigned int ii=0;ii<width;ii++)
+	  sum += prof[(start+ii)%nbins];
+	best = std::max(best,sum/norm);
+      }
+    }
+    return best;
+  }
+
+  //Phase of the pulse at time t (top of band) for a given ephemeris
+  inline double phase(double t, double period, double acc, double tobs){
+    return (t + t*acc/(2.0*REFINE_SPEED_OF_LIGHT)*(t-tobs))/period;
+  }
+
+public:
+  /*!
+    \brief Create a new CubeOptimiser.
+
+    \param folder The folder that produced the cubes (for frequencies).
+    \param ndm Number of DM steps either side of the folded DM.
+    \param nperiod Number of period steps either side of the folded period.
+    \param nacc Number of acceleration steps either side of the folded acceleration.
+  */
+  CubeOptimiser(FilterbankFolder& folder, int ndm=8, int nperiod=8, int nacc=4)
+    :folder(folder),ndm(ndm),nperiod(nperiod),nacc(nacc){}
+
+  /*!
+    \brief Search the refinement grid and store the best point.
+
+    \param cube A folded cube.
+    \param cand The candidate to receive the refined parameters.
+  */
+  void optimise(FoldedCube& cube, Candidate& cand){
+    unsigned int nbins = cube.nbins;
+    unsigned int nints = cube.nints;
+    unsigned int nsubbands = cube.nsubbands;
+    double tobs = folder.get_tobs();
+    double p = cube.period;
+    double ftop = folder.get_top_freq();
+    double fbot = folder.get_bottom_freq();
+    std::vector<double>& sb_freqs = folder.get_subband_freqs();
+
+    double dm_step = p/(nbins*REFINE_DM_CONST*(1.0/(fbot*fbot)-1.0/(ftop*ftop)));
+    double p_step = p*p/(nbins*tobs);
+    double acc_step = 8.0*REFINE_SPEED_OF_LIGHT*p/(nbins*tobs*tobs);
+
+    //Noise of a single cube cell, used to normalise profile S/N
+    double var = 0.0;
+    unsigned int ncells = 0;
+    for (size_t ii=0;ii<cube.data.size();ii++){
+      if (cube.count[ii]){
+	var += cube.data[ii]*cube.data[ii];
+	ncells++;
+      }
+    }
+    if (ncells==0)
+      return;
+    float sigma = sqrt(var/ncells)*sqrt((float)nints*nsubbands);
+
+    std::vector<double> t_mid(nints);
+    std::vector<double> fold_phase(nints);
+    for (unsigned int ii=0;ii<nints;ii++){
+      t_mid[ii] = (ii+0.5)*tobs/nints;
+      fold_phase[ii] = phase(t_mid[ii],p,cube.acc,tobs);
+    }
+
+    std::vector<float> prof(nbins);
+    std::vector<int> shifts(nints*nsubbands);
+    float best_sn = -1.0;
+    double best_dm = cube.dm, best_p = p, best_acc = cube.acc;
+
+    for (int ia=-nacc;ia<=nacc;ia++){
+      double acc = cube.acc + ia*acc_step;
+      for (int ip=-nperiod;ip<=nperiod;ip++){
+	double period = p + ip*p_step;
+	for (int id=-ndm;id<=ndm;id++){
+	  double dm = cube.dm + id*dm_step;
+	  for (unsigned int ii=0;ii<nints;ii++){
+	    for (unsigned int jj=0;jj<nsubbands;jj++){
+	      double f = sb_freqs[jj];
+	      double delay = REFINE_DM_CONST*dm*(1.0/(f*f) - 1.0/(ftop*ftop));
+	      double dphase = phase(t_mid[ii]-delay,period,acc,tobs) - fold_phase[ii];
+	      dphase -= floor(dphase);
+	      shifts[ii*nsubbands+jj] = ((int)(dphase*nbins + 0.5))%nbins;
+	    }
+	  }
+	  std::fill(prof.begin(),prof.end(),0.0f);
+	  for (unsigned int ii=0;ii<nints*nsubbands;ii++){
+	    float* sub = &cube.data[ii*nbins];
+	    int shift = shifts[ii];
+	    for (unsigned int bb=0;bb<nbins;bb++)
+	      prof[(bb+shift)%nbins] += sub[bb];
+	  }
+	  float sn = profile_sn(prof,sigma);
+	  if (sn > best_sn){
+	    best_sn = sn;
+	    best_dm = dm;
+	    best_p = period;
+	    best_acc = acc;
+	  }
+	}
+      }
+    }
+    cand.refined_snr = best_sn;
+    cand.refined_dm = best_dm;
+    cand.refined_period = best_p;
+    cand.refined_acc = best_acc;
+  }
+};
+
+/*!
+  \brief Refines the top candidates directly against the filterbank.
+
+  All candidates are folded in one pass over the filterbank, split in
+  time across the threads. Each thread folds every candidate over its
+  share of the observation into its own partial cubes, which are then
+  summed, so the data are read once whatever the thread count. The
+  DM/period/acceleration grids are then searched with the candidates
+  split across the same threads.
+*/
+class CandidateRefiner {
+private:
+  Filterbank& filterbank;
+  unsigned int nsubbands;
+  unsigned int max_nbins;
+  unsigned int max_nints;
+  ThreadPool& pool;
+  unsigned int nthreads;
+
+  struct FoldArgs {
+    FilterbankFolder* folder;
+    std::vector<FoldedCube*> cubes;
+    size_t first;
+    size_t last;
+  };
+
+  struct OptimiseArgs {
+    FilterbankFolder* folder;
+    std::vector<FoldedCube*> cubes;
+    std::vector<Candidate*> cands;
+  };
+
+  static void* launch_fold(void* ptr){
+    FoldArgs* fargs = reinterpret_cast<FoldArgs*>(ptr);
+    fargs->folder->fold_range(fargs->cubes,fargs->first,fargs->last);
+    return NULL;
+  }
+
+  static void* launch_optimise(void* ptr){
+    OptimiseArgs* oargs = reinterpret_cast<OptimiseArgs*>(ptr);
+    CubeOptimiser optimiser(*oargs->folder);
+    for (size_t ii=0;ii<oargs->cubes.size();ii++)
+      optimiser.optimise(*oargs->cubes[ii],*oargs->cands[ii]);
+    return NULL;
+  }
+
+  //Fold every cube, time split over up to nthreads threads
+  void fold_all(FilterbankFolder& folder, std::vector<FoldedCube*>& cubes){
+    size_t nvalid = folder.prepare(cubes);
+    if (nvalid == 0)
+      return;
+    //Each share rereads max_delay spectra, so keep shares longer than that
+    size_t min_share = folder.get_max_delay()+1;
+    size_t nshares = std::max((size_t) 1,std::min((size_t) nthreads,nvalid/min_share));
+    std::vector<FoldArgs> fargs(nshares);
+    std::vector<void*> ptrs(nshares);
+    for (size_t tt=0;tt<nshares;tt++){
+      fargs[tt].folder = &folder;
+      fargs[tt].first = tt*nvalid/nshares;
+      fargs[tt].last = (tt+1)*nvalid/nshares;
+      for (size_t cc=0;cc<cubes.size();cc++){
+	FoldedCube& cube = *cubes[cc];
+	fargs[tt].cubes.push_back((tt==0) ? &cube :
+				  new FoldedCube(cube.nints,cube.nsubbands,cube.nbins,
+						 cube.period,cube.acc,cube.dm));
+      }
+      ptrs[tt] = (void*) &fargs[tt];
+    }
+    pool.run(launch_fold,ptrs);
+    for (size_t tt=1;tt<nshares;tt++){
+      for (size_t cc=0;cc<cubes.size();cc++){
+	cubes[cc]->add(*fargs[tt].cubes[cc]);
+	delete fargs[tt].cubes[cc];
+      }
+    }
+    folder.normalise(cubes);
+  }
+
+public:
+  /*!
+    \brief Create a new CandidateRefiner.
+
+    \param filterbank The filterbank the candidates were found in.
+    \param nsubbands Number of subbands to fold into.
+    \param max_nbins Maximum number of phase bins per cube.
+    \param max_nints Maximum number of subints per cube.
+    \param pool Threads to run on, placed by the caller.
+    \param nthreads Number of pool threads to use.
+  */
+  CandidateRefiner(Filterbank& filterbank, unsigned int nsubbands,
+		   unsigned int max_nbins, unsigned int max_nints,
+		   ThreadPool& pool, unsigned int nthreads)
+    :filterbank(filterbank),nsubbands(nsubbands),
+     max_nbins(max_nbins),max_nints(max_nints),
+     pool(pool),nthreads(std::max(1u,nthreads)){}
+
+  /*!
+    \brief Refine the first n candidates in place.
+
+    \param cands Candidates, assumed sorted by priority.
+    \param n The number of candidates to refine.
+  */
+  void refine_n(std::vector<Candidate>& cands, unsigned int n){
+    n = std::min(n,(unsigned int)cands.size());
+    if (n==0)
+      return;
+    FilterbankFolder folder(filterbank,nsubbands);
+    float tsamp = filterbank.get_tsamp();
+    float tobs = folder.get_tobs();
+    std::vector<FoldedCube*> cubes;
+    for (unsigned int ii=0;ii<n;ii++){
+      Candidate& cand = cands[ii];
+      double period = cand.opt_period > 0 ? cand.opt_period : 1.0/cand.freq;
+      unsigned int nbins = std::max(8u,std::min(max_nbins,
+        (unsigned int) Utils::prev_power_of_two((size_t)(period/tsamp) + 1)));
+      unsigned int nints = std::max(1u,std::min(max_nints,
+        (unsigned int) Utils::prev_power_of_two((size_t)(tobs/period) + 1)));
+      cubes.push_back(new FoldedCube(nints,folder.get_nsubbands(),nbins,
+				     period,cand.acc,cand.dm));
+    }
+    fold_all(folder,cubes);
+
+    unsigned int nworkers = std::min(nthreads,n);
+    std::vector<OptimiseArgs> oargs(nworkers);
+    std::vector<void*> ptrs(nworkers);
+    for (unsigned int ii=0;ii<n;ii++){
+      oargs[ii%nworkers].cubes.push_back(cubes[ii]);
+      oargs[ii%nworkers].cands.push_back(&cands[ii]);
+    }
+    for (unsigned int ii=0;ii<nworkers;ii++){
+      oargs[ii].folder = &folder;
+      ptrs[ii] = (void*) &oargs[ii];
+    }
+    pool.run(launch_optimise,ptrs);
+    for (size_t ii=0;ii<cubes.size();ii++)
+      delete cubes[ii];
+  }
+};
@@ -3,6 +3,7 @@
 #include <kernels/kernels.h>
 #include <kernels/defaults.h>
 #include <utils/exceptions.hpp>
+#include <algorithm>
 
 class TimeDomainResampler {
 private:
@@ -17,19 +18,29 @@ public:
   
   //Force float until the kernel gets templated
   void resample(DeviceTimeSeries<float>& input, DeviceTimeSeries<float>& output, 
-		unsigned int size, float acc)
+		size_t size, float acc)
   {
     device_resample(input.get_data(), output.get_data(), size,
 		    acc, input.get_tsamp(),max_threads,  max_blocks);
   }
 
   void resampleII(DeviceTimeSeries<float>& input, DeviceTimeSeries<float>& output,
-                unsigned int size, float acc)
+                size_t size, float acc)
   {
     device_resampleII(input.get_data(), output.get_data(), size,
                     acc, input.get_tsamp(),max_threads,  max_blocks);
   }
 
+  //Average groups of factor samples, output tsamp is scaled to match
+  void decimate(DeviceTimeSeries<float>& input, DeviceTimeSeries<float>& output,
+		unsigned int factor)
+  {
+    size_t out_size = std::min((size_t)output.get_nsamps(),(size_t)input.get_nsamps()/factor);
+    device_decimate(input.get_data(), output.get_data(), out_size,
+		    factor, max_threads, max_blocks);
+    output.set_tsamp(input.get_tsamp()*factor);
+  }
+
 
 };
 
@@ -0,0 +1,190 @@
+#pragma once
+#include <utils/candidate_archive.hpp>
+#include <utils/nvtx.hpp>
+#include <utils/exceptions.hpp>
+#include <data_types/candidates.hpp>
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <iostream>
+#include <stdexcept>
+#include "pthread.h"
+
+/*!
+  \brief Writes candidate archive payloads on a background thread.
+
+  Producers (the fold workers) submit each candidate as soon as its
+  fold is final. The payload is copied into a bounded queue and a
+  writer thread appends it to the archive, so file I/O overlaps the
+  folding of later candidates. finish() is given the final, sorted
+  candidate list; payloads not yet written (unfolded candidates) are
+  written then, followed by the summary table and index.
+
+  A write error stops the writer thread. Later submissions are
+  dropped and finish() rethrows the error on the calling thread.
+*/
+class AsyncArchiveWriter {
+private:
+  struct Payload {
+    int id;
+    std::vector<float> fold;
+    int nbins;
+    int nints;
+    std::vector<CandidatePOD> hits;
+  };
+
+  CandidateArchiveWriter archive;
+  std::deque<Payload*> queue;
+  size_t max_queued;
+  std::map<int,ArchiveIndexEntry> written;
+  int next_id;
+  bool stopping;
+  bool running;
+  bool failed;
+  std::string error;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+
+  static void* launch(void* ptr){
+    reinterpret_cast<AsyncArchiveWriter*>(ptr)->run();
+    return NULL;
+  }
+
+  void run(void){
+    NAME_NVTX_THREAD("Archive writer",0)
+    while (true){
+      pthread_mutex_lock(&mutex);
+      while (queue.empty() && !stopping)
+	pthread_cond_wait(&not_empty,&mutex);
+      if (queue.empty()){
+	pthread_mutex_unlock(&mutex);
+	break;
+      }
+      Payload* payload = queue.front();
+      queue.pop_front();
+      pthread_cond_signal(&not_full);
+      pthread_mutex_unlock(&mutex);
+
+      //Only this thread touches the archive until finish() joins it
+      PUSH_NVTX_RANGE("Archive-Write",9)
+      ArchiveIndexEntry entry;
+      try {
+	entry = archive.write_payload(payload->fold.size() ? &payload->fold[0] : NULL,
+				      payload->nbins,payload->nints,payload->hits);
+      } catch (std::exception& e){
+	POP_NVTX_RANGE
+	delete payload;
+	fail(e.what());
+	break;
+      }
+      POP_NVTX_RANGE
+      pthread_mutex_lock(&mutex);
+      written[payload->id] = entry;
+      pthread_mutex_unlock(&mutex);
+      delete payload;
+    }
+  }
+
+  //Record a write error, drop the queue and release blocked producers
+  void fail(std::string what){
+    pthread_mutex_lock(&mutex);
+    failed = true;
+    error = what;
+    for (size_t ii=0;ii<queue.size();ii++)
+      delete queue[ii];
+    queue.clear();
+    pthread_cond_broadcast(&not_full);
+    pthread_mutex_unlock(&mutex);
+  }
+
+public:
+  /*!
+    \brief Create the archive and start the writer thread.
+
+    \param filename Path of the archive.
+    \param max_queued Payloads held in memory before submit() blocks.
+  */
+  AsyncArchiveWriter(std::string filename, size_t max_queued=256)
+    :archive(filename),max_queued(max_queued),next_id(0),
+     stopping(false),running(true),failed(false)
+  {
+    pthread_mutex_init(&mutex,NULL);
+    pthread_cond_init(&not_empty,NULL);
+    pthread_cond_init(&not_full,NULL);
+    pthread_create(&thread,NULL,launch,(void*) this);
+  }
+
+  /*!
+    \brief Queue a candidate's fold and detections for writing.
+
+    Safe to call from several threads. Sets cand.payload_id so that
+    finish() can find the payload again after the list is sorted.
+    Does nothing once a write has failed.
+
+    \param cand A candidate whose fold and associations are final.
+  */
+  void submit(Candidate& cand){
+    Payload* payload = new Payload;
+    payload->fold = cand.fold;
+    payload->nbins = cand.nbins;
+    payload->nints = cand.nints;
+    cand.collect_candidates(payload->hits);
+    pthread_mutex_lock(&mutex);
+    while (queue.size() >= max_queued && !failed)
+      pthread_cond_wait(&not_full,&mutex);
+    if (failed){
+      pthread_mutex_unlock(&mutex);
+      delete payload;
+      return;
+    }
+    payload->id = next_id++;
+    cand.payload_id = payload->id;
+    queue.push_back(payload);
+    pthread_cond_signal(&not_empty);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  /*!
+    \brief Drain the queue and close the archive.
+
+    \param cands The final candidate list, in output order.
+    \throws std::runtime_error if the writer thread failed to write.
+  */
+  void finish(std::vector<Candidate>& cands){
+    if (!running)
+      return;
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&not_empty);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(thread,NULL);
+    running = false;
+    if (failed)
+      ErrorChecker::throw_error(error);
+    for (size_t ii=0;ii<cands.size();ii++){
+      std::map<int,ArchiveIndexEntry>::iterator it = written.find(cands[ii].payload_id);
+      if (cands[ii].payload_id >= 0 && it != written.end())
+	archive.add_summary(cands[ii],it->second);
+      else
+	archive.add(cands[ii]);
+    }
+    archive.close();
+  }
+
+  ~AsyncArchiveWriter(){
+    if (running){
+      std::vector<Candidate> none;
+      try {
+	finish(none);
+      } catch (std::exception& e){
+	std::cerr << "Error: " << e.what() << std::endl;
+      }
+    }
+    pthread_cond_destroy(&not_full);
+    pthread_cond_destroy(&not_empty);
+    pthread_mutex_destroy(&mutex);
+  }
+};
@@ -0,0 +1,120 @@
+#pragma once
+#include <utils/cmdline.hpp>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cctype>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "cuda.h"
+
+#define AUTOTUNE_MAX_WORKERS_PER_GPU 3
+#define AUTOTUNE_TRIALS_PER_WORKER 4
+//Smallest throughput gain worth another worker per GPU
+#define AUTOTUNE_MIN_GAIN 0.05
+
+//Outcome of --autotune, recorded in overview.xml
+struct AutotuneResult {
+  std::string key;
+  std::string source;            /*!< "cache" or "calibration".*/
+  int workers_per_gpu;
+  std::vector<int> tried;        /*!< Workers per GPU timed.*/
+  std::vector<double> rates;     /*!< DM trials per second of each.*/
+
+  AutotuneResult():workers_per_gpu(1){}
+};
+
+/*!
+  \brief Persistent store of --autotune results.
+
+  One line per tuned configuration:
+
+    <key> <workers_per_gpu> <dm_trials_per_second>
+
+  The key identifies the host, its GPUs and every argument that
+  changes the cost of a DM trial, so a cached result is only reused
+  for an equivalent search.
+*/
+class AutotuneCache {
+private:
+  std::string filename;
+
+  struct Entry {
+    std::string key;
+    int workers_per_gpu;
+    double rate;
+  };
+
+  std::vector<Entry> read(void){
+    std::vector<Entry> entries;
+    std::ifstream infile(filename.c_str());
+    std::string line;
+    while (std::getline(infile,line)){
+      std::stringstream fields(line);
+      Entry entry;
+      if (fields >> entry.key >> entry.workers_per_gpu >> entry.rate)
+	entries.push_back(entry);
+    }
+    return entries;
+  }
+
+public:
+  AutotuneCache(std::string filename):filename(filename){}
+
+  static std::string default_filename(void){
+    const char* home = getenv("HOME");
+    return std::string(home ? home : ".")+"/.peasoup_autotune";
+  }
+
+  /*!
+    \brief Key for a search of transform length size on ngpus GPUs.
+  */
+  static std::string make_key(size_t size, int ngpus, CmdLineOptions& args){
+    char host[256] = "unknown";
+    gethostname(host,sizeof(host)-1);
+    cudaDeviceProp properties;
+    std::string gpu = "none";
+    if (cudaGetDeviceProperties(&properties,0) == cudaSuccess)
+      gpu = properties.name;
+    std::stringstream key;
+    key << host << "|" << gpu << "|" << ngpus << "|" << size << "|"
+	<< args.nharmonics << "|" << args.fp16_sums << "|" << args.nsegments << "|"
+	<< args.max_downsamp << "|" << args.acc_coarse_factor << "|" << args.trial_nbits;
+    //Keys are whitespace delimited in the cache file
+    std::string text = key.str();
+    for (size_t ii=0;ii<text.size();ii++)
+      if (isspace(text[ii]))
+	text[ii] = '_';
+    return text;
+  }
+
+  bool lookup(std::string key, int& workers_per_gpu){
+    std::vector<Entry> entries = read();
+    for (size_t ii=0;ii<entries.size();ii++)
+      if (entries[ii].key == key){
+	workers_per_gpu = entries[ii].workers_per_gpu;
+	return true;
+      }
+    return false;
+  }
+
+  //Add or replace a result; the file is replaced atomically
+  void store(std::string key, int workers_per_gpu, double rate){
+    std::vector<Entry> entries = read();
+    std::string tmpname = filename+".tmp";
+    FILE* fo = fopen(tmpname.c_str(),"w");
+    if (fo == NULL){
+      fprintf(stderr,"Could not write autotune cache %s\n",filename.c_str());
+      return;
+    }
+    for (size_t ii=0;ii<entries.size();ii++)
+      if (entries[ii].key != key)
+	fprintf(fo,"%s %d %g\n",entries[ii].key.c_str(),
+		entries[ii].workers_per_gpu,entries[ii].rate);
+    fprintf(fo,"%s %d %g\n",key.c_str(),workers_per_gpu,rate);
+    fclose(fo);
+    rename(tmpname.c_str(),filename.c_str());
+  }
+};
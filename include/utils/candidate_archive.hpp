@@ -0,0 +1,502 @@
+#pragma once
+#include <data_types/candidates.hpp>
+#include <utils/exceptions.hpp>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+  Candidate archive format (version 1), little endian:
+
+    ArchiveHeader                      at offset 0
+    payloads                           fold (float[nbins*nints]) then
+                                       hits (CandidatePOD[nhits]) per
+                                       candidate, each ARCHIVE_ALIGN aligned
+    ArchiveColumn[ncolumns]            at columns_offset
+    column data                        ncands values per column, each
+                                       column ARCHIVE_ALIGN aligned
+    ArchiveIndexEntry[ncands]          at index_offset
+
+  Payloads come first so a writer can stream them out as candidates
+  are produced and append the summary table and index on close. An
+  archive whose index_offset is zero was never closed.
+*/
+
+#define ARCHIVE_MAGIC "PEASOUPA"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_ALIGN 64
+#define ARCHIVE_BYTE_ORDER 0x01020304
+
+struct ArchiveHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t byte_order;
+  uint32_t alignment;
+  uint64_t ncands;
+  uint32_t ncolumns;
+  uint32_t reserved0;
+  uint64_t columns_offset;
+  uint64_t index_offset;
+  uint64_t file_size;
+  uint64_t reserved[8];
+};
+
+//Column types
+enum ArchiveType {
+  ARCHIVE_FLOAT32 = 'f',
+  ARCHIVE_FLOAT64 = 'd',
+  ARCHIVE_INT32   = 'i',
+  ARCHIVE_UINT8   = 'b'
+};
+
+struct ArchiveColumn {
+  char name[24];
+  uint32_t type;
+  uint32_t width;
+  uint64_t offset;
+  uint64_t reserved;
+};
+
+struct ArchiveIndexEntry {
+  uint64_t fold_offset;
+  uint64_t hits_offset;
+  uint32_t nbins;
+  uint32_t nints;
+  uint32_t nhits;
+  uint32_t reserved;
+};
+
+struct ArchiveColumnSpec {
+  const char* name;
+  ArchiveType type;
+};
+
+//Summary table columns, in the order CandidateArchiveWriter::add_summary() fills them
+static const ArchiveColumnSpec archive_columns[] = {
+  {"period",          ARCHIVE_FLOAT64},
+  {"opt_period",      ARCHIVE_FLOAT64},
+  {"dm",              ARCHIVE_FLOAT32},
+  {"dm_idx",          ARCHIVE_INT32},
+  {"acc",             ARCHIVE_FLOAT32},
+  {"nh",              ARCHIVE_INT32},
+  {"snr",             ARCHIVE_FLOAT32},
+  {"folded_snr",      ARCHIVE_FLOAT32},
+  {"refined_snr",     ARCHIVE_FLOAT32},
+  {"refined_period",  ARCHIVE_FLOAT64},
+  {"refined_dm",      ARCHIVE_FLOAT32},
+  {"refined_acc",     ARCHIVE_FLOAT32},
+  {"segment",         ARCHIVE_INT32},
+  {"is_adjacent",     ARCHIVE_UINT8},
+  {"is_physical",     ARCHIVE_UINT8},
+  {"ddm_count_ratio", ARCHIVE_FLOAT32},
+  {"ddm_snr_ratio",   ARCHIVE_FLOAT32},
+  {"nassoc",          ARCHIVE_INT32}
+};
+
+static const unsigned int archive_ncolumns = sizeof(archive_columns)/sizeof(ArchiveColumnSpec);
+
+inline unsigned int archive_type_width(uint32_t type){
+  switch (type){
+  case ARCHIVE_FLOAT64: return 8;
+  case ARCHIVE_FLOAT32: return 4;
+  case ARCHIVE_INT32:   return 4;
+  case ARCHIVE_UINT8:   return 1;
+  default:              return 0;
+  }
+}
+
+/*!
+  \brief Writes candidates to a candidate archive.
+
+  Fold and hit payloads are written as each candidate is added, the
+  columnar summary table and offset index when the archive is closed.
+*/
+class CandidateArchiveWriter {
+private:
+  std::string filename;
+  FILE* fo;
+  uint64_t position;
+  std::vector< std::vector<char> > columns;
+  std::vector<ArchiveIndexEntry> index;
+
+  void write(const void* ptr, size_t nbytes){
+    if (nbytes && fwrite(ptr,1,nbytes,fo) != nbytes)
+      ErrorChecker::throw_error("CandidateArchiveWriter: write to "+filename+" failed");
+    position += nbytes;
+  }
+
+  void align(void){
+    static const char zeros[ARCHIVE_ALIGN] = {0};
+    write(zeros,(ARCHIVE_ALIGN-position%ARCHIVE_ALIGN)%ARCHIVE_ALIGN);
+  }
+
+  template <class T>
+  void push(unsigned int col, T value){
+    const char* bytes = reinterpret_cast<const char*>(&value);
+    columns[col].insert(columns[col].end(),bytes,bytes+sizeof(T));
+  }
+
+  ArchiveHeader make_header(uint64_t columns_offset, uint64_t index_offset){
+    ArchiveHeader hdr;
+    std::memset(&hdr,0,sizeof(hdr));
+    std::memcpy(hdr.magic,ARCHIVE_MAGIC,8);
+    hdr.version = ARCHIVE_VERSION;
+    hdr.header_size = sizeof(ArchiveHeader);
+    hdr.byte_order = ARCHIVE_BYTE_ORDER;
+    hdr.alignment = ARCHIVE_ALIGN;
+    hdr.ncands = index.size();
+    hdr.ncolumns = archive_ncolumns;
+    hdr.columns_offset = columns_offset;
+    hdr.index_offset = index_offset;
+    hdr.file_size = position;
+    return hdr;
+  }
+
+public:
+  /*!
+    \brief Create a new archive, replacing any existing file.
+
+    \param filename Path of the archive.
+  */
+  CandidateArchiveWriter(std::string filename)
+    :filename(filename),position(0),columns(archive_ncolumns)
+  {
+    fo = fopen(filename.c_str(),"wb");
+    if (fo == NULL)
+      ErrorChecker::throw_error("CandidateArchiveWriter: could not open "+filename);
+    //Few large writes rather than one per payload
+    setvbuf(fo,NULL,_IOFBF,8<<20);
+    ArchiveHeader hdr = make_header(0,0);
+    write(&hdr,sizeof(hdr));
+    align();
+  }
+
+  /*!
+    \brief Write a candidate's fold and detections without listing it.
+
+    Payloads may be written in any order; add_summary() later places
+    the candidate in the table using the returned entry.
+
+    \param fold nbins*nints floats, or NULL if not folded.
+    \param nbins Number of phase bins.
+    \param nints Number of subintegrations.
+    \param hits The candidate's detection and its associated detections.
+    \return Index entry locating the payload.
+  */
+  ArchiveIndexEntry write_payload(const float* fold, int nbins, int nints,
+				  std::vector<CandidatePOD>& hits){
+    ArchiveIndexEntry entry;
+    std::memset(&entry,0,sizeof(entry));
+    if (fold != NULL && nbins*nints > 0){
+      entry.fold_offset = position;
+      entry.nbins = nbins;
+      entry.nints = nints;
+      write(fold,sizeof(float)*nbins*nints);
+      align();
+    }
+    entry.hits_offset = position;
+    entry.nhits = hits.size();
+    write(hits.empty() ? NULL : &hits[0],sizeof(CandidatePOD)*hits.size());
+    align();
+    return entry;
+  }
+
+  ArchiveIndexEntry write_payload(Candidate& cand){
+    std::vector<CandidatePOD> hits;
+    cand.collect_candidates(hits);
+    return write_payload(cand.fold.size() ? &cand.fold[0] : NULL,
+			 cand.nbins,cand.nints,hits);
+  }
+
+  /*!
+    \brief Append a candidate and its fold and associated detections.
+
+    \param cand The candidate.
+  */
+  void add(Candidate& cand){
+    add_summary(cand,write_payload(cand));
+  }
+
+  /*!
+    \brief List a candidate whose payload has already been written.
+
+    \param cand The candidate.
+    \param entry Entry returned by write_payload().
+  */
+  void add_summary(Candidate& cand, const ArchiveIndexEntry& entry){
+    index.push_back(entry);
+    unsigned int col = 0;
+    push<double>(col++,1.0/cand.freq);
+    push<double>(col++,cand.opt_period);
+    push<float>(col++,cand.dm);
+    push<int32_t>(col++,cand.dm_idx);
+    push<float>(col++,cand.acc);
+    push<int32_t>(col++,cand.nh);
+    push<float>(col++,cand.snr);
+    push<float>(col++,cand.folded_snr);
+    push<float>(col++,cand.refined_snr);
+    push<double>(col++,cand.refined_period);
+    push<float>(col++,cand.refined_dm);
+    push<float>(col++,cand.refined_acc);
+    push<int32_t>(col++,cand.segment);
+    push<uint8_t>(col++,cand.is_adjacent);
+    push<uint8_t>(col++,cand.is_physical);
+    push<float>(col++,cand.ddm_count_ratio);
+    push<float>(col++,cand.ddm_snr_ratio);
+    push<int32_t>(col++,cand.count_assoc());
+  }
+
+  void add(std::vector<Candidate>& cands){
+    for (size_t ii=0;ii<cands.size();ii++)
+      add(cands[ii]);
+  }
+
+  //Number of candidates added so far
+  size_t size(void){return index.size();}
+
+  /*!
+    \brief Write the summary table, index and final header.
+  */
+  void close(void){
+    if (fo == NULL)
+      return;
+    uint64_t columns_offset = position;
+    std::vector<ArchiveColumn> directory(archive_ncolumns);
+    uint64_t offset = columns_offset + sizeof(ArchiveColumn)*archive_ncolumns;
+    for (unsigned int ii=0;ii<archive_ncolumns;ii++){
+      offset += (ARCHIVE_ALIGN-offset%ARCHIVE_ALIGN)%ARCHIVE_ALIGN;
+      std::memset(&directory[ii],0,sizeof(ArchiveColumn));
+      strncpy(directory[ii].name,archive_columns[ii].name,sizeof(directory[ii].name)-1);
+      directory[ii].type = archive_columns[ii].type;
+      directory[ii].width = archive_type_width(archive_columns[ii].type);
+      directory[ii].offset = offset;
+      offset += columns[ii].size();
+    }
+    write(&directory[0],sizeof(ArchiveColumn)*archive_ncolumns);
+    for (unsigned int ii=0;ii<archive_ncolumns;ii++){
+      align();
+      write(columns[ii].empty() ? NULL : &columns[ii][0],columns[ii].size());
+    }
+    align();
+    uint64_t index_offset = position;
+    write(index.empty() ? NULL : &index[0],sizeof(ArchiveIndexEntry)*index.size());
+    ArchiveHeader hdr = make_header(columns_offset,index_offset);
+    if (fseek(fo,0,SEEK_SET) != 0 || fwrite(&hdr,sizeof(hdr),1,fo) != 1)
+      ErrorChecker::throw_error("CandidateArchiveWriter: could not finalise "+filename);
+    //The header and any buffered data only reach the file here
+    int status = fclose(fo);
+    fo = NULL;
+    if (status != 0)
+      ErrorChecker::throw_error("CandidateArchiveWriter: could not finalise "+filename);
+  }
+
+  ~CandidateArchiveWriter(){
+    if (fo != NULL)
+      fclose(fo);
+  }
+};
+
+/*!
+  \brief Read only, memory mapped view of a candidate archive.
+
+  Columns are returned as pointers into the mapping, so filtering
+  touches only the columns used and nothing is parsed or copied.
+*/
+class CandidateArchive {
+private:
+  std::string filename;
+  int fd;
+  size_t length;
+  const char* base;
+  const ArchiveHeader* hdr;
+  const ArchiveColumn* directory;
+  const ArchiveIndexEntry* index;
+
+  void fail(std::string msg){
+    ErrorChecker::throw_error("CandidateArchive: "+filename+": "+msg);
+  }
+
+  void check_range(uint64_t offset, uint64_t nbytes){
+    if (offset > length || nbytes > length-offset)
+      fail("truncated or corrupt");
+  }
+
+  void release(void){
+    if (base != NULL)
+      munmap((void*) base,length);
+    if (fd >= 0)
+      close(fd);
+    base = NULL;
+    fd = -1;
+  }
+
+  void open_archive(void){
+    fd = open(filename.c_str(),O_RDONLY);
+    if (fd < 0)
+      fail("could not open");
+    struct stat st;
+    if (fstat(fd,&st) != 0)
+      fail("could not stat");
+    length = st.st_size;
+    if (length < sizeof(ArchiveHeader))
+      fail("too short to be an archive");
+    base = (const char*) mmap(NULL,length,PROT_READ,MAP_SHARED,fd,0);
+    if (base == MAP_FAILED){
+      base = NULL;
+      fail("could not map");
+    }
+    hdr = (const ArchiveHeader*) base;
+    if (std::memcmp(hdr->magic,ARCHIVE_MAGIC,8) != 0)
+      fail("not a candidate archive");
+    if (hdr->byte_order != ARCHIVE_BYTE_ORDER)
+      fail("written on a machine of different endianness");
+    if (hdr->version > ARCHIVE_VERSION)
+      fail("written by a newer version of peasoup");
+    if (hdr->index_offset == 0)
+      fail("archive was not closed");
+    check_range(hdr->columns_offset,sizeof(ArchiveColumn)*(uint64_t)hdr->ncolumns);
+    check_range(hdr->index_offset,sizeof(ArchiveIndexEntry)*hdr->ncands);
+    directory = (const ArchiveColumn*)(base+hdr->columns_offset);
+    index = (const ArchiveIndexEntry*)(base+hdr->index_offset);
+    for (unsigned int ii=0;ii<hdr->ncolumns;ii++)
+      check_range(directory[ii].offset,(uint64_t)directory[ii].width*hdr->ncands);
+  }
+
+public:
+  /*!
+    \brief Map an archive and validate its layout.
+
+    \param filename Path of the archive.
+  */
+  CandidateArchive(std::string filename)
+    :filename(filename),fd(-1),length(0),base(NULL)
+  {
+    //The destructor does not run if the constructor throws
+    try {
+      open_archive();
+    } catch (...){
+      release();
+      throw;
+    }
+  }
+
+  const ArchiveHeader& get_header(void){return *hdr;}
+
+  //Number of candidates
+  size_t size(void){return hdr->ncands;}
+
+  unsigned int get_ncolumns(void){return hdr->ncolumns;}
+
+  const ArchiveColumn& get_column_info(unsigned int col){return directory[col];}
+
+  //Column number for a name, or -1 if absent
+  int find_column(std::string name){
+    for (unsigned int ii=0;ii<hdr->ncolumns;ii++)
+      if (name == directory[ii].name)
+	return ii;
+    return -1;
+  }
+
+  /*!
+    \brief Get a column of the summary table.
+
+    \param name Column name, e.g. "snr".
+    \return Pointer to size() values of type T.
+  */
+  template <class T>
+  const T* column(std::string name){
+    int col = find_column(name);
+    if (col < 0)
+      fail("no column "+name);
+    if (directory[col].width != sizeof(T))
+      fail("column "+name+" has a different type");
+    return (const T*)(base+directory[col].offset);
+  }
+
+  //Any column value as a double, for generic filtering and printing
+  double value(unsigned int col, size_t idx){
+    const char* ptr = base + directory[col].offset + idx*directory[col].width;
+    switch (directory[col].type){
+    case ARCHIVE_FLOAT64: return *(const double*) ptr;
+    case ARCHIVE_FLOAT32: return *(const float*) ptr;
+    case ARCHIVE_INT32:   return *(const int32_t*) ptr;
+    case ARCHIVE_UINT8:   return *(const uint8_t*) ptr;
+    default:              return 0.0;
+    }
+  }
+
+  /*!
+    \brief Rebuild the summary fields of a candidate.
+
+    Folds and associated detections are not attached; use get_fold()
+    and get_hits() for those. Every column is looked up by name, so
+    callers reading many rows should hold column() pointers instead.
+
+    \param idx Candidate index.
+    \return The candidate.
+  */
+  Candidate get_candidate(size_t idx){
+    Candidate cand;
+    cand.freq = 1.0/column<double>("period")[idx];
+    cand.opt_period = column<double>("opt_period")[idx];
+    cand.dm = column<float>("dm")[idx];
+    cand.dm_idx = column<int32_t>("dm_idx")[idx];
+    cand.acc = column<float>("acc")[idx];
+    cand.nh = column<int32_t>("nh")[idx];
+    cand.snr = column<float>("snr")[idx];
+    cand.folded_snr = column<float>("folded_snr")[idx];
+    cand.refined_snr = column<float>("refined_snr")[idx];
+    cand.refined_period = column<double>("refined_period")[idx];
+    cand.refined_dm = column<float>("refined_dm")[idx];
+    cand.refined_acc = column<float>("refined_acc")[idx];
+    cand.segment = column<int32_t>("segment")[idx];
+    cand.is_adjacent = column<uint8_t>("is_adjacent")[idx];
+    cand.is_physical = column<uint8_t>("is_physical")[idx];
+    cand.ddm_count_ratio = column<float>("ddm_count_ratio")[idx];
+    cand.ddm_snr_ratio = column<float>("ddm_snr_ratio")[idx];
+    return cand;
+  }
+
+  /*!
+    \brief Get the folded profile of a candidate.
+
+    \param idx Candidate index.
+    \param nbins Set to the number of phase bins.
+    \param nints Set to the number of subintegrations.
+    \return nints*nbins floats, or NULL if the candidate was not folded.
+  */
+  const float* get_fold(size_t idx, int& nbins, int& nints){
+    const ArchiveIndexEntry& entry = index[idx];
+    nbins = entry.nbins;
+    nints = entry.nints;
+    if (entry.nbins*(uint64_t)entry.nints == 0)
+      return NULL;
+    check_range(entry.fold_offset,sizeof(float)*(uint64_t)entry.nbins*entry.nints);
+    return (const float*)(base+entry.fold_offset);
+  }
+
+  /*!
+    \brief Get a candidate's detection and its associated detections.
+
+    \param idx Candidate index.
+    \param nhits Set to the number of detections.
+    \return nhits CandidatePOD records, the candidate itself first.
+  */
+  const CandidatePOD* get_hits(size_t idx, int& nhits){
+    const ArchiveIndexEntry& entry = index[idx];
+    nhits = entry.nhits;
+    check_range(entry.hits_offset,sizeof(CandidatePOD)*(uint64_t)entry.nhits);
+    return (const CandidatePOD*)(base+entry.hits_offset);
+  }
+
+  ~CandidateArchive(){
+    release();
+  }
+};
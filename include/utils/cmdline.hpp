@@ -2,14 +2,23 @@
 #include <tclap/CmdLine.h>
 #include <string>
 #include <iostream>
+#include <ctime>
 
 struct CmdLineOptions {
   std::string infilename;
+  std::string ringbuffer;
+  float stream_overlap;
   std::string outdir;
   std::string killfilename;
   std::string zapfilename;
   int max_num_threads;
-  unsigned int size;
+  int workers_per_gpu;
+  bool autotune;
+  std::string autotune_cache;
+  std::string cpu_affinity;
+  std::string trial_placement;
+  std::string huge_pages;
+  size_t size;
   float dm_start;
   float dm_end;
   float dm_tol;
@@ -18,16 +27,33 @@ struct CmdLineOptions {
   float acc_end;
   float acc_tol;
   float acc_pulse_width;
+  int max_downsamp;
+  int nsegments;
+  int trial_nbits;
+  int acc_coarse_factor;
+  float coarse_min_snr;
   float boundary_5_freq;
   float boundary_25_freq;
   int nharmonics;
+  bool fp16_sums;
   int npdmp;
+  int fold_cache;
+  int fold_threads;
+  int fold_nbins;
+  int fold_nints;
+  int nrefine;
+  int refine_nsubbands;
   int limit;
+  int mem_limit;
   float min_snr;
   float min_freq;
   float max_freq;
   int max_harm;
   float freq_tol;
+  std::string tracefilename;
+  std::string telemetry_file;
+  std::string telemetry_socket;
+  float telemetry_interval;
   bool verbose;
   bool progress_bar;
 };
@@ -73,8 +99,17 @@ bool read_cmdline_options(CmdLineOptions& args, int argc, char **argv)
       TCLAP::CmdLine cmd("Peasoup - a GPU pulsar search pipeline", ' ', "1.0");
 
       TCLAP::ValueArg<std::string> arg_infilename("i", "inputfile",
-						  "File to process (.fil)",
-                                                  true, "", "string", cmd);
+						  "File to process (.fil, or .dada with further .dada files of the observation comma separated)",
+                                                  true, "", "string");
+
+      TCLAP::ValueArg<std::string> arg_ringbuffer("", "ringbuffer",
+						  "Search a shared memory ring buffer as it fills (requires --fft_size)",
+						  true, "", "string");
+      cmd.xorAdd(arg_infilename,arg_ringbuffer);
+
+      TCLAP::ValueArg<float> arg_stream_overlap("", "stream_overlap",
+						"Fraction of each --fft_size window shared with the next when streaming",
+						false, 0.5, "float", cmd);
 
       TCLAP::ValueArg<std::string> arg_outdir("o", "outdir",
 					      "The output directory",
@@ -97,7 +132,7 @@ bool read_cmdline_options(CmdLineOptions& args, int argc, char **argv)
 				     false, 1000, "int", cmd);
 
       TCLAP::ValueArg<size_t> arg_size("", "fft_size",
-                                       "Transform size to use (defaults to lower power of two)",
+                                       "Transform size to use (defaults to largest 2,3,5,7-smooth length)",
                                        false, 0, "size_t", cmd);
 
       TCLAP::ValueArg<float> arg_dm_start("", "dm_start",
@@ -132,6 +167,26 @@ bool read_cmdline_options(CmdLineOptions& args, int argc, char **argv)
                                                  "Minimum pulse width for which acc_tol is valid",
 						 false, 64.0, "float (us)",cmd);
 
+      TCLAP::ValueArg<int> arg_acc_coarse_factor("", "acc_coarse_factor",
+						 "Coarsening of the acceleration grid, >1 enables Fourier domain refinement",
+						 false, 1, "int", cmd);
+
+      TCLAP::ValueArg<float> arg_coarse_min_snr("", "coarse_min_snr",
+						"The minimum S/N for a candidate on the coarse acceleration grid",
+						false, 6.0, "float", cmd);
+
+      TCLAP::ValueArg<int> arg_max_downsamp("", "max_downsamp",
+					    "Maximum time decimation factor for smeared high DM trials",
+					    false, 1, "int", cmd);
+
+      TCLAP::ValueArg<int> arg_nsegments("", "nsegments",
+					 "Number of overlapping segments to search incoherently (1 = coherent)",
+					 false, 1, "int", cmd);
+
+      TCLAP::ValueArg<int> arg_trial_nbits("", "trial_nbits",
+					   "Bits per sample used to hold DM trials in memory (8, 4 or 2)",
+					   false, 8, "int", cmd);
+
       TCLAP::ValueArg<float> arg_boundary_5_freq("", "boundary_5_freq",
                                                  "Frequency at which to switch from median5 to median25",
                                                  false, 0.05, "float", cmd);
@@ -144,10 +199,37 @@ bool read_cmdline_options(CmdLineOptions& args, int argc, char **argv)
                                           "Number of harmonic sums to perform",
                                           false, 4, "int", cmd);
 
+      TCLAP::SwitchArg arg_fp16_sums("", "fp16_sums",
+				     "Store harmonic sums at half precision", cmd);
+
       TCLAP::ValueArg<int> arg_npdmp("", "npdmp",
                                      "Number of candidates to fold and pdmp",
                                      false, 0, "int", cmd);
 
+      TCLAP::ValueArg<int> arg_fold_cache("", "fold_cache",
+					  "Memory (MB) for keeping whitened DM trials for folding",
+					  false, 0, "int", cmd);
+
+      TCLAP::ValueArg<int> arg_fold_threads("", "fold_threads",
+					    "Folding threads, spread over the GPUs in use (default: online CPU cores)",
+					    false, 0, "int", cmd);
+
+      TCLAP::ValueArg<int> arg_fold_nbins("", "fold_nbins",
+					  "Maximum number of phase bins used when folding",
+					  false, 64, "int", cmd);
+
+      TCLAP::ValueArg<int> arg_fold_nints("", "fold_nints",
+					  "Maximum number of subintegrations used when folding",
+					  false, 16, "int", cmd);
+
+      TCLAP::ValueArg<int> arg_nrefine("", "nrefine",
+				       "Number of folded candidates to refine against the filterbank",
+				       false, 0, "int", cmd);
+
+      TCLAP::ValueArg<int> arg_refine_nsubbands("", "refine_nsubbands",
+						"Number of subbands used when refining",
+						false, 32, "int", cmd);
+
       TCLAP::ValueArg<float> arg_min_snr("m", "min_snr",
                                          "The minimum S/N for a candidate",
                                          false, 9.0, "float",cmd);
@@ -168,12 +250,57 @@ bool read_cmdline_options(CmdLineOptions& args, int argc, char **argv)
                                           "Tolerance for distilling frequencies (0.0001 = 0.01%)",
                                           false, 0.0001, "float",cmd);
 
+      TCLAP::ValueArg<int> arg_workers_per_gpu("", "workers_per_gpu",
+					       "Search workers sharing each GPU",
+					       false, 1, "int", cmd);
+
+      TCLAP::SwitchArg arg_autotune("", "autotune",
+				    "Time short search passes to choose --workers_per_gpu", cmd);
+
+      TCLAP::ValueArg<std::string> arg_autotune_cache("", "autotune_cache",
+						      "File of autotune results (default: $HOME/.peasoup_autotune)",
+						      false, "", "string", cmd);
+
+      TCLAP::ValueArg<std::string> arg_cpu_affinity("", "cpu_affinity",
+						    "Pin workers: 'gpu' (CPUs of the GPU's NUMA node) or a CPU list, e.g. 0-7,16-23",
+						    false, "", "string", cmd);
+
+      TCLAP::ValueArg<std::string> arg_trial_placement("", "trial_placement",
+						       "NUMA placement of the DM trials: local, interleave or replicate",
+						       false, "local", "string", cmd);
+
+      TCLAP::ValueArg<std::string> arg_huge_pages("", "huge_pages",
+						  "Huge pages for large host buffers: none, thp, 2M or 1G",
+						  false, "thp", "string", cmd);
+
+      TCLAP::ValueArg<int> arg_mem_limit("", "mem_limit",
+					 "Host memory (MB) to plan the search for (default: cgroup limit or RAM)",
+					 false, 0, "int", cmd);
+
+      TCLAP::ValueArg<std::string> arg_tracefilename("", "trace",
+						     "Write a Chrome trace of the CPU timeline to this file",
+						     false, "", "string", cmd);
+
+      TCLAP::ValueArg<std::string> arg_telemetry_file("", "telemetry_file",
+						      "Keep a JSON status line for the run in this file",
+						      false, "", "string", cmd);
+
+      TCLAP::ValueArg<std::string> arg_telemetry_socket("", "telemetry_socket",
+							"Serve JSON status lines on this Unix socket",
+							false, "", "string", cmd);
+
+      TCLAP::ValueArg<float> arg_telemetry_interval("", "telemetry_interval",
+						    "Seconds between status updates",
+						    false, 5.0, "float", cmd);
+
       TCLAP::SwitchArg arg_verbose("v", "verbose", "verbose mode", cmd);
 
       TCLAP::SwitchArg arg_progress_bar("p", "progress_bar", "Enable progress bar for DM search", cmd);
 
       cmd.parse(argc, argv);
       args.infilename        = arg_infilename.getValue();
+      args.ringbuffer        = arg_ringbuffer.getValue();
+      args.stream_overlap    = arg_stream_overlap.getValue();
       args.outdir            = arg_outdir.getValue();
       args.killfilename      = arg_killfilename.getValue();
       args.zapfilename       = arg_zapfilename.getValue();
@@ -188,15 +315,38 @@ bool read_cmdline_options(CmdLineOptions& args, int argc, char **argv)
       args.acc_end           = arg_acc_end.getValue();
       args.acc_tol           = arg_acc_tol.getValue();
       args.acc_pulse_width   = arg_acc_pulse_width.getValue();
+      args.acc_coarse_factor = arg_acc_coarse_factor.getValue();
+      args.coarse_min_snr    = arg_coarse_min_snr.getValue();
+      args.max_downsamp      = arg_max_downsamp.getValue();
+      args.nsegments         = arg_nsegments.getValue();
+      args.trial_nbits       = arg_trial_nbits.getValue();
       args.boundary_5_freq   = arg_boundary_5_freq.getValue();
       args.boundary_25_freq  = arg_boundary_25_freq.getValue();
       args.nharmonics        = arg_nharmonics.getValue();
+      args.fp16_sums         = arg_fp16_sums.getValue();
       args.npdmp             = arg_npdmp.getValue();
+      args.fold_cache        = arg_fold_cache.getValue();
+      args.fold_threads      = arg_fold_threads.getValue();
+      args.fold_nbins        = arg_fold_nbins.getValue();
+      args.fold_nints        = arg_fold_nints.getValue();
+      args.nrefine           = arg_nrefine.getValue();
+      args.refine_nsubbands  = arg_refine_nsubbands.getValue();
       args.min_snr           = arg_min_snr.getValue();
       args.min_freq          = arg_min_freq.getValue();
       args.max_freq          = arg_max_freq.getValue();
       args.max_harm          = arg_max_harm.getValue();
       args.freq_tol          = arg_freq_tol.getValue();
+      args.workers_per_gpu   = arg_workers_per_gpu.getValue();
+      args.autotune          = arg_autotune.getValue();
+      args.autotune_cache    = arg_autotune_cache.getValue();
+      args.cpu_affinity      = arg_cpu_affinity.getValue();
+      args.trial_placement   = arg_trial_placement.getValue();
+      args.huge_pages        = arg_huge_pages.getValue();
+      args.mem_limit         = arg_mem_limit.getValue();
+      args.tracefilename     = arg_tracefilename.getValue();
+      args.telemetry_file    = arg_telemetry_file.getValue();
+      args.telemetry_socket  = arg_telemetry_socket.getValue();
+      args.telemetry_interval = arg_telemetry_interval.getValue();
       args.verbose           = arg_verbose.getValue();
       args.progress_bar      = arg_progress_bar.getValue();
 
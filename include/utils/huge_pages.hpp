@@ -0,0 +1,300 @@
+#pragma once
+#include <utils/exceptions.hpp>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <limits>
+#include <algorithm>
+#include <new>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define HUGE_PAGE_2M (2UL<<20)
+#define HUGE_PAGE_1G (1UL<<30)
+//Smaller allocations are not worth a huge page and always use new[]
+#define HUGE_PAGE_MIN_BYTES HUGE_PAGE_2M
+
+/*!
+  \brief Huge page backed host allocations for the large arrays.
+
+  Modes (--huge_pages):
+    none - new[], as before.
+    thp  - 2 MB aligned anonymous mappings marked MADV_HUGEPAGE, so
+           transparent huge pages back them when the kernel allows.
+    2M   - explicit 2 MB hugetlbfs pages, else thp.
+    1G   - explicit 1 GB pages for allocations of at least 1 GB, else 2M.
+  Every method falls back to the next one down, ending at new[], so a
+  host without reserved huge pages or with THP disabled still runs.
+
+  Allocations of at least HUGE_PAGE_MIN_BYTES are recorded with the
+  method that served them and, for thp, how much of them the kernel
+  actually backed with huge pages (read from /proc/self/smaps).
+  free() releases pointers it did not allocate with delete[], so
+  buffers from new[] may be passed to it.
+*/
+class HugePages {
+public:
+  struct Allocation {
+    std::string name;
+    size_t nbytes;
+    std::string method;   /*!< "hugetlb_1G", "hugetlb_2M", "thp" or "default".*/
+    size_t huge_bytes;    /*!< Bytes backed by huge pages, last measured.*/
+    void* base;
+    size_t mapped_bytes;
+    bool live;
+  };
+
+private:
+  pthread_mutex_t mutex;
+  std::string mode;
+  std::vector<Allocation> allocations;
+  std::map<void*,size_t> live_idx;
+
+  HugePages():mode("thp"){
+    pthread_mutex_init(&mutex,NULL);
+  }
+
+  static size_t round_up(size_t nbytes, size_t page){
+    return (nbytes+page-1)/page*page;
+  }
+
+  static void* map_hugetlb(size_t nbytes, int page_flag){
+    void* ptr = mmap(NULL,nbytes,PROT_READ|PROT_WRITE,
+		     MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|page_flag,-1,0);
+    return (ptr==MAP_FAILED) ? NULL : ptr;
+  }
+
+  //A 2 MB aligned mapping, so every 2 MB of it can become one huge page
+  static void* map_thp(size_t nbytes){
+    size_t padded = nbytes+HUGE_PAGE_2M;
+    void* ptr = mmap(NULL,padded,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (ptr==MAP_FAILED)
+      return NULL;
+    size_t start = round_up((size_t) ptr,HUGE_PAGE_2M);
+    if (start > (size_t) ptr)
+      munmap(ptr,start-(size_t) ptr);
+    size_t tail = (size_t) ptr+padded-(start+nbytes);
+    if (tail > 0)
+      munmap((void*)(start+nbytes),tail);
+    madvise((void*) start,nbytes,MADV_HUGEPAGE);
+    return (void*) start;
+  }
+
+  /*
+    AnonHugePages of the mappings overlapping [start,end). Neighbouring
+    mappings with the same flags are merged by the kernel, so a shared
+    mapping is counted in proportion to the overlap.
+  */
+  static size_t thp_bytes(size_t start, size_t end){
+    std::ifstream smaps("/proc/self/smaps");
+    std::string line;
+    size_t total = 0;
+    size_t vma_start = 0, vma_end = 0;
+    while (std::getline(smaps,line)){
+      unsigned long lo, hi;
+      if (sscanf(line.c_str(),"%lx-%lx ",&lo,&hi)==2 && line.find(':') > line.find(' ')){
+	vma_start = lo;
+	vma_end = hi;
+	continue;
+      }
+      unsigned long kb;
+      if (sscanf(line.c_str(),"AnonHugePages: %lu kB",&kb)!=1 || kb==0)
+	continue;
+      size_t lo_overlap = std::max(start,vma_start);
+      size_t hi_overlap = std::min(end,vma_end);
+      if (hi_overlap <= lo_overlap)
+	continue;
+      double fraction = (double)(hi_overlap-lo_overlap)/(vma_end-vma_start);
+      total += (size_t)(kb*1024.0*fraction);
+    }
+    return std::min(total,end-start);
+  }
+
+  void measure(Allocation& alloc){
+    if (alloc.method=="thp")
+      alloc.huge_bytes = thp_bytes((size_t) alloc.base,(size_t) alloc.base+alloc.mapped_bytes);
+  }
+
+public:
+  static HugePages& instance(void){
+    static HugePages huge_pages;
+    return huge_pages;
+  }
+
+  void set_mode(std::string new_mode){
+    if (new_mode!="none" && new_mode!="thp" && new_mode!="2M" && new_mode!="1G")
+      ErrorChecker::throw_error("--huge_pages must be none, thp, 2M or 1G");
+    mode = new_mode;
+  }
+
+  std::string get_mode(void){return mode;}
+
+  /*!
+    \brief Allocate nbytes, backed by huge pages where possible.
+
+    \param nbytes Size in bytes.
+    \param name Label for the allocation statistics.
+    \return Pointer to be released with free().
+  */
+  void* allocate(size_t nbytes, std::string name){
+    if (nbytes < HUGE_PAGE_MIN_BYTES)
+      return new unsigned char [nbytes];
+    Allocation alloc;
+    alloc.name = name;
+    alloc.nbytes = nbytes;
+    alloc.base = NULL;
+    alloc.mapped_bytes = nbytes;
+    alloc.huge_bytes = 0;
+    alloc.live = true;
+    if (mode=="1G" && nbytes >= HUGE_PAGE_1G){
+      alloc.mapped_bytes = round_up(nbytes,HUGE_PAGE_1G);
+      if ((alloc.base = map_hugetlb(alloc.mapped_bytes,MAP_HUGE_1GB)) != NULL)
+	alloc.method = "hugetlb_1G";
+    }
+    if (alloc.base==NULL && (mode=="1G" || mode=="2M")){
+      alloc.mapped_bytes = round_up(nbytes,HUGE_PAGE_2M);
+      if ((alloc.base = map_hugetlb(alloc.mapped_bytes,MAP_HUGE_2MB)) != NULL)
+	alloc.method = "hugetlb_2M";
+    }
+    if (alloc.base==NULL && mode!="none"){
+      alloc.mapped_bytes = round_up(nbytes,HUGE_PAGE_2M);
+      if ((alloc.base = map_thp(alloc.mapped_bytes)) != NULL)
+	alloc.method = "thp";
+    }
+    if (alloc.base==NULL){
+      alloc.mapped_bytes = nbytes;
+      alloc.base = new unsigned char [nbytes];
+      alloc.method = "default";
+    }
+    if (alloc.method.compare(0,7,"hugetlb")==0)
+      alloc.huge_bytes = alloc.mapped_bytes;
+    pthread_mutex_lock(&mutex);
+    live_idx[alloc.base] = allocations.size();
+    allocations.push_back(alloc);
+    pthread_mutex_unlock(&mutex);
+    return alloc.base;
+  }
+
+  //Release memory from allocate(), or from new[]
+  void release(void* ptr){
+    if (ptr==NULL)
+      return;
+    pthread_mutex_lock(&mutex);
+    std::map<void*,size_t>::iterator it = live_idx.find(ptr);
+    if (it==live_idx.end()){
+      pthread_mutex_unlock(&mutex);
+      delete [] (unsigned char*) ptr;
+      return;
+    }
+    Allocation& alloc = allocations[it->second];
+    live_idx.erase(it);
+    measure(alloc);
+    alloc.live = false;
+    std::string method = alloc.method;
+    size_t mapped_bytes = alloc.mapped_bytes;
+    pthread_mutex_unlock(&mutex);
+    if (method=="default")
+      delete [] (unsigned char*) ptr;
+    else
+      munmap(ptr,mapped_bytes);
+  }
+
+  template <class T>
+  static T* alloc(size_t units, std::string name){
+    return (T*) instance().allocate(units*sizeof(T),name);
+  }
+
+  template <class T>
+  static void free(T* ptr){
+    instance().release((void*) ptr);
+  }
+
+  /*!
+    \brief Every recorded allocation, with live thp coverage re-measured.
+
+    \return Allocations in the order they were made.
+  */
+  std::vector<Allocation> get_allocations(void){
+    pthread_mutex_lock(&mutex);
+    for (size_t ii=0;ii<allocations.size();ii++)
+      if (allocations[ii].live)
+	measure(allocations[ii]);
+    std::vector<Allocation> copy = allocations;
+    pthread_mutex_unlock(&mutex);
+    return copy;
+  }
+
+  /*!
+    \brief A field of /proc/meminfo, e.g. "HugePages_Free".
+
+    \return Value as listed (kB or pages), 0 if absent.
+  */
+  static size_t meminfo(std::string field){
+    std::ifstream infile("/proc/meminfo");
+    std::string key;
+    size_t value;
+    while (infile >> key >> value){
+      if (key==field+":")
+	return value;
+      infile.ignore(std::numeric_limits<std::streamsize>::max(),'\n');
+    }
+    return 0;
+  }
+};
+
+/*!
+  \brief STL allocator drawing from HugePages, for large std::vectors.
+*/
+template <class T>
+class HugePageAllocator {
+public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <class U>
+  struct rebind {typedef HugePageAllocator<U> other;};
+
+  std::string name;
+
+  HugePageAllocator(std::string name="buffer"):name(name){}
+
+  template <class U>
+  HugePageAllocator(const HugePageAllocator<U>& other):name(other.name){}
+
+  pointer address(reference x) const {return &x;}
+  const_pointer address(const_reference x) const {return &x;}
+
+  pointer allocate(size_type n, const void* hint=0){
+    return HugePages::alloc<T>(n,name);
+  }
+
+  void deallocate(pointer ptr, size_type n){
+    HugePages::free(ptr);
+  }
+
+  size_type max_size(void) const {return std::numeric_limits<size_type>::max()/sizeof(T);}
+
+  void construct(pointer ptr, const T& val){new ((void*) ptr) T(val);}
+  void destroy(pointer ptr){ptr->~T();}
+
+  bool operator==(const HugePageAllocator&) const {return true;}
+  bool operator!=(const HugePageAllocator&) const {return false;}
+};
@@ -0,0 +1,373 @@
+#pragma once
+#include <utils/exceptions.hpp>
+#include <utils/cmdline.hpp>
+#include <utils/utils.hpp>
+#include <transforms/folder.hpp>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <unistd.h>
+#include "cuda.h"
+#include "cufft.h"
+
+//Fraction of the budget kept back for allocations not modelled
+#define MEMORY_PLAN_RESERVE 0.05
+
+/*!
+  \brief Predicts the peak memory of a search and sizes it to a budget.
+
+  Stage sizes are computed from the filterbank header and the search
+  arguments, following the allocations made by the Dedisperser,
+  DispersionTrials, SearchContext (FFTs, spectra, Dereddener,
+  PeakFinder, harmonic sums), SegmentedSearch, WhitenedSeriesCache and
+  the FoldWorker/FoldOptimiser buffers, counting every fold thread
+  placed on a GPU and an optimiser for every fold shape it may use.
+  cuFFT work areas are estimated as one complex value per output bin.
+
+  The host budget is --mem_limit if given, else the cgroup memory
+  limit, else the physical memory. When the plan does not fit it is
+  adapted, in order, by requantising the DM trials to 4 and then 2
+  bits (unless --trial_nbits already asks for fewer than 8), sizing
+  the DM gulp so that only part of the trials is held at 8 bits,
+  shrinking --fold_cache and lowering the fold threads to no fewer
+  than one per GPU. Search workers are never dropped, as a worker
+  costs a few MB of host memory and its GPU would sit idle. A plan
+  that still does not fit is an error, raised before the filterbank
+  data or anything else large is allocated. Fold threads are also
+  capped at as many as fit in each GPU's free memory.
+*/
+class MemoryPlanner {
+public:
+  struct Stage {
+    std::string name;
+    size_t bytes;
+    Stage(std::string name, size_t bytes):name(name),bytes(bytes){}
+  };
+
+private:
+  size_t nsamps;
+  size_t out_nsamps;
+  unsigned int nchans;
+  unsigned int nbits;
+  unsigned int ndms;
+  size_t size;
+  bool filterbank_mapped;
+  CmdLineOptions& args;
+  int requested_fold_threads;
+  std::vector<unsigned int> factors;
+
+  static size_t read_limit(const char* path){
+    std::ifstream infile(path);
+    std::string text;
+    if (!(infile >> text) || text == "max")
+      return 0;
+    return strtoull(text.c_str(),NULL,10);
+  }
+
+  static size_t physical_memory(void){
+    return (size_t) sysconf(_SC_PHYS_PAGES)*sysconf(_SC_PAGESIZE);
+  }
+
+  static size_t packed_bytes(size_t nsamps, unsigned int nbits){
+    unsigned int per_byte = 8/nbits;
+    return (nsamps+per_byte-1)/per_byte;
+  }
+
+  //Device memory of a SearchContext of transform length n
+  size_t context_device_bytes(size_t n, bool owns_tim){
+    size_t nbins = n/2+1;
+    size_t bytes = 0;
+    bytes += 2*nbins*sizeof(cufftComplex);             //R2C and C2R work areas
+    bytes += nbins*sizeof(cufftComplex);               //d_fseries
+    bytes += nbins*sizeof(float);                      //pspec
+    bytes += n*sizeof(float);                          //d_tim_r
+    bytes += owns_tim ? n*sizeof(float) : 0;           //d_tim
+    bytes += (size_t)(nbins*sizeof(float)*2.25);       //Dereddener medians
+    bytes += n*(sizeof(size_t)+sizeof(float));         //PeakFinder
+    bytes += args.nharmonics*nbins*(args.fp16_sums ? 2 : sizeof(float));
+    return bytes;
+  }
+
+  //Host memory of a SearchContext's PeakFinder
+  static size_t context_host_bytes(void){
+    return 100000*(3*sizeof(size_t)+2*sizeof(float));
+  }
+
+  void compute(void){
+    stages.clear();
+    //Host
+    filterbank_bytes = filterbank_mapped ? 0 : nsamps*nchans*nbits/8;
+    if (trial_nbits < 8){
+      trial_bytes = ndms*packed_bytes(out_nsamps,trial_nbits);
+      gulp_bytes = (size_t) dm_gulp*nsamps;
+    } else {
+      trial_bytes = out_nsamps*ndms;
+      gulp_bytes = 0;
+    }
+    size_t contexts = (args.nsegments > 1) ? 1 : factors.size();
+    worker_host_bytes = contexts*context_host_bytes() + (trial_nbits < 8 ? out_nsamps : 0);
+    fold_cache_bytes = (size_t) fold_cache*1024*1024;
+    //FoldWorker unpack buffer and optimised fold
+    fold_host_bytes = (trial_nbits < 8 ? out_nsamps : 0)
+      + (size_t) args.fold_nbins*args.fold_nints*sizeof(float);
+    size_t dedisp_peak = trial_bytes + gulp_bytes;
+    size_t search_peak = trial_bytes + nworkers()*worker_host_bytes + fold_cache_bytes;
+    size_t fold_peak = trial_bytes + fold_cache_bytes + fold_threads*fold_host_bytes;
+    host_peak = filterbank_bytes + std::max(dedisp_peak,std::max(search_peak,fold_peak));
+
+    //Device, per worker
+    search_device_bytes = size*(sizeof(float)+1);      //ReusableDeviceTimeSeries
+    if (args.nsegments > 1){
+      //Segment length and count as chosen by SegmentedSearch
+      size_t seg = Utils::prev_smooth_size(2*size/(args.nsegments+1));
+      size_t half = std::max((size_t) 1,seg/2);
+      size_t nseg = (size > seg) ? std::max((size_t) args.nsegments,(size-seg+half-1)/half+1)
+	: args.nsegments;
+      search_device_bytes += context_device_bytes(seg,true);
+      search_device_bytes += nseg*seg*sizeof(float) + (seg/2+1)*sizeof(float);
+      for (size_t ii=0;ii<factors.size();ii++)
+	if (factors[ii] > 1)
+	  search_device_bytes += size/factors[ii]*sizeof(float);
+    } else {
+      for (size_t ii=0;ii<factors.size();ii++)
+	search_device_bytes += context_device_bytes(size/factors[ii],factors[ii]>1);
+    }
+    size_t fold_n = Utils::prev_smooth_size(out_nsamps);
+    fold_device_bytes = context_device_bytes(fold_n,false) + fold_n*(sizeof(float)+1);
+    //A FoldedSubints and FoldOptimiser are kept for every shape used
+    std::vector< std::pair<unsigned int,unsigned int> > shapes =
+      FoldShapeSelector::possible_shapes(args.fold_nbins,args.fold_nints);
+    for (size_t ii=0;ii<shapes.size();ii++){
+      size_t nb = shapes[ii].first, ni = shapes[ii].second;
+      fold_device_bytes += (2*nb*ni + nb*nb + 3*nb*(nb-1))*sizeof(cufftComplex)
+	+ nb*ni*sizeof(float);
+    }
+    device_peak = std::max(workers_per_gpu*search_device_bytes,folds_per_gpu()*fold_device_bytes);
+
+    stages.push_back(Stage("filterbank",filterbank_bytes));
+    stages.push_back(Stage("dm_trials",trial_bytes));
+    stages.push_back(Stage("dedispersion_gulp",gulp_bytes));
+    stages.push_back(Stage("workers",nworkers()*worker_host_bytes));
+    stages.push_back(Stage("fold_cache",fold_cache_bytes));
+    stages.push_back(Stage("fold_workers",fold_threads*fold_host_bytes));
+    stages.push_back(Stage("device_search",workers_per_gpu*search_device_bytes));
+    stages.push_back(Stage("device_fold",folds_per_gpu()*fold_device_bytes));
+  }
+
+  size_t nworkers(void){
+    return (size_t) nthreads*workers_per_gpu;
+  }
+
+  //FoldWorkers sharing the busiest GPU
+  size_t folds_per_gpu(void){
+    return (fold_threads+nthreads-1)/nthreads;
+  }
+
+  bool fits(void){
+    return host_peak <= usable;
+  }
+
+  //Largest DM gulp whose 8-bit staging fits beside everything else
+  void fit_gulp(void){
+    dm_gulp = ndms;
+    compute();
+    if (fits() || trial_nbits >= 8)
+      return;
+    if (filterbank_bytes + trial_bytes + nsamps >= usable)
+      dm_gulp = 1;
+    else
+      dm_gulp = std::min((size_t) ndms,(usable-filterbank_bytes-trial_bytes)/nsamps);
+    compute();
+  }
+
+  //Cap the fold threads at as many as fit on each GPU
+  void fit_fold_threads(size_t device_free){
+    if (device_free == 0 || fold_device_bytes == 0)
+      return;
+    int max_threads = (int) std::max((size_t) 1,device_free/fold_device_bytes)*nthreads;
+    if (fold_threads <= max_threads)
+      return;
+    std::stringstream note;
+    note << "fold_threads " << fold_threads << " -> " << max_threads;
+    adjustments.push_back(note.str());
+    fold_threads = max_threads;
+    compute();
+  }
+
+public:
+  size_t budget;           /*!< Host memory available to the search (bytes).*/
+  size_t usable;           /*!< Budget less the reserve.*/
+  std::string budget_source;
+  unsigned int trial_nbits;
+  unsigned int dm_gulp;
+  int fold_cache;          /*!< MB.*/
+  int nthreads;
+  int workers_per_gpu;
+  int fold_threads;
+  size_t filterbank_bytes;
+  size_t trial_bytes;
+  size_t gulp_bytes;
+  size_t worker_host_bytes;   /*!< Per search worker.*/
+  size_t fold_cache_bytes;
+  size_t fold_host_bytes;     /*!< Per fold thread.*/
+  size_t host_peak;
+  size_t search_device_bytes; /*!< Per search worker.*/
+  size_t fold_device_bytes;   /*!< Per fold thread.*/
+  size_t device_peak;
+  std::vector<Stage> stages;
+  std::vector<std::string> adjustments;
+
+  /*!
+    \param nsamps Samples in the filterbank.
+    \param nchans Channels in the filterbank.
+    \param nbits Bits per filterbank sample.
+    \param filterbank_mapped True if the data are memory mapped rather than read.
+    \param ndms Number of DM trials.
+    \param max_delay Dispersion delay of the highest DM (samples).
+    \param size Transform length of the search.
+    \param all_factors Downsampling factor of each DM trial, empty for none.
+    \param args Search arguments.
+    \param nthreads Number of GPUs used.
+
+    Workers per GPU and fold threads are taken from
+    args.workers_per_gpu and args.fold_threads.
+  */
+  MemoryPlanner(size_t nsamps, unsigned int nchans, unsigned int nbits,
+		bool filterbank_mapped, unsigned int ndms, size_t max_delay,
+		size_t size, std::vector<unsigned int> all_factors,
+		CmdLineOptions& args, int nthreads)
+    :nsamps(nsamps),out_nsamps(nsamps-max_delay),nchans(nchans),nbits(nbits),ndms(ndms),
+     size(size),filterbank_mapped(filterbank_mapped),args(args),
+     trial_nbits(args.trial_nbits),dm_gulp(ndms),
+     fold_cache(args.npdmp > 0 ? args.fold_cache : 0),nthreads(nthreads),
+     workers_per_gpu(std::max(1,args.workers_per_gpu)),fold_threads(std::max(1,args.fold_threads))
+  {
+    requested_fold_threads = fold_threads;
+    std::sort(all_factors.begin(),all_factors.end());
+    all_factors.erase(std::unique(all_factors.begin(),all_factors.end()),all_factors.end());
+    factors = all_factors.size() ? all_factors : std::vector<unsigned int>(1,1);
+
+    size_t cgroup = read_limit("/sys/fs/cgroup/memory.max");
+    if (cgroup == 0)
+      cgroup = read_limit("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+    size_t physical = physical_memory();
+    if (args.mem_limit > 0){
+      budget = (size_t) args.mem_limit*1024*1024;
+      budget_source = "mem_limit";
+    } else if (cgroup > 0 && cgroup < physical){
+      budget = cgroup;
+      budget_source = "cgroup";
+    } else {
+      budget = physical;
+      budget_source = "physical";
+    }
+    usable = (size_t)(budget*(1.0-MEMORY_PLAN_RESERVE));
+  }
+
+  /*!
+    \brief Choose trial storage, DM gulp, fold cache and fold threads.
+
+    Starts again from the arguments, so it may be re-run after
+    workers_per_gpu changes.
+
+    \param device_free Free bytes on the smallest GPU, 0 if unknown.
+    \return True if the plan fits the host budget.
+  */
+  bool plan(size_t device_free=0){
+    trial_nbits = args.trial_nbits;
+    fold_cache = args.npdmp > 0 ? args.fold_cache : 0;
+    fold_threads = requested_fold_threads;
+    adjustments.clear();
+    fit_gulp();
+    //Requantising only pays off if the 8 bit trials are never all held
+    while (!fits() && trial_nbits > 2){
+      unsigned int before = trial_nbits;
+      trial_nbits = (trial_nbits == 8) ? 4 : 2;
+      fit_gulp();
+      std::stringstream note;
+      note << "trial_nbits " << before << " -> " << trial_nbits;
+      adjustments.push_back(note.str());
+    }
+    if (dm_gulp < ndms){
+      std::stringstream note;
+      note << "dm_gulp " << dm_gulp << " of " << ndms << " trials";
+      adjustments.push_back(note.str());
+    }
+    if (!fits() && fold_cache > 0){
+      size_t excess = host_peak - usable;
+      int before = fold_cache;
+      fold_cache = std::max(0,(int)(fold_cache - (excess+1024*1024-1)/(1024*1024)));
+      compute();
+      std::stringstream note;
+      note << "fold_cache " << before << " -> " << fold_cache << " MB";
+      adjustments.push_back(note.str());
+    }
+    if (!fits() && fold_threads > nthreads && fold_host_bytes > 0){
+      size_t excess = host_peak - usable;
+      int before = fold_threads;
+      size_t fewer = (excess+fold_host_bytes-1)/fold_host_bytes;
+      fold_threads = (fewer < (size_t)(fold_threads-nthreads)) ? fold_threads-fewer : nthreads;
+      compute();
+      std::stringstream note;
+      note << "fold_threads " << before << " -> " << fold_threads;
+      adjustments.push_back(note.str());
+    }
+    fit_fold_threads(device_free);
+    return fits();
+  }
+
+  /*!
+    \brief Whether wpg workers per GPU fit with the current trial storage.
+
+    The fold cache is left out, as plan() shrinks it to make room.
+
+    \param wpg Workers per GPU.
+    \param device_free Free bytes on the smallest GPU, 0 if unknown.
+  */
+  bool fits_workers(int wpg, size_t device_free){
+    int before_wpg = workers_per_gpu;
+    int before_cache = fold_cache;
+    workers_per_gpu = wpg;
+    fold_cache = 0;
+    compute();
+    bool ok = fits() && (device_free == 0 || workers_per_gpu*search_device_bytes <= device_free);
+    workers_per_gpu = before_wpg;
+    fold_cache = before_cache;
+    compute();
+    return ok;
+  }
+
+  /*!
+    \brief Device memory on the smallest of the GPUs used.
+
+    \return Free bytes, or 0 if no GPU reports any.
+  */
+  size_t min_device_free(void){
+    size_t min_free = 0;
+    for (int ii=0;ii<nthreads;ii++){
+      size_t free_bytes = 0, total_bytes = 0;
+      cudaSetDevice(ii);
+      if (cudaMemGetInfo(&free_bytes,&total_bytes) != cudaSuccess)
+	continue;
+      if (min_free == 0 || free_bytes < min_free)
+	min_free = free_bytes;
+    }
+    cudaSetDevice(0);
+    return min_free;
+  }
+
+  void print(std::ostream& out){
+    out << "Memory plan (budget " << budget/(1024*1024) << " MB from "
+	<< budget_source << "):" << std::endl;
+    for (size_t ii=0;ii<stages.size();ii++)
+      out << "  " << stages[ii].name << ": " << stages[ii].bytes/(1024*1024) << " MB" << std::endl;
+    out << "  host peak: " << host_peak/(1024*1024) << " MB, device peak: "
+	<< device_peak/(1024*1024) << " MB per GPU (" << folds_per_gpu()
+	<< " fold thread(s) per GPU)" << std::endl;
+    for (size_t ii=0;ii<adjustments.size();ii++)
+      out << "  adjusted: " << adjustments[ii] << std::endl;
+  }
+};
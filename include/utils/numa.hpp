@@ -0,0 +1,169 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "cuda.h"
+
+#define NUMA_MAX_NODES 64
+
+/*!
+  \brief NUMA nodes of the host and the CPUs and GPUs attached to them.
+
+  Read from sysfs once. Hosts without NUMA information are treated as
+  a single node holding every online CPU. Memory policies are set
+  through the raw system calls, so libnuma is not needed.
+*/
+class NumaTopology {
+private:
+  std::vector<std::vector<int> > node_cpus;
+  std::vector<int> cpu_nodes;
+
+  NumaTopology(){
+    for (int node=0;node<NUMA_MAX_NODES;node++){
+      std::stringstream path;
+      path << "/sys/devices/system/node/node" << node << "/cpulist";
+      std::ifstream infile(path.str().c_str());
+      std::string list;
+      if (!(infile >> list))
+	continue;
+      std::vector<int> cpus = parse_cpulist(list);
+      node_cpus.resize(node+1);
+      node_cpus[node] = cpus;
+      for (size_t ii=0;ii<cpus.size();ii++){
+	if (cpus[ii] >= (int) cpu_nodes.size())
+	  cpu_nodes.resize(cpus[ii]+1,-1);
+	cpu_nodes[cpus[ii]] = node;
+      }
+    }
+    if (node_cpus.size()==0){
+      long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+      node_cpus.resize(1);
+      for (int ii=0;ii<ncpus;ii++){
+	node_cpus[0].push_back(ii);
+	cpu_nodes.push_back(0);
+      }
+    }
+  }
+
+  static long mbind_range(void* ptr, size_t nbytes, int mode, int node, unsigned flags){
+    unsigned long mask = (node >= 0) ? 1UL<<node : 0;
+    //mbind() needs page aligned ranges, edge pages go with the range below
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = ((size_t) ptr+page-1)/page*page;
+    size_t end = ((size_t) ptr+nbytes)/page*page;
+    if (end <= start)
+      return 0;
+    return syscall(SYS_mbind,(void*) start,end-start,mode,
+		   (node >= 0) ? &mask : NULL,(node >= 0) ? NUMA_MAX_NODES : 0,flags);
+  }
+
+public:
+  static NumaTopology& instance(void){
+    static NumaTopology topology;
+    return topology;
+  }
+
+  /*!
+    \brief Parse a CPU list such as "0-7,16-23".
+
+    \return CPU indices in the order listed.
+  */
+  static std::vector<int> parse_cpulist(std::string list){
+    std::vector<int> cpus;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream,item,',')){
+      if (item.size()==0)
+	continue;
+      int first, last;
+      if (sscanf(item.c_str(),"%d-%d",&first,&last) != 2)
+	last = first = atoi(item.c_str());
+      for (int cpu=first;cpu<=last;cpu++)
+	cpus.push_back(cpu);
+    }
+    return cpus;
+  }
+
+  int get_nnodes(void){return node_cpus.size();}
+
+  //Nodes listed in sysfs may be sparse, empty ones have no CPUs
+  std::vector<int>& get_cpus(int node){return node_cpus[node];}
+
+  int get_cpu_node(int cpu){
+    if (cpu < 0 || cpu >= (int) cpu_nodes.size())
+      return -1;
+    return cpu_nodes[cpu];
+  }
+
+  /*!
+    \brief NUMA node of a GPU's PCI slot.
+
+    \return Node index, or -1 if unknown.
+  */
+  int get_gpu_node(int device){
+    char busid[32];
+    if (cudaDeviceGetPCIBusId(busid,sizeof(busid),device) != cudaSuccess)
+      return -1;
+    std::string path = "/sys/bus/pci/devices/";
+    for (char* c=busid;*c;c++)
+      path += tolower(*c);
+    std::ifstream infile((path+"/numa_node").c_str());
+    int node = -1;
+    if (!(infile >> node) || node >= get_nnodes())
+      return -1;
+    return node;
+  }
+
+  /*!
+    \brief Node holding the page at ptr.
+
+    \return Node index, or -1 if the page is not yet placed.
+  */
+  int get_page_node(const void* ptr){
+    int node = -1;
+    if (syscall(SYS_get_mempolicy,&node,NULL,0,ptr,MPOL_F_NODE|MPOL_F_ADDR) != 0)
+      return -1;
+    return node;
+  }
+
+  //Move the pages of a range to one node and keep them there
+  bool bind(void* ptr, size_t nbytes, int node){
+    if (get_nnodes() < 2)
+      return true;
+    return mbind_range(ptr,nbytes,MPOL_BIND,node,MPOL_MF_MOVE) == 0;
+  }
+
+  //Allocate the calling thread's new pages on node where possible,
+  //a negative node restoring the default (local) policy
+  bool prefer_node(int node){
+    if (get_nnodes() < 2)
+      return true;
+    if (node < 0)
+      return syscall(SYS_set_mempolicy,MPOL_DEFAULT,NULL,0) == 0;
+    unsigned long mask = 1UL<<node;
+    return syscall(SYS_set_mempolicy,MPOL_PREFERRED,&mask,NUMA_MAX_NODES) == 0;
+  }
+
+  //Restrict the calling thread to cpus, empty for any CPU
+  bool pin_thread(std::vector<int>& cpus){
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (cpus.size()==0){
+      for (size_t cpu=0;cpu<cpu_nodes.size();cpu++)
+	CPU_SET(cpu,&set);
+    } else {
+      for (size_t ii=0;ii<cpus.size();ii++)
+	CPU_SET(cpus[ii],&set);
+    }
+    return pthread_setaffinity_np(pthread_self(),sizeof(set),&set) == 0;
+  }
+};
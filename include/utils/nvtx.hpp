@@ -1,11 +1,221 @@
 #pragma once
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define TRACE_BUFFER_SIZE (1<<18)
+#define TRACE_MAX_DEPTH 32
+
+struct TraceEvent {
+  const char* name;
+  int dm_idx;
+  int acc_idx;
+  double start;    /*!< Microseconds since tracing was enabled.*/
+  double duration; /*!< Microseconds.*/
+};
+
+/*!
+  \brief Completed ranges of one thread.
+
+  Only the owning thread writes to a buffer, so recording takes no
+  locks. The buffer grows to TRACE_BUFFER_SIZE events, after which
+  the oldest events are overwritten.
+*/
+class TraceBuffer {
+private:
+  TraceEvent stack[TRACE_MAX_DEPTH];
+  int depth;
+
+public:
+  std::vector<TraceEvent> events;
+  size_t nevents;
+  int tid;
+  std::string name;
+
+  TraceBuffer(int tid)
+    :depth(0),nevents(0),tid(tid){
+    char buf[32];
+    snprintf(buf,32,"Thread %d",tid);
+    name = buf;
+  }
+
+  void push(const char* label, int dm_idx, int acc_idx, double now){
+    if (depth < TRACE_MAX_DEPTH){
+      TraceEvent& event = stack[depth];
+      event.name = label;
+      event.dm_idx = dm_idx;
+      event.acc_idx = acc_idx;
+      event.start = now;
+    }
+    depth++;
+  }
+
+  void pop(double now){
+    if (depth == 0)
+      return;
+    depth--;
+    if (depth < TRACE_MAX_DEPTH){
+      if (events.size() < TRACE_BUFFER_SIZE)
+	events.push_back(stack[depth]);
+      else
+	events[nevents%events.size()] = stack[depth];
+      TraceEvent& event = events[nevents%events.size()];
+      event.duration = now - event.start;
+      nevents++;
+    }
+  }
+
+  size_t get_ndropped(void){
+    return nevents > events.size() ? nevents-events.size() : 0;
+  }
+};
+
+/*!
+  \brief CPU timeline of the PUSH_NVTX_RANGE/POP_NVTX_RANGE ranges.
+
+  Disabled unless enable() is called, in which case every thread
+  records its ranges against a monotonic clock and the timeline is
+  written as Chrome trace event JSON when the program exits. The file
+  opens in chrome://tracing or ui.perfetto.dev.
+
+  Range names must be string literals; only the pointer is stored.
+*/
+class Tracer {
+private:
+  pthread_mutex_t mutex;
+  std::vector<TraceBuffer*> buffers;
+  std::string filename;
+  bool enabled;
+  double origin;
+
+  Tracer():enabled(false),origin(0.0){
+    pthread_mutex_init(&mutex,NULL);
+  }
+
+  static double clock_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1.0e6 + ts.tv_nsec*1.0e-3;
+  }
+
+  TraceBuffer* get_buffer(void){
+    static __thread TraceBuffer* buffer = NULL;
+    if (buffer == NULL){
+      pthread_mutex_lock(&mutex);
+      buffer = new TraceBuffer(buffers.size());
+      buffers.push_back(buffer);
+      pthread_mutex_unlock(&mutex);
+    }
+    return buffer;
+  }
+
+  static void write_at_exit(void){
+    instance().write(instance().filename);
+  }
+
+public:
+  static Tracer& instance(void){
+    static Tracer tracer;
+    return tracer;
+  }
+
+  /*!
+    \brief Start recording ranges.
+
+    \param outfile Trace file written at exit.
+  */
+  void enable(std::string outfile){
+    if (enabled)
+      return;
+    filename = outfile;
+    origin = clock_us();
+    enabled = true;
+    get_buffer()->name = "main";
+    atexit(write_at_exit);
+  }
+
+  bool is_enabled(void){return enabled;}
+
+  void push(const char* name, int dm_idx=-1, int acc_idx=-1){
+    if (enabled)
+      get_buffer()->push(name,dm_idx,acc_idx,clock_us()-origin);
+  }
+
+  void pop(void){
+    if (enabled)
+      get_buffer()->pop(clock_us()-origin);
+  }
+
+  //Label the calling thread in the timeline, e.g. "Worker 2"
+  void name_thread(const char* prefix, int idx){
+    if (!enabled)
+      return;
+    char buf[64];
+    snprintf(buf,64,"%s %d",prefix,idx);
+    get_buffer()->name = buf;
+  }
+
+  /*!
+    \brief Write all recorded ranges as Chrome trace event JSON.
+
+    Call only once the recording threads have finished.
+  */
+  void write(std::string outfile){
+    //Usually called at exit, so report rather than throw
+    FILE* fo = fopen(outfile.c_str(),"w");
+    if (fo == NULL){
+      fprintf(stderr,"Tracer: could not open %s\n",outfile.c_str());
+      return;
+    }
+    std::vector<char> iobuf(1<<20);
+    setvbuf(fo,&iobuf[0],_IOFBF,iobuf.size());
+    int pid = getpid();
+    size_t ndropped = 0;
+    fprintf(fo,"{\"traceEvents\":[\n");
+    fprintf(fo,"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,"
+	    "\"args\":{\"name\":\"peasoup\"}}",pid);
+    pthread_mutex_lock(&mutex);
+    for (size_t ii=0;ii<buffers.size();ii++){
+      TraceBuffer& buffer = *buffers[ii];
+      fprintf(fo,",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+	      "\"args\":{\"name\":\"%s\"}}",pid,buffer.tid,buffer.name.c_str());
+      ndropped += buffer.get_ndropped();
+      size_t count = std::min(buffer.nevents,buffer.events.size());
+      for (size_t jj=buffer.nevents-count;jj<buffer.nevents;jj++){
+	TraceEvent& event = buffer.events[jj%buffer.events.size()];
+	fprintf(fo,",\n{\"name\":\"%s\",\"cat\":\"peasoup\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+		"\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+		event.name,pid,buffer.tid,event.start,event.duration);
+	if (event.dm_idx >= 0)
+	  fprintf(fo,"\"dm_idx\":%d%s",event.dm_idx,event.acc_idx >= 0 ? "," : "");
+	if (event.acc_idx >= 0)
+	  fprintf(fo,"\"acc_idx\":%d",event.acc_idx);
+	fprintf(fo,"}}");
+      }
+    }
+    pthread_mutex_unlock(&mutex);
+    fprintf(fo,"\n],\n\"displayTimeUnit\":\"ms\",\n"
+	    "\"otherData\":{\"dropped_events\":%zu}}\n",ndropped);
+    fclose(fo);
+  }
+};
+
+/*
+  Ranges always go to the Tracer, which ignores them unless enabled,
+  and additionally to NVTX when built with USE_NVTX.
+*/
 #ifdef USE_NVTX
 #include "nvToolsExt.h"
 
 static const uint32_t colors[] = { 0x0000ff00, 0x000000ff, 0x00ffff00, 0x00ff00ff, 0x0000ffff, 0x00ff0000, 0x00ffffff };
 static const int num_colors = sizeof(colors)/sizeof(uint32_t);
 
-#define PUSH_NVTX_RANGE(name,cid) { \
+#define PUSH_NVTX_RANGE_IDX(name,cid,dm_idx,acc_idx) { \
 	int color_id = cid; \
 	color_id = color_id%num_colors;\
 	nvtxEventAttributes_t eventAttrib = {0}; \
@@ -16,9 +226,12 @@ static const int num_colors = sizeof(colors)/sizeof(uint32_t);
 	eventAttrib.messageType = NVTX_MESSAGE_TYPE_ASCII; \
 	eventAttrib.message.ascii = name; \
 	nvtxRangePushEx(&eventAttrib); \
+	Tracer::instance().push(name,dm_idx,acc_idx); \
 }
-#define POP_NVTX_RANGE nvtxRangePop();
+#define POP_NVTX_RANGE { nvtxRangePop(); Tracer::instance().pop(); }
 #else
-#define PUSH_NVTX_RANGE(name,cid)
-#define POP_NVTX_RANGE
+#define PUSH_NVTX_RANGE_IDX(name,cid,dm_idx,acc_idx) Tracer::instance().push(name,dm_idx,acc_idx);
+#define POP_NVTX_RANGE Tracer::instance().pop();
 #endif
+#define PUSH_NVTX_RANGE(name,cid) PUSH_NVTX_RANGE_IDX(name,cid,-1,-1)
+#define NAME_NVTX_THREAD(prefix,idx) Tracer::instance().name_thread(prefix,idx);
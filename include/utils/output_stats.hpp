@@ -11,27 +11,28 @@
 #include <utils/xml_util.hpp>
 #include <utils/cmdline.hpp>
 #include <utils/stopwatch.hpp>
+#include <utils/memory_plan.hpp>
+#include <utils/autotune.hpp>
+#include <utils/huge_pages.hpp>
 #include <data_types/header.hpp>
 #include "cuda.h"
 
+/*
+  Writes overview.xml. Sections are streamed to the file in the order
+  they are added; close() ends the document.
+*/
 class OutputFileWriter {
-  XML::Element root;
+  XML::Writer xml;
 
 public:
-  OutputFileWriter()
-    :root("peasoup_search"){}
-
-  std::string to_string(void){
-    return root.to_string(true);
+  OutputFileWriter(std::string filename)
+    :xml(filename)
+  {
+    xml.open("peasoup_search");
   }
 
-  void to_file(std::string filename){
-    std::ofstream outfile;
-    outfile.open(filename.c_str(),std::ifstream::out | std::ifstream::binary);
-    ErrorChecker::check_file_error(outfile, filename);
-    outfile << root.to_string(true);
-    ErrorChecker::check_file_error(outfile, filename);
-    outfile.close();
+  void close(void){
+    xml.finish();
   }
   
   void add_header(std::string filename){
@@ -67,16 +68,54 @@ public:
     header.append(XML::Element("npuls",hdr.npuls));
     header.append(XML::Element("refdm",hdr.refdm));
     header.append(XML::Element("signed",(int)hdr.signed_data));
-    root.append(header);
+    xml.write(header);
+  }
+
+  void add_dada_header(DadaHeader& hdr, size_t nsamples){
+    XML::Element header("header_parameters");
+    header.append(XML::Element("source_name",hdr.source_name));
+    header.append(XML::Element("ra",hdr.ra));
+    header.append(XML::Element("dec",hdr.dec));
+    header.append(XML::Element("telescope",hdr.telescope));
+    header.append(XML::Element("instrument",hdr.instrument));
+    header.append(XML::Element("utc_start",hdr.utc_start));
+    header.append(XML::Element("obs_offset",hdr.obs_offset));
+    header.append(XML::Element("tsamp",hdr.tsamp*1.0e-6));
+    header.append(XML::Element("freq",hdr.freq));
+    header.append(XML::Element("bw",hdr.bw));
+    header.append(XML::Element("nchans",hdr.nchan));
+    header.append(XML::Element("nbits",hdr.nbit));
+    header.append(XML::Element("nsamples",nsamples));
+    xml.write(header);
+  }
+
+  //Position of one streaming search window within the stream
+  void add_stream_window(unsigned int idx, size_t start_sample,
+			 size_t nsamps, double start_time, double latency){
+    XML::Element window("stream_window");
+    window.append(XML::Element("index",idx));
+    window.append(XML::Element("start_sample",start_sample));
+    window.append(XML::Element("nsamples",nsamps));
+    window.append(XML::Element("start_time",start_time));
+    window.append(XML::Element("latency",latency));
+    xml.write(window);
   }
 
   void add_search_parameters(CmdLineOptions& args){
     XML::Element search_options("search_parameters");
     search_options.append(XML::Element("infilename",args.infilename));
+    search_options.append(XML::Element("ringbuffer",args.ringbuffer));
+    search_options.append(XML::Element("stream_overlap",args.stream_overlap));
     search_options.append(XML::Element("outdir",args.outdir));
     search_options.append(XML::Element("killfilename",args.killfilename));
     search_options.append(XML::Element("zapfilename",args.zapfilename));
     search_options.append(XML::Element("max_num_threads",args.max_num_threads));
+    search_options.append(XML::Element("workers_per_gpu",args.workers_per_gpu));
+    search_options.append(XML::Element("autotune",args.autotune));
+    search_options.append(XML::Element("autotune_cache",args.autotune_cache));
+    search_options.append(XML::Element("cpu_affinity",args.cpu_affinity));
+    search_options.append(XML::Element("trial_placement",args.trial_placement));
+    search_options.append(XML::Element("huge_pages",args.huge_pages));
     search_options.append(XML::Element("size",args.size));
     search_options.append(XML::Element("dm_start",args.dm_start));
     search_options.append(XML::Element("dm_end",args.dm_end));
@@ -86,18 +125,35 @@ public:
     search_options.append(XML::Element("acc_end",args.acc_end));
     search_options.append(XML::Element("acc_tol",args.acc_tol));
     search_options.append(XML::Element("acc_pulse_width",args.acc_pulse_width));
+    search_options.append(XML::Element("acc_coarse_factor",args.acc_coarse_factor));
+    search_options.append(XML::Element("coarse_min_snr",args.coarse_min_snr));
+    search_options.append(XML::Element("max_downsamp",args.max_downsamp));
+    search_options.append(XML::Element("nsegments",args.nsegments));
+    search_options.append(XML::Element("trial_nbits",args.trial_nbits));
     search_options.append(XML::Element("boundary_5_freq",args.boundary_5_freq));
     search_options.append(XML::Element("boundary_25_freq",args.boundary_25_freq));
     search_options.append(XML::Element("nharmonics",args.nharmonics));
+    search_options.append(XML::Element("fp16_sums",args.fp16_sums));
     search_options.append(XML::Element("npdmp",args.npdmp));
+    search_options.append(XML::Element("fold_cache",args.fold_cache));
+    search_options.append(XML::Element("fold_threads",args.fold_threads));
+    search_options.append(XML::Element("fold_nbins",args.fold_nbins));
+    search_options.append(XML::Element("fold_nints",args.fold_nints));
+    search_options.append(XML::Element("nrefine",args.nrefine));
+    search_options.append(XML::Element("refine_nsubbands",args.refine_nsubbands));
     search_options.append(XML::Element("min_snr",args.min_snr));
     search_options.append(XML::Element("min_freq",args.min_freq));
     search_options.append(XML::Element("max_freq",args.max_freq));
     search_options.append(XML::Element("max_harm",args.max_harm));
     search_options.append(XML::Element("freq_tol",args.freq_tol));
+    search_options.append(XML::Element("mem_limit",args.mem_limit));
+    search_options.append(XML::Element("tracefilename",args.tracefilename));
+    search_options.append(XML::Element("telemetry_file",args.telemetry_file));
+    search_options.append(XML::Element("telemetry_socket",args.telemetry_socket));
+    search_options.append(XML::Element("telemetry_interval",args.telemetry_interval));
     search_options.append(XML::Element("verbose",args.verbose));
     search_options.append(XML::Element("progress_bar",args.progress_bar));
-    root.append(search_options);
+    xml.write(search_options);
   }
 
   void add_misc_info(void){
@@ -110,7 +166,7 @@ public:
     info.append(XML::Element("local_datetime",buf));
     std::strftime(buf, 128, "%Y-%m-%d-%H:%M", std::gmtime(&t));
     info.append(XML::Element("utc_datetime",buf));
-    root.append(info);
+    xml.write(info);
   }
   
   void add_timing_info(std::map<std::string,Stopwatch>& elapsed_times){
@@ -118,9 +174,106 @@ public:
     typedef std::map<std::string,Stopwatch>::iterator it_type;
     for (it_type it=elapsed_times.begin(); it!=elapsed_times.end(); it++)
       times.append(XML::Element(it->first,it->second.getTime()));
-    root.append(times);
+    xml.write(times);
   }
   
+  void add_acc_refinement(unsigned int coarse_trials, unsigned int full_grid_trials,
+			  unsigned int fine_trials, unsigned int coarse_cands,
+			  unsigned int refined_cands){
+    XML::Element refinement("acceleration_refinement");
+    refinement.append(XML::Element("coarse_trials",coarse_trials));
+    refinement.append(XML::Element("full_grid_trials",full_grid_trials));
+    refinement.append(XML::Element("fine_trials",fine_trials));
+    refinement.append(XML::Element("coarse_candidates",coarse_cands));
+    refinement.append(XML::Element("refined_candidates",refined_cands));
+    xml.write(refinement);
+  }
+
+  //Predicted memory use per stage and any settings changed to fit the budget
+  void add_memory_plan(MemoryPlanner& plan){
+    XML::Element memory("memory_plan");
+    memory.add_attribute("budget_source",plan.budget_source);
+    memory.append(XML::Element("budget",plan.budget));
+    for (size_t ii=0;ii<plan.stages.size();ii++){
+      XML::Element stage("stage");
+      stage.add_attribute("name",plan.stages[ii].name);
+      stage.append(XML::Element("bytes",plan.stages[ii].bytes));
+      memory.append(stage);
+    }
+    memory.append(XML::Element("host_peak",plan.host_peak));
+    memory.append(XML::Element("device_peak",plan.device_peak));
+    memory.append(XML::Element("trial_nbits",plan.trial_nbits));
+    memory.append(XML::Element("dm_gulp",plan.dm_gulp));
+    memory.append(XML::Element("fold_cache",plan.fold_cache));
+    memory.append(XML::Element("nthreads",plan.nthreads));
+    memory.append(XML::Element("workers_per_gpu",plan.workers_per_gpu));
+    memory.append(XML::Element("fold_threads",plan.fold_threads));
+    for (size_t ii=0;ii<plan.adjustments.size();ii++)
+      memory.append(XML::Element("adjustment",plan.adjustments[ii]));
+    xml.write(memory);
+  }
+
+  //Workers per GPU chosen by --autotune and the throughput behind it
+  void add_autotune(AutotuneResult& result){
+    XML::Element autotune("autotune");
+    autotune.add_attribute("source",result.source);
+    autotune.append(XML::Element("key",result.key));
+    autotune.append(XML::Element("workers_per_gpu",result.workers_per_gpu));
+    for (size_t ii=0;ii<result.tried.size();ii++){
+      XML::Element trial("calibration");
+      trial.add_attribute("workers_per_gpu",result.tried[ii]);
+      trial.append(XML::Element("dm_trials_per_second",result.rates[ii]));
+      autotune.append(trial);
+    }
+    xml.write(autotune);
+  }
+
+  //NUMA placement of the trials and how many DMs were searched on their own node
+  void add_numa_placement(int nnodes, std::string placement, size_t replica_nbytes,
+			  unsigned int local_dms, unsigned int remote_dms){
+    XML::Element numa("numa_placement");
+    numa.add_attribute("mode",placement);
+    numa.append(XML::Element("nodes",nnodes));
+    numa.append(XML::Element("replica_bytes",replica_nbytes));
+    numa.append(XML::Element("local_dm_trials",local_dms));
+    numa.append(XML::Element("remote_dm_trials",remote_dms));
+    xml.write(numa);
+  }
+
+  //How each large host buffer was backed and the host's huge page pool
+  void add_huge_pages(void){
+    HugePages& huge_pages = HugePages::instance();
+    XML::Element info("huge_pages");
+    info.add_attribute("mode",huge_pages.get_mode());
+    info.append(XML::Element("hugepage_size_kb",HugePages::meminfo("Hugepagesize")));
+    info.append(XML::Element("hugepages_total",HugePages::meminfo("HugePages_Total")));
+    info.append(XML::Element("hugepages_free",HugePages::meminfo("HugePages_Free")));
+    info.append(XML::Element("anon_huge_kb",HugePages::meminfo("AnonHugePages")));
+    std::vector<HugePages::Allocation> allocations = huge_pages.get_allocations();
+    size_t total = 0, huge = 0;
+    for (size_t ii=0;ii<allocations.size();ii++){
+      XML::Element alloc("allocation");
+      alloc.add_attribute("name",allocations[ii].name);
+      alloc.append(XML::Element("bytes",allocations[ii].nbytes));
+      alloc.append(XML::Element("method",allocations[ii].method));
+      alloc.append(XML::Element("huge_page_bytes",allocations[ii].huge_bytes));
+      info.append(alloc);
+      total += allocations[ii].nbytes;
+      huge += std::min(allocations[ii].huge_bytes,allocations[ii].nbytes);
+    }
+    info.append(XML::Element("total_bytes",total));
+    info.append(XML::Element("huge_page_bytes",huge));
+    xml.write(info);
+  }
+
+  //Largest harmonic sum S/N deviation of a reduced precision search from fp32
+  void add_precision_check(std::string precision, float max_snr_error){
+    XML::Element check("precision_check");
+    check.add_attribute("type",precision);
+    check.append(XML::Element("max_snr_deviation",max_snr_error));
+    xml.write(check);
+  }
+
   void add_gpu_info(std::vector<int>& device_idxs){
     XML::Element gpu_info("cuda_device_parameters");
     int runtime_version,driver_version;
@@ -138,83 +291,71 @@ public:
       device.append(XML::Element("minor_cc",properties.minor));
       gpu_info.append(device);
     }
-    root.append(gpu_info);
+    xml.write(gpu_info);
   }
   
   void add_dm_list(std::vector<float>& dms){
-    XML::Element dm_trials("dedispersion_trials");
-    dm_trials.add_attribute("count",dms.size());
-    for (int ii=0;ii<dms.size();ii++){
-      XML::Element trial("trial");
-      trial.add_attribute("id",ii);
-      trial.set_text(dms[ii]);
-      dm_trials.append(trial);
-    }
-    root.append(dm_trials);
+    xml.open("dedispersion_trials","count",dms.size());
+    for (int ii=0;ii<dms.size();ii++)
+      xml.element("trial","id",ii,dms[ii]);
+    xml.close();
   }
   
   void add_acc_list(std::vector<float>& accs){
-    XML::Element acc_trials("acceleration_trials");
-    acc_trials.add_attribute("count",accs.size());
-    acc_trials.add_attribute("DM",0);
-    for(int ii=0;ii<accs.size();ii++){
-      XML::Element trial("trial");
-      trial.add_attribute("id",ii);
-      trial.set_text(accs[ii]);
-      acc_trials.append(trial);
-    }
-    root.append(acc_trials);
+    xml.open("acceleration_trials","DM",0,"count",accs.size());
+    for(int ii=0;ii<accs.size();ii++)
+      xml.element("trial","id",ii,accs[ii]);
+    xml.close();
   }
 
   void add_candidates(std::vector<Candidate>& candidates, 
 		      std::map<unsigned,long int> byte_map)
   {
-    XML::Element cands("candidates");
+    xml.open("candidates");
     for (int ii=0;ii<candidates.size();ii++){
-      XML::Element cand("candidate");
-      cand.add_attribute("id",ii);
-      cand.append(XML::Element("period",1.0/candidates[ii].freq));
-      cand.append(XML::Element("opt_period",candidates[ii].opt_period));
-      cand.append(XML::Element("dm",candidates[ii].dm));
-      cand.append(XML::Element("acc",candidates[ii].acc));
-      cand.append(XML::Element("nh",candidates[ii].nh));
-      cand.append(XML::Element("snr",candidates[ii].snr));
-      cand.append(XML::Element("folded_snr",candidates[ii].folded_snr));
-      cand.append(XML::Element("is_adjacent",candidates[ii].is_adjacent));
-      cand.append(XML::Element("is_physical",candidates[ii].is_physical));
-      cand.append(XML::Element("ddm_count_ratio",candidates[ii].ddm_count_ratio));
-      cand.append(XML::Element("ddm_snr_ratio",candidates[ii].ddm_snr_ratio));
-      cand.append(XML::Element("nassoc",candidates[ii].count_assoc()));
-      cand.append(XML::Element("byte_offset",byte_map[ii]));
-      cands.append(cand);
+      add_candidate(candidates[ii],ii);
+      xml.element("byte_offset",byte_map[ii]);
+      xml.close();
     }
-    root.append(cands);
+    xml.close();
   }
 
   void add_candidates(std::vector<Candidate>& candidates,
 		      std::map<int,std::string>& filenames){
-    XML::Element cands("candidates");
+    xml.open("candidates");
     for (int ii=0;ii<candidates.size();ii++){
-      XML::Element cand("candidate");
-      cand.add_attribute("id",ii);
-      cand.append(XML::Element("period",1.0/candidates[ii].freq));
-      cand.append(XML::Element("opt_period",candidates[ii].opt_period));
-      cand.append(XML::Element("dm",candidates[ii].dm));
-      cand.append(XML::Element("acc",candidates[ii].acc));
-      cand.append(XML::Element("nh",candidates[ii].nh));
-      cand.append(XML::Element("snr",candidates[ii].snr));
-      cand.append(XML::Element("folded_snr",candidates[ii].folded_snr));
-      cand.append(XML::Element("is_adjacent",candidates[ii].is_adjacent));
-      cand.append(XML::Element("is_physical",candidates[ii].is_physical));
-      cand.append(XML::Element("ddm_count_ratio",candidates[ii].ddm_count_ratio));
-      cand.append(XML::Element("ddm_snr_ratio",candidates[ii].ddm_snr_ratio));
-      cand.append(XML::Element("nassoc",candidates[ii].count_assoc()));
-      cand.append(XML::Element("results_file",filenames[ii]));
-      cands.append(cand);
-    }    
-    root.append(cands);
+      add_candidate(candidates[ii],ii);
+      xml.element("results_file",filenames[ii]);
+      xml.close();
+    }
+    xml.close();
+  }
+
+private:
+  //Opens a candidate element and writes the fields common to all outputs
+  void add_candidate(Candidate& cand, int id){
+    xml.open("candidate","id",id);
+    xml.element("period",1.0/cand.freq);
+    xml.element("opt_period",cand.opt_period);
+    xml.element("dm",cand.dm);
+    xml.element("acc",cand.acc);
+    xml.element("nh",cand.nh);
+    if (cand.segment >= 0)
+      xml.element("segment",cand.segment);
+    xml.element("snr",cand.snr);
+    xml.element("folded_snr",cand.folded_snr);
+    if (cand.refined_snr > 0){
+      xml.element("refined_snr",cand.refined_snr);
+      xml.element("refined_period",cand.refined_period);
+      xml.element("refined_dm",cand.refined_dm);
+      xml.element("refined_acc",cand.refined_acc);
+    }
+    xml.element("is_adjacent",cand.is_adjacent);
+    xml.element("is_physical",cand.is_physical);
+    xml.element("ddm_count_ratio",cand.ddm_count_ratio);
+    xml.element("ddm_snr_ratio",cand.ddm_snr_ratio);
+    xml.element("nassoc",cand.count_assoc());
   }
- 
 };
 
 
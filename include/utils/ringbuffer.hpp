@@ -0,0 +1,356 @@
+#pragma once
+#include <utils/exceptions.hpp>
+#include <string>
+#include <cstring>
+#include <cstddef>
+#include <iostream>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define RINGBUFFER_MAGIC 0x50535242 /* "PSRB" */
+//Seconds between checks that the other end is still running
+#define RINGBUFFER_LIVENESS_INTERVAL 1
+
+/*
+  Layout of the start of the shared segment. The ASCII header block
+  and the data blocks follow, each block starting on a page boundary.
+*/
+struct RingBufferControl {
+  unsigned int magic;
+  size_t header_size;  /*!< Bytes reserved for the ASCII header.*/
+  size_t block_size;   /*!< Bytes per data block.*/
+  size_t nblocks;      /*!< Number of data blocks in the ring.*/
+  size_t header_offset;
+  size_t data_offset;
+  size_t nwritten;     /*!< Blocks marked full by the writer.*/
+  size_t nread;        /*!< Blocks released by the reader.*/
+  size_t last_nbytes;  /*!< Bytes in the final block, valid once eod is set.*/
+  int header_valid;
+  int eod;             /*!< Set by the writer after its final block.*/
+  pid_t writer_pid;
+  pid_t reader_pid;    /*!< 0 until a reader attaches.*/
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+/*!
+  \brief A single writer, single reader ring buffer in POSIX shared memory.
+
+  Modelled on a PSRDADA ring: an ASCII header block describing the
+  data followed by a fixed number of equally sized data blocks. The
+  writer fills blocks in order and blocks when the reader falls a
+  whole ring behind; the reader waits for full blocks and releases
+  them once consumed. Both ends are separate processes sharing a
+  process shared mutex and condition variable in the segment.
+
+  The mutex is robust and every wait wakes each
+  RINGBUFFER_LIVENESS_INTERVAL seconds to check that the other end's
+  process still exists. A reader whose writer has exited reads the
+  blocks already written and then sees the end of the data. A writer
+  whose reader has exited throws rather than waiting for space.
+
+  The writer creates and unlinks the segment. A reader that attached
+  before the unlink keeps its mapping until it detaches.
+*/
+class SharedRingBuffer {
+private:
+  std::string name;
+  bool owner;
+  int fd;
+  size_t total_size;
+  char* base;
+  RingBufferControl* ctl;
+
+  static std::string shm_name(std::string key){
+    return (key.size() && key[0]=='/') ? key : "/"+key;
+  }
+
+  static size_t page_round(size_t nbytes){
+    size_t page = sysconf(_SC_PAGESIZE);
+    return ((nbytes+page-1)/page)*page;
+  }
+
+  char* block(size_t idx){
+    return base + ctl->data_offset + (idx%ctl->nblocks)*ctl->block_size;
+  }
+
+  //Counters are only ever stepped under the mutex, so a peer that died
+  //holding it cannot have left them half updated
+  void lock(void){
+    if (pthread_mutex_lock(&ctl->mutex) == EOWNERDEAD)
+      pthread_mutex_consistent(&ctl->mutex);
+  }
+
+  void unlock(void){pthread_mutex_unlock(&ctl->mutex);}
+
+  void timed_wait(void){
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC,&deadline);
+    deadline.tv_sec += RINGBUFFER_LIVENESS_INTERVAL;
+    if (pthread_cond_timedwait(&ctl->cond,&ctl->mutex,&deadline) == EOWNERDEAD)
+      pthread_mutex_consistent(&ctl->mutex);
+  }
+
+  //Process still running, or not yet known (pid 0). Zombies have exited.
+  static bool alive(pid_t pid){
+    if (pid == 0)
+      return true;
+    if (kill(pid,0) != 0 && errno != EPERM)
+      return false;
+    char path[64];
+    snprintf(path,sizeof(path),"/proc/%d/stat",(int) pid);
+    FILE* stat_file = fopen(path,"r");
+    if (stat_file == NULL)
+      return true;
+    char state = 'R';
+    if (fscanf(stat_file,"%*d (%*[^)]) %c",&state) != 1)
+      state = 'R';
+    fclose(stat_file);
+    return state != 'Z' && state != 'X';
+  }
+
+  //Call with the mutex held. A writer that has exited ends the data.
+  bool writer_gone(void){
+    if (alive(ctl->writer_pid))
+      return false;
+    if (!ctl->eod){
+      std::cerr << "Warning: SharedRingBuffer: writer of " << name
+		<< " exited without ending the data" << std::endl;
+      ctl->last_nbytes = ctl->block_size;
+      ctl->eod = 1;
+    }
+    return true;
+  }
+
+  //Call with the mutex held
+  void check_reader(void){
+    if (!alive(ctl->reader_pid)){
+      unlock();
+      ErrorChecker::throw_error("SharedRingBuffer: reader of "+name+" has exited");
+    }
+  }
+
+public:
+  /*!
+    \brief Create a new ring buffer (writer side).
+
+    \param key Shared memory name, e.g. "peasoup".
+    \param nblocks Number of data blocks.
+    \param block_size Bytes per data block.
+    \param header_size Bytes reserved for the ASCII header.
+  */
+  SharedRingBuffer(std::string key, size_t nblocks, size_t block_size,
+		   size_t header_size=4096)
+    :name(shm_name(key)),owner(true)
+  {
+    if (nblocks < 2 || block_size == 0)
+      ErrorChecker::throw_error("SharedRingBuffer: need at least two non-empty blocks");
+    size_t header_offset = page_round(sizeof(RingBufferControl));
+    size_t data_offset = header_offset + page_round(header_size);
+    block_size = page_round(block_size);
+    total_size = data_offset + nblocks*block_size;
+    shm_unlink(name.c_str());
+    fd = shm_open(name.c_str(), O_RDWR|O_CREAT|O_EXCL, 0666);
+    if (fd < 0 || ftruncate(fd,total_size) != 0)
+      ErrorChecker::throw_error("SharedRingBuffer: could not create "+name);
+    base = (char*) mmap(NULL,total_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    if (base == MAP_FAILED)
+      ErrorChecker::throw_error("SharedRingBuffer: could not map "+name);
+    ctl = (RingBufferControl*) base;
+    std::memset(ctl,0,sizeof(RingBufferControl));
+    ctl->header_size = header_size;
+    ctl->block_size = block_size;
+    ctl->nblocks = nblocks;
+    ctl->header_offset = header_offset;
+    ctl->data_offset = data_offset;
+    ctl->writer_pid = getpid();
+    pthread_mutexattr_t mattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr,PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr,PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&ctl->mutex,&mattr);
+    pthread_mutexattr_destroy(&mattr);
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr,PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr,CLOCK_MONOTONIC);
+    pthread_cond_init(&ctl->cond,&cattr);
+    pthread_condattr_destroy(&cattr);
+    __sync_synchronize();
+    ctl->magic = RINGBUFFER_MAGIC;
+  }
+
+  /*!
+    \brief Attach to an existing ring buffer (reader side).
+
+    Waits up to timeout seconds for the writer to create the segment.
+
+    \param key Shared memory name used by the writer.
+    \param timeout Seconds to wait for the segment to appear.
+  */
+  SharedRingBuffer(std::string key, unsigned int timeout=60)
+    :name(shm_name(key)),owner(false)
+  {
+    struct stat st;
+    for (unsigned int waited=0;;waited++){
+      fd = shm_open(name.c_str(), O_RDWR, 0666);
+      if (fd >= 0 && fstat(fd,&st)==0 && (size_t) st.st_size >= sizeof(RingBufferControl))
+	break;
+      if (fd >= 0)
+	close(fd);
+      if (waited >= timeout*10)
+	ErrorChecker::throw_error("SharedRingBuffer: no ring buffer named "+name);
+      usleep(100000);
+    }
+    total_size = st.st_size;
+    base = (char*) mmap(NULL,total_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    if (base == MAP_FAILED)
+      ErrorChecker::throw_error("SharedRingBuffer: could not map "+name);
+    ctl = (RingBufferControl*) base;
+    while (ctl->magic != RINGBUFFER_MAGIC)
+      usleep(1000);
+    lock();
+    ctl->reader_pid = getpid();
+    unlock();
+  }
+
+  size_t get_block_size(void){return ctl->block_size;}
+
+  size_t get_nblocks(void){return ctl->nblocks;}
+
+  //Blocks written but not yet released by the reader
+  size_t get_nfull(void){
+    lock();
+    size_t nfull = ctl->nwritten - ctl->nread;
+    unlock();
+    return nfull;
+  }
+
+  /*!
+    \brief Publish the ASCII header (writer side).
+  */
+  void write_header(std::string header){
+    if (header.size() >= ctl->header_size)
+      ErrorChecker::throw_error("SharedRingBuffer: header larger than header block");
+    char* dst = base + ctl->header_offset;
+    std::memset(dst,0,ctl->header_size);
+    std::memcpy(dst,header.c_str(),header.size());
+    lock();
+    ctl->header_valid = 1;
+    pthread_cond_broadcast(&ctl->cond);
+    unlock();
+  }
+
+  /*!
+    \brief Wait for and return the ASCII header (reader side).
+  */
+  std::string read_header(void){
+    lock();
+    while (!ctl->header_valid){
+      if (writer_gone()){
+	unlock();
+	ErrorChecker::throw_error("SharedRingBuffer: writer of "+name+" exited before writing a header");
+      }
+      timed_wait();
+    }
+    unlock();
+    const char* src = base + ctl->header_offset;
+    return std::string(src,strnlen(src,ctl->header_size));
+  }
+
+  /*!
+    \brief Wait for a free block and return it for filling (writer side).
+  */
+  char* open_write_block(void){
+    lock();
+    while (ctl->nwritten - ctl->nread >= ctl->nblocks){
+      check_reader();
+      timed_wait();
+    }
+    char* ptr = block(ctl->nwritten);
+    unlock();
+    return ptr;
+  }
+
+  /*!
+    \brief Mark the block from open_write_block() as full.
+
+    \param nbytes Bytes written to the block. A short block ends the data.
+  */
+  void close_write_block(size_t nbytes){
+    lock();
+    ctl->nwritten++;
+    if (nbytes < ctl->block_size){
+      ctl->last_nbytes = nbytes;
+      ctl->eod = 1;
+    }
+    pthread_cond_broadcast(&ctl->cond);
+    unlock();
+  }
+
+  //Signal that no further blocks will be written
+  void mark_eod(void){
+    lock();
+    if (!ctl->eod){
+      ctl->last_nbytes = ctl->block_size;
+      ctl->eod = 1;
+    }
+    pthread_cond_broadcast(&ctl->cond);
+    unlock();
+  }
+
+  /*!
+    \brief Wait for the next full block (reader side).
+
+    \param nbytes Set to the number of valid bytes in the block.
+    \return The block, or NULL once the writer has finished or exited.
+  */
+  char* open_read_block(size_t& nbytes){
+    lock();
+    while (ctl->nread == ctl->nwritten && !ctl->eod && !writer_gone())
+      timed_wait();
+    char* ptr = NULL;
+    nbytes = 0;
+    if (ctl->nread < ctl->nwritten){
+      ptr = block(ctl->nread);
+      bool last = ctl->eod && ctl->nread+1 == ctl->nwritten;
+      nbytes = last ? ctl->last_nbytes : ctl->block_size;
+    }
+    unlock();
+    return ptr;
+  }
+
+  //Release the block from open_read_block() back to the writer
+  void close_read_block(void){
+    lock();
+    ctl->nread++;
+    pthread_cond_broadcast(&ctl->cond);
+    unlock();
+  }
+
+  /*!
+    \brief Wait for the reader to drain the ring (writer side).
+  */
+  void wait_until_empty(void){
+    lock();
+    while (ctl->nread < ctl->nwritten){
+      check_reader();
+      timed_wait();
+    }
+    unlock();
+  }
+
+  ~SharedRingBuffer(){
+    munmap(base,total_size);
+    close(fd);
+    if (owner)
+      shm_unlink(name.c_str());
+  }
+};
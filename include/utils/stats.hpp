@@ -6,13 +6,13 @@
 namespace stats {
 
   template <class T>
-  float rms(T* ptr,unsigned int nsamps,unsigned int first_samp=0)
+  float rms(T* ptr,size_t nsamps,size_t first_samp=0)
   {
     return GPU_rms<T>(ptr,nsamps,first_samp);
   }
 
   template <class T>
-  float mean(T* ptr,unsigned int nsamps,unsigned int first_samp=0)
+  float mean(T* ptr,size_t nsamps,size_t first_samp=0)
   {
     return GPU_mean<T>(ptr,nsamps,first_samp);
   }
@@ -23,8 +23,8 @@ namespace stats {
   }
   
   template <class T>
-  void stats(T* ptr, unsigned int nsamps, float* mean_, float* rms_,
-	     float* std_, unsigned int first_samp=0)
+  void stats(T* ptr, size_t nsamps, float* mean_, float* rms_,
+	     float* std_, size_t first_samp=0)
   {
     *rms_  = rms<T>(ptr,nsamps,first_samp);
     *mean_ = mean<T>(ptr,nsamps,first_samp);
@@ -33,7 +33,7 @@ namespace stats {
   } 
 
   void normalise(float* ptr, float mean, float std, 
-		 unsigned int size, unsigned int max_blocks=MAX_BLOCKS,
+		 size_t size, unsigned int max_blocks=MAX_BLOCKS,
 		 unsigned int max_threads=MAX_THREADS){
     device_normalise(ptr, mean, std, size, max_blocks, max_threads);
     return;
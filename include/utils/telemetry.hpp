@@ -0,0 +1,273 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "pthread.h"
+
+#define TELEMETRY_MAX_WORKERS 64
+
+/*!
+  \brief Publishes machine readable run status while a search runs.
+
+  Workers only bump counters with atomic adds, so the search loops
+  never wait on the publisher. A background thread samples the
+  counters every interval seconds and publishes one JSON line:
+
+    {"time":..., "elapsed":..., "phase":"searching", "dms_done":...,
+     "dms_total":..., "acc_trials":..., "acc_trials_per_sec":[...],
+     "candidates":..., "peak_rss_mb":..., "eta":...}
+
+  to a status file, replaced atomically through a rename so readers
+  never see a partial file, and to every client connected to a Unix
+  domain stream socket (e.g. "nc -U peasoup.sock").
+
+  Disabled, and free, unless start() is called.
+*/
+class Telemetry {
+private:
+  std::string filename;
+  std::string socketname;
+  float interval;
+  bool enabled;
+  bool stopping;
+  int listen_fd;
+  std::vector<int> clients;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+  double start_time;
+
+  //Written by the search threads
+  const char* volatile phase;
+  volatile long dms_total;
+  volatile long dms_done;
+  volatile long candidates;
+  volatile long acc_trials[TELEMETRY_MAX_WORKERS];
+  volatile double pass_start;
+
+  //Only touched by the publisher thread
+  long last_acc_trials[TELEMETRY_MAX_WORKERS];
+  double rates[TELEMETRY_MAX_WORKERS];
+  double last_time;
+
+  Telemetry()
+    :interval(5.0),enabled(false),stopping(false),listen_fd(-1),
+     phase("starting"),dms_total(0),dms_done(0),candidates(0),pass_start(0.0),last_time(0.0){
+    for (int ii=0;ii<TELEMETRY_MAX_WORKERS;ii++){
+      acc_trials[ii] = 0;
+      last_acc_trials[ii] = 0;
+      rates[ii] = 0.0;
+    }
+    pthread_mutex_init(&mutex,NULL);
+    pthread_cond_init(&wake,NULL);
+  }
+
+  static double now(void){
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return tv.tv_sec + 1.0e-6*tv.tv_usec;
+  }
+
+  static void* launch(void* ptr){
+    reinterpret_cast<Telemetry*>(ptr)->run();
+    return NULL;
+  }
+
+  static void stop_at_exit(void){
+    instance().stop();
+  }
+
+  void open_socket(void){
+    struct sockaddr_un addr;
+    if (socketname.size() >= sizeof(addr.sun_path)){
+      fprintf(stderr,"Telemetry: socket path too long: %s\n",socketname.c_str());
+      return;
+    }
+    listen_fd = socket(AF_UNIX,SOCK_STREAM,0);
+    if (listen_fd < 0)
+      return;
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path,sizeof(addr.sun_path),"%s",socketname.c_str());
+    unlink(socketname.c_str());
+    if (bind(listen_fd,(struct sockaddr*) &addr,sizeof(addr)) != 0 ||
+	listen(listen_fd,8) != 0){
+      fprintf(stderr,"Telemetry: could not listen on %s\n",socketname.c_str());
+      close(listen_fd);
+      listen_fd = -1;
+      return;
+    }
+    fcntl(listen_fd,F_SETFL,fcntl(listen_fd,F_GETFL)|O_NONBLOCK);
+  }
+
+  std::string status(void){
+    double t = now();
+    double dt = t - last_time;
+    long done = dms_done;
+    long total = dms_total;
+    long trials_sum = 0;
+    //An early final update would give a noisy rate, keep the last one
+    bool update_rates = dt >= 0.5*interval;
+    std::string rate_list;
+    char buf[256];
+    int nworkers = 0;
+    for (int ii=0;ii<TELEMETRY_MAX_WORKERS;ii++)
+      if (acc_trials[ii] > 0)
+	nworkers = ii+1;
+    for (int ii=0;ii<nworkers;ii++){
+      long count = acc_trials[ii];
+      trials_sum += count;
+      if (update_rates){
+	rates[ii] = (count-last_acc_trials[ii])/dt;
+	last_acc_trials[ii] = count;
+      }
+      snprintf(buf,256,"%s%.1f",ii ? "," : "",rates[ii]);
+      rate_list += buf;
+    }
+    if (update_rates)
+      last_time = t;
+    double eta = -1.0;
+    if (done > 0 && total > done)
+      eta = (t-pass_start)*(total-done)/done;
+    else if (total > 0 && done >= total)
+      eta = 0.0;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    std::string line;
+    snprintf(buf,256,"{\"time\":%.3f,\"elapsed\":%.1f,\"phase\":\"%s\",\"dms_done\":%ld,"
+	     "\"dms_total\":%ld,\"acc_trials\":%ld,\"acc_trials_per_sec\":[",
+	     t,t-start_time,(const char*) phase,done,total,trials_sum);
+    line = buf;
+    line += rate_list;
+    snprintf(buf,256,"],\"candidates\":%ld,\"peak_rss_mb\":%.1f,\"eta\":%.0f}\n",
+	     (long) candidates,usage.ru_maxrss/1024.0,eta);
+    line += buf;
+    return line;
+  }
+
+  void write_file(std::string& line){
+    std::string tmpname = filename+".tmp";
+    FILE* fo = fopen(tmpname.c_str(),"w");
+    if (fo == NULL)
+      return;
+    fwrite(line.c_str(),1,line.size(),fo);
+    fclose(fo);
+    rename(tmpname.c_str(),filename.c_str());
+  }
+
+  void send_clients(std::string& line){
+    int fd;
+    while ((fd = accept(listen_fd,NULL,NULL)) >= 0)
+      clients.push_back(fd);
+    for (size_t ii=0;ii<clients.size();){
+      if (send(clients[ii],line.c_str(),line.size(),MSG_NOSIGNAL|MSG_DONTWAIT) < 0
+	  && errno != EAGAIN){
+	close(clients[ii]);
+	clients.erase(clients.begin()+ii);
+      } else {
+	ii++;
+      }
+    }
+  }
+
+  void publish(void){
+    std::string line = status();
+    if (filename != "")
+      write_file(line);
+    if (listen_fd >= 0)
+      send_clients(line);
+  }
+
+  void run(void){
+    pthread_mutex_lock(&mutex);
+    while (!stopping){
+      struct timespec deadline;
+      double wake_at = now() + interval;
+      deadline.tv_sec = (time_t) wake_at;
+      deadline.tv_nsec = (long)((wake_at-deadline.tv_sec)*1.0e9);
+      pthread_cond_timedwait(&wake,&mutex,&deadline);
+      publish();
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+
+public:
+  static Telemetry& instance(void){
+    static Telemetry telemetry;
+    return telemetry;
+  }
+
+  /*!
+    \brief Start publishing status.
+
+    \param outfile Status file, replaced at every update ("" for none).
+    \param socketpath Unix socket to serve updates on ("" for none).
+    \param seconds Time between updates.
+  */
+  void start(std::string outfile, std::string socketpath, float seconds){
+    if (enabled || (outfile=="" && socketpath==""))
+      return;
+    filename = outfile;
+    socketname = socketpath;
+    interval = seconds > 0 ? seconds : 5.0;
+    start_time = last_time = pass_start = now();
+    if (socketname != "")
+      open_socket();
+    enabled = true;
+    pthread_create(&thread,NULL,launch,(void*) this);
+    atexit(stop_at_exit);
+  }
+
+  //Publish a final update and shut the publisher down
+  void stop(void){
+    if (!enabled)
+      return;
+    phase = "done";
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(thread,NULL);
+    for (size_t ii=0;ii<clients.size();ii++)
+      close(clients[ii]);
+    clients.clear();
+    if (listen_fd >= 0){
+      close(listen_fd);
+      unlink(socketname.c_str());
+    }
+    enabled = false;
+  }
+
+  //Phase names must be string literals
+  void set_phase(const char* name){phase = name;}
+
+  //Start counting a new set of DM trials (a file or a stream window)
+  void start_dm_pass(long ntrials){
+    dms_done = 0;
+    dms_total = ntrials;
+    pass_start = now();
+  }
+
+  /*!
+    \brief Record a searched DM trial.
+
+    \param worker Index of the worker that searched it.
+    \param ntrials Acceleration trials searched.
+    \param ncands Candidates it produced.
+  */
+  void dm_trial_done(int worker, long ntrials, long ncands){
+    if (!enabled)
+      return;
+    __sync_fetch_and_add(&acc_trials[worker%TELEMETRY_MAX_WORKERS],ntrials);
+    __sync_fetch_and_add(&candidates,ncands);
+    __sync_fetch_and_add(&dms_done,1);
+  }
+};
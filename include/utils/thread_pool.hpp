@@ -0,0 +1,156 @@
+#pragma once
+#include <utils/numa.hpp>
+#include <vector>
+#include <pthread.h>
+
+/*!
+  \brief Threads kept alive between search passes.
+
+  run() executes one function call per thread and returns once all of
+  them have finished. The same threads serve every pass (autotune
+  calibration, the search, each window of a streaming search), so
+  their CPU pinning, NUMA memory policy, per-thread trace buffers and
+  CUDA contexts are set up once. Threads are added when a pass needs
+  more than the pool holds.
+
+  Slot placement is applied by the slot's own thread before its next
+  call, as the memory policy can only be set by the thread it governs.
+*/
+class ThreadPool {
+private:
+  struct Slot {
+    ThreadPool* pool;
+    int idx;
+    pthread_t thread;
+    std::vector<int> cpus;     /*!< CPUs to run on, empty for any.*/
+    int node;                  /*!< Node to allocate on, -1 for the default policy.*/
+    bool placement_changed;
+    unsigned long generation;  /*!< Last pass seen.*/
+  };
+
+  pthread_mutex_t mutex;
+  pthread_cond_t start_cond;
+  pthread_cond_t done_cond;
+  std::vector<Slot*> slots;
+  void* (*func)(void*);
+  std::vector<void*> func_args;
+  unsigned long generation;
+  int npending;
+  bool stopping;
+
+  static void* launch(void* ptr){
+    Slot* slot = reinterpret_cast<Slot*>(ptr);
+    slot->pool->serve(*slot);
+    return NULL;
+  }
+
+  void serve(Slot& slot){
+    pthread_mutex_lock(&mutex);
+    while (true){
+      while (!stopping && slot.generation==generation)
+	pthread_cond_wait(&start_cond,&mutex);
+      if (stopping)
+	break;
+      slot.generation = generation;
+      //Passes with fewer calls than threads leave the later slots idle
+      if (slot.idx >= (int) func_args.size())
+	continue;
+      bool place = slot.placement_changed;
+      slot.placement_changed = false;
+      std::vector<int> cpus = slot.cpus;
+      int node = slot.node;
+      void* (*call)(void*) = func;
+      void* arg = func_args[slot.idx];
+      pthread_mutex_unlock(&mutex);
+
+      if (place){
+	NumaTopology& topology = NumaTopology::instance();
+	topology.pin_thread(cpus);
+	topology.prefer_node(node);
+      }
+      call(arg);
+
+      pthread_mutex_lock(&mutex);
+      if (--npending==0)
+	pthread_cond_signal(&done_cond);
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+
+  void grow(size_t nthreads){
+    while (slots.size() < nthreads){
+      Slot* slot = new Slot;
+      slot->pool = this;
+      slot->idx = slots.size();
+      slot->node = -1;
+      slot->placement_changed = false;
+      slot->generation = generation;
+      slots.push_back(slot);
+      pthread_create(&slot->thread,NULL,launch,(void*) slot);
+    }
+  }
+
+public:
+  ThreadPool()
+    :func(NULL),generation(0),npending(0),stopping(false){
+    pthread_mutex_init(&mutex,NULL);
+    pthread_cond_init(&start_cond,NULL);
+    pthread_cond_init(&done_cond,NULL);
+  }
+
+  size_t size(void){return slots.size();}
+
+  /*!
+    \brief Set where a slot's thread runs and allocates.
+
+    \param idx Slot index; the pool grows to include it.
+    \param cpus CPUs the thread may run on, empty for any.
+    \param node NUMA node for the thread's new pages, -1 for the default.
+  */
+  void set_placement(int idx, std::vector<int> cpus, int node){
+    pthread_mutex_lock(&mutex);
+    grow(idx+1);
+    Slot& slot = *slots[idx];
+    if (slot.cpus != cpus || slot.node != node){
+      slot.cpus = cpus;
+      slot.node = node;
+      slot.placement_changed = true;
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+
+  /*!
+    \brief Call function(args[ii]) on slot ii for every ii and wait.
+
+    \param function Function to call.
+    \param args One argument per call.
+  */
+  void run(void* (*function)(void*), std::vector<void*>& args){
+    if (args.size()==0)
+      return;
+    pthread_mutex_lock(&mutex);
+    grow(args.size());
+    func = function;
+    func_args = args;
+    npending = args.size();
+    generation++;
+    pthread_cond_broadcast(&start_cond);
+    while (npending > 0)
+      pthread_cond_wait(&done_cond,&mutex);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  ~ThreadPool(){
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_broadcast(&start_cond);
+    pthread_mutex_unlock(&mutex);
+    for (size_t ii=0;ii<slots.size();ii++){
+      pthread_join(slots[ii]->thread,NULL);
+      delete slots[ii];
+    }
+    pthread_cond_destroy(&start_cond);
+    pthread_cond_destroy(&done_cond);
+    pthread_mutex_destroy(&mutex);
+  }
+};
@@ -0,0 +1,79 @@
+#pragma once
+#include <utils/exceptions.hpp>
+#include <cstring>
+#include <cstddef>
+
+/*!
+  \brief Converts packed filterbank samples to float.
+
+  One specialisation per bit depth so the shifts, masks and loop
+  trip counts are compile time constants. The inner loops then unroll
+  and auto-vectorise. Sub-byte samples follow the sigproc convention
+  of packing from the least significant bit.
+*/
+template <unsigned int NBITS>
+struct Unpacker {
+  static void unpack(const unsigned char* in, float* out, size_t n){
+    const unsigned int per_byte = 8/NBITS;
+    const unsigned int mask = (1<<NBITS)-1;
+    size_t nfull = n/per_byte;
+    for (size_t ii=0;ii<nfull;ii++){
+      unsigned int byte = in[ii];
+      for (unsigned int kk=0;kk<per_byte;kk++)
+	out[ii*per_byte+kk] = (byte>>(kk*NBITS))&mask;
+    }
+    for (size_t ii=nfull*per_byte;ii<n;ii++)
+      out[ii] = (in[nfull]>>((ii-nfull*per_byte)*NBITS))&mask;
+  }
+};
+
+template <>
+struct Unpacker<8> {
+  static void unpack(const unsigned char* in, float* out, size_t n){
+    for (size_t ii=0;ii<n;ii++)
+      out[ii] = in[ii];
+  }
+};
+
+template <>
+struct Unpacker<16> {
+  static void unpack(const unsigned char* in, float* out, size_t n){
+    const unsigned short* in16 = reinterpret_cast<const unsigned short*>(in);
+    for (size_t ii=0;ii<n;ii++)
+      out[ii] = in16[ii];
+  }
+};
+
+//32-bit filterbanks hold floats
+template <>
+struct Unpacker<32> {
+  static void unpack(const unsigned char* in, float* out, size_t n){
+    std::memcpy(out,in,n*sizeof(float));
+  }
+};
+
+/*!
+  \brief Unpack n samples of the given bit depth to float.
+
+  \param nbits Bits per sample (1, 2, 4, 8, 16 or 32).
+  \param in Packed input samples.
+  \param out Output buffer of at least n floats.
+  \param n Number of samples.
+*/
+inline void unpack_samples(unsigned int nbits, const unsigned char* in, float* out, size_t n){
+  switch (nbits){
+  case 1:  Unpacker<1>::unpack(in,out,n);  break;
+  case 2:  Unpacker<2>::unpack(in,out,n);  break;
+  case 4:  Unpacker<4>::unpack(in,out,n);  break;
+  case 8:  Unpacker<8>::unpack(in,out,n);  break;
+  case 16: Unpacker<16>::unpack(in,out,n); break;
+  case 32: Unpacker<32>::unpack(in,out,n); break;
+  default:
+    ErrorChecker::throw_error("unpack_samples: only 1, 2, 4, 8, 16 and 32 bit data are supported");
+  }
+}
+
+//True if unpack_samples supports the bit depth
+inline bool unpacker_supports(unsigned int nbits){
+  return nbits==1 || nbits==2 || nbits==4 || nbits==8 || nbits==16 || nbits==32;
+}
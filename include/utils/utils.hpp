@@ -5,26 +5,46 @@
 #include <utils/exceptions.hpp>
 #include <fstream>
 #include <vector>
+#include <algorithm>
 #include <iostream>
 
 class Utils {
 public:
-  static unsigned int prev_power_of_two(unsigned int val){
-    unsigned int n = 1;
+  static size_t prev_power_of_two(size_t val){
+    size_t n = 1;
     while (n*2<val){
       n*=2;
     }
     return n;
   }
+
+  /*
+    Largest even 2^a.3^b.5^c.7^d not exceeding val. cuFFT handles these
+    lengths with mixed radix kernels at close to power of two cost.
+  */
+  static size_t prev_smooth_size(size_t val){
+    unsigned long long best = 2;
+    for (unsigned long long p7=1;p7<=val;p7*=7)
+      for (unsigned long long p5=p7;p5<=val;p5*=5)
+	for (unsigned long long p3=p5;p3<=val;p3*=3){
+	  unsigned long long n = p3*2;
+	  if (n > val)
+	    continue;
+	  while (n*2 <= val)
+	    n *= 2;
+	  best = std::max(best,n);
+	}
+    return (size_t) best;
+  }
   
   template <class T>
-  static void device_malloc(T** ptr,unsigned int units){
+  static void device_malloc(T** ptr,size_t units){
     cudaMalloc((void**)ptr, sizeof(T)*units);
     ErrorChecker::check_cuda_error("Error from device_malloc");
   }
   
   template <class T>
-  static void host_malloc(T** ptr,unsigned int units){
+  static void host_malloc(T** ptr,size_t units){
     cudaMallocHost((void**)ptr, sizeof(T)*units);
     ErrorChecker::check_cuda_error("Error from host_malloc");
   }
@@ -42,19 +62,19 @@ public:
   }
 
   template <class T>
-  static void h2dcpy(T* d_ptr, T* h_ptr, unsigned int units){
+  static void h2dcpy(T* d_ptr, T* h_ptr, size_t units){
     cudaMemcpy(d_ptr,h_ptr,sizeof(T)*units,cudaMemcpyHostToDevice);
     ErrorChecker::check_cuda_error("Error from h2dcpy");
   }
 
   template <class T>
-  static void d2hcpy(T* h_ptr, T* d_ptr, unsigned int units){
+  static void d2hcpy(T* h_ptr, T* d_ptr, size_t units){
     cudaMemcpy(h_ptr,d_ptr,sizeof(T)*units,cudaMemcpyDeviceToHost);
     ErrorChecker::check_cuda_error("Error from d2hcpy");
   }
 
   template <class T>
-  static void d2dcpy(T* d_ptr_dst, T* d_ptr_src, unsigned int units){
+  static void d2dcpy(T* d_ptr_dst, T* d_ptr_src, size_t units){
     cudaMemcpy(d_ptr_dst,d_ptr_src,sizeof(T)*units,cudaMemcpyDeviceToDevice);
     ErrorChecker::check_cuda_error("Error from d2dcpy");
   }
@@ -143,7 +163,7 @@ private:
   float acc_hi;
   float tol;
   float pulse_width;
-  unsigned int nsamps;
+  size_t nsamps;
   float tsamp;
   float cfreq;
   float cfreq_GHz;
@@ -153,7 +173,7 @@ private:
 
 public:
   AccelerationPlan(float acc_lo, float acc_hi, float tol,
-		   float pulse_width, unsigned int nsamps,
+		   float pulse_width, size_t nsamps,
 		   float tsamp, float cfreq, float bw)
     :acc_lo(acc_lo),acc_hi(acc_hi),tol(tol),
      pulse_width(pulse_width),nsamps(nsamps),
@@ -165,18 +185,38 @@ public:
     pulse_width /= 1.0e3;
   }
   
-  void generate_accel_list(float dm,std::vector<float>& acc_list){
+  //Plan for a different transform, e.g. one segment of the observation
+  AccelerationPlan resized(size_t new_nsamps, float new_tsamp){
+    AccelerationPlan plan(*this);
+    plan.nsamps = new_nsamps;
+    plan.tsamp = new_tsamp;
+    plan.tsamp_us = 1.0e6 * new_tsamp;
+    plan.tobs = new_nsamps*new_tsamp;
+    return plan;
+  }
+
+  //Acceleration step for which smearing stays within tolerance at this DM
+  float get_accel_step(float dm){
+    float tdm = pow(8.3*bw/pow(cfreq,3.0)*dm,2.0);
+    float tpulse = pulse_width * pulse_width;
+    float ttsamp = tsamp * tsamp;
+    float w_us = sqrt(tdm+tpulse+ttsamp);
+    return 2.0 * w_us * 1.0e-6 * 24.0 * 299792458.0/tobs/tobs * sqrt((tol*tol)-1.0);
+  }
+
+  /*
+    coarsening > 1 widens the step to give the coarse grid of a
+    hierarchical search, see AccelerationRefiner.
+  */
+  void generate_accel_list(float dm,std::vector<float>& acc_list,
+			   unsigned int coarsening=1){
     if (acc_hi==acc_lo){
       acc_list.clear();
       acc_list.push_back(0.0);
       return;
     }
 
-    float tdm = pow(8.3*bw/pow(cfreq,3.0)*dm,2.0);
-    float tpulse = pulse_width * pulse_width;
-    float ttsamp = tsamp * tsamp;
-    float w_us = sqrt(tdm+tpulse+ttsamp);
-    float alt_a = 2.0 * w_us * 1.0e-6 * 24.0 * 299792458.0/tobs/tobs * sqrt((tol*tol)-1.0);
+    float alt_a = get_accel_step(dm)*coarsening;
     unsigned int naccels = (unsigned int)((float)(acc_hi-acc_lo))/alt_a;
     acc_list.clear();
     acc_list.reserve(naccels+3);
@@ -192,4 +232,40 @@ public:
   }
 };
 
+/*
+  Picks a time decimation factor for each DM trial. Trials are
+  downsampled by the largest power of two that keeps the sampling
+  time within the effective pulse width (intra-channel smearing,
+  intrinsic width and sampling time added in quadrature), so no
+  sensitivity is lost where smearing already dominates.
+*/
+class DownsamplingPlan {
+private:
+  std::vector<unsigned int> factors;
+
+public:
+  DownsamplingPlan(std::vector<float>& dm_list, float tsamp, float cfreq,
+		   float foff, float pulse_width, unsigned int max_factor,
+		   size_t size, size_t min_size=4096)
+  {
+    float cfreq_GHz = 1.0e-3 * cfreq;
+    float tsamp_us = 1.0e6 * tsamp;
+    float chan_bw = fabs(foff);
+    factors.resize(dm_list.size());
+    for (int ii=0;ii<dm_list.size();ii++){
+      float tdm_us = 8.3 * chan_bw * dm_list[ii] / pow(cfreq_GHz,3.0);
+      float w_us = sqrt(tdm_us*tdm_us + pulse_width*pulse_width + tsamp_us*tsamp_us);
+      unsigned int factor = 1;
+      while (factor*2 <= max_factor && factor*2*tsamp_us <= w_us
+	     && size%(factor*4)==0 && size/(factor*2) >= min_size)
+	factor *= 2;
+      factors[ii] = factor;
+    }
+  }
+
+  unsigned int get_factor(unsigned int dm_idx){return factors[dm_idx];}
+
+  std::vector<unsigned int>& get_factors(void){return factors;}
+};
+
 
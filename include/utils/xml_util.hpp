@@ -5,6 +5,8 @@
 #include <iomanip>
 #include <map>
 #include <vector>
+#include <stdexcept>
+#include <stdio.h>
 
 namespace XML {
 
@@ -58,13 +60,8 @@ namespace XML {
       attributes[key] = converter.str();
     }
     
-    std::string to_string(bool header=false, int level=0){
-      std::stringstream xml;
-
-      xml << std::setprecision(15);
-      if (header)
-	xml << "<?xml version='1.0' encoding='ISO-8859-1'?>\n";
-      
+    //Serialise into one stream rather than concatenating per child strings
+    void write(std::ostream& xml, int level=0){
       for (int ii=0;ii<level;ii++)
 	xml << "  ";
 
@@ -81,12 +78,148 @@ namespace XML {
       } else {
 	xml << "\n";
 	for (int ii=0;ii<children.size();ii++)
-	  xml << children[ii].to_string(false,level+1);
+	  children[ii].write(xml,level+1);
 	for (int ii=0;ii<level;ii++)
 	  xml << "  ";
       }
       xml << "</" << name << ">\n";
+    }
+
+    std::string to_string(bool header=false, int level=0){
+      std::stringstream xml;
+      if (header)
+	xml << "<?xml version='1.0' encoding='ISO-8859-1'?>\n";
+      write(xml,level);
       return xml.str();
     }
   };
+
+  /*!
+    \brief Writes an XML document to a file as it is produced.
+
+    Produces the same layout as Element::to_string without holding a
+    tree in memory. Elements are opened and closed explicitly and leaf
+    values are formatted straight into a large stdio buffer, so large
+    lists (candidates, DM trials) cost one formatted write per value.
+    Small fixed sections can still be built as an Element and written
+    whole.
+  */
+  class Writer {
+  private:
+    std::string filename;
+    FILE* fo;
+    std::vector<char> buffer;
+    std::vector<std::string> open_elements;
+    char scratch[64];
+
+    void indent(void){
+      for (size_t ii=0;ii<open_elements.size();ii++)
+	fputs("  ",fo);
+    }
+
+    const char* format(const std::string& value){return value.c_str();}
+    const char* format(const char* value){return value;}
+    const char* format(bool value){return value ? "1" : "0";}
+    const char* format(int value){snprintf(scratch,64,"%d",value); return scratch;}
+    const char* format(unsigned int value){snprintf(scratch,64,"%u",value); return scratch;}
+    const char* format(long value){snprintf(scratch,64,"%ld",value); return scratch;}
+    const char* format(unsigned long value){snprintf(scratch,64,"%lu",value); return scratch;}
+    const char* format(long long value){snprintf(scratch,64,"%lld",value); return scratch;}
+    const char* format(unsigned long long value){snprintf(scratch,64,"%llu",value); return scratch;}
+    //Matches the setprecision(15) stream formatting used by Element
+    const char* format(double value){snprintf(scratch,64,"%.15g",value); return scratch;}
+    const char* format(float value){return format((double) value);}
+
+  public:
+    /*!
+      \brief Open a file and write the XML declaration.
+
+      \param filename Output file name.
+      \param buffer_size Bytes of stdio buffering.
+    */
+    Writer(std::string filename, size_t buffer_size=1<<20)
+      :filename(filename),buffer(buffer_size)
+    {
+      fo = fopen(filename.c_str(),"w");
+      if (fo == NULL)
+	throw std::runtime_error("Could not open XML file "+filename);
+      setvbuf(fo,&buffer[0],_IOFBF,buffer.size());
+      fputs("<?xml version='1.0' encoding='ISO-8859-1'?>\n",fo);
+    }
+
+    //Open an element that will contain child elements
+    void open(std::string name){
+      indent();
+      fprintf(fo,"<%s>\n",name.c_str());
+      open_elements.push_back(name);
+    }
+
+    template <class X>
+    void open(std::string name, std::string key, X value){
+      indent();
+      fprintf(fo,"<%s %s='%s'>\n",name.c_str(),key.c_str(),format(value));
+      open_elements.push_back(name);
+    }
+
+    //Attributes are written in the (sorted) order an Element would use
+    template <class X, class Y>
+    void open(std::string name, std::string key1, X value1, std::string key2, Y value2){
+      indent();
+      fprintf(fo,"<%s %s='%s'",name.c_str(),key1.c_str(),format(value1));
+      fprintf(fo," %s='%s'>\n",key2.c_str(),format(value2));
+      open_elements.push_back(name);
+    }
+
+    //Close the innermost open element
+    void close(void){
+      std::string name = open_elements.back();
+      open_elements.pop_back();
+      indent();
+      fprintf(fo,"</%s>\n",name.c_str());
+    }
+
+    //A leaf element holding a single value
+    template <class X>
+    void element(const char* name, X value){
+      indent();
+      fprintf(fo,"<%s>%s</%s>\n",name,format(value),name);
+    }
+
+    //A leaf element with one attribute
+    template <class X, class Y>
+    void element(const char* name, const char* key, X attribute, Y value){
+      indent();
+      fprintf(fo,"<%s %s='%s'>",name,key,format(attribute));
+      fprintf(fo,"%s</%s>\n",format(value),name);
+    }
+
+    //A prebuilt element and its children
+    void write(Element& element){
+      std::stringstream xml;
+      xml << std::setprecision(15);
+      element.write(xml,open_elements.size());
+      fputs(xml.str().c_str(),fo);
+    }
+
+    //Close any open elements and flush to disk
+    void finish(void){
+      if (fo == NULL)
+	return;
+      while (!open_elements.empty())
+	close();
+      bool failed = ferror(fo) != 0;
+      failed |= fclose(fo) != 0;
+      fo = NULL;
+      if (failed)
+	throw std::runtime_error("Error writing XML file "+filename);
+    }
+
+    ~Writer(){
+      if (fo != NULL){
+	while (!open_elements.empty())
+	  close();
+	fclose(fo);
+      }
+    }
+  };
 }
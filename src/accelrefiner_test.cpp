@@ -0,0 +1,105 @@
+#include <data_types/timeseries.hpp>
+#include <data_types/fourierseries.hpp>
+#include <data_types/candidates.hpp>
+#include <transforms/accelrefiner.hpp>
+#include <transforms/resampler.hpp>
+#include <transforms/ffter.hpp>
+#include <transforms/spectrumformer.hpp>
+#include <utils/exceptions.hpp>
+#include <utils/utils.hpp>
+#include <utils/stats.hpp>
+#include <utils/stopwatch.hpp>
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+#include <stdio.h>
+#include "cuda.h"
+#include "cufft.h"
+
+static double gaussian(void){
+  double u = (rand()+1.0)/(RAND_MAX+2.0);
+  double v = (rand()+1.0)/(RAND_MAX+2.0);
+  return sqrt(-2.0*log(u))*cos(2.0*M_PI*v);
+}
+
+/*
+  Sinusoid in white noise, accelerated so that resampleII at acc
+  turns it back into a pure tone: input sample j holds the tone at
+  output sample i, where j = i + i*accel_fact*(i-size).
+*/
+static void make_series(std::vector<float>& data, float tsamp, double freq, float acc, float amp){
+  size_t size = data.size();
+  double accel_fact = acc*tsamp/(2.0*ACCEL_REFINE_SPEED_OF_LIGHT);
+  double b = 1.0-accel_fact*size;
+  srand(42);
+  for (size_t jj=0;jj<size;jj++){
+    double ii = (fabs(accel_fact) < 1e-20) ? jj : (-b+sqrt(b*b+4.0*accel_fact*jj))/(2.0*accel_fact);
+    data[jj] = amp*sin(2.0*M_PI*freq*ii*tsamp) + gaussian();
+  }
+}
+
+int main(void)
+{
+  size_t size = 1<<20;
+  float tsamp = 0.000064;
+  double tobs = size*tsamp;
+  double r_true = 200000.37;
+  double freq = r_true/tobs;
+  float acc = 200.0;
+  //One fine step drifts the fundamental by one bin
+  float step = ACCEL_REFINE_SPEED_OF_LIGHT/(r_true*tobs);
+  int nsteps = 4;
+
+  std::vector<float> data(size);
+  make_series(data,tsamp,freq,acc,0.02);
+  DeviceTimeSeries<float> d_tim(size);
+  d_tim.set_tsamp(tsamp);
+  Utils::h2dcpy<float>(d_tim.get_data(),&data[0],size);
+  DeviceTimeSeries<float> d_tim_r(size);
+  d_tim_r.set_tsamp(tsamp);
+  DeviceFourierSeries<cufftComplex> fseries(size/2+1,1.0/tobs);
+  DevicePowerSpectrum<float> pspec(fseries);
+  CuFFTerR2C r2cfft(size);
+  SpectrumFormer former;
+  TimeDomainResampler resampler;
+
+  //Noise statistics as the search and the refiner each use them
+  r2cfft.execute(d_tim.get_data(),fseries.get_data());
+  float mean,std,rms,bin_mean,bin_std;
+  former.form(fseries,pspec);
+  stats::stats<float>(pspec.get_data(),size/2+1,&bin_mean,&rms,&bin_std);
+  former.form_interpolated(fseries,pspec);
+  stats::stats<float>(pspec.get_data(),size/2+1,&mean,&rms,&std);
+
+  //Coarse detection a few fine steps off, at the nearest bin
+  Candidate cand(10.0,0,acc+3.4*step,0,0.0,floor(r_true+0.5)/tobs);
+  Stopwatch timer;
+  timer.start();
+  unsigned int ntrials = AccelerationRefiner(tobs).refine(fseries,cand,bin_mean,bin_std,step,nsteps);
+  timer.stop();
+
+  //S/N of the resampleII+FFT search at the true acceleration
+  resampler.resampleII(d_tim,d_tim_r,size,acc);
+  r2cfft.execute(d_tim_r.get_data(),fseries.get_data());
+  former.form_interpolated(fseries,pspec);
+  std::vector<float> spectrum(size/2+1);
+  Utils::d2hcpy<float>(&spectrum[0],pspec.get_data(),size/2+1);
+  float resampled_snr = 0.0;
+  for (size_t ii=(size_t) r_true-2;ii<=(size_t) r_true+2;ii++)
+    resampled_snr = std::max(resampled_snr,(spectrum[ii]-mean)/std);
+
+  printf("Refine time: %.4f s for %u trials\n",timer.getTime(),ntrials);
+  printf("acc: %f (true %f, step %f)  freq: %.6f (true %.6f, step %.6f)\n",
+	 cand.acc,acc,step,cand.freq,freq,0.25/tobs);
+  printf("Refined S/N: %f  resampled S/N: %f\n",cand.snr,resampled_snr);
+
+  //Within one fine step of each, and no worse than the full search
+  if (fabs(cand.acc-acc) > step ||
+      fabs(cand.freq-freq) > 0.25/tobs ||
+      cand.snr < 0.9*resampled_snr){
+    printf("FAILED\n");
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
@@ -0,0 +1,99 @@
+#include <utils/candidate_archive.hpp>
+#include <utils/async_writer.hpp>
+#include <algorithm>
+#include <vector>
+#include <cmath>
+#include <stdio.h>
+
+//Check every field of an archive against the candidates written to it
+static int check_archive(const char* filename, std::vector<Candidate>& cands)
+{
+  int failures = 0;
+  CandidateArchive archive(filename);
+  if (archive.size() != cands.size()){
+    printf("Archive holds %zu candidates, expected %zu\n",archive.size(),cands.size());
+    return 1;
+  }
+  const double* period = archive.column<double>("period");
+  const float* folded_snr = archive.column<float>("folded_snr");
+  const int32_t* segment = archive.column<int32_t>("segment");
+  const uint8_t* is_physical = archive.column<uint8_t>("is_physical");
+  const int32_t* nassoc = archive.column<int32_t>("nassoc");
+  for (size_t ii=0;ii<cands.size();ii++){
+    Candidate& cand = cands[ii];
+    if (period[ii] != 1.0/cand.freq || folded_snr[ii] != cand.folded_snr ||
+	segment[ii] != cand.segment || is_physical[ii] != cand.is_physical ||
+	nassoc[ii] != cand.count_assoc()){
+      printf("Summary mismatch for candidate %zu\n",ii);
+      failures++;
+    }
+    int nbins, nints, nhits;
+    const float* fold = archive.get_fold(ii,nbins,nints);
+    if (nbins != cand.nbins || nints != cand.nints ||
+	(fold != NULL && ((size_t) fold)%ARCHIVE_ALIGN) ||
+	(fold == NULL) != (cand.fold.size() == 0)){
+      printf("Fold mismatch for candidate %zu\n",ii);
+      failures++;
+    }
+    for (size_t kk=0;fold!=NULL && kk<cand.fold.size();kk++)
+      if (fold[kk] != cand.fold[kk]){
+	printf("Fold value mismatch for candidate %zu\n",ii);
+	failures++;
+	break;
+      }
+    const CandidatePOD* hits = archive.get_hits(ii,nhits);
+    if (nhits != cand.count_assoc()+1 || hits[0].snr != cand.snr || hits[0].freq != cand.freq){
+      printf("Hits mismatch for candidate %zu\n",ii);
+      failures++;
+    }
+  }
+  return failures;
+}
+
+//Round trip candidates through an archive, directly and through the writer thread
+int main(void)
+{
+  std::vector<Candidate> cands;
+  for (int ii=0;ii<5;ii++){
+    Candidate cand(10.0*ii,ii,0.5*ii,ii%4,20.0-ii,1.0/(0.01*(ii+1)));
+    cand.folded_snr = 15.0-ii;
+    cand.opt_period = 0.01*(ii+1)+1e-9;
+    cand.is_physical = ii%2;
+    cand.segment = ii-1;
+    for (int jj=0;jj<ii;jj++){
+      Candidate assoc(10.0*ii+jj,ii,0.0,1,8.0,50.0+jj);
+      cand.append(assoc);
+    }
+    if (ii%2==0){
+      std::vector<float> fold(64*16);
+      for (size_t kk=0;kk<fold.size();kk++)
+	fold[kk] = kk*ii;
+      cand.set_fold(&fold[0],64,16);
+    }
+    cands.push_back(cand);
+  }
+
+  const char* filename = "archive_test.archive";
+  CandidateArchiveWriter writer(filename);
+  writer.add(cands);
+  writer.close();
+  int failures = check_archive(filename,cands);
+
+  //Folded payloads arrive out of order and the list is sorted afterwards
+  {
+    AsyncArchiveWriter async_writer(filename,2);
+    for (int ii=cands.size()-1;ii>=0;ii--)
+      if (cands[ii].fold.size() > 0)
+	async_writer.submit(cands[ii]);
+    std::reverse(cands.begin(),cands.end());
+    async_writer.finish(cands);
+  }
+  failures += check_archive(filename,cands);
+
+  remove(filename);
+  if (failures)
+    printf("%d failures\n",failures);
+  else
+    printf("All candidates round tripped\n");
+  return failures ? 1 : 0;
+}
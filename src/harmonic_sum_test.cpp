@@ -30,7 +30,7 @@ int main()
   Utils::h2dcpy<float>(pspec.get_data(),test_pattern,NBINS);
   
   HarmonicSums<float> sums(pspec, NFOLDS);
-  HarmonicFolder folder(sums);
+  HarmonicFolder<float> folder(sums);
 
   for (int jj=0;jj<100;jj++)
     folder.fold(pspec);
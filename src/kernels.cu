@@ -8,6 +8,7 @@
 #include <thrust/sort.h>
 #include <thrust/iterator/zip_iterator.h>
 #include <thrust/iterator/counting_iterator.h>
+#include <thrust/iterator/transform_iterator.h>
 #include <thrust/device_vector.h>
 #include <thrust/extrema.h>
 #include <thrust/device_ptr.h>
@@ -29,70 +30,75 @@
 
 //--------------Harmonic summing----------------//
 
+//Sums are accumulated in fp32 whatever the storage type
+inline __device__ void store_sum(float* dst, float val){*dst = val;}
+inline __device__ void store_sum(half* dst, float val){*dst = __float2half(val);}
+
 /* Unwrapped for 3x speed increase */
+template <typename T>
 __global__
-void harmonic_sum_kernel(float *d_idata, float **d_odata,
+void harmonic_sum_kernel(float *d_idata, T **d_odata,
 			 size_t size, unsigned nharms)
   
 {
-  for( int idx = blockIdx.x*blockDim.x + threadIdx.x ; idx < size ; idx += blockDim.x*gridDim.x )
+  for( size_t idx = blockIdx.x*blockDim.x + threadIdx.x ; idx < size ; idx += blockDim.x*gridDim.x )
     {
       float val = d_idata[idx];
       
       if (nharms>0)
 	{
-      	  val += d_idata[(int) (idx*0.5 + 0.5)];
-	  d_odata[0][idx] = val*rsqrt(2.0);
+      	  val += d_idata[(size_t) (idx*0.5 + 0.5)];
+	  store_sum(&d_odata[0][idx], val*rsqrt(2.0));
 	}
       
       if (nharms>1)
 	{
-	  val += d_idata[(int) (idx * 0.75 + 0.5)];
-	  val += d_idata[(int) (idx * 0.25 + 0.5)];
-	  d_odata[1][idx] = val*0.5;
+	  val += d_idata[(size_t) (idx * 0.75 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.25 + 0.5)];
+	  store_sum(&d_odata[1][idx], val*0.5);
 	}
 
       if (nharms>2)
 	{
-	  val += d_idata[(int) (idx * 0.125 + 0.5)];
-	  val += d_idata[(int) (idx * 0.375 + 0.5)];
-	  val += d_idata[(int) (idx * 0.625 + 0.5)];
-	  val += d_idata[(int) (idx * 0.875 + 0.5)];
-	  d_odata[2][idx] = val*rsqrt(8.0);
+	  val += d_idata[(size_t) (idx * 0.125 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.375 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.625 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.875 + 0.5)];
+	  store_sum(&d_odata[2][idx], val*rsqrt(8.0));
 	}
 
       if (nharms>3)
 	{
-	  val += d_idata[(int) (idx * 0.0625 + 0.5)];
-	  val += d_idata[(int) (idx * 0.1875 + 0.5)];
-	  val += d_idata[(int) (idx * 0.3125 + 0.5)];
-	  val += d_idata[(int) (idx * 0.4375 + 0.5)];
-	  val += d_idata[(int) (idx * 0.5625 + 0.5)];
-	  val += d_idata[(int) (idx * 0.6875 + 0.5)];
-	  val += d_idata[(int) (idx * 0.8125 + 0.5)];
-	  val += d_idata[(int) (idx * 0.9375 + 0.5)];
-	  d_odata[3][idx] = val*0.25;
+	  val += d_idata[(size_t) (idx * 0.0625 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.1875 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.3125 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.4375 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.5625 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.6875 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.8125 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.9375 + 0.5)];
+	  store_sum(&d_odata[3][idx], val*0.25);
 	}
       
       if (nharms>4)
 	{
-	  val += d_idata[(int) (idx * 0.03125 + 0.5)];
-	  val += d_idata[(int) (idx * 0.09375 + 0.5)];
-	  val += d_idata[(int) (idx * 0.15625 + 0.5)];
-	  val += d_idata[(int) (idx * 0.21875 + 0.5)];
-	  val += d_idata[(int) (idx * 0.28125 + 0.5)];
-	  val += d_idata[(int) (idx * 0.34375 + 0.5)];
-	  val += d_idata[(int) (idx * 0.40625 + 0.5)];
-	  val += d_idata[(int) (idx * 0.46875 + 0.5)];
-	  val += d_idata[(int) (idx * 0.53125 + 0.5)];
-	  val += d_idata[(int) (idx * 0.59375 + 0.5)];
-	  val += d_idata[(int) (idx * 0.65625 + 0.5)];
-	  val += d_idata[(int) (idx * 0.71875 + 0.5)];
-	  val += d_idata[(int) (idx * 0.78125 + 0.5)];
-	  val += d_idata[(int) (idx * 0.84375 + 0.5)];
-	  val += d_idata[(int) (idx * 0.90625 + 0.5)];
-	  val += d_idata[(int) (idx * 0.96875 + 0.5)];
-	  d_odata[4][idx] = val*rsqrt(32.0);
+	  val += d_idata[(size_t) (idx * 0.03125 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.09375 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.15625 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.21875 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.28125 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.34375 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.40625 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.46875 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.53125 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.59375 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.65625 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.71875 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.78125 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.84375 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.90625 + 0.5)];
+	  val += d_idata[(size_t) (idx * 0.96875 + 0.5)];
+	  store_sum(&d_odata[4][idx], val*rsqrt(32.0));
 	}
     }
   return;
@@ -196,17 +202,32 @@ void harmonic_sum_kernel_wshared(float *d_idata, float **d_odata,
   return;
   }*/
 
-void device_harmonic_sum(float* d_input_array, float** d_output_array,
-			 size_t size, unsigned nharms, 
-			 unsigned int max_blocks, unsigned int max_threads)
+template <typename T>
+void harmonic_sum(float* d_input_array, T** d_output_array,
+		  size_t size, unsigned nharms, 
+		  unsigned int max_blocks, unsigned int max_threads)
 {
   unsigned blocks = size/max_threads + 1;
   if (blocks > max_blocks)
     blocks = max_blocks;
-  harmonic_sum_kernel<<<blocks,max_threads>>>(d_input_array,d_output_array,size,nharms);
+  harmonic_sum_kernel<T><<<blocks,max_threads>>>(d_input_array,d_output_array,size,nharms);
   ErrorChecker::check_cuda_error("Error from device_harmonic_sum");
 }
 
+void device_harmonic_sum(float* d_input_array, float** d_output_array,
+			 size_t size, unsigned nharms, 
+			 unsigned int max_blocks, unsigned int max_threads)
+{
+  harmonic_sum<float>(d_input_array,d_output_array,size,nharms,max_blocks,max_threads);
+}
+
+void device_harmonic_sum(float* d_input_array, half** d_output_array,
+			 size_t size, unsigned nharms, 
+			 unsigned int max_blocks, unsigned int max_threads)
+{
+  harmonic_sum<half>(d_input_array,d_output_array,size,nharms,max_blocks,max_threads);
+}
+
 //------------spectrum forming--------------//
 
 
@@ -216,7 +237,7 @@ __global__
 void power_series_kernel(cufftComplex *d_idata, float* d_odata, 
 			 size_t size, size_t gulp_index)
 {
-  int idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_index;
+  size_t idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_index;
   cufftComplex& x = d_idata[idx];
   if(idx<size)
     {
@@ -232,7 +253,7 @@ __global__ void bin_interbin_series_kernel(cufftComplex *d_idata,float* d_odata,
 					   size_t size, size_t gulp_index)
 {
   float* d_idata_float = (float*)d_idata;
-  int idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_index;
+  size_t idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_index;
   float re_l =0.0;
   float im_l =0.0;
   if (idx>0 && idx<size) {
@@ -361,6 +382,32 @@ void device_resampleII(float * d_idata, float * d_odata,
   ErrorChecker::check_cuda_error("Error from device_resampleII");
 }
 
+//Averages each group of factor input samples into one output sample
+__global__ void decimate_kernel(float* input_d,
+				float* output_d,
+				unsigned int factor,
+				size_t out_size)
+{
+  for( size_t idx = blockIdx.x*blockDim.x + threadIdx.x ; idx < out_size ; idx += blockDim.x*gridDim.x )
+  {
+    float sum = 0.0;
+    for (unsigned int ii=0;ii<factor;ii++)
+      sum += input_d[idx*factor+ii];
+    output_d[idx] = sum/factor;
+  }
+}
+
+void device_decimate(float * d_idata, float * d_odata,
+		     size_t out_size, unsigned int factor,
+		     unsigned int max_threads, unsigned int max_blocks)
+{
+  unsigned blocks = out_size/max_threads + 1;
+  if (blocks > max_blocks)
+    blocks = max_blocks;
+  decimate_kernel<<< blocks,max_threads >>>(d_idata, d_odata, factor, out_size);
+  ErrorChecker::check_cuda_error("Error from device_decimate");
+}
+
 void device_resample(float * d_idata, float * d_odata,
 		     size_t size, float a, 
 		     float tsamp, unsigned int max_threads,
@@ -381,29 +428,33 @@ void device_resample(float * d_idata, float * d_odata,
 //------------------peak finding-----------------//
 //defined here as (although Thrust based) requires CUDA functors
 
-struct greater_than_threshold : thrust::unary_function<thrust::tuple<int,float>,bool>
+struct greater_than_threshold : thrust::unary_function<thrust::tuple<size_t,float>,bool>
 {
   float threshold;
-  __device__ bool operator()(thrust::tuple<int,float> t) { return thrust::get<1>(t) > threshold; }
+  __device__ bool operator()(thrust::tuple<size_t,float> t) { return thrust::get<1>(t) > threshold; }
   greater_than_threshold(float thresh):threshold(thresh){}
 };
 
-int device_find_peaks(int n, int start_index, float * d_dat,
-		      float thresh, int * indexes, float * snrs,
-		      thrust::device_vector<int>& d_index, 
-		      thrust::device_vector<float>& d_snrs,
-		      cached_allocator& policy)
+struct half_to_float : thrust::unary_function<half,float>
+{
+  __device__ float operator()(const half& x) const { return __half2float(x); }
+};
+
+template <typename SnrIterator>
+int find_peaks(size_t n, size_t start_index, SnrIterator dptr_dat,
+	       float thresh, size_t * indexes, float * snrs,
+	       thrust::device_vector<size_t>& d_index, 
+	       thrust::device_vector<float>& d_snrs,
+	       cached_allocator& policy)
 {
   
   using thrust::tuple;
   using thrust::counting_iterator;
   using thrust::zip_iterator;
-  // Wrap the device pointer to let Thrust know                              
-  thrust::device_ptr<float> dptr_dat(d_dat + start_index);
   typedef thrust::device_vector<float>::iterator snr_iterator;
-  typedef thrust::device_vector<int>::iterator indices_iterator;
-  thrust::counting_iterator<int> iter(start_index);
-  zip_iterator<tuple<counting_iterator<int>,thrust::device_ptr<float> > > zipped_iter = make_zip_iterator(make_tuple(iter,dptr_dat));
+  typedef thrust::device_vector<size_t>::iterator indices_iterator;
+  thrust::counting_iterator<size_t> iter(start_index);
+  zip_iterator<tuple<counting_iterator<size_t>,SnrIterator> > zipped_iter = make_zip_iterator(make_tuple(iter,dptr_dat));
   zip_iterator<tuple<indices_iterator,snr_iterator> > zipped_out_iter = make_zip_iterator(make_tuple(d_index.begin(),d_snrs.begin()));
   
   //apply execution policy to get some speed up
@@ -415,6 +466,28 @@ int device_find_peaks(int n, int start_index, float * d_dat,
   return(num_copied);
 }
 
+int device_find_peaks(size_t n, size_t start_index, float * d_dat,
+		      float thresh, size_t * indexes, float * snrs,
+		      thrust::device_vector<size_t>& d_index, 
+		      thrust::device_vector<float>& d_snrs,
+		      cached_allocator& policy)
+{
+  // Wrap the device pointer to let Thrust know                              
+  thrust::device_ptr<float> dptr_dat(d_dat + start_index);
+  return find_peaks(n,start_index,dptr_dat,thresh,indexes,snrs,d_index,d_snrs,policy);
+}
+
+int device_find_peaks(size_t n, size_t start_index, half * d_dat,
+		      float thresh, size_t * indexes, float * snrs,
+		      thrust::device_vector<size_t>& d_index, 
+		      thrust::device_vector<float>& d_snrs,
+		      cached_allocator& policy)
+{
+  thrust::device_ptr<half> dptr_dat(d_dat + start_index);
+  return find_peaks(n,start_index,thrust::make_transform_iterator(dptr_dat,half_to_float()),
+		    thresh,indexes,snrs,d_index,d_snrs,policy);
+}
+
 //------------------rednoise----------------//
 
 template<typename T>
@@ -424,7 +497,7 @@ struct square {
 };
 
 template<typename T>
-float GPU_rms(T* d_collection,int nsamps, int min_bin)
+float GPU_rms(T* d_collection,size_t nsamps, size_t min_bin)
 {
   T rms_sum;
   float rms;
@@ -438,7 +511,7 @@ float GPU_rms(T* d_collection,int nsamps, int min_bin)
 }
 
 template<typename T>
-float GPU_mean(T* d_collection,int nsamps, int min_bin)
+float GPU_mean(T* d_collection,size_t nsamps, size_t min_bin)
 {
   float mean;
   T m_sum;
@@ -463,14 +536,32 @@ void GPU_fill(T* start, T* end, T value){
 }
 
 template void GPU_fill<float>(float*, float*, float);
-template float GPU_rms<float>(float*,int,int);
-template float GPU_mean<float>(float*,int,int);
+template float GPU_rms<float>(float*,size_t,size_t);
+template float GPU_mean<float>(float*,size_t,size_t);
+
+struct abs_difference : thrust::unary_function<thrust::tuple<float,half>,float>
+{
+  __device__ float operator()(thrust::tuple<float,half> t) const {
+    return fabsf(thrust::get<0>(t)-__half2float(thrust::get<1>(t)));
+  }
+};
+
+float device_max_abs_difference(float* d_ref, half* d_test, size_t size)
+{
+  using thrust::device_ptr;
+  float retval = thrust::transform_reduce(
+    thrust::make_zip_iterator(thrust::make_tuple(device_ptr<float>(d_ref),device_ptr<half>(d_test))),
+    thrust::make_zip_iterator(thrust::make_tuple(device_ptr<float>(d_ref)+size,device_ptr<half>(d_test)+size)),
+    abs_difference(),0.0f,thrust::maximum<float>());
+  ErrorChecker::check_cuda_error("Error from device_max_abs_difference");
+  return retval;
+}
 
 __global__
 void normalisation_kernel(float*d_powers, float mean, float sigma, 
 			  size_t size, size_t gulp_idx)
 {
-  int idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_idx;
+  size_t idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_idx;
   if (idx>=size)
     return;
   float val = d_powers[idx];
@@ -482,7 +573,7 @@ void normalisation_kernel(float*d_powers, float mean, float sigma,
 void device_normalise(float* d_powers,
 		      float mean,
 		      float sigma,
-		      unsigned int size,
+		      size_t size,
 		      unsigned int max_blocks,
 		      unsigned int max_threads)
 {
@@ -494,6 +585,29 @@ void device_normalise(float* d_powers,
 }
 
 
+__global__
+void accumulate_kernel(float* d_input, float* d_output,
+		       size_t size, size_t gulp_idx)
+{
+  size_t idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_idx;
+  if (idx>=size)
+    return;
+  d_output[idx] += d_input[idx];
+}
+
+void device_accumulate(float* d_input,
+		       float* d_output,
+		       size_t size,
+		       unsigned int max_blocks,
+		       unsigned int max_threads)
+{
+  BlockCalculator calc(size, max_blocks, max_threads);
+  for (int ii=0;ii<calc.size();ii++)
+    accumulate_kernel<<<calc[ii].blocks,max_threads>>>(d_input,d_output,size,
+						       calc[ii].data_idx);
+  ErrorChecker::check_cuda_error("Error from device_accumulate");
+}
+
 //old normalisation routine used after a different
 //rednoise algorithm was applied
 void device_normalise_spectrum(int nsamp,
@@ -645,7 +759,7 @@ void device_fold_timeseries(float* input, float* output,
     return;
   }
 
-  fold_time_series_kernel<<<nsubints,nbins,2*nbins*nsubints*sizeof(float)>>>
+  fold_time_series_kernel<<<nsubints,nbins,2*nbins*sizeof(float)>>>
     (input,output,nsubints,nbins,nsamps_per_subint,tsamp_by_period);
   ErrorChecker::check_cuda_error("Error from device_fold_timeseries.");
 }
@@ -663,16 +777,16 @@ __device__ inline cuComplex cuCexpf(cuComplex z)
 }
 
 __global__
-void shift_array_generator_kernel(cuComplex* shift_ar, unsigned int shift_ar_size,
+void shift_array_generator_kernel(cuComplex* shift_ar, size_t shift_ar_size,
 				  unsigned int nbins, unsigned int nints,
 				  unsigned int nshift, float* shifts,
-				  float two_pi)
+				  size_t gulp_idx, float two_pi)
 {
-  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  size_t idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_idx;
   if (idx >= shift_ar_size)
     return;
   float subint = idx/nbins%nints;
-  unsigned int shift_idx = idx/(nbins*nints);
+  size_t shift_idx = idx/((size_t)nbins*nints);
   unsigned int bin = idx%nbins;
   float shift = subint/nints * shifts[shift_idx];
   float ramp = bin*two_pi/nbins;
@@ -684,40 +798,41 @@ void shift_array_generator_kernel(cuComplex* shift_ar, unsigned int shift_ar_siz
 }
 
 __global__
-void template_generator_kernel(cuComplex* templates, unsigned int nbins, unsigned int size)
+void template_generator_kernel(cuComplex* templates, unsigned int nbins, size_t size,
+			       size_t gulp_idx)
 {
-  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  size_t idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_idx;
   if (idx>=size)
     return;
   unsigned int bin = idx%nbins;
-  unsigned int template_idx = idx/nbins;
+  size_t template_idx = idx/nbins;
   float val = (bin<=template_idx);
   templates[idx] = make_cuComplex(val,0.0);
 }
 
 __global__
 void multiply_by_shift_kernel(cuComplex* input, cuComplex* output,
-			      cuComplex* shift_array, unsigned int nbins_by_nints,
-			      unsigned int size)
+			      cuComplex* shift_array, size_t nbins_by_nints,
+			      size_t size, size_t gulp_idx)
 {
-  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  size_t idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_idx;
   if (idx>=size)
     return;
-  unsigned int in_idx = idx%(nbins_by_nints);
+  size_t in_idx = idx%(nbins_by_nints);
   output[idx] = cuCmulf(input[in_idx],shift_array[idx]);
 }
 
 __global__
 void collapse_subints_kernel(cuComplex* input, cuComplex* output, 
 			     unsigned int nbins, unsigned int nints, 
-			     unsigned int nbins_by_nints, unsigned int size)
+			     size_t nbins_by_nints, size_t size, size_t gulp_idx)
 {
-  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  size_t idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_idx;
   if (idx>=size)
     return;
   unsigned int bin = idx%nbins;
-  unsigned int fold = idx/nbins;
-  unsigned int in_idx = (fold*nbins_by_nints)+bin;
+  size_t fold = idx/nbins;
+  size_t in_idx = (fold*nbins_by_nints)+bin;
   cuComplex val =  make_cuComplex(0.0,0.0);
   for (int ii=0;ii<nints;ii++)
     val = cuCaddf(val,input[in_idx+ii*nbins]);  
@@ -727,15 +842,15 @@ void collapse_subints_kernel(cuComplex* input, cuComplex* output,
 __global__
 void multiply_by_template_kernel(cuComplex* input, cuComplex* output,
 				 cuComplex* templates, unsigned int nbins,
-				 unsigned int nshifts, unsigned int nbins_by_nshifts,
-				 unsigned int size, unsigned int step)
+				 unsigned int nshifts, size_t nbins_by_nshifts,
+				 size_t size, unsigned int step, size_t gulp_idx)
 {
-  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  size_t idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_idx;
   if (idx>=size)
     return;
-  unsigned int template_idx = idx/nbins_by_nshifts;
+  size_t template_idx = idx/nbins_by_nshifts;
   unsigned int bin = idx%nbins;
-  unsigned int shift = idx%nbins_by_nshifts;
+  size_t shift = idx%nbins_by_nshifts;
   float width = (template_idx+1.0);
   cuComplex normalisation_factor = make_cuComplex(sqrtf(width),0.0);
   if (bin==0)
@@ -745,24 +860,86 @@ void multiply_by_template_kernel(cuComplex* input, cuComplex* output,
 }
 
 __global__
-void cuCabsf_kernel(cuComplex* input, float* output, unsigned int size)
+void shift_and_collapse_kernel(cuComplex* input, cuComplex* output,
+			       float* shifts, unsigned int nbins,
+			       unsigned int nints, size_t size,
+			       size_t gulp_idx, float two_pi)
+{
+  size_t idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_idx;
+  if (idx>=size)
+    return;
+  unsigned int bin = idx%nbins;
+  size_t shift_idx = idx/nbins;
+  float ramp = bin*two_pi/nbins;
+  if (bin>nbins/2)
+    ramp-=two_pi;
+  //phase ramp is generated on the fly rather than read from
+  //a precomputed nshifts*nints*nbins array
+  float step = -1*ramp*shifts[shift_idx]/nints;
+  float re,im;
+  cuComplex val = make_cuComplex(0.0,0.0);
+  for (int ii=0;ii<nints;ii++){
+    sincosf(step*ii,&im,&re);
+    val = cuCaddf(val,cuCmulf(input[(size_t)ii*nbins+bin],make_cuComplex(re,im)));
+  }
+  output[idx] = val;
+}
+
+__global__
+void apply_shift_kernel(cuComplex* input, cuComplex* output, float shift,
+			unsigned int nbins, unsigned int nints,
+			size_t size, size_t gulp_idx,
+			float two_pi)
+{
+  size_t idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_idx;
+  if (idx>=size)
+    return;
+  unsigned int bin = idx%nbins;
+  float subint = idx/nbins;
+  float ramp = bin*two_pi/nbins;
+  if (bin>nbins/2)
+    ramp-=two_pi;
+  float re,im;
+  sincosf(-1*ramp*shift*subint/nints,&im,&re);
+  output[idx] = cuCmulf(input[idx],make_cuComplex(re,im));
+}
+
+__global__
+void profile_power_kernel(cuComplex* input, float* output,
+			  unsigned int nbins, unsigned int nshifts)
 {
   int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx>=nshifts)
+    return;
+  float power = 0.0;
+  cuComplex val;
+  //skip the DC bin
+  for (int ii=1;ii<nbins;ii++){
+    val = input[(size_t)idx*nbins+ii];
+    power += val.x*val.x + val.y*val.y;
+  }
+  output[idx] = power;
+}
+
+__global__
+void cuCabsf_kernel(cuComplex* input, float* output, size_t size, size_t gulp_idx)
+{
+  size_t idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_idx;
   if (idx>=size)
     return;
   output[idx] = cuCabsf(input[idx]);
 }
 
 __global__
-void real_to_complex_kernel(float* input, cuComplex* output, unsigned int size) 
+void real_to_complex_kernel(float* input, cuComplex* output, size_t size, size_t gulp_idx) 
 {
-  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  size_t idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_idx;
   if (idx>=size)
     return;
   output[idx] = make_cuComplex(input[idx],0.0);
 }
 
-unsigned int device_argmax(float* input, unsigned int size)
+size_t device_argmax(float* input, size_t size)
 {
   thrust::device_ptr<float> ptr(input);
   thrust::device_ptr<float> max_elem = thrust::max_element(ptr,ptr+size);
@@ -770,29 +947,29 @@ unsigned int device_argmax(float* input, unsigned int size)
   return thrust::distance(ptr,max_elem);
 }
 
-void device_real_to_complex(float* input, cuComplex* output, unsigned int size, 
+void device_real_to_complex(float* input, cuComplex* output, size_t size, 
 			    unsigned int max_blocks, unsigned int max_threads)
 {
   BlockCalculator calc(size,max_blocks,max_threads);
   for (int ii=0;ii<calc.size();ii++)
-    real_to_complex_kernel<<<calc[ii].blocks,max_threads>>>(input,output,size);
+    real_to_complex_kernel<<<calc[ii].blocks,max_threads>>>(input,output,size,calc[ii].data_idx);
   ErrorChecker::check_cuda_error("Error from device_real_to_complex");
   return;
 }
 
 
-void device_get_absolute_value(cuComplex* input, float* output, unsigned int size,
+void device_get_absolute_value(cuComplex* input, float* output, size_t size,
 			       unsigned int max_blocks, unsigned int max_threads)
 {
   BlockCalculator calc(size,max_blocks,max_threads);
   for (int ii=0;ii<calc.size();ii++)
-    cuCabsf_kernel<<<calc[ii].blocks,max_threads>>>(input,output,size);
+    cuCabsf_kernel<<<calc[ii].blocks,max_threads>>>(input,output,size,calc[ii].data_idx);
   ErrorChecker::check_cuda_error("Error from device_get_absolute_value");
   return;
 }
 
 void device_generate_shift_array(cuComplex* shifted_ar,
-                                 unsigned int shifted_ar_size,
+                                 size_t shifted_ar_size,
                                  unsigned int nbins, unsigned int nints,
                                  unsigned int nshift, float* shifts,
                                  unsigned int max_blocks, unsigned int max_threads)
@@ -801,32 +978,35 @@ void device_generate_shift_array(cuComplex* shifted_ar,
   BlockCalculator calc(shifted_ar_size,max_blocks,max_threads);
   for (int ii=0;ii<calc.size();ii++)
     shift_array_generator_kernel<<<calc[ii].blocks,max_threads>>>(shifted_ar, shifted_ar_size, nbins,
-								  nints, nshift, shifts, two_pi);
+								  nints, nshift, shifts,
+								  calc[ii].data_idx, two_pi);
   ErrorChecker::check_cuda_error("Error from device_generate_shift_array");
   return;
 }
 
 void device_generate_template_array(cuComplex* templates, unsigned int nbins, 
-				    unsigned int size, unsigned int max_blocks,
+				    size_t size, unsigned int max_blocks,
 				    unsigned int max_threads)
 {
   BlockCalculator calc(size,max_blocks,max_threads);
   for (int ii=0;ii<calc.size();ii++){
-    template_generator_kernel<<<calc[ii].blocks,max_threads>>>(templates, nbins, size);
+    template_generator_kernel<<<calc[ii].blocks,max_threads>>>(templates, nbins, size,
+							       calc[ii].data_idx);
   }
   ErrorChecker::check_cuda_error("Error from device_generate_template_array");
   return;
 }
 
 void device_multiply_by_shift(cuComplex* input, cuComplex* output,
-                              cuComplex* shift_array, unsigned int size,
-			      unsigned int nbins_by_nints,
+                              cuComplex* shift_array, size_t size,
+			      size_t nbins_by_nints,
 			      unsigned int max_blocks, unsigned int max_threads)
 {
   BlockCalculator calc(size, max_blocks, max_threads);
   for (int ii=0;ii<calc.size();ii++){
     multiply_by_shift_kernel<<<calc[ii].blocks,max_threads>>>(input,output,shift_array,
-							      nbins_by_nints,size);
+							      nbins_by_nints,size,
+							      calc[ii].data_idx);
   }
   ErrorChecker::check_cuda_error("Error from device_multiply_by_shift");
   return;
@@ -834,14 +1014,15 @@ void device_multiply_by_shift(cuComplex* input, cuComplex* output,
 
 void device_collapse_subints(cuComplex* input, cuComplex* output,
 			     unsigned int nbins, unsigned int nints,
-			     unsigned int size, unsigned int max_blocks, 
+			     size_t size, unsigned int max_blocks, 
 			     unsigned int max_threads)
 {
-  unsigned int nbins_by_nints = nbins*nints;
+  size_t nbins_by_nints = (size_t) nbins*nints;
   BlockCalculator calc(size, max_blocks, max_threads);
   for (int ii=0;ii<calc.size();ii++){
     collapse_subints_kernel<<<calc[ii].blocks,max_threads>>>(input,output,nbins,
-							     nints,nbins_by_nints,size);
+							     nints,nbins_by_nints,size,
+							     calc[ii].data_idx);
   }
   ErrorChecker::check_cuda_error("Error from device_collapse_subints");
   return;
@@ -850,20 +1031,61 @@ void device_collapse_subints(cuComplex* input, cuComplex* output,
 void device_multiply_by_templates(cuComplex* input, cuComplex* output,
 				  cuComplex* templates, unsigned int nbins,
 				  unsigned int nshifts,
-				  unsigned int size, unsigned int step,
+				  size_t size, unsigned int step,
 				  unsigned int max_blocks, unsigned int max_threads)
 {
-  unsigned int nbins_by_nshifts = nbins*nshifts;
+  size_t nbins_by_nshifts = (size_t) nbins*nshifts;
   BlockCalculator calc(size, max_blocks, max_threads);
   for (int ii=0;ii<calc.size();ii++){
     multiply_by_template_kernel<<<calc[ii].blocks,max_threads>>>(input,output,templates,
 								 nbins,nshifts,nbins_by_nshifts,
-								 size,step);
+								 size,step,calc[ii].data_idx);
   }
   ErrorChecker::check_cuda_error("Error from device_multiply_by_templates");
   return;
 }
 
+void device_shift_and_collapse(cuComplex* input, cuComplex* output,
+			       float* shifts, unsigned int nbins,
+			       unsigned int nints, unsigned int nshifts,
+			       unsigned int max_blocks, unsigned int max_threads)
+{
+  float two_pi = 2*3.14159265359;
+  size_t size = (size_t) nbins*nshifts;
+  BlockCalculator calc(size, max_blocks, max_threads);
+  for (int ii=0;ii<calc.size();ii++){
+    shift_and_collapse_kernel<<<calc[ii].blocks,max_threads>>>(input,output,shifts,nbins,nints,
+							       size,calc[ii].data_idx,two_pi);
+  }
+  ErrorChecker::check_cuda_error("Error from device_shift_and_collapse");
+  return;
+}
+
+void device_apply_shift(cuComplex* input, cuComplex* output, float shift,
+			unsigned int nbins, unsigned int nints,
+			unsigned int max_blocks, unsigned int max_threads)
+{
+  float two_pi = 2*3.14159265359;
+  size_t size = (size_t) nbins*nints;
+  BlockCalculator calc(size, max_blocks, max_threads);
+  for (int ii=0;ii<calc.size();ii++){
+    apply_shift_kernel<<<calc[ii].blocks,max_threads>>>(input,output,shift,nbins,nints,
+							size,calc[ii].data_idx,two_pi);
+  }
+  ErrorChecker::check_cuda_error("Error from device_apply_shift");
+  return;
+}
+
+void device_profile_power(cuComplex* input, float* output,
+			  unsigned int nbins, unsigned int nshifts,
+			  unsigned int max_threads)
+{
+  unsigned int blocks = nshifts/max_threads + 1;
+  profile_power_kernel<<<blocks,max_threads>>>(input,output,nbins,nshifts);
+  ErrorChecker::check_cuda_error("Error from device_profile_power");
+  return;
+}
+
 //--------------Rednoise stuff--------------//
 
 //Ben Barsdells median scrunching algorithm from Heimdall
@@ -1011,9 +1233,9 @@ hd_error linear_stretch(const hd_float* d_in,
 }
 
 __global__ 
-void divide_c_by_f_kernel(cuComplex* c, float* f, unsigned int size, unsigned int gulp_idx)
+void divide_c_by_f_kernel(cuComplex* c, float* f, size_t size, size_t gulp_idx)
 {
-  int idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_idx;
+  size_t idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_idx;
   if (idx>=size)
     return;
   if (idx<5)
@@ -1022,12 +1244,12 @@ void divide_c_by_f_kernel(cuComplex* c, float* f, unsigned int size, unsigned in
     c[idx] = cuCdivf(c[idx],make_cuComplex(f[idx],0.0));
 }
 
-void device_divide_c_by_f(cuComplex* c, float* f, unsigned int size,
+void device_divide_c_by_f(cuComplex* c, float* f, size_t size,
 			    unsigned int max_blocks, unsigned int max_threads)
 {
   BlockCalculator calc(size, max_blocks, max_threads);
   for (int ii=0;ii<calc.size();ii++){
-    divide_c_by_f_kernel<<<calc[ii].blocks,max_threads>>>(c,f,size,ii*max_threads*max_blocks);
+    divide_c_by_f_kernel<<<calc[ii].blocks,max_threads>>>(c,f,size,calc[ii].data_idx);
   }
   ErrorChecker::check_cuda_error();
   return;
@@ -1036,16 +1258,16 @@ void device_divide_c_by_f(cuComplex* c, float* f, unsigned int size,
 __global__
 void zap_birdies_kernel(cuComplex* fseries, float* birdies, float* widths,
 			float bin_width, unsigned int size,
-			unsigned int fseries_size)
+			size_t fseries_size)
 {
   int idx = blockIdx.x * blockDim.x + threadIdx.x;
   if (idx>=size)
     return;
-  int ii;
+  long long ii;
   float freq = birdies[idx];
   float width = widths[idx];
-  int low_bin = __float2int_rd((freq-width)/bin_width);
-  int high_bin = __float2int_ru((freq+width)/bin_width);
+  long long low_bin = __float2ll_rd((freq-width)/bin_width);
+  long long high_bin = __float2ll_ru((freq+width)/bin_width);
   
   if (low_bin<0)
     low_bin = 0;
@@ -1058,7 +1280,7 @@ void zap_birdies_kernel(cuComplex* fseries, float* birdies, float* widths,
 }
 
 void device_zap_birdies(cuComplex* fseries, float* d_birdies, float* d_widths, float bin_width,
-			unsigned int birdies_size, unsigned int fseries_size,
+			unsigned int birdies_size, size_t fseries_size,
 			unsigned int max_blocks, unsigned int max_threads)
 {
   BlockCalculator calc(birdies_size, max_blocks, max_threads);
@@ -1142,20 +1364,22 @@ void device_cuCmulf_inplace(cufftComplex* x, cufftComplex* y,
 //This is to get around the stupid thrust copy issue
 
 template <class X,class Y> __global__
-void conversion_kernel(X* x, Y* y, unsigned int size,
-                       unsigned int gulp_idx)
+void conversion_kernel(X* x, Y* y, size_t size,
+                       size_t gulp_idx)
 {
-  int idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_idx;
+  size_t idx = blockIdx.x * blockDim.x + threadIdx.x + gulp_idx;
   if (idx<size)
     y[idx] = x[idx];
   return;
 }
 
-template __global__ void conversion_kernel<char,float>(char*,float*,unsigned int,unsigned int);
-template __global__ void conversion_kernel<unsigned char,float>(unsigned char*,float*,unsigned int,unsigned int);
+template __global__ void conversion_kernel<char,float>(char*,float*,size_t,size_t);
+template __global__ void conversion_kernel<unsigned char,float>(unsigned char*,float*,size_t,size_t);
+template __global__ void conversion_kernel<unsigned short,float>(unsigned short*,float*,size_t,size_t);
+template __global__ void conversion_kernel<float,float>(float*,float*,size_t,size_t);
 
 template <class X,class Y>
-void device_conversion(X* x, Y* y, unsigned int size,
+void device_conversion(X* x, Y* y, size_t size,
                        unsigned int max_blocks,
                        unsigned int max_threads)
 {
@@ -1166,7 +1390,9 @@ void device_conversion(X* x, Y* y, unsigned int size,
   return;
 }
 
-template void device_conversion<char,float>(char*, float*, unsigned int, unsigned int, unsigned int);
-template void device_conversion<unsigned char,float>(unsigned char*, float*, unsigned int, unsigned int, unsigned int);
+template void device_conversion<char,float>(char*, float*, size_t, unsigned int, unsigned int);
+template void device_conversion<unsigned char,float>(unsigned char*, float*, size_t, unsigned int, unsigned int);
+template void device_conversion<unsigned short,float>(unsigned short*, float*, size_t, unsigned int, unsigned int);
+template void device_conversion<float,float>(float*, float*, size_t, unsigned int, unsigned int);
 
 
@@ -0,0 +1,121 @@
+#include <utils/candidate_archive.hpp>
+#include <tclap/CmdLine.h>
+#include <string>
+#include <iostream>
+#include <stdio.h>
+
+/*
+  Inspect a candidate archive: print the summary table (default),
+  the header, or the fold or detections of one candidate.
+*/
+
+struct CmdLineOptions {
+  std::string infilename;
+  bool info;
+  int fold_idx;
+  int hits_idx;
+  float min_snr;
+};
+
+void print_info(CandidateArchive& archive){
+  const ArchiveHeader& hdr = archive.get_header();
+  printf("version     %u\n",hdr.version);
+  printf("candidates  %llu\n",(unsigned long long) hdr.ncands);
+  printf("file size   %llu\n",(unsigned long long) hdr.file_size);
+  printf("columns     %u\n",hdr.ncolumns);
+  for (unsigned int ii=0;ii<archive.get_ncolumns();ii++){
+    const ArchiveColumn& col = archive.get_column_info(ii);
+    printf("  %-20s %c%u\n",col.name,(char) col.type,col.width*8);
+  }
+}
+
+void print_table(CandidateArchive& archive, float min_snr){
+  unsigned int ncols = archive.get_ncolumns();
+  printf("#id");
+  for (unsigned int cc=0;cc<ncols;cc++)
+    printf("\t%s",archive.get_column_info(cc).name);
+  printf("\n");
+  const float* snr = archive.column<float>("snr");
+  for (size_t ii=0;ii<archive.size();ii++){
+    if (snr[ii] < min_snr)
+      continue;
+    printf("%zu",ii);
+    for (unsigned int cc=0;cc<ncols;cc++)
+      printf("\t%.15g",archive.value(cc,ii));
+    printf("\n");
+  }
+}
+
+int main(int argc, char **argv)
+{
+  CmdLineOptions args;
+  try
+    {
+      TCLAP::CmdLine cmd("Peasoup - candidate archive inspector", ' ', "1.0");
+
+      TCLAP::UnlabeledValueArg<std::string> arg_infilename("archive","Candidate archive",
+							   true, "", "string", cmd);
+
+      TCLAP::SwitchArg arg_info("", "info", "Print the archive header and column list", cmd);
+
+      TCLAP::ValueArg<int> arg_fold_idx("", "fold",
+					"Print the folded profile of this candidate",
+					false, -1, "int", cmd);
+
+      TCLAP::ValueArg<int> arg_hits_idx("", "hits",
+					"Print the detections associated with this candidate",
+					false, -1, "int", cmd);
+
+      TCLAP::ValueArg<float> arg_min_snr("m", "min_snr",
+					 "Only list candidates of at least this S/N",
+					 false, 0.0, "float", cmd);
+
+      cmd.parse(argc, argv);
+      args.infilename        = arg_infilename.getValue();
+      args.info              = arg_info.getValue();
+      args.fold_idx          = arg_fold_idx.getValue();
+      args.hits_idx          = arg_hits_idx.getValue();
+      args.min_snr           = arg_min_snr.getValue();
+
+    }catch (TCLAP::ArgException &e) {
+    std::cerr << "Error: " << e.error() << " for arg " << e.argId()
+	      << std::endl;
+    return -1;
+  }
+
+  CandidateArchive archive(args.infilename);
+  if (args.info){
+    print_info(archive);
+    return 0;
+  }
+
+  if (args.fold_idx >= 0){
+    if (args.fold_idx >= (int) archive.size())
+      ErrorChecker::throw_error("Candidate index out of range");
+    int nbins, nints;
+    const float* fold = archive.get_fold(args.fold_idx,nbins,nints);
+    if (fold == NULL)
+      ErrorChecker::throw_error("Candidate was not folded");
+    for (int ii=0;ii<nints;ii++){
+      for (int jj=0;jj<nbins;jj++)
+	printf("%s%g",jj ? " " : "",fold[ii*nbins+jj]);
+      printf("\n");
+    }
+    return 0;
+  }
+
+  if (args.hits_idx >= 0){
+    if (args.hits_idx >= (int) archive.size())
+      ErrorChecker::throw_error("Candidate index out of range");
+    int nhits;
+    const CandidatePOD* hits = archive.get_hits(args.hits_idx,nhits);
+    printf("#dm\tdm_idx\tacc\tnh\tsnr\tfreq\n");
+    for (int ii=0;ii<nhits;ii++)
+      printf("%g\t%d\t%g\t%d\t%g\t%.15g\n",hits[ii].dm,hits[ii].dm_idx,
+	     hits[ii].acc,hits[ii].nh,hits[ii].snr,hits[ii].freq);
+    return 0;
+  }
+
+  print_table(archive,args.min_snr);
+  return 0;
+}
@@ -0,0 +1,431 @@
+#include <data_types/candidates.hpp>
+#include <utils/candidate_archive.hpp>
+#include <utils/exceptions.hpp>
+#include <tclap/CmdLine.h>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <limits>
+#include <algorithm>
+#include <iterator>
+#include <stdio.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "pthread.h"
+
+/*
+  Sifts the candidates of many peasoup output directories.
+
+  Each directory is read from candidates.archive when present, else
+  from the <candidates> section of overview.xml. Directories are
+  processed in parallel and matching candidates written in directory
+  order, as CSV or as a binary table:
+
+    char[8]      "PSQUERY1"
+    uint32       number of directories
+    per directory: uint32 length, then that many characters
+    uint64       number of records
+    QueryRecord  per record
+*/
+
+struct CmdLineOptions {
+  std::vector<std::string> dirs;
+  std::string outfilename;
+  bool binary;
+  bool recursive;
+  int nthreads;
+  float min_snr;
+  float min_folded_snr;
+  double min_period;
+  double max_period;
+  float min_dm;
+  float max_dm;
+  bool physical;
+  float min_ddm_count_ratio;
+  float max_ddm_count_ratio;
+  float min_ddm_snr_ratio;
+  float max_ddm_snr_ratio;
+};
+
+struct QueryRecord {
+  uint32_t dir_idx;
+  int32_t id;
+  double period;
+  double opt_period;
+  float dm;
+  float acc;
+  int32_t nh;
+  float snr;
+  float folded_snr;
+  float ddm_count_ratio;
+  float ddm_snr_ratio;
+  int32_t nassoc;
+  uint8_t is_adjacent;
+  uint8_t is_physical;
+  uint8_t reserved[6];
+};
+
+class CandidateFilter {
+private:
+  CmdLineOptions& args;
+
+public:
+  CandidateFilter(CmdLineOptions& args):args(args){}
+
+  bool accept(float snr, float folded_snr, double period, float dm, bool is_physical,
+	      float ddm_count_ratio, float ddm_snr_ratio){
+    return snr >= args.min_snr && folded_snr >= args.min_folded_snr &&
+      period >= args.min_period && period <= args.max_period &&
+      dm >= args.min_dm && dm <= args.max_dm &&
+      (is_physical || !args.physical) &&
+      ddm_count_ratio >= args.min_ddm_count_ratio && ddm_count_ratio <= args.max_ddm_count_ratio &&
+      ddm_snr_ratio >= args.min_ddm_snr_ratio && ddm_snr_ratio <= args.max_ddm_snr_ratio;
+  }
+
+  bool accept(Candidate& cand){
+    return accept(cand.snr,cand.folded_snr,1.0/cand.freq,cand.dm,cand.is_physical,
+		  cand.ddm_count_ratio,cand.ddm_snr_ratio);
+  }
+};
+
+QueryRecord make_record(Candidate& cand, uint32_t dir_idx, int id, int nassoc){
+  QueryRecord rec;
+  std::memset(&rec,0,sizeof(rec));
+  rec.dir_idx = dir_idx;
+  rec.id = id;
+  rec.period = 1.0/cand.freq;
+  rec.opt_period = cand.opt_period;
+  rec.dm = cand.dm;
+  rec.acc = cand.acc;
+  rec.nh = cand.nh;
+  rec.snr = cand.snr;
+  rec.folded_snr = cand.folded_snr;
+  rec.ddm_count_ratio = cand.ddm_count_ratio;
+  rec.ddm_snr_ratio = cand.ddm_snr_ratio;
+  rec.nassoc = nassoc;
+  rec.is_adjacent = cand.is_adjacent;
+  rec.is_physical = cand.is_physical;
+  return rec;
+}
+
+bool file_exists(std::string path){
+  struct stat st;
+  return stat(path.c_str(),&st)==0;
+}
+
+//Filter on the archive columns, only building records for candidates that pass
+void query_archive(std::string path, uint32_t dir_idx, CandidateFilter& filter,
+		   std::vector<QueryRecord>& out){
+  CandidateArchive archive(path);
+  //Columns are looked up by name once, not per row
+  const float* snr = archive.column<float>("snr");
+  const float* folded_snr = archive.column<float>("folded_snr");
+  const double* period = archive.column<double>("period");
+  const double* opt_period = archive.column<double>("opt_period");
+  const float* dm = archive.column<float>("dm");
+  const float* acc = archive.column<float>("acc");
+  const int32_t* nh = archive.column<int32_t>("nh");
+  const uint8_t* is_adjacent = archive.column<uint8_t>("is_adjacent");
+  const uint8_t* is_physical = archive.column<uint8_t>("is_physical");
+  const float* ddm_count_ratio = archive.column<float>("ddm_count_ratio");
+  const float* ddm_snr_ratio = archive.column<float>("ddm_snr_ratio");
+  const int32_t* nassoc = archive.column<int32_t>("nassoc");
+  for (size_t ii=0;ii<archive.size();ii++){
+    if (!filter.accept(snr[ii],folded_snr[ii],period[ii],dm[ii],is_physical[ii],
+		       ddm_count_ratio[ii],ddm_snr_ratio[ii]))
+      continue;
+    Candidate cand;
+    cand.freq = 1.0/period[ii];
+    cand.opt_period = opt_period[ii];
+    cand.dm = dm[ii];
+    cand.acc = acc[ii];
+    cand.nh = nh[ii];
+    cand.snr = snr[ii];
+    cand.folded_snr = folded_snr[ii];
+    cand.is_adjacent = is_adjacent[ii];
+    cand.is_physical = is_physical[ii];
+    cand.ddm_count_ratio = ddm_count_ratio[ii];
+    cand.ddm_snr_ratio = ddm_snr_ratio[ii];
+    QueryRecord rec = make_record(cand,dir_idx,ii,nassoc[ii]);
+    //Candidate::freq is single precision, the period column is not
+    rec.period = period[ii];
+    out.push_back(rec);
+  }
+}
+
+//Value of <tag>...</tag> between begin and end, or fallback if absent
+double xml_value(const char* begin, const char* end, const char* tag, double fallback=0.0){
+  char open_tag[64];
+  snprintf(open_tag,64,"<%s>",tag);
+  size_t len = strlen(open_tag);
+  for (const char* ptr=begin; ptr+len<end; ptr++){
+    ptr = (const char*) memchr(ptr,'<',end-ptr);
+    if (ptr == NULL)
+      break;
+    if (strncmp(ptr,open_tag,len)==0)
+      return strtod(ptr+len,NULL);
+  }
+  return fallback;
+}
+
+void query_overview(std::string path, uint32_t dir_idx, CandidateFilter& filter,
+		    std::vector<QueryRecord>& out){
+  std::ifstream infile(path.c_str(),std::ifstream::in | std::ifstream::binary);
+  ErrorChecker::check_file_error(infile,path);
+  std::string xml((std::istreambuf_iterator<char>(infile)),std::istreambuf_iterator<char>());
+  size_t pos = xml.find("<candidates>");
+  const char* marker = "<candidate id='";
+  while (pos != std::string::npos){
+    pos = xml.find(marker,pos);
+    if (pos == std::string::npos)
+      break;
+    size_t stop = xml.find("</candidate>",pos);
+    if (stop == std::string::npos)
+      break;
+    const char* begin = xml.c_str()+pos;
+    const char* end = xml.c_str()+stop;
+    int id = atoi(begin+strlen(marker));
+    Candidate cand;
+    double period = xml_value(begin,end,"period");
+    cand.freq = 1.0/period;
+    cand.opt_period = xml_value(begin,end,"opt_period");
+    cand.dm = xml_value(begin,end,"dm");
+    cand.acc = xml_value(begin,end,"acc");
+    cand.nh = xml_value(begin,end,"nh");
+    cand.snr = xml_value(begin,end,"snr");
+    cand.folded_snr = xml_value(begin,end,"folded_snr");
+    cand.is_adjacent = xml_value(begin,end,"is_adjacent");
+    cand.is_physical = xml_value(begin,end,"is_physical");
+    cand.ddm_count_ratio = xml_value(begin,end,"ddm_count_ratio");
+    cand.ddm_snr_ratio = xml_value(begin,end,"ddm_snr_ratio");
+    if (filter.accept(cand)){
+      QueryRecord rec = make_record(cand,dir_idx,id,(int) xml_value(begin,end,"nassoc"));
+      //As for the archive, keep the period at the precision it was written
+      rec.period = period;
+      out.push_back(rec);
+    }
+    pos = stop;
+  }
+}
+
+//Directories below root holding peasoup output
+void find_output_dirs(std::string root, std::vector<std::string>& found){
+  if (file_exists(root+"/candidates.archive") || file_exists(root+"/overview.xml"))
+    found.push_back(root);
+  DIR* dir = opendir(root.c_str());
+  if (dir == NULL)
+    return;
+  std::vector<std::string> children;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL){
+    std::string name(entry->d_name);
+    if (name=="." || name=="..")
+      continue;
+    struct stat st;
+    std::string path = root+"/"+name;
+    if (stat(path.c_str(),&st)==0 && S_ISDIR(st.st_mode))
+      children.push_back(path);
+  }
+  closedir(dir);
+  std::sort(children.begin(),children.end());
+  for (size_t ii=0;ii<children.size();ii++)
+    find_output_dirs(children[ii],found);
+}
+
+class QueryDispenser {
+private:
+  std::vector<std::string>& dirs;
+  CandidateFilter& filter;
+  std::vector< std::vector<QueryRecord> >& results;
+  size_t next;
+  pthread_mutex_t mutex;
+
+public:
+  QueryDispenser(std::vector<std::string>& dirs, CandidateFilter& filter,
+		 std::vector< std::vector<QueryRecord> >& results)
+    :dirs(dirs),filter(filter),results(results),next(0){
+    pthread_mutex_init(&mutex,NULL);
+  }
+
+  void run(void){
+    while (true){
+      pthread_mutex_lock(&mutex);
+      size_t idx = next++;
+      pthread_mutex_unlock(&mutex);
+      if (idx >= dirs.size())
+	break;
+      std::string archive = dirs[idx]+"/candidates.archive";
+      try {
+	if (file_exists(archive))
+	  query_archive(archive,idx,filter,results[idx]);
+	else
+	  query_overview(dirs[idx]+"/overview.xml",idx,filter,results[idx]);
+      } catch (std::exception& e){
+	std::cerr << "Skipping " << dirs[idx] << ": " << e.what() << std::endl;
+	results[idx].clear();
+      }
+    }
+  }
+
+  static void* launch(void* ptr){
+    reinterpret_cast<QueryDispenser*>(ptr)->run();
+    return NULL;
+  }
+
+  ~QueryDispenser(){
+    pthread_mutex_destroy(&mutex);
+  }
+};
+
+void write_csv(FILE* fo, std::vector<std::string>& dirs,
+	       std::vector< std::vector<QueryRecord> >& results){
+  fprintf(fo,"directory,id,period,opt_period,dm,acc,nh,snr,folded_snr,"
+	  "is_adjacent,is_physical,ddm_count_ratio,ddm_snr_ratio,nassoc\n");
+  for (size_t dd=0;dd<results.size();dd++)
+    for (size_t ii=0;ii<results[dd].size();ii++){
+      QueryRecord& rec = results[dd][ii];
+      fprintf(fo,"%s,%d,%.15g,%.15g,%g,%g,%d,%g,%g,%d,%d,%g,%g,%d\n",
+	      dirs[dd].c_str(),rec.id,rec.period,rec.opt_period,rec.dm,rec.acc,
+	      rec.nh,rec.snr,rec.folded_snr,rec.is_adjacent,rec.is_physical,
+	      rec.ddm_count_ratio,rec.ddm_snr_ratio,rec.nassoc);
+    }
+}
+
+void write_binary(FILE* fo, std::vector<std::string>& dirs,
+		  std::vector< std::vector<QueryRecord> >& results){
+  fwrite("PSQUERY1",1,8,fo);
+  uint32_t ndirs = dirs.size();
+  fwrite(&ndirs,sizeof(ndirs),1,fo);
+  uint64_t nrecords = 0;
+  for (size_t dd=0;dd<dirs.size();dd++){
+    uint32_t len = dirs[dd].size();
+    fwrite(&len,sizeof(len),1,fo);
+    fwrite(dirs[dd].c_str(),1,len,fo);
+    nrecords += results[dd].size();
+  }
+  fwrite(&nrecords,sizeof(nrecords),1,fo);
+  for (size_t dd=0;dd<results.size();dd++)
+    if (results[dd].size())
+      fwrite(&results[dd][0],sizeof(QueryRecord),results[dd].size(),fo);
+}
+
+int main(int argc, char **argv)
+{
+  CmdLineOptions args;
+  float inf = std::numeric_limits<float>::max();
+  try
+    {
+      TCLAP::CmdLine cmd("Peasoup - candidate query tool", ' ', "1.0");
+
+      TCLAP::UnlabeledMultiArg<std::string> arg_dirs("dirs","Peasoup output directories",
+						     true, "string", cmd);
+
+      TCLAP::ValueArg<std::string> arg_outfilename("o", "outfile",
+						   "Output file (default stdout)",
+						   false, "", "string", cmd);
+
+      TCLAP::SwitchArg arg_binary("b", "binary", "Write a binary table rather than CSV", cmd);
+
+      TCLAP::SwitchArg arg_recursive("r", "recursive", "Search below the given directories for output", cmd);
+
+      TCLAP::ValueArg<int> arg_nthreads("t", "num_threads",
+					"Number of directories to read at once",
+					false, 8, "int", cmd);
+
+      TCLAP::ValueArg<float> arg_min_snr("", "min_snr", "Minimum S/N",
+					 false, 0.0, "float", cmd);
+
+      TCLAP::ValueArg<float> arg_min_folded_snr("", "min_folded_snr", "Minimum folded S/N",
+						false, 0.0, "float", cmd);
+
+      TCLAP::ValueArg<double> arg_min_period("", "min_period", "Minimum period (s)",
+					     false, 0.0, "double", cmd);
+
+      TCLAP::ValueArg<double> arg_max_period("", "max_period", "Maximum period (s)",
+					     false, inf, "double", cmd);
+
+      TCLAP::ValueArg<float> arg_min_dm("", "min_dm", "Minimum DM",
+					false, -inf, "float", cmd);
+
+      TCLAP::ValueArg<float> arg_max_dm("", "max_dm", "Maximum DM",
+					false, inf, "float", cmd);
+
+      TCLAP::SwitchArg arg_physical("", "physical", "Only candidates flagged is_physical", cmd);
+
+      TCLAP::ValueArg<float> arg_min_ddm_count_ratio("", "min_ddm_count_ratio", "Minimum ddm_count_ratio",
+						     false, -inf, "float", cmd);
+
+      TCLAP::ValueArg<float> arg_max_ddm_count_ratio("", "max_ddm_count_ratio", "Maximum ddm_count_ratio",
+						     false, inf, "float", cmd);
+
+      TCLAP::ValueArg<float> arg_min_ddm_snr_ratio("", "min_ddm_snr_ratio", "Minimum ddm_snr_ratio",
+						   false, -inf, "float", cmd);
+
+      TCLAP::ValueArg<float> arg_max_ddm_snr_ratio("", "max_ddm_snr_ratio", "Maximum ddm_snr_ratio",
+						   false, inf, "float", cmd);
+
+      cmd.parse(argc, argv);
+      args.dirs                = arg_dirs.getValue();
+      args.outfilename         = arg_outfilename.getValue();
+      args.binary              = arg_binary.getValue();
+      args.recursive           = arg_recursive.getValue();
+      args.nthreads            = arg_nthreads.getValue();
+      args.min_snr             = arg_min_snr.getValue();
+      args.min_folded_snr      = arg_min_folded_snr.getValue();
+      args.min_period          = arg_min_period.getValue();
+      args.max_period          = arg_max_period.getValue();
+      args.min_dm              = arg_min_dm.getValue();
+      args.max_dm              = arg_max_dm.getValue();
+      args.physical            = arg_physical.getValue();
+      args.min_ddm_count_ratio = arg_min_ddm_count_ratio.getValue();
+      args.max_ddm_count_ratio = arg_max_ddm_count_ratio.getValue();
+      args.min_ddm_snr_ratio   = arg_min_ddm_snr_ratio.getValue();
+      args.max_ddm_snr_ratio   = arg_max_ddm_snr_ratio.getValue();
+
+    }catch (TCLAP::ArgException &e) {
+    std::cerr << "Error: " << e.error() << " for arg " << e.argId()
+	      << std::endl;
+    return -1;
+  }
+
+  std::vector<std::string> dirs;
+  if (args.recursive){
+    for (size_t ii=0;ii<args.dirs.size();ii++)
+      find_output_dirs(args.dirs[ii],dirs);
+  } else {
+    dirs = args.dirs;
+  }
+
+  CandidateFilter filter(args);
+  std::vector< std::vector<QueryRecord> > results(dirs.size());
+  QueryDispenser dispenser(dirs,filter,results);
+  int nthreads = std::max(1,std::min(args.nthreads,(int) dirs.size()));
+  std::vector<pthread_t> threads(nthreads);
+  for (int ii=0;ii<nthreads;ii++)
+    pthread_create(&threads[ii],NULL,QueryDispenser::launch,(void*) &dispenser);
+  for (int ii=0;ii<nthreads;ii++)
+    pthread_join(threads[ii],NULL);
+
+  FILE* fo = stdout;
+  if (args.outfilename != ""){
+    fo = fopen(args.outfilename.c_str(),"wb");
+    if (fo == NULL)
+      ErrorChecker::throw_error("Could not open "+args.outfilename);
+  }
+  //Static, as stdout is flushed at exit after main's locals are gone
+  static char buffer[8<<20];
+  setvbuf(fo,buffer,_IOFBF,sizeof(buffer));
+  if (args.binary)
+    write_binary(fo,dirs,results);
+  else
+    write_csv(fo,dirs,results);
+  if (fo != stdout)
+    fclose(fo);
+  else
+    fflush(fo);
+  return 0;
+}
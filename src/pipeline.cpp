@@ -205,7 +205,7 @@ int main(int argc, char **argv)
   }
   DispersionTrials<unsigned char> trials = dedisperser.dedisperse();
   
-  unsigned int size;
+  size_t size;
   if (args.size==0)
     size = Utils::prev_power_of_two(filobj.get_nsamps());
   else
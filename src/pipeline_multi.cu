@@ -2,9 +2,13 @@
 #include <data_types/fourierseries.hpp>
 #include <data_types/candidates.hpp>
 #include <data_types/filterbank.hpp>
+#include <data_types/whitened_cache.hpp>
+#include <data_types/trial_placement.hpp>
 #include <transforms/dedisperser.hpp>
 #include <transforms/resampler.hpp>
 #include <transforms/folder.hpp>
+#include <transforms/refiner.hpp>
+#include <transforms/accelrefiner.hpp>
 #include <transforms/ffter.hpp>
 #include <transforms/dereddener.hpp>
 #include <transforms/spectrumformer.hpp>
@@ -18,8 +22,14 @@
 #include <utils/stats.hpp>
 #include <utils/stopwatch.hpp>
 #include <utils/progress_bar.hpp>
+#include <utils/nvtx.hpp>
+#include <utils/telemetry.hpp>
 #include <utils/cmdline.hpp>
 #include <utils/output_stats.hpp>
+#include <utils/autotune.hpp>
+#include <utils/thread_pool.hpp>
+#include <utils/numa.hpp>
+#include <utils/candidate_archive.hpp>
 #include <string>
 #include <iostream>
 #include <stdio.h>
@@ -30,6 +40,12 @@
 #include <cmath>
 #include <map>
 
+/*
+  Hands DM trial indices to workers. With a TrialPlacement, DMs are
+  queued by the NUMA node holding them and a worker is given the next
+  DM on its own node, falling back to DMs local everywhere and then to
+  the node with the most DMs left. Without one DMs go out in order.
+*/
 class DMDispenser {
 private:
   DispersionTrials<unsigned char>& trials;
@@ -38,12 +54,34 @@ private:
   int count;
   ProgressBar* progress;
   bool use_progress_bar;
+  //One queue per node, the last for DMs local to every node
+  std::vector<std::vector<int> > queues;
+  std::vector<size_t> heads;
+
+  size_t remaining(int queue){
+    return queues[queue].size()-heads[queue];
+  }
 
 public:
-  DMDispenser(DispersionTrials<unsigned char>& trials)
-    :trials(trials),dm_idx(0),use_progress_bar(false){
+  unsigned int local_dms;
+  unsigned int remote_dms;
+
+  //Only the first max_count trials are released if max_count >= 0
+  DMDispenser(DispersionTrials<unsigned char>& trials, TrialPlacement* placement=NULL,
+	      int max_count=-1)
+    :trials(trials),dm_idx(0),use_progress_bar(false),local_dms(0),remote_dms(0){
     count = trials.get_count();
+    if (max_count >= 0)
+      count = std::min(count,max_count);
+    int nnodes = (placement!=NULL) ? placement->get_nnodes() : 0;
+    queues.resize(nnodes+1);
+    heads.assign(nnodes+1,0);
+    for (int ii=0;ii<count;ii++){
+      int node = (placement!=NULL) ? placement->get_dm_node(ii) : -1;
+      queues[(node >= 0 && node < nnodes) ? node : nnodes].push_back(ii);
+    }
     pthread_mutex_init(&mutex, NULL);
+    Telemetry::instance().start_dm_pass(count);
   }
   
   void enable_progress_bar(){
@@ -51,7 +89,8 @@ public:
     use_progress_bar = true;
   }
 
-  int get_dm_trial_idx(void){
+  //node is the NUMA node of the calling worker, -1 if unknown
+  int get_dm_trial_idx(int node=-1){
     pthread_mutex_lock(&mutex);
     int retval;
     if (dm_idx==0)
@@ -59,14 +98,26 @@ public:
 	printf("Releasing DMs to workers...\n");
 	progress->start();
       }
-    if (dm_idx >= trials.get_count()){
+    if (dm_idx >= count){
       retval =  -1;
       if (use_progress_bar)
 	progress->stop();
     } else {
       if (use_progress_bar)
 	progress->set_progress((float)dm_idx/count);
-      retval = dm_idx;
+      int shared = queues.size()-1;
+      int queue = (node >= 0 && node < shared && remaining(node)) ? node : shared;
+      if (!remaining(queue))
+	for (int ii=0;ii<shared;ii++)
+	  if (remaining(ii) > remaining(queue))
+	    queue = ii;
+      retval = queues[queue][heads[queue]++];
+      if (node >= 0 && shared > 0){
+	if (queue==node || queue==shared)
+	  local_dms++;
+	else
+	  remote_dms++;
+      }
       dm_idx++;
     }
     pthread_mutex_unlock(&mutex);
@@ -80,22 +131,272 @@ public:
   }
 };
 
+/*
+  Transform length dependent search state. Workers build one of these
+  per downsampling factor so every factor keeps its own FFT plans,
+  buffers, Dereddener and PeakFinder.
+
+  Harmonic sums are stored either as fp32 or, with --fp16_sums, as
+  fp16. The fp16 sums halve the memory traffic of the summing and peak
+  finding stages; the fundamental spectrum stays fp32 as it is also
+  used for whitening.
+*/
+class SearchContext {
+private:
+  DeviceTimeSeries<float>* owned_tim;
+  HarmonicSums<float>* sums;
+  HarmonicFolder<float>* harm_folder;
+  HarmonicSums<half>* half_sums;
+  HarmonicFolder<half>* half_folder;
+
+public:
+  size_t size;
+  CuFFTerR2C r2cfft;
+  CuFFTerC2R c2rfft;
+  DeviceFourierSeries<cufftComplex> d_fseries;
+  DevicePowerSpectrum<float> pspec;
+  DeviceTimeSeries<float>* d_tim;
+  DeviceTimeSeries<float> d_tim_r;
+  Dereddener rednoise;
+  PeakFinder cand_finder;
+
+  //If tim is NULL a buffer of the context size is allocated
+  SearchContext(size_t size, float bin_width, float threshold,
+		CmdLineOptions& args, DeviceTimeSeries<float>* tim=NULL)
+    :owned_tim(NULL),sums(NULL),harm_folder(NULL),half_sums(NULL),half_folder(NULL),
+     size(size),r2cfft(size),c2rfft(size),
+     d_fseries(size/2+1,bin_width),pspec(d_fseries),d_tim(tim),
+     d_tim_r(size),rednoise(size/2+1),
+     cand_finder(threshold,args.min_freq,args.max_freq,size)
+  {
+    if (d_tim==NULL)
+      d_tim = owned_tim = new DeviceTimeSeries<float>(size);
+    if (args.fp16_sums){
+      half_sums = new HarmonicSums<half>(pspec,args.nharmonics);
+      half_folder = new HarmonicFolder<half>(*half_sums);
+    } else {
+      sums = new HarmonicSums<float>(pspec,args.nharmonics);
+      harm_folder = new HarmonicFolder<float>(*sums);
+    }
+  }
+
+  //Harmonic sum the normalised spectrum and search it and every sum
+  void search_spectrum(SpectrumCandidates& cands){
+    cand_finder.find_candidates(pspec,cands);
+    if (half_sums!=NULL){
+      half_folder->fold(pspec);
+      cand_finder.find_candidates(*half_sums,cands);
+    } else {
+      harm_folder->fold(pspec);
+      cand_finder.find_candidates(*sums,cands);
+    }
+  }
+
+  /*
+    Largest S/N difference between the fp16 sums of the last searched
+    spectrum and the same sums formed in fp32. Returns 0 if the context
+    is not using fp16 sums.
+  */
+  float check_fp16_sums(void){
+    if (half_sums==NULL)
+      return 0.0;
+    HarmonicSums<float> ref_sums(pspec,half_sums->size());
+    HarmonicFolder<float> ref_folder(ref_sums);
+    ref_folder.fold(pspec);
+    float max_error = 0.0;
+    for (int ii=0;ii<ref_sums.size();ii++)
+      max_error = std::max(max_error,
+			   device_max_abs_difference(ref_sums[ii]->get_data(),
+						     (*half_sums)[ii]->get_data(),
+						     pspec.get_nbins()));
+    return max_error;
+  }
+
+  ~SearchContext(){
+    if (owned_tim!=NULL)
+      delete owned_tim;
+    if (sums!=NULL){
+      delete harm_folder;
+      delete sums;
+    }
+    if (half_sums!=NULL){
+      delete half_folder;
+      delete half_sums;
+    }
+  }
+};
+
+/*
+  Incoherent search over overlapping segments of a DM trial.
+
+  The trial is cut into nsegments segments of a 2,3,5,7-smooth length
+  that overlap by at least half. Rounding the length down to a smooth
+  size can leave the requested count short of that overlap, in which
+  case segments are added. Each segment is whitened once and then,
+  for every acceleration trial of the (much coarser) segment plan, is
+  searched on its own and its normalised spectrum is added to a running
+  sum. The sum is searched after the last segment. Segment detections
+  carry their segment index, combined detections carry -1.
+*/
+class SegmentedSearch {
+private:
+  unsigned int nsegments;
+  size_t seg_size;
+  size_t stride;
+  float tobs;
+  CmdLineOptions& args;
+  SearchContext ctx;
+  AccelerationPlan acc_plan;
+  std::vector<DeviceTimeSeries<float>*> segments;
+  std::vector<float> means;
+  std::vector<float> stds;
+  float* combined;
+  TimeDomainResampler resampler;
+  SpectrumFormer former;
+  HarmonicDistiller harm_finder;
+  AccelerationDistiller acc_still;
+
+  static size_t segment_size(size_t size, unsigned int nsegments){
+    return Utils::prev_smooth_size(2*size/(nsegments+1));
+  }
+
+  //Fewest segments, and at least the number asked for, whose stride is at most half a segment
+  static unsigned int segment_count(size_t size, unsigned int min_segments){
+    size_t seg_size = segment_size(size,min_segments);
+    if (min_segments < 2 || size <= seg_size)
+      return min_segments;
+    size_t half = std::max((size_t) 1,seg_size/2);
+    return std::max((size_t) min_segments,(size-seg_size+half-1)/half+1);
+  }
+
+public:
+  SegmentedSearch(size_t size, unsigned int min_segments, float tsamp,
+		  AccelerationPlan& full_plan, CmdLineOptions& args)
+    :nsegments(segment_count(size,min_segments)),seg_size(segment_size(size,min_segments)),
+     tobs(seg_size*tsamp),args(args),
+     ctx(seg_size,1.0/(seg_size*tsamp),args.min_snr,args),
+     acc_plan(full_plan.resized(seg_size,tsamp)),
+     means(nsegments),stds(nsegments),
+     harm_finder(args.freq_tol,args.max_harm,false),
+     acc_still(seg_size*tsamp,args.freq_tol,true)
+  {
+    stride = (nsegments>1) ? (size-seg_size)/(nsegments-1) : 0;
+    for (int ii=0;ii<nsegments;ii++)
+      segments.push_back(new DeviceTimeSeries<float>(seg_size));
+    Utils::device_malloc<float>(&combined,seg_size/2+1);
+  }
+
+  size_t get_segment_size(void){return seg_size;}
+
+  //Returns the number of acceleration trials searched
+  unsigned int search(DeviceTimeSeries<float>& tim, float dm, int dm_idx,
+		      Zapper* bzap, std::vector<Candidate>& output)
+  {
+    float rms;
+    size_t nbins = seg_size/2+1;
+
+    //Whiten every segment once
+    for (int ss=0;ss<nsegments;ss++){
+      Utils::d2dcpy<float>(segments[ss]->get_data(),tim.get_data()+ss*stride,seg_size);
+      segments[ss]->set_tsamp(tim.get_tsamp());
+      ctx.r2cfft.execute(segments[ss]->get_data(),ctx.d_fseries.get_data());
+      former.form(ctx.d_fseries,ctx.pspec);
+      ctx.rednoise.calculate_median(ctx.pspec);
+      ctx.rednoise.deredden(ctx.d_fseries);
+      if (bzap!=NULL)
+	bzap->zap(ctx.d_fseries);
+      former.form_interpolated(ctx.d_fseries,ctx.pspec);
+      stats::stats<float>(ctx.pspec.get_data(),nbins,&means[ss],&rms,&stds[ss]);
+      ctx.c2rfft.execute(ctx.d_fseries.get_data(),segments[ss]->get_data());
+    }
+
+    std::vector<float> acc_list;
+    acc_plan.generate_accel_list(dm,acc_list);
+    if (args.verbose)
+      std::cout << "Searching " << acc_list.size() << " acceleration trials in "
+		<< nsegments << " segments of " << seg_size << " samples" << std::endl;
+
+    CandidateCollection segment_cands;
+    CandidateCollection combined_cands;
+    for (int jj=0;jj<acc_list.size();jj++){
+      GPU_fill(combined,combined+nbins,0.0f);
+      for (int ss=0;ss<nsegments;ss++){
+	resampler.resampleII(*segments[ss],ctx.d_tim_r,seg_size,acc_list[jj]);
+	ctx.r2cfft.execute(ctx.d_tim_r.get_data(),ctx.d_fseries.get_data());
+	former.form_interpolated(ctx.d_fseries,ctx.pspec);
+	stats::normalise(ctx.pspec.get_data(),means[ss]*seg_size,stds[ss]*seg_size,nbins);
+	device_accumulate(ctx.pspec.get_data(),combined,nbins,MAX_BLOCKS,MAX_THREADS);
+	SpectrumCandidates trial_cands(dm,dm_idx,acc_list[jj]);
+	ctx.search_spectrum(trial_cands);
+	std::vector<Candidate> distilled = harm_finder.distill(trial_cands.cands);
+	for (int kk=0;kk<distilled.size();kk++)
+	  distilled[kk].segment = ss;
+	segment_cands.append(distilled);
+      }
+      //Sum of nsegments unit variance spectra
+      Utils::d2dcpy<float>(ctx.pspec.get_data(),combined,nbins);
+      stats::normalise(ctx.pspec.get_data(),0.0,sqrt((float)nsegments),nbins);
+      SpectrumCandidates trial_cands(dm,dm_idx,acc_list[jj]);
+      ctx.search_spectrum(trial_cands);
+      combined_cands.append(harm_finder.distill(trial_cands.cands));
+    }
+    std::vector<Candidate> distilled = acc_still.distill(combined_cands.cands);
+    output.insert(output.end(),distilled.begin(),distilled.end());
+    distilled = acc_still.distill(segment_cands.cands);
+    output.insert(output.end(),distilled.begin(),distilled.end());
+    return acc_list.size();
+  }
+
+  ~SegmentedSearch(){
+    for (int ii=0;ii<segments.size();ii++)
+      delete segments[ii];
+    Utils::device_free(combined);
+  }
+};
+
 class Worker {
 private:
   DispersionTrials<unsigned char>& trials;
   DMDispenser& manager;
   CmdLineOptions& args;
   AccelerationPlan& acc_plan;
-  unsigned int size;
+  DownsamplingPlan* ds_plan;
+  WhitenedSeriesCache* cache;
+  TrialPlacement* placement;
+  size_t size;
+  int id;
   int device;
+  int node;
   std::map<std::string,Stopwatch> timers;
+  std::map<unsigned int,SearchContext*> contexts;
+  std::map<unsigned int,SegmentedSearch*> segmented;
+  std::map<unsigned int,DeviceTimeSeries<float>*> decimated;
   
 public:
   CandidateCollection dm_trial_cands;
+  //Hierarchical acceleration search bookkeeping
+  unsigned int coarse_trials;
+  unsigned int fine_trials;
+  unsigned int full_grid_trials;
+  unsigned int coarse_cands;
+  unsigned int refined_cands;
+  //Largest fp16 vs fp32 harmonic sum S/N difference seen
+  float fp16_max_error;
+  bool fp16_checked;
+  //DM trials after the first, which also builds plans and buffers, and their time
+  unsigned int steady_trials;
+  float steady_time;
 
   Worker(DispersionTrials<unsigned char>& trials, DMDispenser& manager, 
-	 AccelerationPlan& acc_plan, CmdLineOptions& args, unsigned int size, int device)
-    :trials(trials),manager(manager),acc_plan(acc_plan),args(args),size(size),device(device){}
+	 AccelerationPlan& acc_plan, CmdLineOptions& args, size_t size, int id, int device,
+	 WhitenedSeriesCache* cache=NULL, DownsamplingPlan* ds_plan=NULL,
+	 int node=-1, TrialPlacement* placement=NULL)
+    :trials(trials),manager(manager),acc_plan(acc_plan),args(args),
+     ds_plan(ds_plan),cache(cache),placement(placement),size(size),id(id),device(device),
+     node(node),
+     coarse_trials(0),fine_trials(0),full_grid_trials(0),
+     coarse_cands(0),refined_cands(0),fp16_max_error(0.0),fp16_checked(false),
+     steady_trials(0),steady_time(0.0){}
   
   void start(void)
   {
@@ -106,50 +407,58 @@ public:
     //timers["search"]      = Stopwatch();
 
     cudaSetDevice(device);
+    NAME_NVTX_THREAD("Worker",id)
     Stopwatch pass_timer;
     pass_timer.start();
+    Stopwatch steady_timer;
+    unsigned int ndone = 0;
 
     bool padding = false;
     if (size > trials.get_nsamps())
       padding = true;
     
-    CuFFTerR2C r2cfft(size);
-    CuFFTerC2R c2rfft(size);
     float tobs = size*trials.get_tsamp();
     float bin_width = 1.0/tobs;
-    DeviceFourierSeries<cufftComplex> d_fseries(size/2+1,bin_width);
     DedispersedTimeSeries<unsigned char> tim;
+    std::vector<unsigned char> unpack_buffer;
+    //The copy of the trials on this worker's node, NULL for the original
+    unsigned char* storage = (placement!=NULL) ? placement->get_storage(node) : NULL;
     ReusableDeviceTimeSeries<float,unsigned char> d_tim(size);
-    DeviceTimeSeries<float> d_tim_r(size);
     TimeDomainResampler resampler;
-    DevicePowerSpectrum<float> pspec(d_fseries);
     Zapper* bzap;
     if (args.zapfilename!=""){
       if (args.verbose)
 	std::cout << "Using zapfile: " << args.zapfilename << std::endl;
       bzap = new Zapper(args.zapfilename);
     }
-    Dereddener rednoise(size/2+1);
     SpectrumFormer former;
-    PeakFinder cand_finder(args.min_snr,args.min_freq,args.max_freq,size);
-    HarmonicSums<float> sums(pspec,args.nharmonics);
-    HarmonicFolder harm_folder(sums);
     std::vector<float> acc_list;
     HarmonicDistiller harm_finder(args.freq_tol,args.max_harm,false);
     AccelerationDistiller acc_still(tobs,args.freq_tol,true);
+    //With a coarse grid, peaks are taken at a lower threshold and refined
+    bool hierarchical = args.acc_coarse_factor > 1;
+    float threshold = hierarchical ? args.coarse_min_snr : args.min_snr;
+    AccelerationRefiner acc_refiner(tobs);
+    std::vector<float> full_acc_list;
     float mean,std,rms;
+    float bin_mean,bin_std;
     float padding_mean;
+    unsigned int factor;
     int ii;
 
 	PUSH_NVTX_RANGE("DM-Loop",0)
     while (true){
       //timers["get_trial_dm"].start();
-      ii = manager.get_dm_trial_idx();
+      ii = manager.get_dm_trial_idx(node);
       //timers["get_trial_dm"].stop();
+      if (ndone==1)
+	steady_timer.start();
 
       if (ii==-1)
         break;
-      trials.get_idx(ii,tim);
+      ndone++;
+      PUSH_NVTX_RANGE_IDX("DM-Trial",0,ii,-1)
+      trials.get_idx(ii,tim,unpack_buffer,storage);
       
       if (args.verbose)
 	std::cout << "Copying DM trial to device (DM: " << tim.get_dm() << ")"<< std::endl;
@@ -162,90 +471,185 @@ public:
 	    d_tim.fill(trials.get_nsamps(),d_tim.get_nsamps(),padding_mean);
       }
 
+      //Frequencies are unchanged by decimation as tobs is preserved
+      factor = (ds_plan==NULL) ? 1 : ds_plan->get_factor(ii);
+
+      if (args.nsegments > 1){
+	DeviceTimeSeries<float>* search_tim = &d_tim;
+	if (factor > 1){
+	  if (decimated.find(factor)==decimated.end())
+	    decimated[factor] = new DeviceTimeSeries<float>(size/factor);
+	  search_tim = decimated[factor];
+	  resampler.decimate(d_tim,*search_tim,factor);
+	}
+	if (segmented.find(factor)==segmented.end())
+	  segmented[factor] = new SegmentedSearch(size/factor,args.nsegments,
+						  trials.get_tsamp()*factor,acc_plan,args);
+	std::vector<Candidate> found;
+	unsigned int nacc = segmented[factor]->search(*search_tim,tim.get_dm(),ii,
+						      (args.zapfilename!="") ? bzap : NULL,found);
+	dm_trial_cands.append(found);
+	Telemetry::instance().dm_trial_done(id,nacc,found.size());
+	POP_NVTX_RANGE
+	continue;
+      }
+
+      if (contexts.find(factor)==contexts.end())
+	contexts[factor] = new SearchContext(size/factor,bin_width,threshold,args,
+					     (factor==1) ? &d_tim : NULL);
+      SearchContext& ctx = *contexts[factor];
+      if (factor > 1){
+	if (args.verbose)
+	  std::cout << "Downsampling by a factor of " << factor << std::endl;
+	resampler.decimate(d_tim,*ctx.d_tim,factor);
+      }
+
       if (args.verbose)
 	    std::cout << "Generating accelration list" << std::endl;
-      acc_plan.generate_accel_list(tim.get_dm(),acc_list);
+      acc_plan.generate_accel_list(tim.get_dm(),acc_list,
+				   hierarchical ? args.acc_coarse_factor : 1);
       
       if (args.verbose)
 	    std::cout << "Searching "<< acc_list.size()<< " acceleration trials for DM "<< tim.get_dm() << std::endl;
 
       if (args.verbose)
 	    std::cout << "Executing forward FFT" << std::endl;
-      r2cfft.execute(d_tim.get_data(),d_fseries.get_data());
+      ctx.r2cfft.execute(ctx.d_tim->get_data(),ctx.d_fseries.get_data());
 
       if (args.verbose)
 	    std::cout << "Forming power spectrum" << std::endl;
-      former.form(d_fseries,pspec);
+      former.form(ctx.d_fseries,ctx.pspec);
 
       if (args.verbose)
 	    std::cout << "Finding running median" << std::endl;
-      rednoise.calculate_median(pspec);
+      ctx.rednoise.calculate_median(ctx.pspec);
 
       if (args.verbose)
 	    std::cout << "Dereddening Fourier series" << std::endl;
-      rednoise.deredden(d_fseries);
+      ctx.rednoise.deredden(ctx.d_fseries);
 
       if (args.zapfilename!=""){
 	    if (args.verbose)
 	      std::cout << "Zapping birdies" << std::endl;
-	    bzap->zap(d_fseries);
+	    bzap->zap(ctx.d_fseries);
+      }
+
+      //The refiner's matched filter has the noise of a single bin, not of the interbinned spectrum
+      if (hierarchical){
+	    former.form(ctx.d_fseries,ctx.pspec);
+	    stats::stats<float>(ctx.pspec.get_data(),ctx.size/2+1,&bin_mean,&rms,&bin_std);
       }
 
       if (args.verbose)
 	    std::cout << "Forming interpolated power spectrum" << std::endl;
-      former.form_interpolated(d_fseries,pspec);
+      former.form_interpolated(ctx.d_fseries,ctx.pspec);
 
       if (args.verbose)
 	    std::cout << "Finding statistics" << std::endl;
-      stats::stats<float>(pspec.get_data(),size/2+1,&mean,&rms,&std);
+      stats::stats<float>(ctx.pspec.get_data(),ctx.size/2+1,&mean,&rms,&std);
 
       if (args.verbose)
 	    std::cout << "Executing inverse FFT" << std::endl;
-      c2rfft.execute(d_fseries.get_data(),d_tim.get_data());
+      ctx.c2rfft.execute(ctx.d_fseries.get_data(),ctx.d_tim->get_data());
 
       CandidateCollection accel_trial_cands;    
       PUSH_NVTX_RANGE("Acceleration-Loop",1)
 
       for (int jj=0;jj<acc_list.size();jj++){
+	    PUSH_NVTX_RANGE_IDX("Acceleration-Trial",2,ii,jj)
 	    if (args.verbose)
 	      std::cout << "Resampling to "<< acc_list[jj] << " m/s/s" << std::endl;
-	    resampler.resampleII(d_tim,d_tim_r,size,acc_list[jj]);
+	    resampler.resampleII(*ctx.d_tim,ctx.d_tim_r,ctx.size,acc_list[jj]);
 
 	    if (args.verbose)
 	      std::cout << "Execute forward FFT" << std::endl;
-	    r2cfft.execute(d_tim_r.get_data(),d_fseries.get_data());
+	    ctx.r2cfft.execute(ctx.d_tim_r.get_data(),ctx.d_fseries.get_data());
 
 	    if (args.verbose)
 	      std::cout << "Form interpolated power spectrum" << std::endl;
-	    former.form_interpolated(d_fseries,pspec);
+	    former.form_interpolated(ctx.d_fseries,ctx.pspec);
 
 	    if (args.verbose)
 	      std::cout << "Normalise power spectrum" << std::endl;
-	    stats::normalise(pspec.get_data(),mean*size,std*size,size/2+1);
+	    stats::normalise(ctx.pspec.get_data(),mean*ctx.size,std*ctx.size,ctx.size/2+1);
 
 	    if (args.verbose)
-	      std::cout << "Harmonic summing" << std::endl;
-	    harm_folder.fold(pspec);
-		
-	    if (args.verbose)
-	      std::cout << "Finding peaks" << std::endl;
+	      std::cout << "Harmonic summing and finding peaks" << std::endl;
 	    SpectrumCandidates trial_cands(tim.get_dm(),ii,acc_list[jj]);
-	    cand_finder.find_candidates(pspec,trial_cands);
-	    cand_finder.find_candidates(sums,trial_cands);
+	    ctx.search_spectrum(trial_cands);
+
+	    //Compare the first fp16 sums against fp32 once per worker
+	    if (args.fp16_sums && !fp16_checked){
+	      fp16_max_error = std::max(fp16_max_error,ctx.check_fp16_sums());
+	      fp16_checked = true;
+	    }
 	
 	    if (args.verbose)
 	      std::cout << "Distilling harmonics" << std::endl;
 	      accel_trial_cands.append(harm_finder.distill(trial_cands.cands));
+	    POP_NVTX_RANGE
       }
 	  POP_NVTX_RANGE
       if (args.verbose)
 	    std::cout << "Distilling accelerations" << std::endl;
-      dm_trial_cands.append(acc_still.distill(accel_trial_cands.cands));
+      std::vector<Candidate> distilled = acc_still.distill(accel_trial_cands.cands);
+
+      unsigned int fine_before = fine_trials;
+      if (hierarchical){
+	if (args.verbose)
+	  std::cout << "Refining " << distilled.size() << " coarse candidates" << std::endl;
+	acc_plan.generate_accel_list(tim.get_dm(),full_acc_list);
+	coarse_trials += acc_list.size();
+	full_grid_trials += full_acc_list.size();
+	coarse_cands += distilled.size();
+	//The acceleration loop overwrote the whitened spectrum
+	ctx.r2cfft.execute(ctx.d_tim->get_data(),ctx.d_fseries.get_data());
+	float step = acc_plan.get_accel_step(tim.get_dm());
+	std::vector<Candidate> refined;
+	for (int kk=0;kk<distilled.size();kk++){
+	  fine_trials += acc_refiner.refine(ctx.d_fseries,distilled[kk],bin_mean*ctx.size,
+					    bin_std*ctx.size,step,args.acc_coarse_factor/2);
+	  if (distilled[kk].snr >= args.min_snr)
+	    refined.push_back(distilled[kk]);
+	}
+	refined_cands += refined.size();
+	std::sort(refined.begin(),refined.end(),snr_less_than());
+	distilled.swap(refined);
+      }
+
+      //d_tim still holds the whitened series, keep it for the folder
+      if (cache!=NULL && factor==1 && distilled.size()>0){
+	if (args.verbose)
+	  std::cout << "Offering whitened series to fold cache" << std::endl;
+	cache->offer(ii,d_tim,distilled[0].snr);
+      }
+      dm_trial_cands.append(distilled);
+      Telemetry::instance().dm_trial_done(id,acc_list.size()+fine_trials-fine_before,
+					  distilled.size());
+      POP_NVTX_RANGE
     }
 	POP_NVTX_RANGE
+    if (ndone > 1){
+      steady_timer.stop();
+      steady_trials = ndone-1;
+      steady_time = steady_timer.getTime();
+    }
 	
     if (args.zapfilename!="")
       delete bzap;
+
+    std::map<unsigned int,SearchContext*>::iterator iter;
+    for (iter=contexts.begin();iter!=contexts.end();iter++)
+      delete iter->second;
+    contexts.clear();
+    std::map<unsigned int,SegmentedSearch*>::iterator seg_iter;
+    for (seg_iter=segmented.begin();seg_iter!=segmented.end();seg_iter++)
+      delete seg_iter->second;
+    segmented.clear();
+    std::map<unsigned int,DeviceTimeSeries<float>*>::iterator dec_iter;
+    for (dec_iter=decimated.begin();dec_iter!=decimated.end();dec_iter++)
+      delete dec_iter->second;
+    decimated.clear();
     
     if (args.verbose)
       std::cout << "DM processing took " << pass_timer.getTime() << " seconds"<< std::endl;
@@ -258,6 +662,371 @@ void* launch_worker_thread(void* ptr){
   return NULL;
 }
 
+//A DADA observation may be given as a comma separated list of files
+std::vector<std::string> split_filenames(std::string list){
+  std::vector<std::string> filenames;
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream,item,','))
+    if (item.size())
+      filenames.push_back(item);
+  if (filenames.size()==0)
+    filenames.push_back(list);
+  return filenames;
+}
+
+
+//Search bookkeeping summed over workers
+struct SearchTotals {
+  unsigned int coarse_trials;
+  unsigned int fine_trials;
+  unsigned int full_grid_trials;
+  unsigned int coarse_cands;
+  unsigned int refined_cands;
+  float fp16_max_error;
+  //DMs searched by a worker on the NUMA node holding them, or not
+  unsigned int local_dms;
+  unsigned int remote_dms;
+
+  SearchTotals()
+    :coarse_trials(0),fine_trials(0),full_grid_trials(0),
+     coarse_cands(0),refined_cands(0),fp16_max_error(0.0),local_dms(0),remote_dms(0){}
+};
+
+/*
+  Places the pool thread of each of nworkers workers as --cpu_affinity
+  asks, worker ii using GPU ii%ngpus:
+    gpu  - the CPUs of the NUMA node of the worker's GPU
+    list - CPU list[ii%n] of a list such as "0-7,16-23"
+  Pinned threads also allocate on their node, so each worker's host
+  buffers are NUMA local. Returns the node of each worker, -1 if it
+  is not pinned.
+*/
+std::vector<int> place_workers(ThreadPool& pool, CmdLineOptions& args, int nworkers, int ngpus)
+{
+  NumaTopology& topology = NumaTopology::instance();
+  std::vector<int> cpu_list;
+  if (args.cpu_affinity!="" && args.cpu_affinity!="gpu")
+    cpu_list = NumaTopology::parse_cpulist(args.cpu_affinity);
+  std::vector<int> nodes(nworkers,-1);
+  for (int ii=0;ii<nworkers;ii++){
+    std::vector<int> cpus;
+    if (args.cpu_affinity=="gpu"){
+      nodes[ii] = topology.get_gpu_node(ii%ngpus);
+      if (nodes[ii] >= 0)
+	cpus = topology.get_cpus(nodes[ii]);
+    } else if (cpu_list.size()){
+      cpus.push_back(cpu_list[ii%cpu_list.size()]);
+      nodes[ii] = topology.get_cpu_node(cpus[0]);
+    }
+    pool.set_placement(ii,cpus,nodes[ii]);
+  }
+  return nodes;
+}
+
+/*
+  Searches the DM trials released by dispenser with workers_per_gpu
+  workers on each of ngpus GPUs, run on the pool's threads. Workers
+  sharing a GPU overlap their host work (unpacking, copies,
+  distilling) with each other's kernels. Returns the finished
+  workers, which the caller deletes.
+*/
+std::vector<Worker*> run_workers(ThreadPool& pool, DispersionTrials<unsigned char>& trials,
+				 DMDispenser& dispenser, CmdLineOptions& args,
+				 AccelerationPlan& acc_plan, size_t size, int ngpus,
+				 int workers_per_gpu, DownsamplingPlan* ds_plan,
+				 TrialPlacement* placement, WhitenedSeriesCache* fold_cache)
+{
+  int nworkers = ngpus*workers_per_gpu;
+  std::vector<int> nodes = place_workers(pool,args,nworkers,ngpus);
+  std::vector<Worker*> workers(nworkers);
+  std::vector<void*> worker_ptrs(nworkers);
+  for (int ii=0;ii<nworkers;ii++){
+    workers[ii] = new Worker(trials,dispenser,acc_plan,args,size,ii,ii%ngpus,fold_cache,ds_plan,
+			     nodes[ii],placement);
+    worker_ptrs[ii] = (void*) workers[ii];
+  }
+  pool.run(launch_worker_thread,worker_ptrs);
+  return workers;
+}
+
+/*
+  Chooses the number of workers per GPU for --autotune. The first
+  AUTOTUNE_TRIALS_PER_WORKER DM trials per worker are searched with 1
+  to AUTOTUNE_MAX_WORKERS_PER_GPU workers on each GPU, timing each
+  worker after its first trial. A larger count is kept only if it is
+  at least AUTOTUNE_MIN_GAIN faster, and counts whose predicted memory
+  does not fit are not tried. Returns the chosen count's throughput.
+*/
+double calibrate(ThreadPool& pool, DispersionTrials<unsigned char>& trials, CmdLineOptions& args,
+		 AccelerationPlan& acc_plan, size_t size, int ngpus, DownsamplingPlan* ds_plan,
+		 TrialPlacement* placement, MemoryPlanner& mem_plan, AutotuneResult& result)
+{
+  size_t device_free = mem_plan.min_device_free();
+  double best_rate = 0.0;
+  result.workers_per_gpu = 1;
+  for (int wpg=1;wpg<=AUTOTUNE_MAX_WORKERS_PER_GPU;wpg++){
+    int nworkers = ngpus*wpg;
+    int ncal = std::min((int) trials.get_count(),AUTOTUNE_TRIALS_PER_WORKER*nworkers);
+    if (wpg > 1){
+      if (!mem_plan.fits_workers(wpg,device_free))
+	break;
+      //Every worker needs a trial after its first to be timed
+      if (ncal < 2*nworkers)
+	break;
+    }
+    DMDispenser dispenser(trials,placement,ncal);
+    std::vector<Worker*> workers = run_workers(pool,trials,dispenser,args,acc_plan,size,
+					       ngpus,wpg,ds_plan,placement,NULL);
+    double rate = 0.0;
+    for (int ii=0;ii<nworkers;ii++){
+      if (workers[ii]->steady_time > 0)
+	rate += workers[ii]->steady_trials/workers[ii]->steady_time;
+      delete workers[ii];
+    }
+    result.tried.push_back(wpg);
+    result.rates.push_back(rate);
+    if (args.verbose)
+      std::cout << "Autotune: " << wpg << " worker(s) per GPU search "
+		<< rate << " DM trials/s" << std::endl;
+    if (rate > best_rate*(1.0+AUTOTUNE_MIN_GAIN)){
+      result.workers_per_gpu = wpg;
+      best_rate = rate;
+    }
+  }
+  return best_rate;
+}
+
+/*
+  Searches all DM trials with --workers_per_gpu workers per GPU, then distills,
+  scores and folds the candidates. Shared by whole file searches and
+  by each window of a streaming search. Folded candidates are passed
+  to writer, if given, as soon as their folds are final.
+*/
+void search_trials(DispersionTrials<unsigned char>& trials, Filterbank& filobj,
+		   CmdLineOptions& args, AccelerationPlan& acc_plan, size_t size,
+		   int nthreads, ThreadPool& pool, DownsamplingPlan* ds_plan,
+		   TrialPlacement* placement, WhitenedSeriesCache* fold_cache,
+		   std::map<std::string,Stopwatch>& timers, SearchTotals& totals,
+		   CandidateCollection& dm_cands, AsyncArchiveWriter* writer=NULL)
+{
+  //Multithreading commands
+  timers["searching"].start();
+  Telemetry::instance().set_phase("searching");
+  PUSH_NVTX_RANGE("Search",4)
+  DMDispenser dispenser(trials,placement);
+  if (args.progress_bar)
+    dispenser.enable_progress_bar();
+  std::vector<Worker*> workers = run_workers(pool,trials,dispenser,args,acc_plan,size,nthreads,
+					     args.workers_per_gpu,ds_plan,placement,fold_cache);
+  totals.local_dms += dispenser.local_dms;
+  totals.remote_dms += dispenser.remote_dms;
+  
+  DMDistiller dm_still(args.freq_tol,true);
+  HarmonicDistiller harm_still(args.freq_tol,args.max_harm,true,false);
+  for (int ii=0; ii<workers.size(); ii++)
+    dm_cands.append(workers[ii]->dm_trial_cands.cands);
+  for (int ii=0; ii<workers.size(); ii++){
+    totals.coarse_trials += workers[ii]->coarse_trials;
+    totals.fine_trials += workers[ii]->fine_trials;
+    totals.full_grid_trials += workers[ii]->full_grid_trials;
+    totals.coarse_cands += workers[ii]->coarse_cands;
+    totals.refined_cands += workers[ii]->refined_cands;
+    totals.fp16_max_error = std::max(totals.fp16_max_error,workers[ii]->fp16_max_error);
+    delete workers[ii];
+  }
+  if (args.fp16_sums && args.verbose)
+    std::cout << "Largest fp16 harmonic sum S/N deviation from fp32: "
+	      << totals.fp16_max_error << std::endl;
+  POP_NVTX_RANGE
+  timers["searching"].stop();
+  
+  if (args.verbose)
+    std::cout << "Distilling DMs" << std::endl;
+  Telemetry::instance().set_phase("distilling");
+  PUSH_NVTX_RANGE("Distill",5)
+  dm_cands.cands = dm_still.distill(dm_cands.cands);
+  dm_cands.cands = harm_still.distill(dm_cands.cands);
+  
+  CandidateScorer cand_scorer(filobj.get_tsamp(),filobj.get_cfreq(), filobj.get_foff(),
+			      fabs(filobj.get_foff())*filobj.get_nchans());
+  cand_scorer.score_all(dm_cands.cands);
+  POP_NVTX_RANGE
+
+  if (args.verbose)
+    std::cout << "Setting up time series folder" << std::endl;
+  
+  MultiFolder folder(dm_cands.cands,trials,args.fold_threads,args.fold_nbins,args.fold_nints,
+		     nthreads);
+  folder.set_cache(fold_cache);
+  folder.set_writer(writer);
+  folder.set_zapfile(args.zapfilename);
+  timers["folding"].start();
+  Telemetry::instance().set_phase("folding");
+  PUSH_NVTX_RANGE("Fold",6)
+  if (args.progress_bar)
+    folder.enable_progress_bar();
+
+  if (args.npdmp > 0){
+    if (args.verbose)
+      std::cout << "Folding top "<< args.npdmp <<" cands" << std::endl;
+    folder.fold_n(args.npdmp);
+  }
+  POP_NVTX_RANGE
+  timers["folding"].stop();
+}
+
+/*
+  Streaming search of a shared memory ring buffer. The filterbank is
+  dedispersed a gulp at a time into DM trials of --fft_size samples.
+  After the first full window each gulp advances the trials by
+  fft_size*(1-overlap) samples, so only the new samples plus the
+  dispersion delay are dedispersed. Every window is searched as soon
+  as it is complete and written to its own window_NNNNN directory.
+*/
+int run_stream(CmdLineOptions& args, int nthreads, ThreadPool& pool,
+	       std::map<std::string,Stopwatch>& timers)
+{
+  if (args.size==0)
+    ErrorChecker::throw_error("Streaming searches require --fft_size");
+  if (args.stream_overlap < 0.0 || args.stream_overlap >= 1.0)
+    ErrorChecker::throw_error("--stream_overlap must be in [0,1)");
+  if (args.trial_nbits < 8){
+    std::cerr << "Warning: --trial_nbits is ignored when streaming" << std::endl;
+    args.trial_nbits = 8;
+  }
+  if (args.nrefine > 0)
+    std::cerr << "Warning: --nrefine is ignored when streaming" << std::endl;
+  if (args.autotune)
+    std::cerr << "Warning: --autotune is ignored when streaming" << std::endl;
+  if (args.trial_placement!="local")
+    std::cerr << "Warning: --trial_placement is ignored when streaming" << std::endl;
+
+  if (args.verbose)
+    std::cout << "Attaching to ring buffer: " << args.ringbuffer << std::endl;
+  RingBufferFilterbank filobj(args.ringbuffer);
+
+  Dedisperser dedisperser(filobj,nthreads);
+  if (args.killfilename!="")
+    dedisperser.set_killmask(args.killfilename);
+  dedisperser.generate_dm_list(args.dm_start,args.dm_end,args.dm_pulse_width,args.dm_tol);
+  std::vector<float> dm_list = dedisperser.get_dm_list();
+  size_t max_delay = dedisperser.get_max_delay();
+  size_t size = args.size;
+  size_t step = std::max((size_t) 1,(size_t)(size*(1.0-args.stream_overlap)));
+  if (args.verbose)
+    std::cout << dm_list.size() << " DM trials, windows of " << size
+	      << " samples every " << step << " samples" << std::endl;
+
+  AccelerationPlan acc_plan(args.acc_start, args.acc_end, args.acc_tol,
+			    args.acc_pulse_width, size, filobj.get_tsamp(),
+			    filobj.get_cfreq(), filobj.get_foff());
+  DownsamplingPlan* ds_plan = NULL;
+  if (args.max_downsamp > 1)
+    ds_plan = new DownsamplingPlan(dm_list, filobj.get_tsamp(), filobj.get_cfreq(),
+				   filobj.get_foff(), args.dm_pulse_width,
+				   args.max_downsamp, size);
+  std::vector<float> acc_list;
+  acc_plan.generate_accel_list(0.0,acc_list);
+
+  //Cap the fold threads as for a file, each window holding size+max_delay samples
+  MemoryPlanner mem_plan(size+max_delay,filobj.get_nchans(),filobj.get_nbits(),false,
+			 dm_list.size(),max_delay,size,
+			 ds_plan != NULL ? ds_plan->get_factors() : std::vector<unsigned int>(),
+			 args,nthreads);
+  if (!mem_plan.plan(mem_plan.min_device_free()))
+    std::cerr << "Warning: streaming search may not fit in the memory budget" << std::endl;
+  if (args.verbose || mem_plan.adjustments.size())
+    mem_plan.print(std::cout);
+  args.fold_threads = mem_plan.fold_threads;
+
+  unsigned char* trial_data = HugePages::alloc<unsigned char>(size*dm_list.size(),"dm_trials");
+  DispersionTrials<unsigned char> trials(trial_data,size,filobj.get_tsamp(),dm_list);
+  CandidateFileWriter top_dir(args.outdir);
+  std::vector<int> device_idxs;
+  for (int device_idx=0;device_idx<nthreads;device_idx++)
+    device_idxs.push_back(device_idx);
+
+  //The first window needs fft_size new samples, later ones step
+  size_t nnew = size;
+  size_t window_end = 0;
+  unsigned int nwindows = 0;
+  filobj.reserve(size+max_delay);
+  while (true){
+    timers["reading"].start();
+    Telemetry::instance().set_phase("reading");
+    size_t nsamps = filobj.fill(nnew+max_delay);
+    timers["reading"].stop();
+    if (nsamps < nnew+max_delay)
+      break;
+    Stopwatch latency;
+    latency.start();
+
+    timers["dedispersion"].start();
+    Telemetry::instance().set_phase("dedispersion");
+    PUSH_NVTX_RANGE("Dedisperse",3)
+    trials.shift(nnew);
+    dedisperser.dedisperse_into(trial_data+(size-nnew),size);
+    POP_NVTX_RANGE
+    timers["dedispersion"].stop();
+    window_end = filobj.get_start_sample()+nnew;
+    size_t window_start = window_end-size;
+    if (args.verbose)
+      std::cout << "Searching window " << nwindows << " (samples "
+		<< window_start << " to " << window_end << ")" << std::endl;
+
+    char window_name[32];
+    sprintf(window_name,"window_%05u",nwindows);
+    std::string window_dir = args.outdir+"/"+window_name;
+    CandidateFileWriter cand_files(window_dir);
+    AsyncArchiveWriter archive(window_dir+"/candidates.archive");
+
+    CandidateCollection dm_cands;
+    SearchTotals totals;
+    search_trials(trials,filobj,args,acc_plan,size,nthreads,pool,ds_plan,NULL,NULL,
+		  timers,totals,dm_cands,&archive);
+    int new_size = std::min(args.limit,(int) dm_cands.cands.size());
+    dm_cands.cands.resize(new_size);
+
+    cand_files.write_binary(dm_cands.cands,"candidates.peasoup");
+    archive.finish(dm_cands.cands);
+    latency.stop();
+
+    OutputFileWriter stats(window_dir+"/overview.xml");
+    stats.add_misc_info();
+    stats.add_dada_header(filobj.get_header(),size+max_delay);
+    stats.add_stream_window(nwindows,window_start,size,
+			    window_start*filobj.get_tsamp(),latency.getTime());
+    stats.add_search_parameters(args);
+    stats.add_dm_list(dm_list);
+    stats.add_acc_list(acc_list);
+    if (args.acc_coarse_factor > 1)
+      stats.add_acc_refinement(totals.coarse_trials,totals.full_grid_trials,totals.fine_trials,
+			       totals.coarse_cands,totals.refined_cands);
+    if (args.fp16_sums)
+      stats.add_precision_check("fp16",totals.fp16_max_error);
+    stats.add_huge_pages();
+    stats.add_gpu_info(device_idxs);
+    stats.add_candidates(dm_cands.cands,cand_files.byte_mapping);
+    stats.add_timing_info(timers);
+    stats.close();
+    if (args.verbose)
+      std::cout << "Window " << nwindows << " written to " << window_dir
+		<< " (" << dm_cands.cands.size() << " candidates, "
+		<< latency.getTime() << " s after its last sample)" << std::endl;
+
+    //Keep the dispersion delay needed by the next gulp
+    filobj.discard(nnew);
+    nnew = step;
+    nwindows++;
+  }
+  if (args.verbose)
+    std::cout << "Stream ended after " << nwindows << " windows" << std::endl;
+  if (ds_plan != NULL)
+    delete ds_plan;
+  HugePages::free(trial_data);
+  return 0;
+}
 
 int main(int argc, char **argv)
 {
@@ -266,31 +1035,48 @@ int main(int argc, char **argv)
   timers["dedispersion"] = Stopwatch();
   timers["searching"]    = Stopwatch();
   timers["folding"]      = Stopwatch();
+  timers["refining"]     = Stopwatch();
   timers["total"]        = Stopwatch();
   timers["total"].start();
 
   CmdLineOptions args;
   if (!read_cmdline_options(args,argc,argv))
     ErrorChecker::throw_error("Failed to parse command line arguments.");
+  if (args.tracefilename!="")
+    Tracer::instance().enable(args.tracefilename);
+  Telemetry::instance().start(args.telemetry_file,args.telemetry_socket,
+			      args.telemetry_interval);
 
   int nthreads = std::min(Utils::gpu_count(),args.max_num_threads);
   nthreads = std::max(1,nthreads);
+  if (args.workers_per_gpu < 1)
+    ErrorChecker::throw_error("--workers_per_gpu must be at least 1");
+  //Folding is host bound as much as GPU bound, so it uses every core by default
+  if (args.fold_threads < 1)
+    args.fold_threads = std::max(1L,sysconf(_SC_NPROCESSORS_ONLN));
+  if (args.cpu_affinity!="" && args.cpu_affinity!="gpu" &&
+      NumaTopology::parse_cpulist(args.cpu_affinity).size()==0)
+    ErrorChecker::throw_error("--cpu_affinity must be 'gpu' or a CPU list");
+  HugePages::instance().set_mode(args.huge_pages);
+  //Worker threads persist across autotuning, the search and stream windows
+  ThreadPool pool;
+
+  if (args.ringbuffer!="")
+    return run_stream(args,nthreads,pool,timers);
 
   if (args.verbose)
     std::cout << "Using file: " << args.infilename << std::endl;
   std::string filename(args.infilename);
 
-  //Stopwatch timer;
-  if (args.progress_bar)
-    printf("Reading data from %s\n",args.infilename.c_str());
-  
-  timers["reading"].start();
-  SigprocFilterbank filobj(filename);
-  timers["reading"].stop();
-    
-  if (args.progress_bar){
-    printf("Complete (execution time %.2f s)\n",timers["reading"].getTime());
-  }
+  //Only the headers are read until the memory plan is made
+  std::vector<std::string> filenames = split_filenames(filename);
+  DadaFilterbank* dada = NULL;
+  Filterbank* fil_ptr;
+  if (filenames[0].size() > 5 && filenames[0].rfind(".dada")==filenames[0].size()-5)
+    fil_ptr = dada = new DadaFilterbank(filenames,false);
+  else
+    fil_ptr = new SigprocFilterbank(filename,false);
+  Filterbank& filobj = *fil_ptr;
 
   Dedisperser dedisperser(filobj,nthreads);
   if (args.killfilename!=""){
@@ -311,21 +1097,13 @@ int main(int argc, char **argv)
     std::cout << "Executing dedispersion" << std::endl;
   }
 
-  if (args.progress_bar)
-    printf("Starting dedispersion...\n");
+  if (dedisperser.get_max_delay() >= filobj.get_nsamps())
+    ErrorChecker::throw_error("Dispersion delay of the highest DM exceeds the observation");
 
-  timers["dedispersion"].start();
-  PUSH_NVTX_RANGE("Dedisperse",3)
-  DispersionTrials<unsigned char> trials = dedisperser.dedisperse();
-  POP_NVTX_RANGE
-  timers["dedispersion"].stop();
-
-  if (args.progress_bar)
-    printf("Complete (execution time %.2f s)\n",timers["dedispersion"].getTime());
-
-  unsigned int size;
+  size_t size;
+  //Transform the dedispersed length, so no DM trial needs padding
   if (args.size==0)
-    size = Utils::prev_power_of_two(filobj.get_nsamps());
+    size = Utils::prev_smooth_size(filobj.get_nsamps()-dedisperser.get_max_delay());
   else
     //size = std::min(args.size,filobj.get_nsamps());
     size = args.size;
@@ -337,51 +1115,160 @@ int main(int argc, char **argv)
 			    filobj.get_cfreq(), filobj.get_foff()); 
   
   
-  //Multithreading commands
-  timers["searching"].start();
-  std::vector<Worker*> workers(nthreads);
-  std::vector<pthread_t> threads(nthreads);
-  DMDispenser dispenser(trials);
-  if (args.progress_bar)
-    dispenser.enable_progress_bar();
-  
-  for (int ii=0;ii<nthreads;ii++){
-    workers[ii] = (new Worker(trials,dispenser,acc_plan,args,size,ii));
-    pthread_create(&threads[ii], NULL, launch_worker_thread, (void*) workers[ii]);
+  DownsamplingPlan* ds_plan = NULL;
+  if (args.max_downsamp > 1){
+    ds_plan = new DownsamplingPlan(dm_list, filobj.get_tsamp(), filobj.get_cfreq(),
+				   filobj.get_foff(), args.dm_pulse_width,
+				   args.max_downsamp, size);
+    if (args.verbose)
+      for (int ii=0;ii<dm_list.size();ii++)
+	std::cout << "DM " << dm_list[ii] << " downsampled by "
+		  << ds_plan->get_factor(ii) << std::endl;
   }
-  
-  DMDistiller dm_still(args.freq_tol,true);
-  HarmonicDistiller harm_still(args.freq_tol,args.max_harm,true,false);
-  CandidateCollection dm_cands;
-  for (int ii=0; ii<nthreads; ii++){
-    pthread_join(threads[ii],NULL);
-    dm_cands.append(workers[ii]->dm_trial_cands.cands);
+
+  //Workers per GPU are reused from an earlier run on this host, else timed
+  //after dedispersion. A cached count is known in time to be planned for.
+  AutotuneResult autotune;
+  AutotuneCache autotune_cache(args.autotune_cache!="" ? args.autotune_cache :
+			       AutotuneCache::default_filename());
+  if (args.autotune){
+    autotune.key = AutotuneCache::make_key(size,nthreads,args);
+    if (autotune_cache.lookup(autotune.key,autotune.workers_per_gpu)){
+      autotune.source = "cache";
+      args.workers_per_gpu = autotune.workers_per_gpu;
+    }
   }
-  timers["searching"].stop();
-  
-  if (args.verbose)
-    std::cout << "Distilling DMs" << std::endl;
-  dm_cands.cands = dm_still.distill(dm_cands.cands);
-  dm_cands.cands = harm_still.distill(dm_cands.cands);
-  
-  CandidateScorer cand_scorer(filobj.get_tsamp(),filobj.get_cfreq(), filobj.get_foff(),
-			      fabs(filobj.get_foff())*filobj.get_nchans());
-  cand_scorer.score_all(dm_cands.cands);
 
+  //Size the run to the memory budget before anything large is allocated
+  MemoryPlanner mem_plan(filobj.get_nsamps(),filobj.get_nchans(),filobj.get_nbits(),
+			 dada != NULL && dada->is_mapped(),dm_list.size(),
+			 dedisperser.get_max_delay(),size,
+			 ds_plan != NULL ? ds_plan->get_factors() : std::vector<unsigned int>(),
+			 args,nthreads);
+  size_t device_free = mem_plan.min_device_free();
+  bool plan_fits = mem_plan.plan(device_free);
+  if (args.verbose || mem_plan.adjustments.size() || !plan_fits)
+    mem_plan.print(std::cout);
+  if (!plan_fits)
+    ErrorChecker::throw_error("Search does not fit in the memory budget, see memory plan above");
+  if (device_free > 0 && mem_plan.device_peak > device_free)
+    std::cerr << "Warning: predicted GPU memory use of " << mem_plan.device_peak/(1024*1024)
+	      << " MB exceeds the " << device_free/(1024*1024) << " MB free" << std::endl;
+  args.fold_threads = mem_plan.fold_threads;
+
+  //Stopwatch timer;
+  if (args.progress_bar)
+    printf("Reading data from %s\n",args.infilename.c_str());
+
+  timers["reading"].start();
+  Telemetry::instance().set_phase("reading");
+  PUSH_NVTX_RANGE("Read",7)
+  filobj.load();
+  if (dada != NULL && args.verbose)
+    std::cout << (dada->is_mapped() ? "Memory mapped " : "Read ")
+	      << filenames.size() << " DADA file(s)" << std::endl;
+  POP_NVTX_RANGE
+  timers["reading"].stop();
+
+  if (args.progress_bar){
+    printf("Complete (execution time %.2f s)\n",timers["reading"].getTime());
+  }
+
+  if (args.progress_bar)
+    printf("Starting dedispersion...\n");
+
+  timers["dedispersion"].start();
+  Telemetry::instance().set_phase("dedispersion");
+  PUSH_NVTX_RANGE("Dedisperse",3)
+  if (args.verbose && mem_plan.trial_nbits < 8)
+    std::cout << "Requantising DM trials to " << mem_plan.trial_nbits << " bits, "
+	      << mem_plan.dm_gulp << " DMs at a time" << std::endl;
+  DispersionTrials<unsigned char> trials = (mem_plan.trial_nbits < 8) ?
+    dedisperser.dedisperse(mem_plan.trial_nbits,mem_plan.dm_gulp) : dedisperser.dedisperse();
   if (args.verbose)
-    std::cout << "Setting up time series folder" << std::endl;
-  
-  MultiFolder folder(dm_cands.cands,trials);
-  timers["folding"].start();
+    std::cout << "DM trials use " << trials.get_nbytes() << " bytes" << std::endl;
+  POP_NVTX_RANGE
+  timers["dedispersion"].stop();
+
   if (args.progress_bar)
-    folder.enable_progress_bar();
+    printf("Complete (execution time %.2f s)\n",timers["dedispersion"].getTime());
 
-  if (args.npdmp > 0){
+  //Spread or copy the trials across NUMA nodes, replicas permitting
+  std::string placement_mode = args.trial_placement;
+  size_t replica_nbytes = (size_t)(NumaTopology::instance().get_nnodes()-1)*trials.get_nbytes();
+  if (placement_mode=="replicate" && mem_plan.host_peak+replica_nbytes > mem_plan.usable){
+    std::cerr << "Warning: DM trial replicas exceed the memory budget, interleaving instead" << std::endl;
+    placement_mode = "interleave";
+  }
+  TrialPlacement placement(trials,placement_mode);
+  if (args.verbose)
+    std::cout << "DM trial placement: " << placement.get_mode() << " over "
+	      << placement.get_nnodes() << " NUMA node(s)" << std::endl;
+
+  if (args.autotune && autotune.source==""){
+    timers["autotuning"].start();
+    Telemetry::instance().set_phase("autotuning");
+    PUSH_NVTX_RANGE("Autotune",10)
+    double rate = calibrate(pool,trials,args,acc_plan,size,nthreads,ds_plan,&placement,
+			    mem_plan,autotune);
+    POP_NVTX_RANGE
+    timers["autotuning"].stop();
+    autotune.source = "calibration";
+    autotune_cache.store(autotune.key,autotune.workers_per_gpu,rate);
+    args.workers_per_gpu = autotune.workers_per_gpu;
+    //Calibration only tries counts that fit, so the trials keep their storage
+    mem_plan.workers_per_gpu = args.workers_per_gpu;
+    mem_plan.plan(device_free);
+    if (args.verbose || mem_plan.adjustments.size())
+      mem_plan.print(std::cout);
+  }
+  if (args.autotune && args.verbose)
+    std::cout << "Using " << args.workers_per_gpu << " worker(s) per GPU (from "
+	      << autotune.source << ")" << std::endl;
+
+  //Whitened series are only reusable if the folder uses the same length
+  WhitenedSeriesCache* fold_cache = NULL;
+  if (mem_plan.fold_cache > 0){
+    if (Utils::prev_smooth_size(trials.get_nsamps()) == size)
+      fold_cache = new WhitenedSeriesCache((size_t)mem_plan.fold_cache*1024*1024);
+    else if (args.verbose)
+      std::cout << "Fold cache disabled: transform size differs from fold length" << std::endl;
+  }
+
+  //Folds are archived by a writer thread while later candidates fold
+  CandidateFileWriter cand_files(args.outdir);
+  AsyncArchiveWriter archive(args.outdir+"/candidates.archive");
+  CandidateCollection dm_cands;
+  SearchTotals totals;
+  search_trials(trials,filobj,args,acc_plan,size,nthreads,pool,ds_plan,&placement,fold_cache,
+		timers,totals,dm_cands,&archive);
+  if (ds_plan != NULL)
+    delete ds_plan;
+
+  if (fold_cache != NULL){
     if (args.verbose)
-      std::cout << "Folding top "<< args.npdmp <<" cands" << std::endl;
-    folder.fold_n(args.npdmp);
+      std::cout << "Fold cache: " << fold_cache->get_hits() << " hits, "
+		<< fold_cache->get_misses() << " misses" << std::endl;
+    delete fold_cache;
   }
-  timers["folding"].stop();
+
+  timers["refining"].start();
+  if (args.nrefine > 0){
+    if (args.verbose)
+      std::cout << "Refining top "<< args.nrefine <<" cands against the filterbank" << std::endl;
+    Telemetry::instance().set_phase("refining");
+    PUSH_NVTX_RANGE("Refine",8)
+    //Host bound like folding, so on the fold threads, placed as the workers are
+    int refine_threads = args.fold_threads;
+    if (args.cpu_affinity!="" && args.cpu_affinity!="gpu")
+      refine_threads = std::min(refine_threads,(int) NumaTopology::parse_cpulist(args.cpu_affinity).size());
+    place_workers(pool,args,refine_threads,nthreads);
+    CandidateRefiner refiner(filobj,args.refine_nsubbands,args.fold_nbins,args.fold_nints,
+			     pool,refine_threads);
+    refiner.refine_n(dm_cands.cands,args.nrefine);
+    POP_NVTX_RANGE
+  }
+  timers["refining"].stop();
 
   if (args.verbose)
     std::cout << "Writing output files" << std::endl;
@@ -390,18 +1277,37 @@ int main(int argc, char **argv)
   int new_size = std::min(args.limit,(int) dm_cands.cands.size());
   dm_cands.cands.resize(new_size);
 
-  CandidateFileWriter cand_files(args.outdir);
+  Telemetry::instance().set_phase("writing");
+  PUSH_NVTX_RANGE("Write",9)
   cand_files.write_binary(dm_cands.cands,"candidates.peasoup");
+  archive.finish(dm_cands.cands);
+  POP_NVTX_RANGE
   
-  OutputFileWriter stats;
+  std::stringstream xml_filepath;
+  xml_filepath << args.outdir << "/" << "overview.xml";
+  OutputFileWriter stats(xml_filepath.str());
   stats.add_misc_info();
-  stats.add_header(filename);
+  if (dada != NULL)
+    stats.add_dada_header(dada->get_header(),filobj.get_nsamps());
+  else
+    stats.add_header(filename);
   stats.add_search_parameters(args);
   stats.add_dm_list(dm_list);
   
   std::vector<float> acc_list;
   acc_plan.generate_accel_list(0.0,acc_list);
   stats.add_acc_list(acc_list);
+  if (args.acc_coarse_factor > 1)
+    stats.add_acc_refinement(totals.coarse_trials,totals.full_grid_trials,totals.fine_trials,
+			     totals.coarse_cands,totals.refined_cands);
+  if (args.fp16_sums)
+    stats.add_precision_check("fp16",totals.fp16_max_error);
+  stats.add_memory_plan(mem_plan);
+  if (args.autotune)
+    stats.add_autotune(autotune);
+  stats.add_numa_placement(placement.get_nnodes(),placement.get_mode(),
+			   placement.get_replica_nbytes(),totals.local_dms,totals.remote_dms);
+  stats.add_huge_pages();
   
   std::vector<int> device_idxs;
   for (int device_idx=0;device_idx<nthreads;device_idx++)
@@ -411,9 +1317,8 @@ int main(int argc, char **argv)
   timers["total"].stop();
   stats.add_timing_info(timers);
   
-  std::stringstream xml_filepath;
-  xml_filepath << args.outdir << "/" << "overview.xml";
-  stats.to_file(xml_filepath.str());
-  
+  stats.close();
+
+  delete fil_ptr;
   return 0;
 }
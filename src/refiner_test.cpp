@@ -0,0 +1,90 @@
+#include <data_types/filterbank.hpp>
+#include <data_types/candidates.hpp>
+#include <transforms/refiner.hpp>
+#include <utils/stopwatch.hpp>
+#include <vector>
+#include <iostream>
+#include <cstdlib>
+#include <cmath>
+#include <stdio.h>
+
+//Synthetic 8-bit filterbank holding a dispersed pulse train
+class FakeFilterbank: public Filterbank {
+  std::vector<unsigned char> buffer;
+public:
+  FakeFilterbank(unsigned int nsamps, unsigned int nchans, float tsamp,
+		 float fch1, float foff, double period, float dm)
+  {
+    this->nsamps = nsamps;
+    this->nchans = nchans;
+    this->nbits = 8;
+    this->tsamp = tsamp;
+    this->fch1 = fch1;
+    this->foff = foff;
+    buffer.resize((size_t)nsamps*nchans);
+    double ftop = std::max(fch1,fch1+(nchans-1)*foff);
+    srand(42);
+    for (unsigned int jj=0;jj<nchans;jj++){
+      double f = fch1+jj*foff;
+      double delay = REFINE_DM_CONST*dm*(1.0/(f*f)-1.0/(ftop*ftop));
+      for (unsigned int ii=0;ii<nsamps;ii++){
+	double phase = (ii*tsamp-delay)/period;
+	phase -= floor(phase);
+	float val = 100.0 + 10.0*((rand()/(float)RAND_MAX)-0.5)*3.46;
+	if (phase < 0.05)
+	  val += 6.0;
+	buffer[(size_t)ii*nchans+jj] = (unsigned char) val;
+      }
+    }
+    this->data = &buffer[0];
+  }
+};
+
+int main(void)
+{
+  double period = 0.0502;
+  float dm = 50.0;
+  FakeFilterbank fil(1<<19,64,0.000256,1500.0,-4.0,period,dm);
+
+  //Start the candidate a couple of grid steps away from the truth
+  std::vector<Candidate> cands;
+  Candidate cand(dm-3.0,0,0.0,1,10.0,1.0/(period*1.00001));
+  cands.push_back(cand);
+  std::vector<Candidate> split_cands = cands;
+
+  ThreadPool pool;
+  Stopwatch timer;
+  timer.start();
+  CandidateRefiner refiner(fil,16,64,32,pool,1);
+  refiner.refine_n(cands,1);
+  timer.stop();
+
+  printf("Refine time: %.2f s\n",timer.getTime());
+  printf("S/N: %f  DM: %f (true %f)  P: %.9f (true %.9f)  acc: %f\n",
+	 cands[0].refined_snr,cands[0].refined_dm,dm,
+	 cands[0].refined_period,period,cands[0].refined_acc);
+
+  //The same fold split in time over 4 threads
+  timer.reset();
+  timer.start();
+  CandidateRefiner split_refiner(fil,16,64,32,pool,4);
+  split_refiner.refine_n(split_cands,1);
+  timer.stop();
+  printf("Refine time (4 threads): %.2f s  S/N: %f\n",timer.getTime(),split_cands[0].refined_snr);
+
+  //Allow one grid step in each dimension
+  double p_step = period*period/(64*fil.get_nsamps()*fil.get_tsamp());
+  if (fabs(cands[0].refined_dm-dm) > 1.5 ||
+      fabs(cands[0].refined_period-period) > 1.5*p_step){
+    printf("FAILED\n");
+    return 1;
+  }
+  if (split_cands[0].refined_dm != cands[0].refined_dm ||
+      split_cands[0].refined_period != cands[0].refined_period ||
+      fabs(split_cands[0].refined_snr-cands[0].refined_snr) > 1e-3*cands[0].refined_snr){
+    printf("FAILED (threads disagree)\n");
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
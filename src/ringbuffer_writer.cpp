@@ -0,0 +1,150 @@
+#include <data_types/filterbank.hpp>
+#include <data_types/header.hpp>
+#include <utils/ringbuffer.hpp>
+#include <utils/exceptions.hpp>
+#include <tclap/CmdLine.h>
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+/*
+  Stand-in for a telescope backend: plays a filterbank file into a
+  shared memory ring buffer for peasoup --ringbuffer to consume.
+*/
+
+struct CmdLineOptions {
+  std::string infilename;
+  std::string key;
+  int nblocks;
+  int block_size;
+  bool realtime;
+  bool verbose;
+};
+
+//DADA header describing a filterbank so RingBufferFilterbank restores its metadata
+std::string make_header(Filterbank& fil, std::string source, size_t header_size){
+  double bw = fil.get_foff()*fil.get_nchans();
+  double freq = fil.get_fch1() + bw/2.0 - fil.get_foff()/2.0;
+  size_t bytes_per_samp = (size_t) fil.get_nchans()*fil.get_nbits()/8;
+  std::stringstream header;
+  header << std::setprecision(15);
+  header << "HDR_VERSION 1.0\n"
+	 << "HDR_SIZE " << header_size << "\n"
+	 << "SOURCE " << (source.size() ? source : "unknown") << "\n"
+	 << "INSTRUMENT peasoup_ringbuffer_writer\n"
+	 << "FREQ " << freq << "\n"
+	 << "BW " << bw << "\n"
+	 << "NCHAN " << fil.get_nchans() << "\n"
+	 << "NBIT " << fil.get_nbits() << "\n"
+	 << "NPOL 1\n"
+	 << "NDIM 1\n"
+	 << "TSAMP " << fil.get_tsamp()*1.0e6 << "\n"
+	 << "BYTES_PER_SECOND " << (size_t)(bytes_per_samp/fil.get_tsamp()) << "\n"
+	 << "OBS_OFFSET 0\n";
+  return header.str();
+}
+
+double wall_time(void){
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec + 1.0e-6*tv.tv_usec;
+}
+
+int main(int argc, char **argv)
+{
+  CmdLineOptions args;
+  try
+    {
+      TCLAP::CmdLine cmd("Peasoup - shared memory ring buffer writer", ' ', "1.0");
+
+      TCLAP::ValueArg<std::string> arg_infilename("i", "inputfile",
+						  "File to play into the ring buffer (.fil or .dada)",
+						  true, "", "string", cmd);
+
+      TCLAP::ValueArg<std::string> arg_key("k", "key",
+					   "Shared memory name of the ring buffer",
+					   false, "peasoup", "string", cmd);
+
+      TCLAP::ValueArg<int> arg_nblocks("n", "nblocks",
+				       "Number of blocks in the ring",
+				       false, 8, "int", cmd);
+
+      TCLAP::ValueArg<int> arg_block_size("b", "block_size",
+					  "Bytes per block",
+					  false, 4*1024*1024, "int", cmd);
+
+      TCLAP::SwitchArg arg_realtime("r", "realtime", "Write at the rate the data were recorded", cmd);
+
+      TCLAP::SwitchArg arg_verbose("v", "verbose", "verbose mode", cmd);
+
+      cmd.parse(argc, argv);
+      args.infilename        = arg_infilename.getValue();
+      args.key               = arg_key.getValue();
+      args.nblocks           = arg_nblocks.getValue();
+      args.block_size        = arg_block_size.getValue();
+      args.realtime          = arg_realtime.getValue();
+      args.verbose           = arg_verbose.getValue();
+
+    }catch (TCLAP::ArgException &e) {
+    std::cerr << "Error: " << e.error() << " for arg " << e.argId()
+	      << std::endl;
+    return -1;
+  }
+
+  Filterbank* fil;
+  std::string source;
+  if (args.infilename.size() > 5 &&
+      args.infilename.rfind(".dada")==args.infilename.size()-5){
+    DadaFilterbank* dada = new DadaFilterbank(args.infilename);
+    source = dada->get_header().source_name;
+    fil = dada;
+  } else {
+    std::ifstream infile(args.infilename.c_str(),std::ifstream::in | std::ifstream::binary);
+    ErrorChecker::check_file_error(infile, args.infilename);
+    SigprocHeader hdr;
+    read_header(infile,hdr);
+    source = hdr.source_name;
+    fil = new SigprocFilterbank(args.infilename);
+  }
+
+  size_t header_size = 4096;
+  SharedRingBuffer ring(args.key,args.nblocks,args.block_size,header_size);
+  ring.write_header(make_header(*fil,source,header_size));
+  if (args.verbose)
+    std::cout << "Created ring buffer " << args.key << " with " << ring.get_nblocks()
+	      << " blocks of " << ring.get_block_size() << " bytes" << std::endl;
+
+  size_t bytes_per_samp = (size_t) fil->get_nchans()*fil->get_nbits()/8;
+  size_t total = fil->get_nsamps()*bytes_per_samp;
+  double bytes_per_sec = bytes_per_samp/fil->get_tsamp();
+  const char* src = (const char*) fil->get_data();
+  size_t written = 0;
+  double start = wall_time();
+  while (written < total){
+    size_t nbytes = std::min(ring.get_block_size(),total-written);
+    if (args.realtime){
+      double due = start + (written+nbytes)/bytes_per_sec;
+      double now = wall_time();
+      if (due > now)
+	usleep((useconds_t)((due-now)*1.0e6));
+    }
+    char* block = ring.open_write_block();
+    std::memcpy(block,src+written,nbytes);
+    ring.close_write_block(nbytes);
+    written += nbytes;
+    if (args.verbose)
+      std::cout << "Wrote " << written << " of " << total << " bytes" << std::endl;
+  }
+  ring.mark_eod();
+
+  if (args.verbose)
+    std::cout << "Waiting for the reader to drain the ring" << std::endl;
+  ring.wait_until_empty();
+  delete fil;
+  return 0;
+}
@@ -0,0 +1,56 @@
+#include <utils/unpacker.hpp>
+#include <vector>
+#include <cstdlib>
+#include <stdio.h>
+
+//Pack values least significant bits first, as sigproc does
+static void pack(std::vector<unsigned int>& vals, unsigned int nbits,
+		 std::vector<unsigned char>& out)
+{
+  out.assign((vals.size()*nbits+7)/8,0);
+  if (nbits == 16){
+    for (size_t ii=0;ii<vals.size();ii++)
+      ((unsigned short*)&out[0])[ii] = vals[ii];
+    return;
+  }
+  unsigned int per_byte = 8/nbits;
+  for (size_t ii=0;ii<vals.size();ii++)
+    out[ii/per_byte] |= vals[ii]<<((ii%per_byte)*nbits);
+}
+
+int main(void)
+{
+  unsigned int depths[] = {1,2,4,8,16};
+  size_t n = 1001; //not a multiple of the samples per byte
+  int failures = 0;
+  for (int dd=0;dd<5;dd++){
+    unsigned int nbits = depths[dd];
+    std::vector<unsigned int> vals(n);
+    for (size_t ii=0;ii<n;ii++)
+      vals[ii] = rand()%(1<<nbits);
+    std::vector<unsigned char> packed;
+    pack(vals,nbits,packed);
+    std::vector<float> out(n);
+    unpack_samples(nbits,&packed[0],&out[0],n);
+    for (size_t ii=0;ii<n;ii++)
+      if (out[ii] != vals[ii]){
+	printf("%u-bit mismatch at %zu: %f != %u\n",nbits,ii,out[ii],vals[ii]);
+	failures++;
+	break;
+      }
+  }
+  std::vector<float> fvals(n), fout(n);
+  for (size_t ii=0;ii<n;ii++)
+    fvals[ii] = rand()/(float)RAND_MAX-0.5;
+  unpack_samples(32,(unsigned char*)&fvals[0],&fout[0],n);
+  if (fout != fvals){
+    printf("32-bit mismatch\n");
+    failures++;
+  }
+  if (failures){
+    printf("FAILED\n");
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}